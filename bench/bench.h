@@ -0,0 +1,27 @@
+/*
+ * bench.h: shared declarations between the termbench driver and
+ * its stub front end.
+ */
+
+#ifndef PUTTY_BENCH_H
+#define PUTTY_BENCH_H
+
+/*
+ * Counters maintained by benchfe.c. The driver samples them before
+ * and after each run.
+ */
+extern unsigned long bench_allocs, bench_frees;
+extern unsigned long bench_paints, bench_textcalls, bench_textchars;
+
+/*
+ * If set, get_ctx() hands out a context, so that scheduled window
+ * updates actually run do_paint(). Otherwise term_update() is a
+ * no-op and only term_out() is measured.
+ */
+extern int bench_paint_enabled;
+
+extern int bench_timer_pending;
+extern long bench_next_timer;
+void bench_run_timers(void);
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * benchfe.c: stub front end for the headless terminal benchmark.
+ *
+ * Everything the terminal, logging and timing modules expect a
+ * real front end to supply is implemented here as a no-op or as
+ * the cheapest thing that keeps them happy. The only real work
+ * done is counting: allocations (via the linker's --wrap option,
+ * so only calls made from PuTTY's own object files are seen) and
+ * the amount of drawing the terminal asks for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "putty.h"
+#include "bench.h"
+
+int flags;
+
+unsigned long bench_allocs, bench_frees;
+unsigned long bench_paints, bench_textcalls, bench_textchars;
+int bench_paint_enabled;
+int bench_timer_pending;
+long bench_next_timer;
+
+/* ----------------------------------------------------------------------
+ * Allocation counting. The Makefile links with -Wl,--wrap=malloc
+ * and friends, which redirects calls from our objects here.
+ */
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr)
+	bench_frees++;
+    __real_free(ptr);
+}
+
+/* ----------------------------------------------------------------------
+ * Time and timers.
+ */
+
+long bench_tickcount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * TICKSPERSEC + ts.tv_nsec / (1000000000L / TICKSPERSEC);
+}
+
+void timer_change_notify(long next)
+{
+    bench_timer_pending = TRUE;
+    bench_next_timer = next;
+}
+
+/*
+ * Called by the driver between chunks of input, standing in for
+ * the WM_TIMER handling in a real front end.
+ */
+void bench_run_timers(void)
+{
+    long next;
+
+    if (!bench_timer_pending || bench_tickcount() - bench_next_timer < 0)
+	return;
+    bench_timer_pending = FALSE;
+    if (run_timers(bench_next_timer, &next))
+	timer_change_notify(next);
+}
+
+/* ----------------------------------------------------------------------
+ * Threads, for the log writer, done with pthreads.
+ */
+
+struct thread {
+    pthread_t t;
+    void (*fn)(void *ctx);
+    void *ctx;
+};
+
+static void *thread_main(void *param)
+{
+    struct thread *t = (struct thread *)param;
+    t->fn(t->ctx);
+    return NULL;
+}
+
+void *thread_start(void (*fn)(void *ctx), void *ctx)
+{
+    struct thread *t = snew(struct thread);
+
+    t->fn = fn;
+    t->ctx = ctx;
+    if (pthread_create(&t->t, NULL, thread_main, t)) {
+	sfree(t);
+	return NULL;
+    }
+    return t;
+}
+
+void thread_join(void *thread)
+{
+    struct thread *t = (struct thread *)thread;
+    pthread_join(t->t, NULL);
+    sfree(t);
+}
+
+struct event {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int set;
+};
+
+void *event_new(void)
+{
+    struct event *e = snew(struct event);
+    pthread_mutex_init(&e->mutex, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    e->set = 0;
+    return e;
+}
+
+void event_set(void *event)
+{
+    struct event *e = (struct event *)event;
+    pthread_mutex_lock(&e->mutex);
+    e->set = 1;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->mutex);
+}
+
+void event_wait(void *event)
+{
+    struct event *e = (struct event *)event;
+    pthread_mutex_lock(&e->mutex);
+    while (!e->set)
+	pthread_cond_wait(&e->cond, &e->mutex);
+    e->set = 0;			       /* auto-reset */
+    pthread_mutex_unlock(&e->mutex);
+}
+
+void event_free(void *event)
+{
+    struct event *e = (struct event *)event;
+    pthread_cond_destroy(&e->cond);
+    pthread_mutex_destroy(&e->mutex);
+    sfree(e);
+}
+
+void memory_barrier(void)
+{
+    __sync_synchronize();
+}
+
+FILE *open_temp_file(void)
+{
+    return tmpfile();
+}
+
+/* ----------------------------------------------------------------------
+ * Drawing.
+ */
+
+static int dummy_ctx;
+
+Context get_ctx(void *frontend)
+{
+    if (!bench_paint_enabled)
+	return NULL;
+    bench_paints++;
+    return &dummy_ctx;
+}
+
+void free_ctx(Context ctx)
+{
+}
+
+void do_text(Context ctx, int x, int y, wchar_t *text, int len,
+	     unsigned long attr, int lattr)
+{
+    bench_textcalls++;
+    bench_textchars += len;
+}
+
+void do_cursor(Context ctx, int x, int y, wchar_t *text, int len,
+	       unsigned long attr, int lattr)
+{
+}
+
+int char_width(Context ctx, int uc)
+{
+    return 1;
+}
+
+void sys_cursor(void *frontend, int x, int y)
+{
+}
+
+void set_sbar(void *frontend, int total, int start, int page)
+{
+}
+
+void palette_set(void *frontend, int n, int r, int g, int b)
+{
+}
+
+void palette_reset(void *frontend)
+{
+}
+
+/* ----------------------------------------------------------------------
+ * Window management, clipboard and bells: all ignored.
+ */
+
+void set_title(void *frontend, char *title)
+{
+}
+
+void set_icon(void *frontend, char *title)
+{
+}
+
+char *get_window_title(void *frontend, int icon)
+{
+    return "termbench";
+}
+
+void request_resize(void *frontend, int w, int h)
+{
+}
+
+void set_iconic(void *frontend, int iconic)
+{
+}
+
+void move_window(void *frontend, int x, int y)
+{
+}
+
+void set_zorder(void *frontend, int top)
+{
+}
+
+void refresh_window(void *frontend)
+{
+}
+
+void set_zoomed(void *frontend, int zoomed)
+{
+}
+
+int is_iconic(void *frontend)
+{
+    return FALSE;
+}
+
+void get_window_pos(void *frontend, int *x, int *y)
+{
+    *x = *y = 0;
+}
+
+void get_window_pixels(void *frontend, int *x, int *y)
+{
+    *x = *y = 0;
+}
+
+void write_clip(void *frontend, wchar_t *data, int *attr, int len,
+		int must_deselect)
+{
+}
+
+void get_clip(void *frontend, wchar_t **p, int *len)
+{
+    if (p)
+	*p = NULL;
+    if (len)
+	*len = 0;
+}
+
+void request_paste(void *frontend)
+{
+}
+
+void set_raw_mouse_mode(void *frontend, int activate)
+{
+}
+
+void do_beep(void *frontend, int mode)
+{
+}
+
+/* ----------------------------------------------------------------------
+ * Line discipline: responses from the terminal go nowhere.
+ */
+
+void ldisc_send(void *handle, char *buf, int len, int interactive)
+{
+}
+
+void lpage_send(void *handle, int codepage, char *buf, int len,
+		int interactive)
+{
+}
+
+void luni_send(void *handle, wchar_t * widebuf, int len, int interactive)
+{
+}
+
+/* ----------------------------------------------------------------------
+ * Code page conversion. The benchmark only runs in UTF-8 mode, so
+ * these are only reached by copy and paste, which we never do.
+ */
+
+int is_dbcs_leadbyte(int codepage, char byte)
+{
+    return FALSE;
+}
+
+int mb_to_wc(int codepage, int flags, char *mbstr, int mblen,
+	     wchar_t *wcstr, int wclen)
+{
+    int i;
+    for (i = 0; i < mblen && i < wclen; i++)
+	wcstr[i] = (unsigned char) mbstr[i];
+    return i;
+}
+
+int wc_to_mb(int codepage, int flags, wchar_t *wcstr, int wclen,
+	     char *mbstr, int mblen, char *defchr, int *defused,
+	     struct unicode_data *ucsdata)
+{
+    int i;
+    for (i = 0; i < wclen && i < mblen; i++)
+	mbstr[i] = (wcstr[i] < 0x80 ? (char) wcstr[i] : '.');
+    return i;
+}
+
+/* ----------------------------------------------------------------------
+ * Logging support and fatal errors.
+ */
+
+void logevent(void *frontend, const char *string)
+{
+}
+
+int askappend(void *frontend, Filename filename,
+	      void (*callback)(void *ctx, int result), void *ctx)
+{
+    return 2;			       /* always overwrite */
+}
+
+Filename filename_from_str(const char *str)
+{
+    Filename ret;
+    strncpy(ret.path, str, sizeof(ret.path));
+    ret.path[sizeof(ret.path)-1] = '\0';
+    return ret;
+}
+
+const char *filename_to_str(const Filename *fn)
+{
+    return fn->path;
+}
+
+int filename_equal(Filename f1, Filename f2)
+{
+    return !strcmp(f1.path, f2.path);
+}
+
+int filename_is_null(Filename fn)
+{
+    return !*fn.path;
+}
+
+void fatalbox(char *fmt, ...)
+{
+    va_list ap;
+    fputs("termbench: fatal error: ", stderr);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+void modalfatalbox(char *fmt, ...)
+{
+    va_list ap;
+    fputs("termbench: fatal error: ", stderr);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
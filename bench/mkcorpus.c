@@ -0,0 +1,274 @@
+/*
+ * mkcorpus.c: generate the benchmark corpus for termbench.
+ *
+ * The corpus is a handful of byte streams of the kind a terminal
+ * sees from a pty, reproduced synthetically from a fixed seed so
+ * that every build measures exactly the same input:
+ *
+ *   ascii-flood  plain printable ASCII lines (`cat' of a big log)
+ *   ls-lR        a recursive long directory listing
+ *   gcc-colour   colourised compiler diagnostics amid make output
+ *   utf8-cjk     UTF-8 text mixing CJK, kana, Hangul, accented
+ *                Latin and combining characters
+ *   vim-tmux     full-screen redraws: cursor addressing, scroll
+ *                regions, 256-colour syntax highlighting and a
+ *                tmux-style status line
+ *
+ * Usage: mkcorpus [-s bytes] output-directory
+ * Each file is a little over `bytes' long (default 1000000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long seed;
+
+static unsigned long rnd(unsigned long n)
+{
+    seed = seed * 1103515245UL + 12345UL;
+    seed &= 0xFFFFFFFFUL;
+    return (seed >> 8) % n;
+}
+
+static const char *const words[] = {
+    "the", "terminal", "buffer", "connection", "session", "window",
+    "request", "packet", "server", "client", "value", "error", "line",
+    "scrollback", "timeout", "handler", "kernel", "module", "config",
+    "started", "finished", "failed", "retrying", "ok", "user", "data",
+    "0x7f3a", "1024", "42", "[INFO]", "[WARN]", "[DEBUG]", "=",
+};
+#define NWORDS (sizeof(words) / sizeof(*words))
+
+static void put_words(FILE *fp, int n)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+	if (i)
+	    fputc(' ', fp);
+	fputs(words[rnd(NWORDS)], fp);
+    }
+}
+
+static void put_utf8(FILE *fp, unsigned long c)
+{
+    if (c < 0x80) {
+	fputc(c, fp);
+    } else if (c < 0x800) {
+	fputc(0xC0 | (c >> 6), fp);
+	fputc(0x80 | (c & 0x3F), fp);
+    } else if (c < 0x10000) {
+	fputc(0xE0 | (c >> 12), fp);
+	fputc(0x80 | ((c >> 6) & 0x3F), fp);
+	fputc(0x80 | (c & 0x3F), fp);
+    } else {
+	fputc(0xF0 | (c >> 18), fp);
+	fputc(0x80 | ((c >> 12) & 0x3F), fp);
+	fputc(0x80 | ((c >> 6) & 0x3F), fp);
+	fputc(0x80 | (c & 0x3F), fp);
+    }
+}
+
+static void gen_ascii(FILE *fp, long size)
+{
+    long line = 0;
+    while (ftell(fp) < size) {
+	fprintf(fp, "2024-03-%02d 12:%02d:%02d.%03d ", (int)(line / 86400 % 28) + 1,
+		(int)(line / 60 % 60), (int)(line % 60), (int)rnd(1000));
+	put_words(fp, 4 + rnd(14));
+	fputs("\r\n", fp);
+	line++;
+    }
+}
+
+static void gen_lslR(FILE *fp, long size)
+{
+    static const char *const perms[] = {
+	"-rw-r--r--", "-rwxr-xr-x", "drwxr-xr-x", "lrwxrwxrwx", "-rw-------"
+    };
+    static const char *const months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+    int dir = 0;
+    while (ftell(fp) < size) {
+	int i, n = 3 + rnd(30);
+	fprintf(fp, "./usr/share/pkg%d/%s:\r\ntotal %d\r\n", dir++,
+		words[rnd(NWORDS)], (int)rnd(5000));
+	for (i = 0; i < n; i++) {
+	    fprintf(fp, "%s %2d root root %8lu %s %2d %02d:%02d %s%s.%s\r\n",
+		    perms[rnd(5)], 1 + (int)rnd(4), rnd(2000000),
+		    months[rnd(12)], 1 + (int)rnd(28), (int)rnd(24),
+		    (int)rnd(60), words[rnd(NWORDS)], words[rnd(NWORDS)],
+		    rnd(2) ? "c" : "h");
+	}
+	fputs("\r\n", fp);
+    }
+}
+
+static void gen_gcc(FILE *fp, long size)
+{
+    static const char *const files[] = {
+	"terminal.c", "logging.c", "sftp.c", "windows/window.c", "misc.c"
+    };
+    while (ftell(fp) < size) {
+	const char *file = files[rnd(5)];
+	int lineno = 1 + rnd(6000), col = 1 + rnd(60), i;
+
+	if (rnd(3)) {
+	    fprintf(fp, "gcc -O2 -Wall -I. -c %s -o %.*s.o\r\n", file,
+		    (int)(strlen(file) - 2), file);
+	    continue;
+	}
+	fprintf(fp, "\033[01m\033[K%s:\033[m\033[K In function "
+		"'\033[01m\033[K%s_%s\033[m\033[K':\r\n", file,
+		words[rnd(NWORDS)], words[rnd(NWORDS)]);
+	fprintf(fp, "\033[01m\033[K%s:%d:%d:\033[m\033[K %s ", file, lineno,
+		col, rnd(2) ? "\033[01;31m\033[Kerror:\033[m\033[K" :
+		"\033[01;35m\033[Kwarning:\033[m\033[K");
+	put_words(fp, 3 + rnd(8));
+	fputs(" [\033[01;35m\033[K-Wunused-variable\033[m\033[K]\r\n", fp);
+	fprintf(fp, " %4d |     ", lineno);
+	put_words(fp, 2 + rnd(6));
+	fputs(";\r\n      |     ", fp);
+	for (i = 0; i < col % 20; i++)
+	    fputc(' ', fp);
+	fputs("\033[01;32m\033[K^~~~~\033[m\033[K\r\n", fp);
+    }
+}
+
+static void gen_cjk(FILE *fp, long size)
+{
+    while (ftell(fp) < size) {
+	int i, n = 10 + rnd(60);
+	for (i = 0; i < n; i++) {
+	    switch (rnd(10)) {
+	      case 0: case 1: case 2: case 3:
+		put_utf8(fp, 0x4E00 + rnd(0x5000));   /* CJK ideographs */
+		break;
+	      case 4:
+		put_utf8(fp, 0x3041 + rnd(0x56));     /* hiragana */
+		break;
+	      case 5:
+		put_utf8(fp, 0xAC00 + rnd(0x2BA4));   /* Hangul */
+		break;
+	      case 6:
+		put_utf8(fp, 0xC0 + rnd(0x40));	      /* Latin-1 letters */
+		break;
+	      case 7:
+		put_utf8(fp, 'a' + rnd(26));
+		put_utf8(fp, 0x300 + rnd(0x30));      /* combining marks */
+		break;
+	      case 8:
+		put_utf8(fp, 0x3000 + rnd(3));	      /* CJK punctuation */
+		break;
+	      default:
+		fputs(words[rnd(NWORDS)], fp);
+		fputc(' ', fp);
+		break;
+	    }
+	}
+	fputs("\r\n", fp);
+    }
+}
+
+static void gen_vim(FILE *fp, long size)
+{
+    int rows = 24, cols = 80;
+
+    fputs("\033[?1049h\033[?1h\033=", fp);
+    while (ftell(fp) < size) {
+	int y, action = rnd(4);
+
+	if (action == 0) {
+	    /* Full redraw of the text area. */
+	    fputs("\033[H\033[2J", fp);
+	    for (y = 1; y < rows - 1; y++) {
+		int x = 0;
+		fprintf(fp, "\033[%d;1H\033[38;5;130m%4d \033[m", y, y);
+		while (x < cols - 20) {
+		    int w = 2 + rnd(10);
+		    fprintf(fp, "\033[38;5;%dm%s\033[m ", (int)rnd(256),
+			    words[rnd(NWORDS)]);
+		    x += w;
+		}
+		fputs("\033[K", fp);
+	    }
+	} else if (action == 1) {
+	    /* Scroll the text area by a few lines within a region. */
+	    int n = 1 + rnd(5);
+	    fprintf(fp, "\033[1;%dr\033[%d;1H", rows - 2, rows - 2);
+	    for (y = 0; y < n; y++) {
+		fputs("\r\n\033[38;5;130m  ~ \033[m", fp);
+		put_words(fp, 3 + rnd(8));
+	    }
+	    fprintf(fp, "\033[1;%dr", rows);
+	} else if (action == 2) {
+	    /* Reverse scroll from the top of the region. */
+	    fprintf(fp, "\033[1;%dr\033[1;1H\033M\033M", rows - 2);
+	    put_words(fp, 4);
+	    fprintf(fp, "\033[1;%dr", rows);
+	} else {
+	    /* Insert/delete characters in a line being edited. */
+	    fprintf(fp, "\033[%d;%dH", 1 + (int)rnd(rows - 2),
+		    6 + (int)rnd(cols - 10));
+	    fprintf(fp, "\033[%d@%s\033[%dP", 1 + (int)rnd(4),
+		    words[rnd(NWORDS)], 1 + (int)rnd(4));
+	}
+
+	/* vim status line and tmux status bar. */
+	fprintf(fp, "\033[%d;1H\033[7m %s.c [+] \033[27m\033[K"
+		"\033[%d;%dH%d,%d%8s", rows - 1, words[rnd(NWORDS)],
+		rows - 1, cols - 18, (int)rnd(5000), (int)rnd(80), "All");
+	fprintf(fp, "\033[%d;1H\033[30;42m[0] 0:vim* 1:bash- \033[K"
+		"\033[%d;%dH\"host\" %02d:%02d\033[m", rows, rows, cols - 20,
+		(int)rnd(24), (int)rnd(60));
+	fprintf(fp, "\033[%d;%dH", 1 + (int)rnd(rows - 2), 1 + (int)rnd(cols));
+    }
+    fputs("\033[?1l\033>\033[?1049l", fp);
+}
+
+static const struct {
+    const char *name;
+    void (*gen)(FILE *fp, long size);
+} corpora[] = {
+    { "ascii-flood", gen_ascii },
+    { "ls-lR", gen_lslR },
+    { "gcc-colour", gen_gcc },
+    { "utf8-cjk", gen_cjk },
+    { "vim-tmux", gen_vim },
+};
+
+int main(int argc, char **argv)
+{
+    long size = 1000000;
+    const char *dir;
+    int i;
+
+    if (argc == 4 && !strcmp(argv[1], "-s")) {
+	size = atol(argv[2]);
+	dir = argv[3];
+    } else if (argc == 2) {
+	dir = argv[1];
+    } else {
+	fprintf(stderr, "usage: mkcorpus [-s bytes] output-directory\n");
+	return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(corpora) / sizeof(*corpora)); i++) {
+	char *path = malloc(strlen(dir) + strlen(corpora[i].name) + 2);
+	FILE *fp;
+
+	sprintf(path, "%s/%s", dir, corpora[i].name);
+	fp = fopen(path, "wb");
+	if (!fp) {
+	    perror(path);
+	    return 1;
+	}
+	seed = 12345 + i;
+	corpora[i].gen(fp, size);
+	fclose(fp);
+	free(path);
+    }
+    return 0;
+}
@@ -0,0 +1,303 @@
+/*
+ * termbench.c: headless throughput benchmark for the terminal
+ * emulator.
+ *
+ * Each corpus file named on the command line is fed through
+ * term_data() in fixed-size chunks, repeatedly, against a fresh
+ * terminal and the stub front end in benchfe.c. For each corpus we
+ * report throughput, time per input byte, the number of heap
+ * allocations made per megabyte of input and the memory holding the
+ * compressed scrollback at the end of the run, as tab-separated
+ * values suitable for diffing between builds.
+ *
+ * Usage: termbench [options] corpus-file...
+ *   -w cols     terminal width (default 80)
+ *   -h rows     terminal height (default 24)
+ *   -s lines    scrollback lines (default 200, as in settings.c)
+ *   -c bytes    size of each term_data() call (default 4096)
+ *   -n MB       minimum input per measured run (default 16)
+ *   -r runs     measured runs per corpus; the fastest is reported
+ *               (default 3)
+ *   -p          service window updates, so that do_paint() runs
+ *   -l file     write an ASCII session log to `file'
+ *   -L file     write a raw (LGTYP_DEBUG) session log to `file'
+ *   -z          compress the session log with gzip
+ *   -R kbytes   start a new session log file every `kbytes'
+ *
+ * A megabyte here is 10^6 bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "putty.h"
+#include "terminal.h"
+#include "bench.h"
+
+static const wchar_t unitab_xterm_std[32] = {
+    0x2666, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+    0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+    0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+    0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7, 0x0020
+};
+
+/*
+ * Set up the character tables the way init_ucs() in winucs.c does
+ * for a UTF-8 line code page and a Unicode font.
+ */
+static void bench_init_ucs(struct unicode_data *ucsdata)
+{
+    int i;
+
+    memset(ucsdata, 0, sizeof(*ucsdata));
+    ucsdata->line_codepage = CP_UTF8;
+    ucsdata->font_codepage = 0;
+    ucsdata->dbcs_screenfont = FALSE;
+
+    for (i = 0; i < 256; i++) {
+	ucsdata->unitab_line[i] = i;
+	ucsdata->unitab_font[i] = i;
+	ucsdata->unitab_oemcp[i] = i;
+	ucsdata->unitab_scoacs[i] = i;
+	if (i < ' ' || (i >= 0x7F && i < 0xA0))
+	    ucsdata->unitab_ctrl[i] = i;
+	else
+	    ucsdata->unitab_ctrl[i] = 0xFF;
+    }
+
+    memcpy(ucsdata->unitab_xterm, ucsdata->unitab_line,
+	   sizeof(ucsdata->unitab_xterm));
+    memcpy(ucsdata->unitab_xterm + '`', unitab_xterm_std,
+	   sizeof(unitab_xterm_std));
+    ucsdata->unitab_xterm['_'] = ' ';
+}
+
+/*
+ * Fill in the settings the terminal looks at, using the same
+ * defaults as load_open_settings() in settings.c.
+ */
+static void bench_default_config(Config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->bksp_is_delete = 1;
+    cfg->remote_qtitle_action = TITLE_EMPTY;
+    strcpy(cfg->answerback, "PuTTY");
+    cfg->beep = 1;
+    cfg->bellovl = 1;
+    cfg->bellovl_n = 5;
+    cfg->bellovl_t = 2 * TICKSPERSEC;
+    cfg->bellovl_s = 5 * TICKSPERSEC;
+    cfg->savelines = 200;
+    cfg->sb_pack_age = 1000;
+    cfg->sb_spill_age = 0;
+    cfg->wrap_mode = 1;
+    cfg->width = 80;
+    cfg->height = 24;
+    cfg->vtmode = VT_UNICODE;
+    cfg->ansi_colour = 1;
+    cfg->xterm_256_colour = 1;
+    cfg->bold_colour = 1;
+    cfg->mouse_override = 1;
+    strcpy(cfg->line_codepage, "UTF-8");
+    cfg->utf8_override = 1;
+    cfg->scroll_on_disp = 1;
+    cfg->erase_to_scrollback = 1;
+    cfg->bce = 1;
+    cfg->logtype = LGTYP_NONE;
+    cfg->logxfovr = LGXF_OVR;
+    cfg->logflush = 1;
+    cfg->logflushtime = 500;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *read_corpus(const char *filename, int *lenp)
+{
+    FILE *fp;
+    char *data = NULL;
+    int len = 0, size = 0, ret;
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+	perror(filename);
+	exit(1);
+    }
+    do {
+	if (len == size) {
+	    size = size * 3 / 2 + 65536;
+	    data = sresize(data, size, char);
+	}
+	ret = fread(data + len, 1, size - len, fp);
+	len += ret;
+    } while (ret > 0);
+    fclose(fp);
+
+    if (len == 0) {
+	fprintf(stderr, "%s: empty corpus file\n", filename);
+	exit(1);
+    }
+    *lenp = len;
+    return data;
+}
+
+struct bench_result {
+    double bytes;
+    double seconds;
+    unsigned long allocs;
+    unsigned long paints;
+    unsigned long updates, skipped, paintticks;
+    unsigned long sbbytes;
+};
+
+/*
+ * Feed `data' repeatedly through a freshly created terminal until
+ * at least `minbytes' have gone in.
+ */
+static void run_one(Config *cfg, struct unicode_data *ucsdata,
+		    char *data, int len, int rows, int cols, int chunk,
+		    double minbytes, struct bench_result *res)
+{
+    Terminal *term;
+    void *logctx;
+    unsigned long allocs0, paints0;
+    double done = 0, t0, t1;
+    int pos;
+
+    term = term_init(cfg, ucsdata, NULL);
+    term_size(term, rows, cols, cfg->savelines);
+    logctx = log_init(NULL, cfg);
+    term_provide_logctx(term, logctx);
+    logfopen(logctx);
+
+    allocs0 = bench_allocs;
+    paints0 = bench_paints;
+    t0 = now_seconds();
+    while (done < minbytes) {
+	for (pos = 0; pos < len; pos += chunk) {
+	    int n = (len - pos < chunk ? len - pos : chunk);
+	    term_data(term, 0, data + pos, n);
+	    bench_run_timers();
+	}
+	done += len;
+    }
+    t1 = now_seconds();
+
+    res->bytes = done;
+    res->seconds = t1 - t0;
+    res->allocs = bench_allocs - allocs0;
+    res->paints = bench_paints - paints0;
+    term_get_update_stats(term, &res->updates, &res->skipped,
+			  &res->paintticks);
+    res->sbbytes = term->sbbytes + term->sbpagebytes;
+
+    term_free(term);
+    log_free(logctx);
+}
+
+static const char *basename_of(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: termbench [-w cols] [-h rows] [-s savelines]"
+	    " [-a package] [-d spillage]\n"
+	    "                 [-c chunk] [-n MB] [-r runs]"
+	    " [-p] [-l asciilog | -L rawlog]\n"
+	    "                 [-z] [-R kbytes] corpus-file...\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    Config cfg;
+    struct unicode_data ucsdata;
+    int rows = 24, cols = 80, chunk = 4096, runs = 3;
+    double minmb = 16;
+    const char *logname = "none";
+    int i;
+
+    bench_default_config(&cfg);
+    bench_init_ucs(&ucsdata);
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+	char *opt = argv[i];
+	if (!strcmp(opt, "-p")) {
+	    bench_paint_enabled = TRUE;
+	    continue;
+	}
+	if (!strcmp(opt, "-z")) {
+	    cfg.logcompress = TRUE;
+	    continue;
+	}
+	if (i + 1 >= argc || opt[2])
+	    usage();
+	switch (opt[1]) {
+	  case 'w': cols = atoi(argv[++i]); break;
+	  case 'h': rows = atoi(argv[++i]); break;
+	  case 's': cfg.savelines = atoi(argv[++i]); break;
+	  case 'a': cfg.sb_pack_age = atoi(argv[++i]); break;
+	  case 'd': cfg.sb_spill_age = atoi(argv[++i]); break;
+	  case 'c': chunk = atoi(argv[++i]); break;
+	  case 'n': minmb = atof(argv[++i]); break;
+	  case 'r': runs = atoi(argv[++i]); break;
+	  case 'R': cfg.logrotsize = atoi(argv[++i]); break;
+	  case 'l':
+	  case 'L':
+	    cfg.logtype = (opt[1] == 'l' ? LGTYP_ASCII : LGTYP_DEBUG);
+	    logname = argv[++i];
+	    cfg.logfilename = filename_from_str(logname);
+	    break;
+	  default:
+	    usage();
+	}
+    }
+    if (i >= argc || rows < 1 || cols < 1 || chunk < 1 || runs < 1)
+	usage();
+    cfg.width = cols;
+    cfg.height = rows;
+
+    printf("# termbench\tcols=%d\trows=%d\tsavelines=%d\tpackage=%d"
+	   "\tspillage=%d\tchunk=%d\tpaint=%d\tlog=%s\n", cols, rows,
+	   cfg.savelines, cfg.sb_pack_age, cfg.sb_spill_age, chunk,
+	   bench_paint_enabled, logname);
+    printf("corpus\tbytes\tseconds\tMB/s\tns/byte\tallocs/MB\tpaints"
+	   "\tupdates\tskipped\tpaintms\tsbKB\n");
+
+    for (; i < argc; i++) {
+	struct bench_result best, res;
+	char *data;
+	int len, r;
+
+	data = read_corpus(argv[i], &len);
+	for (r = 0; r < runs; r++) {
+	    run_one(&cfg, &ucsdata, data, len, rows, cols, chunk,
+		    minmb * 1e6, &res);
+	    if (r == 0 || res.seconds < best.seconds)
+		best = res;
+	}
+	sfree(data);
+
+	printf("%s\t%.0f\t%.4f\t%.2f\t%.2f\t%.1f\t%lu\t%lu\t%lu\t%lu"
+	       "\t%lu\n",
+	       basename_of(argv[i]), best.bytes, best.seconds,
+	       best.bytes / best.seconds / 1e6,
+	       best.seconds * 1e9 / best.bytes,
+	       best.allocs * 1e6 / best.bytes, best.paints,
+	       best.updates, best.skipped,
+	       best.paintticks * 1000 / TICKSPERSEC,
+	       best.sbbytes / 1024);
+	fflush(stdout);
+    }
+
+    return 0;
+}
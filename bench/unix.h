@@ -0,0 +1,67 @@
+/*
+ * unix.h: minimal platform header for the headless benchmark build.
+ *
+ * puttyps.h picks this file up on anything that isn't Windows. It
+ * supplies just enough of what winstuff.h normally provides for
+ * the platform-independent modules (terminal.c, logging.c,
+ * timing.c and friends) to compile and link against the stub
+ * front end in benchfe.c.
+ */
+
+#ifndef PUTTY_UNIX_H
+#define PUTTY_UNIX_H
+
+#include <stdio.h>		       /* for FILENAME_MAX */
+#include "tree234.h"
+
+struct Filename {
+    char path[FILENAME_MAX];
+};
+#define f_open(filename, mode, isprivate) ( fopen((filename).path, (mode)) )
+
+struct FontSpec {
+    char name[64];
+    int isbold;
+    int height;
+    int charset;
+};
+
+#ifndef GLOBAL
+#ifdef PUTTY_DO_GLOBALS
+#define GLOBAL
+#else
+#define GLOBAL extern
+#endif
+#endif
+
+#ifndef DONE_TYPEDEFS
+#define DONE_TYPEDEFS
+typedef struct config_tag Config;
+typedef struct backend_tag Backend;
+typedef struct terminal_tag Terminal;
+#endif
+
+#define PUTTY_REG_POS "Software\\PuTTYCyg"
+
+/*
+ * The benchmark front end counts time in milliseconds from an
+ * arbitrary origin, just like GetTickCount.
+ */
+long bench_tickcount(void);
+#define GETTICKCOUNT bench_tickcount
+#define CURSORBLINK 500
+#define TICKSPERSEC 1000
+
+#define DEFAULT_CODEPAGE 0
+#define CP_ACP 0
+
+typedef void *Context;		       /* never dereferenced */
+
+#define MULTICLICK_ONLY_EVENT 1
+#define SELECTION_NUL_TERMINATED 1
+#define SEL_NL { 10 }
+
+#define BYTE unsigned char
+#define WCHAR wchar_t
+
+#endif
@@ -973,6 +973,21 @@ void setup_config_box(struct controlbox *b, int midsession,
     ctrl_checkbox(s, "Flush log file frequently", 'u',
 		 HELPCTX(logging_flush),
 		 dlg_stdcheckbox_handler, I(offsetof(Config,logflush)));
+    ctrl_editbox(s, "Milliseconds before buffered output is written", 'i',
+		 20, HELPCTX(logging_flush),
+		 dlg_stdeditbox_handler, I(offsetof(Config,logflushtime)),
+		 I(-1));
+    ctrl_checkbox(s, "Compress log file with gzip", 'z',
+		 HELPCTX(logging_compress),
+		 dlg_stdcheckbox_handler, I(offsetof(Config,logcompress)));
+    ctrl_editbox(s, "Start a new log file after this many kbytes", 'k',
+		 20, HELPCTX(logging_rotate),
+		 dlg_stdeditbox_handler, I(offsetof(Config,logrotsize)),
+		 I(-1));
+    ctrl_editbox(s, "Start a new log file after this many minutes", 'n',
+		 20, HELPCTX(logging_rotate),
+		 dlg_stdeditbox_handler, I(offsetof(Config,logrottime)),
+		 I(-1));
 
     /*
      * The Terminal panel.
@@ -1161,6 +1176,12 @@ void setup_config_box(struct controlbox *b, int midsession,
     ctrl_editbox(s, "Lines of scrollback", 's', 50,
 		 HELPCTX(window_scrollback),
 		 dlg_stdeditbox_handler, I(offsetof(Config,savelines)), I(-1));
+    ctrl_editbox(s, "Compress scrollback older than (lines)", NO_SHORTCUT,
+		 50, HELPCTX(window_scrollback), dlg_stdeditbox_handler,
+		 I(offsetof(Config,sb_pack_age)), I(-1));
+    ctrl_editbox(s, "Move scrollback older than (lines) to disk", NO_SHORTCUT,
+		 50, HELPCTX(window_scrollback), dlg_stdeditbox_handler,
+		 I(offsetof(Config,sb_spill_age)), I(-1));
     ctrl_checkbox(s, "Display scrollbar", 'd',
 		  HELPCTX(window_scrollback),
 		  dlg_stdcheckbox_handler, I(offsetof(Config,scrollbar)));
@@ -7,10 +7,338 @@
 #include <ctype.h>
 
 #include <time.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "putty.h"
 
+/*
+ * gzip compression of log files. This is a simple deflate
+ * compressor: greedy LZ77 matching over a 32K window, coded with
+ * the fixed Huffman tables. Terminal output is full of repeated
+ * prompts and escape sequences, so that gets most of what building
+ * dynamic trees would, for a lot less code.
+ *
+ * Input is gathered in the top half of a 64K window, and compressed
+ * when that fills up or the stream is flushed; the bottom half holds
+ * the history that matches can refer back to. The compressed output
+ * collects in `out' until the caller takes it with zip_output().
+ */
+#define ZIP_WSIZE 32768
+#define ZIP_HSIZE 32768
+#define ZIP_MINMATCH 3
+#define ZIP_MAXMATCH 258
+#define ZIP_CHAIN 32		       /* most candidates to try per match */
+#define ZIP_MAXIN ZIP_WSIZE	       /* most input per zip_data() call */
+/* Worst case is 9 bits a byte, and a call can compress twice. */
+#define ZIP_OUTSIZE (2 * (ZIP_WSIZE + ZIP_WSIZE / 8) + 64)
+
+struct logzip {
+    unsigned char win[2 * ZIP_WSIZE];
+    int head[ZIP_HSIZE];	       /* latest position with each hash */
+    int prev[ZIP_WSIZE];	       /* previous position with same hash */
+    int pos, end;		       /* compressed up to pos, data to end */
+    unsigned long crc, size;
+    unsigned long bits;		       /* output bits not yet in `out' */
+    int nbits;
+    unsigned char out[ZIP_OUTSIZE];
+    int outlen;
+};
+
+static const unsigned short zip_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char zip_lextra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short zip_dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const unsigned char zip_dextra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/*
+ * The fixed literal/length codes, bit-reversed ready for output,
+ * and the CRC-32 table. Both are set up by zip_new(), which is
+ * only called from the main thread.
+ */
+static unsigned short zip_lcode[288];
+static unsigned char zip_llen[288];
+static unsigned long zip_crctab[256];
+static int zip_tables_done = FALSE;
+
+static unsigned zip_reverse(unsigned code, int len)
+{
+    unsigned ret = 0;
+    while (len-- > 0) {
+	ret = (ret << 1) | (code & 1);
+	code >>= 1;
+    }
+    return ret;
+}
+
+static void zip_tables(void)
+{
+    int i, j;
+
+    for (i = 0; i < 288; i++) {
+	unsigned code;
+	int len;
+	if (i < 144)
+	    code = 0x30 + i, len = 8;
+	else if (i < 256)
+	    code = 0x190 + i - 144, len = 9;
+	else if (i < 280)
+	    code = i - 256, len = 7;
+	else
+	    code = 0xC0 + i - 280, len = 8;
+	zip_lcode[i] = zip_reverse(code, len);
+	zip_llen[i] = len;
+    }
+
+    for (i = 0; i < 256; i++) {
+	unsigned long c = i;
+	for (j = 0; j < 8; j++)
+	    c = (c & 1 ? 0xEDB88320UL ^ (c >> 1) : c >> 1);
+	zip_crctab[i] = c;
+    }
+
+    zip_tables_done = TRUE;
+}
+
+static void zip_bits(struct logzip *z, unsigned long value, int nbits)
+{
+    z->bits |= value << z->nbits;
+    z->nbits += nbits;
+    while (z->nbits >= 8) {
+	z->out[z->outlen++] = (unsigned char)z->bits;
+	z->bits >>= 8;
+	z->nbits -= 8;
+    }
+}
+
+static void zip_align(struct logzip *z)
+{
+    if (z->nbits)
+	zip_bits(z, 0, 8 - z->nbits);
+}
+
+static unsigned zip_hash(const unsigned char *p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (ZIP_HSIZE - 1);
+}
+
+static void zip_insert(struct logzip *z, int p)
+{
+    unsigned h = zip_hash(z->win + p);
+    z->prev[p & (ZIP_WSIZE - 1)] = z->head[h];
+    z->head[h] = p;
+}
+
+static void zip_match(struct logzip *z, int len, int dist)
+{
+    int i;
+
+    for (i = 28; zip_lbase[i] > len; i--);
+    zip_bits(z, zip_lcode[257 + i], zip_llen[257 + i]);
+    zip_bits(z, len - zip_lbase[i], zip_lextra[i]);
+    for (i = 29; zip_dbase[i] > dist; i--);
+    zip_bits(z, zip_reverse(i, 5), 5);
+    zip_bits(z, dist - zip_dbase[i], zip_dextra[i]);
+}
+
+/*
+ * Compress everything from pos to end as one fixed-code block.
+ */
+static void zip_compress(struct logzip *z)
+{
+    int p = z->pos, i;
+
+    if (p == z->end)
+	return;
+
+    zip_bits(z, 2, 3);		       /* not final; fixed codes */
+    while (p < z->end) {
+	int len = 0, dist = 0;
+
+	if (z->end - p >= ZIP_MINMATCH) {
+	    int maxlen = z->end - p, chain = ZIP_CHAIN;
+	    int cand = z->head[zip_hash(z->win + p)];
+
+	    if (maxlen > ZIP_MAXMATCH)
+		maxlen = ZIP_MAXMATCH;
+	    while (cand >= 0 && p - cand <= ZIP_WSIZE && chain-- > 0) {
+		if (z->win[cand + len] == z->win[p + len]) {
+		    int l = 0;
+		    while (l < maxlen && z->win[cand + l] == z->win[p + l])
+			l++;
+		    if (l > len) {
+			len = l;
+			dist = p - cand;
+			if (len == maxlen)
+			    break;
+		    }
+		}
+		cand = z->prev[cand & (ZIP_WSIZE - 1)];
+	    }
+	}
+
+	if (len >= ZIP_MINMATCH) {
+	    zip_match(z, len, dist);
+	} else {
+	    len = 1;
+	    zip_bits(z, zip_lcode[z->win[p]], zip_llen[z->win[p]]);
+	}
+	for (i = 0; i < len; i++, p++)
+	    if (z->end - p >= ZIP_MINMATCH)
+		zip_insert(z, p);
+    }
+    zip_bits(z, zip_lcode[256], zip_llen[256]);	/* end of block */
+    z->pos = p;
+    assert(z->outlen <= ZIP_OUTSIZE - 16);
+}
+
+/*
+ * Discard the bottom half of the window to make room for more
+ * input. Only called when everything has been compressed.
+ */
+static void zip_slide(struct logzip *z)
+{
+    int i;
+
+    memmove(z->win, z->win + ZIP_WSIZE, ZIP_WSIZE);
+    z->pos -= ZIP_WSIZE;
+    z->end -= ZIP_WSIZE;
+    for (i = 0; i < ZIP_HSIZE; i++)
+	z->head[i] = (z->head[i] >= ZIP_WSIZE ? z->head[i] - ZIP_WSIZE : -1);
+    for (i = 0; i < ZIP_WSIZE; i++)
+	z->prev[i] = (z->prev[i] >= ZIP_WSIZE ? z->prev[i] - ZIP_WSIZE : -1);
+}
+
+static struct logzip *zip_new(void)
+{
+    struct logzip *z = snew(struct logzip);
+    int i;
+
+    if (!zip_tables_done)
+	zip_tables();
+
+    for (i = 0; i < ZIP_HSIZE; i++)
+	z->head[i] = -1;
+    for (i = 0; i < ZIP_WSIZE; i++)
+	z->prev[i] = -1;
+    z->pos = z->end = ZIP_WSIZE;       /* no history yet */
+    z->crc = 0xFFFFFFFFUL;
+    z->size = 0;
+    z->bits = 0;
+    z->nbits = 0;
+    z->outlen = 0;
+
+    /* gzip header: deflate, no flags, no time, unknown OS. */
+    zip_bits(z, 0x8B1F, 16);
+    zip_bits(z, 8, 8);
+    zip_bits(z, 0, 8);
+    zip_bits(z, 0, 16);
+    zip_bits(z, 0, 16);
+    zip_bits(z, 0, 8);
+    zip_bits(z, 255, 8);
+    return z;
+}
+
+/*
+ * Add up to ZIP_MAXIN bytes of input.
+ */
+static void zip_data(struct logzip *z, const void *vdata, int len)
+{
+    const unsigned char *data = (const unsigned char *)vdata;
+    unsigned long crc = z->crc;
+    int i;
+
+    assert(len <= ZIP_MAXIN);
+    for (i = 0; i < len; i++)
+	crc = zip_crctab[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    z->crc = crc;
+    z->size += len;
+
+    while (len > 0) {
+	int n = 2 * ZIP_WSIZE - z->end;
+	if (n > len)
+	    n = len;
+	memcpy(z->win + z->end, data, n);
+	z->end += n;
+	data += n;
+	len -= n;
+	if (z->end == 2 * ZIP_WSIZE) {
+	    zip_compress(z);
+	    zip_slide(z);
+	}
+    }
+}
+
+/*
+ * Compress all the input so far and bring the output to a byte
+ * boundary with an empty stored block, so that a reader of the file
+ * can decompress everything up to here.
+ */
+static void zip_flush(struct logzip *z)
+{
+    zip_compress(z);
+    zip_bits(z, 0, 3);		       /* not final; stored */
+    zip_align(z);
+    zip_bits(z, 0x0000, 16);
+    zip_bits(z, 0xFFFF, 16);
+}
+
+/*
+ * End the stream: an empty final block, then the gzip trailer.
+ */
+static void zip_finish(struct logzip *z)
+{
+    unsigned long crc = z->crc ^ 0xFFFFFFFFUL;
+
+    zip_compress(z);
+    zip_bits(z, 3, 3);		       /* final; fixed codes */
+    zip_bits(z, zip_lcode[256], zip_llen[256]);
+    zip_align(z);
+    zip_bits(z, crc & 0xFFFF, 16);
+    zip_bits(z, (crc >> 16) & 0xFFFF, 16);
+    zip_bits(z, z->size & 0xFFFF, 16);
+    zip_bits(z, (z->size >> 16) & 0xFFFF, 16);
+}
+
+/*
+ * Return the output produced so far, and empty the output buffer.
+ * The data stays valid until the next call to any of the above.
+ */
+static void *zip_output(struct logzip *z, int *len)
+{
+    *len = z->outlen;
+    z->outlen = 0;
+    return z->out;
+}
+
+/*
+ * Output to an open log file is collected into LOG_BUFSIZE-byte
+ * buffers, which are handed to a writer thread through a ring of
+ * LOG_NBUFS of them, so that a slow disk doesn't hold up the
+ * session. If the ring fills up we wait for the writer to catch up,
+ * so the memory used is bounded.
+ */
+#define LOG_BUFSIZE 65536
+#define LOG_NBUFS 8
+
+struct logbuf {
+    char *data;
+    int len;
+    int flush;			       /* fflush() after writing this */
+};
+
 /* log session to file stuff ... */
 struct LogContext {
     FILE *lgfp;
@@ -19,10 +347,221 @@ struct LogContext {
     Filename currlogfilename;
     void *frontend;
     Config cfg;
+
+    struct logzip *zip;		       /* non-NULL if compressing */
+
+    /*
+     * Rotation. `written' counts bytes (before compression) since
+     * the file was opened. `rotbase' is the name the file would have
+     * had without the sequence number `rotseq' added.
+     */
+    unsigned long written;
+    long rotate_when;
+    int rotate_due;
+    Filename rotbase;
+    int rotseq;
+
+    /*
+     * The ring. bufs[head % LOG_NBUFS] is the one we're filling
+     * (curlen bytes so far); bufs[tail % LOG_NBUFS] is the next one
+     * for the writer. Only this thread changes head, and only the
+     * writer changes tail. `writer' is NULL if there is no writer
+     * thread, in which case we just fwrite() as we go.
+     */
+    struct logbuf bufs[LOG_NBUFS];
+    volatile unsigned head, tail;
+    int curlen;
+    int unflushed;		       /* sent data without flush since */
+    int wantflush;		       /* logflush() since last send */
+    int timer_pending;
+    void *writer, *wake, *space;
+    volatile int stop;
 };
 
 static void xlatlognam(Filename *d, Filename s, char *hostname, struct tm *tm);
 
+/*
+ * Write data to the open log file, compressing it if need be. This
+ * is called by the writer thread if there is one.
+ */
+static void log_output(struct LogContext *ctx, const char *data, int len,
+		       int flush)
+{
+    if (ctx->zip) {
+	void *out;
+	int n, outlen;
+
+	do {
+	    n = (len < ZIP_MAXIN ? len : ZIP_MAXIN);
+	    zip_data(ctx->zip, data, n);
+	    data += n;
+	    len -= n;
+	    if (!len && flush)
+		zip_flush(ctx->zip);
+	    out = zip_output(ctx->zip, &outlen);
+	    if (outlen)
+		fwrite(out, 1, outlen, ctx->lgfp);
+	} while (len > 0);
+    } else if (len)
+	fwrite(data, 1, len, ctx->lgfp);
+    if (flush)
+	fflush(ctx->lgfp);
+}
+
+#ifndef NO_THREADS
+/*
+ * The writer thread. It reads `stop' before emptying the ring, so
+ * that anything queued before logfclose() set it is written out
+ * before the thread returns.
+ */
+static void log_writer(void *handle)
+{
+    struct LogContext *ctx = (struct LogContext *)handle;
+
+    while (1) {
+	int stop = ctx->stop;
+	memory_barrier();
+	while (ctx->tail != ctx->head) {
+	    struct logbuf *b = &ctx->bufs[ctx->tail % LOG_NBUFS];
+	    memory_barrier();	       /* see head before the contents */
+	    log_output(ctx, b->data, b->len, b->flush);
+	    memory_barrier();	       /* finish with it before tail */
+	    ctx->tail++;
+	    event_set(ctx->space);
+	}
+	if (stop)
+	    break;
+	event_wait(ctx->wake);
+    }
+}
+
+/*
+ * Return the buffer we're filling, waiting for the writer to free
+ * one up if we're starting a new one and the ring is full.
+ */
+static char *log_curbuf(struct LogContext *ctx)
+{
+    struct logbuf *b = &ctx->bufs[ctx->head % LOG_NBUFS];
+
+    if (ctx->curlen == 0) {
+	while (ctx->head - ctx->tail >= LOG_NBUFS)
+	    event_wait(ctx->space);
+	memory_barrier();	       /* writer has finished with it */
+	if (!b->data)
+	    b->data = snewn(LOG_BUFSIZE, char);
+    }
+    return b->data;
+}
+
+/*
+ * Hand the current buffer to the writer thread, if there's
+ * anything to write or (if `flush' is set) to flush.
+ */
+static void log_send(struct LogContext *ctx, int flush)
+{
+    struct logbuf *b;
+
+    if (!ctx->curlen && !(flush && ctx->unflushed))
+	return;
+
+    log_curbuf(ctx);
+    b = &ctx->bufs[ctx->head % LOG_NBUFS];
+    b->len = ctx->curlen;
+    b->flush = flush;
+    ctx->curlen = 0;
+    ctx->unflushed = !flush;
+    memory_barrier();		       /* contents before head */
+    ctx->head++;
+    event_set(ctx->wake);
+}
+
+static void log_timer(void *handle, long now)
+{
+    struct LogContext *ctx = (struct LogContext *)handle;
+
+    ctx->timer_pending = FALSE;
+    if (ctx->state == L_OPEN && ctx->writer)
+	log_send(ctx, ctx->wantflush || ctx->cfg.logflush);
+    ctx->wantflush = FALSE;
+}
+
+/*
+ * Make sure whatever is in the current buffer gets to the writer
+ * within the configured flush interval.
+ */
+static void log_schedule(struct LogContext *ctx)
+{
+    if (ctx->timer_pending)
+	return;
+    if (ctx->cfg.logflushtime <= 0) {
+	log_send(ctx, ctx->wantflush);
+	ctx->wantflush = FALSE;
+    } else {
+	ctx->timer_pending = TRUE;
+	schedule_timer(ctx->cfg.logflushtime * TICKSPERSEC / 1000,
+		       log_timer, ctx);
+    }
+}
+
+static void log_queue(struct LogContext *ctx, const char *data, int len)
+{
+    while (len > 0) {
+	char *buf = log_curbuf(ctx);
+	int n = LOG_BUFSIZE - ctx->curlen;
+
+	if (n > len)
+	    n = len;
+	memcpy(buf + ctx->curlen, data, n);
+	ctx->curlen += n;
+	data += n;
+	len -= n;
+	if (ctx->curlen == LOG_BUFSIZE)
+	    log_send(ctx, FALSE);
+    }
+    if (ctx->curlen)
+	log_schedule(ctx);
+}
+
+static void log_start_writer(struct LogContext *ctx)
+{
+    ctx->head = ctx->tail = 0;
+    ctx->curlen = 0;
+    ctx->unflushed = ctx->wantflush = FALSE;
+    ctx->stop = FALSE;
+    ctx->wake = event_new();
+    ctx->space = event_new();
+    if (ctx->wake && ctx->space)
+	ctx->writer = thread_start(log_writer, ctx);
+    if (!ctx->writer) {
+	/* Fall back to writing synchronously. */
+	if (ctx->wake)
+	    event_free(ctx->wake);
+	if (ctx->space)
+	    event_free(ctx->space);
+	ctx->wake = ctx->space = NULL;
+    }
+}
+
+/*
+ * Pass the writer everything we've got, and wait for it to write
+ * it all out and exit.
+ */
+static void log_stop_writer(struct LogContext *ctx)
+{
+    log_send(ctx, FALSE);
+    memory_barrier();		       /* last head before stop */
+    ctx->stop = TRUE;
+    event_set(ctx->wake);
+    thread_join(ctx->writer);
+    ctx->writer = NULL;
+    event_free(ctx->wake);
+    event_free(ctx->space);
+    ctx->wake = ctx->space = NULL;
+}
+#endif
+
+static void logrotate(struct LogContext *ctx);
+
 /*
  * Internal wrapper function which must be called for _all_ output
  * to the log file. It takes care of opening the log file if it
@@ -39,11 +578,27 @@ static void logwrite(struct LogContext *ctx, void *data, int len)
     if (ctx->state == L_CLOSED)
 	logfopen(ctx);
 
+    /*
+     * Start a new log file if this one is big or old enough. That
+     * can fail, leaving us in L_ERROR, so do it before the rest.
+     */
+    if (ctx->state == L_OPEN &&
+	(ctx->rotate_due ||
+	 (ctx->cfg.logrotsize > 0 &&
+	  ctx->written >= (unsigned long)ctx->cfg.logrotsize * 1024)))
+	logrotate(ctx);
+
     if (ctx->state == L_OPENING) {
 	bufchain_add(&ctx->queue, data, len);
     } else if (ctx->state == L_OPEN) {
 	assert(ctx->lgfp);
-	fwrite(data, 1, len, ctx->lgfp);
+	ctx->written += len;
+#ifndef NO_THREADS
+	if (ctx->writer)
+	    log_queue(ctx, data, len);
+	else
+#endif
+	    log_output(ctx, data, len, FALSE);
     }				       /* else L_ERROR, so ignore the write */
 }
 
@@ -65,13 +620,70 @@ static void logprintf(struct LogContext *ctx, const char *fmt, ...)
 }
 
 /*
- * Flush any open log file.
+ * Flush any open log file. If there's a writer thread, we don't
+ * wait for it: the flush happens within the flush interval.
  */
 void logflush(void *handle) {
     struct LogContext *ctx = (struct LogContext *)handle;
     if (ctx->cfg.logtype > 0)
-	if (ctx->state == L_OPEN)
-	    fflush(ctx->lgfp);
+	if (ctx->state == L_OPEN) {
+#ifndef NO_THREADS
+	    if (ctx->writer) {
+		ctx->wantflush = TRUE;
+		log_schedule(ctx);
+		return;
+	    }
+#endif
+	    log_output(ctx, NULL, 0, TRUE);
+	}
+}
+
+/*
+ * Write out everything logged so far, and wait for it to reach the
+ * file. Used when a session ends, so that the log is complete while
+ * the window stays open.
+ */
+void log_sync(void *handle)
+{
+    struct LogContext *ctx = (struct LogContext *)handle;
+    if (ctx->state != L_OPEN)
+	return;
+#ifndef NO_THREADS
+    if (ctx->writer) {
+	log_send(ctx, TRUE);
+	ctx->wantflush = FALSE;
+	while (ctx->head != ctx->tail)
+	    event_wait(ctx->space);
+	return;
+    }
+#endif
+    log_output(ctx, NULL, 0, TRUE);
+}
+
+static void log_rotate_timer(void *handle, long now)
+{
+    struct LogContext *ctx = (struct LogContext *)handle;
+
+    /* Wait for the next write, so as not to start an empty file. */
+    if (ctx->state == L_OPEN && ctx->cfg.logrottime > 0 &&
+	now == ctx->rotate_when)
+	ctx->rotate_due = TRUE;
+}
+
+/*
+ * Arrange to start a new file logrottime minutes from now, if
+ * that's set. Any earlier arrangement no longer counts.
+ */
+static void log_schedule_rotation(struct LogContext *ctx)
+{
+    ctx->rotate_due = FALSE;
+    if (ctx->cfg.logrottime > 0) {
+	int mins = ctx->cfg.logrottime;
+	if (mins > INT_MAX / (60 * TICKSPERSEC))
+	    mins = INT_MAX / (60 * TICKSPERSEC);
+	ctx->rotate_when = schedule_timer(mins * 60 * TICKSPERSEC,
+					  log_rotate_timer, ctx);
+    }
 }
 
 static void logfopen_callback(void *handle, int mode)
@@ -93,6 +705,14 @@ static void logfopen_callback(void *handle, int mode)
     }
 
     if (ctx->state == L_OPEN) {
+	ctx->written = 0;
+	log_schedule_rotation(ctx);
+	if (ctx->cfg.logcompress)
+	    ctx->zip = zip_new();
+#ifndef NO_THREADS
+	log_start_writer(ctx);
+#endif
+
 	/* Write header line into log file. */
 	tm = ltime();
 	strftime(buf, 24, "%Y.%m.%d %H:%M:%S", &tm);
@@ -148,6 +768,8 @@ void logfopen(void *handle)
 
     /* substitute special codes in file name */
     xlatlognam(&ctx->currlogfilename, ctx->cfg.logfilename,ctx->cfg.host, &tm);
+    ctx->rotbase = ctx->currlogfilename;
+    ctx->rotseq = 0;
 
     ctx->lgfp = f_open(ctx->currlogfilename, "r", FALSE);  /* file already present? */
     if (ctx->lgfp) {
@@ -166,13 +788,64 @@ void logfopen(void *handle)
 	logfopen_callback(ctx, mode);  /* open the file */
 }
 
-void logfclose(void *handle)
+/*
+ * Finish writing and close the log file, if it's open.
+ */
+static void log_closefile(struct LogContext *ctx)
 {
-    struct LogContext *ctx = (struct LogContext *)handle;
     if (ctx->lgfp) {
+#ifndef NO_THREADS
+	if (ctx->writer)
+	    log_stop_writer(ctx);
+#endif
+	if (ctx->zip) {
+	    void *out;
+	    int outlen;
+	    zip_finish(ctx->zip);
+	    out = zip_output(ctx->zip, &outlen);
+	    fwrite(out, 1, outlen, ctx->lgfp);
+	    sfree(ctx->zip);
+	    ctx->zip = NULL;
+	}
 	fclose(ctx->lgfp);
 	ctx->lgfp = NULL;
     }
+}
+
+/*
+ * Close the log file and start a new one, working its name out
+ * afresh from the current time. If that gives the same name as
+ * before, add a sequence number rather than overwrite it; and
+ * since we can't sensibly stop to ask, `ask' means append.
+ */
+static void logrotate(struct LogContext *ctx)
+{
+    Filename fn;
+    struct tm tm;
+
+    log_closefile(ctx);
+
+    tm = ltime();
+    xlatlognam(&fn, ctx->cfg.logfilename, ctx->cfg.host, &tm);
+    if (filename_equal(fn, ctx->rotbase)) {
+	char *name = dupprintf("%s.%d", filename_to_str(&ctx->rotbase),
+			       ++ctx->rotseq);
+	ctx->currlogfilename = filename_from_str(name);
+	sfree(name);
+    } else {
+	ctx->currlogfilename = ctx->rotbase = fn;
+	ctx->rotseq = 0;
+    }
+
+    logfopen_callback(ctx, ctx->cfg.logxfovr == LGXF_OVR ? 2 : 1);
+}
+
+void logfclose(void *handle)
+{
+    struct LogContext *ctx = (struct LogContext *)handle;
+    log_closefile(ctx);
+    expire_timer_context(ctx);
+    ctx->timer_pending = FALSE;
     ctx->state = L_CLOSED;
 }
 
@@ -188,6 +861,19 @@ void logtraffic(void *handle, unsigned char c, int logmode)
     }
 }
 
+/*
+ * Log a run of session traffic at once, for callers with more than
+ * one byte to hand.
+ */
+void logtraffic_span(void *handle, const void *data, int len, int logmode)
+{
+    struct LogContext *ctx = (struct LogContext *)handle;
+    if (ctx->cfg.logtype > 0 && len > 0) {
+	if (ctx->cfg.logtype == logmode)
+	    logwrite(ctx, (void *)data, len);
+    }
+}
+
 /*
  * Log an Event Log entry. Used in SSH packet logging mode; this is
  * also as convenient a place as any to put the output of Event Log
@@ -218,15 +904,25 @@ void log_eventlog(void *handle, const char *event)
  * Log an SSH packet.
  * If n_blanks != 0, blank or omit some parts.
  * Set of blanking areas must be in increasing order.
+ *
+ * The hex dump is formatted a row at a time straight into `dump',
+ * which is passed to logwrite() whenever it fills up, rather than
+ * going through sprintf() and a logwrite() per row.
  */
+#define DUMP_ASCII (10+1+3*16+2)       /* column of first ASCII char */
+#define DUMP_ROWLEN (DUMP_ASCII+16+2)
+#define DUMP_ROWS 32
+
 void log_packet(void *handle, int direction, int type,
 		char *texttype, void *data, int len,
 		int n_blanks, const struct logblank_t *blanks)
 {
     struct LogContext *ctx = (struct LogContext *)handle;
-    char dumpdata[80], smalldata[5];
+    static const char hex[] = "0123456789abcdef";
+    char dump[DUMP_ROWS * DUMP_ROWLEN], *row = dump;
+    int dumplen = 0;
     int p = 0, b = 0, omitted = 0;
-    int output_pos = 0; /* NZ if pending output in dumpdata */
+    int output_pos = 0; /* NZ if pending output in row */
 
     if (!(ctx->cfg.logtype == LGTYP_SSHRAW ||
           (ctx->cfg.logtype == LGTYP_PACKETS && texttype)))
@@ -263,41 +959,55 @@ void log_packet(void *handle, int direction, int type,
 	/* If we're about to stop omitting, it's time to say how
 	 * much we omitted. */
 	if ((blktype != PKTLOG_OMIT) && omitted) {
+	    if (dumplen)
+		logwrite(ctx, dump, dumplen);
+	    dumplen = 0;
 	    logprintf(ctx, "  (%d byte%s omitted)\r\n",
 		      omitted, (omitted==1?"":"s"));
 	    omitted = 0;
 	}
 
-	/* (Re-)initialise dumpdata as necessary
-	 * (start of row, or if we've just stopped omitting) */
-	if (!output_pos && !omitted)
-	    sprintf(dumpdata, "  %08x%*s\r\n", p-(p%16), 1+3*16+2+16, "");
-
 	/* Deal with the current byte. */
 	if (blktype == PKTLOG_OMIT) {
 	    omitted++;
 	} else {
-	    int c;
+	    int c, col = p % 16;
+
+	    /* Start a new row if necessary (start of row, or if
+	     * we've just stopped omitting). */
+	    if (!output_pos) {
+		int i, offset = p - col;
+		if (dumplen > (int)sizeof(dump) - DUMP_ROWLEN) {
+		    logwrite(ctx, dump, dumplen);
+		    dumplen = 0;
+		}
+		row = dump + dumplen;
+		row[0] = row[1] = ' ';
+		for (i = 0; i < 8; i++)
+		    row[2+i] = hex[(offset >> (28 - 4*i)) & 0xF];
+		memset(row + 10, ' ', DUMP_ROWLEN - 10);
+	    }
+
 	    if (blktype == PKTLOG_BLANK) {
 		c = 'X';
-		sprintf(smalldata, "XX");
+		row[10+2+3*col] = row[10+2+3*col+1] = 'X';
 	    } else {  /* PKTLOG_EMIT */
 		c = ((unsigned char *)data)[p];
-		sprintf(smalldata, "%02x", c);
+		row[10+2+3*col] = hex[c >> 4];
+		row[10+2+3*col+1] = hex[c & 0xF];
 	    }
-	    dumpdata[10+2+3*(p%16)] = smalldata[0];
-	    dumpdata[10+2+3*(p%16)+1] = smalldata[1];
-	    dumpdata[10+1+3*16+2+(p%16)] = (isprint(c) ? c : '.');
-	    output_pos = (p%16) + 1;
+	    row[DUMP_ASCII+col] = (isprint(c) ? c : '.');
+	    output_pos = col + 1;
 	}
 
 	p++;
 
-	/* Flush row if necessary */
+	/* Finish row if necessary */
 	if (((p % 16) == 0) || (p == len) || omitted) {
 	    if (output_pos) {
-		strcpy(dumpdata + 10+1+3*16+2+output_pos, "\r\n");
-		logwrite(ctx, dumpdata, strlen(dumpdata));
+		row[DUMP_ASCII+output_pos] = '\r';
+		row[DUMP_ASCII+output_pos+1] = '\n';
+		dumplen += DUMP_ASCII+output_pos+2;
 		output_pos = 0;
 	    }
 	}
@@ -305,6 +1015,8 @@ void log_packet(void *handle, int direction, int type,
     }
 
     /* Tidy up */
+    if (dumplen)
+	logwrite(ctx, dump, dumplen);
     if (omitted)
 	logprintf(ctx, "  (%d byte%s omitted)\r\n",
 		  omitted, (omitted==1?"":"s"));
@@ -314,33 +1026,54 @@ void log_packet(void *handle, int direction, int type,
 void *log_init(void *frontend, Config *cfg)
 {
     struct LogContext *ctx = snew(struct LogContext);
+    int i;
+
     ctx->lgfp = NULL;
     ctx->state = L_CLOSED;
     ctx->frontend = frontend;
     ctx->cfg = *cfg;		       /* STRUCTURE COPY */
     bufchain_init(&ctx->queue);
+    for (i = 0; i < LOG_NBUFS; i++)
+	ctx->bufs[i].data = NULL;
+    ctx->head = ctx->tail = 0;
+    ctx->curlen = 0;
+    ctx->unflushed = ctx->wantflush = FALSE;
+    ctx->timer_pending = FALSE;
+    ctx->writer = ctx->wake = ctx->space = NULL;
+    ctx->zip = NULL;
+    ctx->written = 0;
+    ctx->rotate_due = FALSE;
     return ctx;
 }
 
 void log_free(void *handle)
 {
     struct LogContext *ctx = (struct LogContext *)handle;
+    int i;
 
     logfclose(ctx);
     bufchain_clear(&ctx->queue);
+    for (i = 0; i < LOG_NBUFS; i++)
+	sfree(ctx->bufs[i].data);
     sfree(ctx);
 }
 
 void log_reconfig(void *handle, Config *cfg)
 {
     struct LogContext *ctx = (struct LogContext *)handle;
-    int reset_logging;
+    int reset_logging, reset_rotation;
 
+    /*
+     * A file can't change between compressed and not half way
+     * through, so that needs a new one too.
+     */
     if (!filename_equal(ctx->cfg.logfilename, cfg->logfilename) ||
-	ctx->cfg.logtype != cfg->logtype)
+	ctx->cfg.logtype != cfg->logtype ||
+	!ctx->cfg.logcompress != !cfg->logcompress)
 	reset_logging = TRUE;
     else
 	reset_logging = FALSE;
+    reset_rotation = (ctx->cfg.logrottime != cfg->logrottime);
 
     if (reset_logging)
 	logfclose(ctx);
@@ -349,6 +1082,8 @@ void log_reconfig(void *handle, Config *cfg)
 
     if (reset_logging)
 	logfopen(ctx);
+    else if (reset_rotation && ctx->state == L_OPEN)
+	log_schedule_rotation(ctx);
 }
 
 /*
@@ -321,25 +321,87 @@ void base64_encode_atom(unsigned char *data, int n, char *out)
 
 /* ----------------------------------------------------------------------
  * Generic routines to deal with send buffers: a linked list of
- * smallish blocks, with the operations
+ * blocks, with the operations
  * 
  *  - add an arbitrary amount of data to the end of the list
+ *  - hand over an allocated buffer to go on the end of the list,
+ *    without copying it
  *  - remove the first N bytes from the list
  *  - return a (pointer,length) pair giving some initial data in
  *    the list, suitable for passing to a send or write system
- *    call
+ *    call, or several such pairs for a vectored one
  *  - retrieve a larger amount of initial data from the list
  *  - return the current size of the buffer chain in bytes
+ *
+ * A granule's buffer normally follows its header in the same
+ * allocation, and is sized to suit the data that caused it to be
+ * created: a power of two between BUFFER_GRANULE and
+ * BUFFER_GRANULE_MAX bytes, so a big write costs one allocation
+ * rather than one per 512 bytes. Freed granules are kept on a free
+ * list per size, up to BUFFER_SPARES of each, for reuse.
  */
 
 #define BUFFER_GRANULE  512
+#define BUFFER_GRANULE_MAX 65536
+#define BUFFER_SIZES 8			/* 512 up to 64K */
+#define BUFFER_SPARES 4
 
 struct bufchain_granule {
     struct bufchain_granule *next;
-    int buflen, bufpos;
-    char buf[BUFFER_GRANULE];
+    char *buf;
+    int buflen, bufpos, bufsize;
 };
 
+#ifndef NO_POOLED_ALLOC
+static struct bufchain_granule *bufchain_spares[BUFFER_SIZES];
+static int bufchain_nspares[BUFFER_SIZES];
+#endif
+
+static struct bufchain_granule *bufchain_new_granule(int len)
+{
+    struct bufchain_granule *b;
+    int size = BUFFER_GRANULE, i = 0;
+
+    while (size < len && size < BUFFER_GRANULE_MAX) {
+	size <<= 1;
+	i++;
+    }
+
+#ifndef NO_POOLED_ALLOC
+    if ((b = bufchain_spares[i]) != NULL) {
+	bufchain_spares[i] = b->next;
+	bufchain_nspares[i]--;
+    } else
+#endif
+    {
+	b = (struct bufchain_granule *)
+	    smalloc(sizeof(struct bufchain_granule) + size);
+	b->buf = (char *)(b + 1);
+	b->bufsize = size;
+    }
+    b->next = NULL;
+    b->buflen = b->bufpos = 0;
+    return b;
+}
+
+static void bufchain_free_granule(struct bufchain_granule *b)
+{
+#ifndef NO_POOLED_ALLOC
+    {
+	int i;
+
+	for (i = 0; (BUFFER_GRANULE << i) < b->bufsize; i++);
+	if (bufchain_nspares[i] < BUFFER_SPARES) {
+	    b->next = bufchain_spares[i];
+	    bufchain_spares[i] = b;
+	    bufchain_nspares[i]++;
+	    return;
+	}
+    }
+#endif
+    sfree(b);
+}
+
 void bufchain_init(bufchain *ch)
 {
     ch->head = ch->tail = NULL;
@@ -352,7 +414,7 @@ void bufchain_clear(bufchain *ch)
     while (ch->head) {
 	b = ch->head;
 	ch->head = ch->head->next;
-	sfree(b);
+	bufchain_free_granule(b);
     }
     ch->tail = NULL;
     ch->buffersize = 0;
@@ -363,6 +425,15 @@ int bufchain_size(bufchain *ch)
     return ch->buffersize;
 }
 
+static void bufchain_append_granule(bufchain *ch, struct bufchain_granule *b)
+{
+    if (ch->tail)
+	ch->tail->next = b;
+    else
+	ch->head = b;
+    ch->tail = b;
+}
+
 void bufchain_add(bufchain *ch, const void *data, int len)
 {
     const char *buf = (const char *)data;
@@ -371,28 +442,21 @@ void bufchain_add(bufchain *ch, const void *data, int len)
 
     ch->buffersize += len;
 
-    if (ch->tail && ch->tail->buflen < BUFFER_GRANULE) {
-	int copylen = min(len, BUFFER_GRANULE - ch->tail->buflen);
+    if (ch->tail && ch->tail->buflen < ch->tail->bufsize) {
+	int copylen = min(len, ch->tail->bufsize - ch->tail->buflen);
 	memcpy(ch->tail->buf + ch->tail->buflen, buf, copylen);
 	buf += copylen;
 	len -= copylen;
 	ch->tail->buflen += copylen;
     }
     while (len > 0) {
-	int grainlen = min(len, BUFFER_GRANULE);
-	struct bufchain_granule *newbuf;
-	newbuf = snew(struct bufchain_granule);
-	newbuf->bufpos = 0;
-	newbuf->buflen = grainlen;
+	struct bufchain_granule *newbuf = bufchain_new_granule(len);
+	int grainlen = min(len, newbuf->bufsize);
 	memcpy(newbuf->buf, buf, grainlen);
+	newbuf->buflen = grainlen;
 	buf += grainlen;
 	len -= grainlen;
-	if (ch->tail)
-	    ch->tail->next = newbuf;
-	else
-	    ch->head = ch->tail = newbuf;
-	newbuf->next = NULL;
-	ch->tail = newbuf;
+	bufchain_append_granule(ch, newbuf);
     }
 }
 
@@ -408,7 +472,7 @@ void bufchain_consume(bufchain *ch, int len)
 	    remlen = ch->head->buflen - ch->head->bufpos;
 	    tmp = ch->head;
 	    ch->head = tmp->next;
-	    sfree(tmp);
+	    bufchain_free_granule(tmp);
 	    if (!ch->head)
 		ch->tail = NULL;
 	} else
@@ -424,6 +488,24 @@ void bufchain_prefix(bufchain *ch, void **data, int *len)
     *data = ch->head->buf + ch->head->bufpos;
 }
 
+/*
+ * Like bufchain_prefix, but return up to `maxsegs' contiguous
+ * segments from the front of the chain at once, in `data' and
+ * `len'. Returns the number of segments filled in, which is zero
+ * only if the chain is empty.
+ */
+int bufchain_prefixv(bufchain *ch, void **data, int *len, int maxsegs)
+{
+    struct bufchain_granule *tmp;
+    int n;
+
+    for (n = 0, tmp = ch->head; tmp && n < maxsegs; n++, tmp = tmp->next) {
+	data[n] = tmp->buf + tmp->bufpos;
+	len[n] = tmp->buflen - tmp->bufpos;
+    }
+    return n;
+}
+
 void bufchain_fetch(bufchain *ch, void *data, int len)
 {
     struct bufchain_granule *tmp;
@@ -577,6 +659,132 @@ void safefree(void *ptr)
 #endif
 }
 
+/* ----------------------------------------------------------------------
+ * The pooled allocator behind snew_pooled() and friends.
+ *
+ * Requests up to POOL_MAX bytes are rounded up to a multiple of
+ * POOL_QUANTUM, and each such size has its own class: a free list
+ * of blocks, refilled when it runs dry by cutting up a new slab of
+ * at least POOL_SLAB bytes. Slabs are never handed back, so memory
+ * freed into a class stays available to that class only. Anything
+ * bigger than POOL_MAX goes straight to the ordinary allocator.
+ */
+
+#define POOL_QUANTUM 16
+#define POOL_MAX 4096
+#define POOL_CLASSES (POOL_MAX / POOL_QUANTUM)
+#define POOL_SLAB 16384
+#define POOL_SLAB_MIN_BLOCKS 8
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+static struct pool_class {
+    struct pool_block *free;
+    struct pool_stats stats;
+} pool_classes[POOL_CLASSES];
+
+/*
+ * Return the class for a request of n objects of a given size, or
+ * -1 if it's too big for the pool.
+ */
+static int pool_class(size_t n, size_t size)
+{
+    if (size && n > POOL_MAX / size)
+	return -1;
+    size *= n;
+    return size ? (size - 1) / POOL_QUANTUM : 0;
+}
+
+void *pool_alloc(size_t n, size_t size)
+{
+    struct pool_class *pc;
+    struct pool_block *b;
+    int c = pool_class(n, size);
+
+    if (c < 0)
+	return safemalloc(n, size);
+
+    pc = &pool_classes[c];
+    if (!pc->free) {
+	size_t bsize = (c + 1) * POOL_QUANTUM;
+	size_t nblocks = POOL_SLAB / bsize;
+	char *slab;
+
+	if (nblocks < POOL_SLAB_MIN_BLOCKS)
+	    nblocks = POOL_SLAB_MIN_BLOCKS;
+	slab = snewn(nblocks * bsize, char);
+	while (nblocks-- > 0) {
+	    b = (struct pool_block *)(slab + nblocks * bsize);
+	    b->next = pc->free;
+	    pc->free = b;
+	}
+	pc->stats.size = bsize;
+	pc->stats.slabs++;
+    }
+
+    b = pc->free;
+    pc->free = b->next;
+    pc->stats.allocs++;
+    if (++pc->stats.inuse > pc->stats.peak)
+	pc->stats.peak = pc->stats.inuse;
+    return b;
+}
+
+void pool_free(void *ptr, size_t n, size_t size)
+{
+    struct pool_class *pc;
+    struct pool_block *b = (struct pool_block *)ptr;
+    int c;
+
+    if (!ptr)
+	return;
+
+    c = pool_class(n, size);
+    if (c < 0) {
+	safefree(ptr);
+	return;
+    }
+
+    pc = &pool_classes[c];
+    assert(pc->stats.inuse > 0);
+    b->next = pc->free;
+    pc->free = b;
+    pc->stats.frees++;
+    pc->stats.inuse--;
+}
+
+void *pool_realloc(void *ptr, size_t oldn, size_t n, size_t size)
+{
+    int oldc, c;
+    void *p;
+
+    if (!ptr)
+	return pool_alloc(n, size);
+
+    oldc = pool_class(oldn, size);
+    c = pool_class(n, size);
+    if (oldc == c && c >= 0)
+	return ptr;		       /* still fits the same block */
+    if (oldc < 0 && c < 0)
+	return saferealloc(ptr, n, size);
+
+    p = pool_alloc(n, size);
+    memcpy(p, ptr, (n < oldn ? n : oldn) * size);
+    pool_free(ptr, oldn, size);
+    return p;
+}
+
+int pool_stats(int n, struct pool_stats *stats)
+{
+    if (n < 0 || n >= POOL_CLASSES)
+	return 0;
+    *stats = pool_classes[n].stats;
+    stats->size = (n + 1) * POOL_QUANTUM;
+    return 1;
+}
+
 /* ----------------------------------------------------------------------
  * Debugging routines.
  */
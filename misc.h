@@ -44,6 +44,7 @@ void bufchain_clear(bufchain *ch);
 int bufchain_size(bufchain *ch);
 void bufchain_add(bufchain *ch, const void *data, int len);
 void bufchain_prefix(bufchain *ch, void **data, int *len);
+int bufchain_prefixv(bufchain *ch, void **data, int *len, int maxsegs);
 void bufchain_consume(bufchain *ch, int len);
 void bufchain_fetch(bufchain *ch, void *data, int len);
 
@@ -501,6 +501,8 @@ struct config_tag {
     char wintitle[256];		       /* initial window title */
     /* Terminal options */
     int savelines;
+    int sb_pack_age;		       /* 0 means never pack scrollback */
+    int sb_spill_age;		       /* 0 means keep it all in memory */
     int dec_om;
     int wrap_mode;
     int lfhascr;
@@ -526,6 +528,10 @@ struct config_tag {
     int logtype;
     int logxfovr;
     int logflush;
+    int logflushtime;		       /* ms before buffered log is written */
+    int logcompress;		       /* gzip the log file */
+    int logrotsize;		       /* kbytes per log file; 0 = no limit */
+    int logrottime;		       /* minutes per log file; 0 = no limit */
     int logomitpass;
     int logomitdata;
     int hide_mouseptr;
@@ -824,6 +830,8 @@ void term_provide_resize_fn(Terminal *term,
 			    void *resize_ctx);
 void term_provide_logctx(Terminal *term, void *logctx);
 void term_set_focus(Terminal *term, int has_focus);
+void term_get_update_stats(Terminal *term, unsigned long *painted,
+			   unsigned long *skipped, unsigned long *ticks);
 char *term_get_ttymode(Terminal *term, const char *mode);
 int term_get_userpass_input(Terminal *term, prompts_t *p,
 			    unsigned char *in, int inlen);
@@ -837,7 +845,9 @@ void log_reconfig(void *logctx, Config *cfg);
 void logfopen(void *logctx);
 void logfclose(void *logctx);
 void logtraffic(void *logctx, unsigned char c, int logmode);
+void logtraffic_span(void *logctx, const void *data, int len, int logmode);
 void logflush(void *logctx);
+void log_sync(void *logctx);
 void log_eventlog(void *logctx, const char *string);
 enum { PKT_INCOMING, PKT_OUTGOING };
 enum { PKTLOG_EMIT, PKTLOG_BLANK, PKTLOG_OMIT };
@@ -1110,6 +1120,38 @@ int filename_is_null(Filename fn);
 char *get_username(void);	       /* return value needs freeing */
 char *get_random_data(int bytes);      /* used in cmdgen.c */
 
+/*
+ * Background threads, used by logging.c to write log files without
+ * holding up everything else. A platform which can't provide them
+ * defines NO_THREADS, and log files are written synchronously.
+ *
+ * thread_start() runs fn(ctx) in a new thread, returning NULL if it
+ * can't; thread_join() waits for it to return and frees the handle.
+ * An event is set by event_set() and waited for, and automatically
+ * reset, by event_wait(). memory_barrier() makes sure all memory
+ * accesses before it are complete before any after it begin, as
+ * seen from other threads.
+ *
+ * The thread must not use the pooled allocator (snew_pooled() and
+ * friends) or bufchains, which aren't thread-safe.
+ */
+#ifndef NO_THREADS
+void *thread_start(void (*fn)(void *ctx), void *ctx);
+void thread_join(void *thread);
+void *event_new(void);
+void event_set(void *event);
+void event_wait(void *event);
+void event_free(void *event);
+void memory_barrier(void);
+#endif
+
+/*
+ * open_temp_file() opens a new, empty file for reading and writing
+ * in binary mode, which is deleted when it's closed; terminal.c uses
+ * it to keep scrollback on disk. It returns NULL on failure.
+ */
+FILE *open_temp_file(void);
+
 /*
  * Exports and imports from timing.c.
  *
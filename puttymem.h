@@ -39,4 +39,53 @@ void safefree(void *);
 #define snewn(n, type) ((type *)snmalloc((n), sizeof(type)))
 #define sresize(ptr, n, type) ((type *)snrealloc((ptr), (n), sizeof(type)))
 
+/*
+ * Pooled allocation, for small objects which are allocated and
+ * freed in large numbers. Blocks are carved out of larger slabs and
+ * recycled through a free list per size class, so the caller must
+ * say how big a block is when freeing or resizing it. A block from
+ * these macros must only ever be passed to these macros, and vice
+ * versa.
+ *
+ * Pooling hides allocations from the heap debugging in MINEFIELD
+ * and MALLOC_LOG, so those turn it off, as does NO_POOLED_ALLOC;
+ * the macros then fall back to the ordinary ones above.
+ */
+#if defined MINEFIELD || defined MALLOC_LOG
+#ifndef NO_POOLED_ALLOC
+#define NO_POOLED_ALLOC
+#endif
+#endif
+
+#ifdef NO_POOLED_ALLOC
+#define snew_pooled(type) snew(type)
+#define snewn_pooled(n, type) snewn(n, type)
+#define sresize_pooled(ptr, oldn, n, type) sresize(ptr, n, type)
+#define sfree_pooled(ptr, type) sfree(ptr)
+#define sfreen_pooled(ptr, n, type) sfree(ptr)
+#else
+#define snew_pooled(type) ((type *)pool_alloc(1, sizeof(type)))
+#define snewn_pooled(n, type) ((type *)pool_alloc((n), sizeof(type)))
+#define sresize_pooled(ptr, oldn, n, type) \
+    ((type *)pool_realloc((ptr), (oldn), (n), sizeof(type)))
+#define sfree_pooled(ptr, type) pool_free((ptr), 1, sizeof(type))
+#define sfreen_pooled(ptr, n, type) pool_free((ptr), (n), sizeof(type))
+#endif
+
+void *pool_alloc(size_t n, size_t size);
+void *pool_realloc(void *ptr, size_t oldn, size_t n, size_t size);
+void pool_free(void *ptr, size_t n, size_t size);
+
+/*
+ * Statistics for one size class of the pool. pool_stats() fills in
+ * those for the nth class, returning zero once n runs off the end.
+ */
+struct pool_stats {
+    size_t size;		       /* block size of this class */
+    unsigned long slabs;	       /* slabs allocated for it */
+    unsigned long allocs, frees;       /* calls, over all time */
+    unsigned long inuse, peak;	       /* blocks in use, now and at most */
+};
+int pool_stats(int n, struct pool_stats *stats);
+
 #endif
@@ -255,6 +255,10 @@ void save_open_settings(void *sesskey, Config *cfg)
     write_setting_i(sesskey, "LogType", cfg->logtype);
     write_setting_i(sesskey, "LogFileClash", cfg->logxfovr);
     write_setting_i(sesskey, "LogFlush", cfg->logflush);
+    write_setting_i(sesskey, "LogFlushInterval", cfg->logflushtime);
+    write_setting_i(sesskey, "LogCompress", cfg->logcompress);
+    write_setting_i(sesskey, "LogRotateSize", cfg->logrotsize);
+    write_setting_i(sesskey, "LogRotateTime", cfg->logrottime);
     write_setting_i(sesskey, "SSHLogOmitPasswords", cfg->logomitpass);
     write_setting_i(sesskey, "SSHLogOmitData", cfg->logomitdata);
     p = "raw";
@@ -350,6 +354,8 @@ void save_open_settings(void *sesskey, Config *cfg)
 #endif
 		    );
     write_setting_i(sesskey, "ScrollbackLines", cfg->savelines);
+    write_setting_i(sesskey, "ScrollbackPackAge", cfg->sb_pack_age);
+    write_setting_i(sesskey, "ScrollbackSpillAge", cfg->sb_spill_age);
     write_setting_i(sesskey, "DECOriginMode", cfg->dec_om);
     write_setting_i(sesskey, "AutoWrapMode", cfg->wrap_mode);
     write_setting_i(sesskey, "LFImpliesCR", cfg->lfhascr);
@@ -460,6 +466,10 @@ void load_open_settings(void *sesskey, Config *cfg)
     gppi(sesskey, "LogType", 0, &cfg->logtype);
     gppi(sesskey, "LogFileClash", LGXF_ASK, &cfg->logxfovr);
     gppi(sesskey, "LogFlush", 1, &cfg->logflush);
+    gppi(sesskey, "LogFlushInterval", 500, &cfg->logflushtime);
+    gppi(sesskey, "LogCompress", 0, &cfg->logcompress);
+    gppi(sesskey, "LogRotateSize", 0, &cfg->logrotsize);
+    gppi(sesskey, "LogRotateTime", 0, &cfg->logrottime);
     gppi(sesskey, "SSHLogOmitPasswords", 1, &cfg->logomitpass);
     gppi(sesskey, "SSHLogOmitData", 0, &cfg->logomitdata);
 
@@ -607,6 +617,8 @@ void load_open_settings(void *sesskey, Config *cfg)
 #endif
 	;
     gppi(sesskey, "ScrollbackLines", 200, &cfg->savelines);
+    gppi(sesskey, "ScrollbackPackAge", 1000, &cfg->sb_pack_age);
+    gppi(sesskey, "ScrollbackSpillAge", 0, &cfg->sb_spill_age);
     gppi(sesskey, "DECOriginMode", 0, &cfg->dec_om);
     gppi(sesskey, "AutoWrapMode", 1, &cfg->wrap_mode);
     gppi(sesskey, "LFImpliesCR", 0, &cfg->lfhascr);
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <limits.h>
 
+#include "putty.h"
 #include "misc.h"
 #include "int64.h"
 #include "tree234.h"
@@ -48,7 +49,7 @@ static void sftp_pkt_addbyte(struct sftp_packet *pkt, unsigned char byte)
 static struct sftp_packet *sftp_pkt_init(int pkt_type)
 {
     struct sftp_packet *pkt;
-    pkt = snew(struct sftp_packet);
+    pkt = snew_pooled(struct sftp_packet);
     pkt->data = NULL;
     pkt->savedpos = -1;
     pkt->length = 0;
@@ -206,7 +207,7 @@ static void sftp_pkt_free(struct sftp_packet *pkt)
 {
     if (pkt->data)
 	sfree(pkt->data);
-    sfree(pkt);
+    sfree_pooled(pkt, struct sftp_packet);
 }
 
 /* ----------------------------------------------------------------------
@@ -230,7 +231,7 @@ struct sftp_packet *sftp_recv(void)
     if (!sftp_recvdata(x, 4))
 	return NULL;
 
-    pkt = snew(struct sftp_packet);
+    pkt = snew_pooled(struct sftp_packet);
     pkt->savedpos = 0;
     pkt->length = pkt->maxlen = GET_32BIT(x);
     pkt->data = snewn(pkt->length, char);
@@ -1007,7 +1008,7 @@ struct fxp_names *fxp_readdir_recv(struct sftp_packet *pktin,
 		}
 		sfree(ret->names);
 		sfree(ret);
-		sfree(pktin);
+		sftp_pkt_free(pktin);
 		return NULL;
 	    }
 	    ret->names[i].filename = mkstr(str1, len1);
@@ -1105,12 +1106,38 @@ void fxp_set_userdata(struct sftp_request *req, void *data)
 /*
  * A wrapper to go round fxp_read_* and fxp_write_*, which manages
  * the queueing of multiple read/write requests.
+ *
+ * The amount of data we keep in flight (req_maxsize, the `window')
+ * is adjusted as we go. Once per round trip we measure the rate at
+ * which requests are being answered; the product of that and the
+ * shortest round-trip time seen is how much data the connection
+ * itself can hold. (Not the current round-trip time, which
+ * includes time spent queueing behind our own requests.)
+ * If we've been keeping the window full and it isn't much bigger
+ * than that, the link might take more, so we double the window;
+ * if it's well over twice that, we're just tying up memory (and
+ * the server), so we shrink it. Read requests are sized as a
+ * fraction of the window, so that a small window still has several
+ * requests in flight.
  */
 
+#define XFER_WINDOW_MIN 32768
+#define XFER_WINDOW_INIT 131072
+#define XFER_WINDOW_MAX 16777216
+#define XFER_REQ_MIN 4096
+#define XFER_REQ_MAX 32768	       /* the most servers will always send */
+/*
+ * Round trips shorter than this can't be measured reliably with a
+ * tick count as coarse as some platforms', so we assume at least
+ * this much.
+ */
+#define XFER_RTT_FLOOR (TICKSPERSEC / 50)
+
 struct req {
     char *buffer;
     int len, retlen, complete;
     uint64 offset;
+    long sent;			       /* GETTICKCOUNT() when sent */
     struct req *next, *prev;
 };
 
@@ -1119,8 +1146,26 @@ struct fxp_xfer {
     int req_totalsize, req_maxsize, eof, err;
     struct fxp_handle *fh;
     struct req *head, *tail;
+    int req_size;		       /* size of new read requests */
+    int window_max, req_size_max;
+    int window_full;		       /* req_maxsize limited us lately */
+    long srtt, min_rtt;		       /* <0 if unknown */
+    long rate_start;		       /* start of current rate sample */
+    unsigned long rate_bytes;	       /* bytes answered since then */
+    unsigned long rate;		       /* bytes per second */
 };
 
+static void xfer_set_reqsize(struct fxp_xfer *xfer)
+{
+    int size = (xfer->req_maxsize / 8) & ~(XFER_REQ_MIN - 1);
+
+    if (size > xfer->req_size_max)
+	size = xfer->req_size_max;
+    if (size < XFER_REQ_MIN)
+	size = XFER_REQ_MIN;
+    xfer->req_size = size;
+}
+
 static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
 {
     struct fxp_xfer *xfer = snew(struct fxp_xfer);
@@ -1129,14 +1174,95 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64 offset)
     xfer->offset = offset;
     xfer->head = xfer->tail = NULL;
     xfer->req_totalsize = 0;
-    xfer->req_maxsize = 1048576;
+    xfer->req_maxsize = XFER_WINDOW_INIT;
     xfer->err = 0;
     xfer->filesize = uint64_make(ULONG_MAX, ULONG_MAX);
     xfer->furthestdata = uint64_make(0, 0);
+    xfer->window_max = XFER_WINDOW_MAX;
+    xfer->req_size_max = XFER_REQ_MAX;
+    xfer->window_full = FALSE;
+    xfer->srtt = xfer->min_rtt = -1;
+    xfer->rate_start = GETTICKCOUNT();
+    xfer->rate_bytes = 0;
+    xfer->rate = 0;
+    xfer_set_reqsize(xfer);
 
     return xfer;
 }
 
+/*
+ * Set ceilings on the window and on the size of read requests (0
+ * leaves one unchanged). Beware of raising the request size beyond
+ * what the server will return in one go: a short read other than
+ * at end of file is treated as an error.
+ */
+void xfer_set_limits(struct fxp_xfer *xfer, int window_max, int req_size_max)
+{
+    if (window_max > 0)
+	xfer->window_max = max(window_max, XFER_WINDOW_MIN);
+    if (req_size_max > 0)
+	xfer->req_size_max = max(req_size_max, XFER_REQ_MIN);
+    if (xfer->req_maxsize > xfer->window_max)
+	xfer->req_maxsize = xfer->window_max;
+    xfer_set_reqsize(xfer);
+}
+
+void xfer_get_stats(struct fxp_xfer *xfer, struct fxp_xfer_stats *stats)
+{
+    stats->rtt = xfer->srtt < 0 ? 0 : xfer->srtt;
+    stats->inflight = xfer->req_totalsize;
+    stats->window = xfer->req_maxsize;
+    stats->req_size = xfer->req_size;
+    stats->rate = xfer->rate;
+}
+
+/*
+ * Account for a request which has been answered, carrying `bytes'
+ * of file data one way or the other, and adjust the window.
+ */
+static void xfer_answered(struct fxp_xfer *xfer, struct req *rr, int bytes)
+{
+    long now = GETTICKCOUNT();
+    long rtt = now - rr->sent, elapsed;
+    double bdp;
+
+    if (rtt < 0)
+	rtt = 0;
+    if (xfer->srtt < 0)
+	xfer->srtt = xfer->min_rtt = rtt;
+    else
+	xfer->srtt = (7 * xfer->srtt + rtt) / 8;
+    if (rtt < xfer->min_rtt)
+	xfer->min_rtt = rtt;
+
+    if (bytes > 0)
+	xfer->rate_bytes += bytes;
+
+    elapsed = now - xfer->rate_start;
+    if (elapsed <= 0 || elapsed < xfer->srtt)
+	return;			       /* wait for a full round trip */
+
+    xfer->rate = (unsigned long)
+	((double)xfer->rate_bytes * TICKSPERSEC / elapsed);
+    bdp = (double)xfer->rate * max(xfer->min_rtt, XFER_RTT_FLOOR) /
+	TICKSPERSEC;
+
+    if (xfer->window_full && bdp * 4 >= (double)xfer->req_maxsize * 3) {
+	if (xfer->req_maxsize <= xfer->window_max / 2)
+	    xfer->req_maxsize *= 2;
+	else
+	    xfer->req_maxsize = xfer->window_max;
+    } else if (bdp * 4 < xfer->req_maxsize) {
+	int target = (xfer->req_maxsize + (int)(bdp * 2)) / 2;
+	xfer->req_maxsize = max(target, XFER_WINDOW_MIN);
+    }
+    xfer_set_reqsize(xfer);
+
+    xfer->rate_start = now;
+    xfer->rate_bytes = 0;
+    xfer->window_full = FALSE;
+}
+
 int xfer_done(struct fxp_xfer *xfer)
 {
     /*
@@ -1156,7 +1282,7 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	struct req *rr;
 	struct sftp_request *req;
 
-	rr = snew(struct req);
+	rr = snew_pooled(struct req);
 	rr->offset = xfer->offset;
 	rr->complete = 0;
 	if (xfer->tail) {
@@ -1169,8 +1295,9 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	xfer->tail = rr;
 	rr->next = NULL;
 
-	rr->len = 32768;
+	rr->len = xfer->req_size;
 	rr->buffer = snewn(rr->len, char);
+	rr->sent = GETTICKCOUNT();
 	sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
 	fxp_set_userdata(req, rr);
 
@@ -1181,6 +1308,9 @@ void xfer_download_queue(struct fxp_xfer *xfer)
 	{ char buf[40]; uint64_decimal(rr->offset, buf); printf("queueing read request %p at %s\n", rr, buf); }
 #endif
     }
+
+    if (xfer->req_totalsize >= xfer->req_maxsize)
+	xfer->window_full = TRUE;
 }
 
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64 offset)
@@ -1206,6 +1336,7 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 #ifdef DEBUG_DOWNLOAD
     printf("read request %p has returned [%d]\n", rr, rr->retlen);
 #endif
+    xfer_answered(xfer, rr, rr->retlen);
 
     if ((rr->retlen < 0 && fxp_error_type()==SSH_FX_EOF) || rr->retlen == 0) {
 	xfer->eof = TRUE;
@@ -1305,7 +1436,7 @@ int xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
 	else
 	    xfer->tail = NULL;
 	xfer->req_totalsize -= rr->len;
-	sfree(rr);
+	sfree_pooled(rr, struct req);
     }
 
     if (retbuf) {
@@ -1337,8 +1468,18 @@ int xfer_upload_ready(struct fxp_xfer *xfer)
 {
     if (xfer->req_totalsize < xfer->req_maxsize)
 	return 1;
-    else
+    else {
+	xfer->window_full = TRUE;
 	return 0;
+    }
+}
+
+/*
+ * How much data the caller should pass to each xfer_upload_data().
+ */
+int xfer_upload_blocksize(struct fxp_xfer *xfer)
+{
+    return xfer->req_size;
 }
 
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
@@ -1346,7 +1487,7 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
     struct req *rr;
     struct sftp_request *req;
 
-    rr = snew(struct req);
+    rr = snew_pooled(struct req);
     rr->offset = xfer->offset;
     rr->complete = 0;
     if (xfer->tail) {
@@ -1361,6 +1502,7 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
 
     rr->len = len;
     rr->buffer = NULL;
+    rr->sent = GETTICKCOUNT();
     sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
     fxp_set_userdata(req, rr);
 
@@ -1386,6 +1528,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
 #ifdef DEBUG_UPLOAD
     printf("write request %p has returned [%d]\n", rr, ret);
 #endif
+    xfer_answered(xfer, rr, ret ? rr->len : 0);
 
     /*
      * Remove this one from the queue.
@@ -1401,7 +1544,7 @@ int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
     else
 	xfer->tail = prev;
     xfer->req_totalsize -= rr->len;
-    sfree(rr);
+    sfree_pooled(rr, struct req);
 
     if (!ret)
 	return -1;
@@ -1416,7 +1559,150 @@ void xfer_cleanup(struct fxp_xfer *xfer)
 	rr = xfer->head;
 	xfer->head = xfer->head->next;
 	sfree(rr->buffer);
-	sfree(rr);
+	sfree_pooled(rr, struct req);
     }
     sfree(xfer);
 }
+
+#ifdef TEST
+
+/*
+ * Test code: run the adaptive window against a simulated link, and
+ * check that it grows to fill a long fat pipe, shrinks again on a
+ * slow one, and stays inside the limits set by xfer_set_limits().
+ * Build it from the bench directory with
+ *
+ *   gcc -DTEST -O2 -I. -I.. -c ../sftp.c
+ *   gcc -O2 -I. -I.. sftp.o ../misc.c ../tree234.c ../int64.c -o sftptest
+ */
+
+#include <stdarg.h>
+
+static long test_now;
+
+long bench_tickcount(void)
+{
+    return test_now;
+}
+
+int sftp_senddata(char *data, int len)
+{
+    return 0;
+}
+
+int sftp_recvdata(char *data, int len)
+{
+    return 0;
+}
+
+void modalfatalbox(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+/*
+ * The link delivers each answer half a round trip after the server
+ * has sent it, and the server can only send `bandwidth' bytes per
+ * tick, one answer after another.
+ */
+#define TEST_QUEUE 8192
+
+struct test_req {
+    struct req rr;
+    double done;
+};
+
+static struct test_req testq[TEST_QUEUE];
+static int testq_head, testq_tail;
+static double link_free;
+
+static void run_link(struct fxp_xfer *xfer, long rtt, double bandwidth,
+		     long duration)
+{
+    long end = test_now + duration;
+
+    while (test_now < end) {
+	struct test_req *t;
+	double start;
+
+	while (xfer->req_totalsize < xfer->req_maxsize) {
+	    t = &testq[testq_tail];
+	    testq_tail = (testq_tail + 1) % TEST_QUEUE;
+	    assert(testq_tail != testq_head);
+	    t->rr.len = xfer->req_size;
+	    t->rr.sent = test_now;
+	    start = test_now + rtt / 2.0;
+	    if (link_free > start)
+		start = link_free;
+	    link_free = start + t->rr.len / bandwidth;
+	    t->done = link_free + rtt / 2.0;
+	    xfer->req_totalsize += t->rr.len;
+	}
+	xfer->window_full = TRUE;
+
+	t = &testq[testq_head];
+	testq_head = (testq_head + 1) % TEST_QUEUE;
+	if (t->done > test_now)
+	    test_now = (long)t->done + (t->done > (long)t->done);
+	xfer->req_totalsize -= t->rr.len;
+	xfer_answered(xfer, &t->rr, t->rr.len);
+    }
+}
+
+static int errors = 0;
+
+static void check(struct fxp_xfer *xfer, const char *what,
+		  int window_lo, int window_hi, int req_hi)
+{
+    struct fxp_xfer_stats st;
+
+    xfer_get_stats(xfer, &st);
+    printf("%-12s rtt %4ld  inflight %8d  window %8d  req %5d"
+	   "  rate %9lu\n", what, st.rtt, st.inflight, st.window,
+	   st.req_size, st.rate);
+    if (st.window < window_lo || st.window > window_hi) {
+	printf("  window should be in [%d,%d]\n", window_lo, window_hi);
+	errors++;
+    }
+    if (st.req_size > req_hi) {
+	printf("  request size should be at most %d\n", req_hi);
+	errors++;
+    }
+}
+
+int main(void)
+{
+    struct fxp_xfer *xfer;
+
+    xfer = xfer_init(NULL, uint64_make(0, 0));
+    check(xfer, "initial", XFER_WINDOW_INIT, XFER_WINDOW_INIT,
+	  XFER_REQ_MAX);
+
+    /* 8MB/s with a 100ms round trip holds 800K. */
+    run_link(xfer, 100, 8000, 20 * TICKSPERSEC);
+    check(xfer, "fast", 800000, 4 * 800000, XFER_REQ_MAX);
+
+    /* 32K/s holds only 3.2K: back down to the minimum. */
+    run_link(xfer, 100, 32, 60 * TICKSPERSEC);
+    check(xfer, "slow", XFER_WINDOW_MIN, XFER_WINDOW_MIN, XFER_REQ_MAX);
+
+    /* Fast again, but held within the limits. */
+    xfer_set_limits(xfer, 262144, 8192);
+    run_link(xfer, 100, 8000, 20 * TICKSPERSEC);
+    check(xfer, "limited", 262144, 262144, 8192);
+
+    xfer_set_limits(xfer, XFER_WINDOW_MAX, XFER_REQ_MAX);
+    run_link(xfer, 100, 8000, 20 * TICKSPERSEC);
+    check(xfer, "unlimited", 800000, 4 * 800000, XFER_REQ_MAX);
+
+    sfree(xfer);
+    printf("%d errors\n", errors);
+    return errors != 0;
+}
+
+#endif
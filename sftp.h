@@ -243,6 +243,23 @@ int xfer_upload_ready(struct fxp_xfer *xfer);
 void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len);
 int xfer_upload_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
 
+int xfer_upload_blocksize(struct fxp_xfer *xfer);
+
 int xfer_done(struct fxp_xfer *xfer);
 void xfer_set_error(struct fxp_xfer *xfer);
 void xfer_cleanup(struct fxp_xfer *xfer);
+
+/*
+ * The amount of data kept in flight adapts to the connection, within
+ * limits which can be set by xfer_set_limits(). xfer_get_stats()
+ * reports on how it's doing.
+ */
+struct fxp_xfer_stats {
+    long rtt;			       /* smoothed round trip, in ticks */
+    int inflight;		       /* bytes requested, not yet answered */
+    int window;			       /* current limit on inflight */
+    int req_size;		       /* current size of each request */
+    unsigned long rate;		       /* recent throughput, bytes/sec */
+};
+void xfer_set_limits(struct fxp_xfer *xfer, int window_max, int req_size_max);
+void xfer_get_stats(struct fxp_xfer *xfer, struct fxp_xfer_stats *stats);
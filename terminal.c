@@ -48,6 +48,8 @@
 #define TM_PUTTY	(0xFFFF)
 
 #define UPDATE_DELAY    ((TICKSPERSEC+49)/50)/* ticks to defer window update */
+#define MAX_UPDATE_DELAY ((TICKSPERSEC+9)/10)/* ...when output is heavy */
+#define KEY_ECHO_WAIT   (TICKSPERSEC)  /* how long a keypress hurries updates */
 #define TBLINK_DELAY    ((TICKSPERSEC*9+19)/20)/* ticks between text blinks*/
 #define CBLINK_DELAY    (CURSORBLINK) /* ticks between cursor blinks */
 #define VBELL_DELAY     (VBELL_TIMEOUT) /* visual bell timeout in ticks */
@@ -100,7 +102,7 @@ static termline *lineptr(Terminal *, int, int, int);
 static void unlineptr(termline *);
 static void do_paint(Terminal *, Context, int);
 static void erase_lots(Terminal *, int, int, int);
-static int find_last_nonempty_line(Terminal *, tree234 *);
+static int find_last_nonempty_line(Terminal *, struct termscreen *);
 static void swap_screen(Terminal *, int, int, int);
 static void update_sbar(Terminal *);
 static void deselect(Terminal *);
@@ -115,8 +117,8 @@ static termline *newline(Terminal *term, int cols, int bce)
     termline *line;
     int j;
 
-    line = snew(termline);
-    line->chars = snewn(cols, termchar);
+    line = snew_pooled(termline);
+    line->chars = snewn_pooled(cols, termchar);
     for (j = 0; j < cols; j++)
 	line->chars[j] = (bce ? term->erase_char : term->basic_erase_char);
     line->cols = line->size = cols;
@@ -130,8 +132,8 @@ static termline *newline(Terminal *term, int cols, int bce)
 static void freeline(termline *line)
 {
     if (line) {
-	sfree(line->chars);
-	sfree(line);
+	sfreen_pooled(line->chars, line->size, termchar);
+	sfree_pooled(line, termline);
     }
 }
 
@@ -141,6 +143,128 @@ static void unlineptr(termline *line)
 	freeline(line);
 }
 
+/*
+ * Manage the ring of lines making up a screen.
+ */
+static struct termscreen *newscreen(void)
+{
+    struct termscreen *scr = snew(struct termscreen);
+    scr->lines = NULL;
+    scr->rows = scr->top = 0;
+    return scr;
+}
+
+static void freescreen(struct termscreen *scr)
+{
+    int i;
+
+    if (scr) {
+	for (i = 0; i < scr->rows; i++)
+	    freeline(scr->lines[i]);
+	sfree(scr->lines);
+	sfree(scr);
+    }
+}
+
+static termline **screen_slot(struct termscreen *scr, int y)
+{
+    int i = scr->top + y;
+
+    assert(y >= 0 && y < scr->rows);
+    if (i >= scr->rows)
+	i -= scr->rows;
+    return &scr->lines[i];
+}
+
+#define screen_line(scr, y) (*screen_slot(scr, y))
+
+/*
+ * Rearrange the ring so that line 0 is in slot 0, which makes
+ * inserting and deleting lines straightforward.
+ */
+static void screen_unrotate(struct termscreen *scr)
+{
+    termline **lines;
+    int i;
+
+    if (scr->top == 0)
+	return;
+    lines = snewn(scr->rows, termline *);
+    for (i = 0; i < scr->rows; i++)
+	lines[i] = screen_line(scr, i);
+    sfree(scr->lines);
+    scr->lines = lines;
+    scr->top = 0;
+}
+
+/*
+ * Insert a line so that it becomes line `y', or remove line `y'.
+ * These are only used when resizing, so they needn't be quick.
+ */
+static void screen_insert(struct termscreen *scr, termline *line, int y)
+{
+    assert(y >= 0 && y <= scr->rows);
+    screen_unrotate(scr);
+    scr->lines = sresize(scr->lines, scr->rows + 1, termline *);
+    memmove(scr->lines + y + 1, scr->lines + y,
+	    (scr->rows - y) * sizeof(termline *));
+    scr->lines[y] = line;
+    scr->rows++;
+}
+
+static termline *screen_remove(struct termscreen *scr, int y)
+{
+    termline *line;
+
+    assert(y >= 0 && y < scr->rows);
+    screen_unrotate(scr);
+    line = scr->lines[y];
+    memmove(scr->lines + y, scr->lines + y + 1,
+	    (scr->rows - y - 1) * sizeof(termline *));
+    scr->rows--;
+    return line;
+}
+
+/*
+ * Rotate lines `topline' to `botline' of a screen up by `lines'
+ * (which must be between 0 and the size of the region), so that
+ * the top `lines' of them end up at the bottom.
+ */
+static void screen_rotate(struct termscreen *scr, int topline, int botline,
+			  int lines)
+{
+    termline *tmp[16], **save;
+    int i, n = botline - topline + 1;
+
+    assert(lines >= 0 && lines <= n);
+    if (lines == 0 || lines == n)
+	return;
+
+    if (topline == 0 && botline == scr->rows - 1) {
+	scr->top += lines;
+	if (scr->top >= scr->rows)
+	    scr->top -= scr->rows;
+	return;
+    }
+
+    save = (lines <= lenof(tmp) ? tmp : snewn(lines, termline *));
+    for (i = 0; i < lines; i++)
+	save[i] = screen_line(scr, topline + i);
+    for (i = topline; i + lines <= botline; i++)
+	screen_line(scr, i) = screen_line(scr, i + lines);
+    for (i = 0; i < lines; i++)
+	screen_line(scr, botline - lines + 1 + i) = save[i];
+    if (save != tmp)
+	sfree(save);
+}
+
+/*
+ * Follow a cc_next link. `cc' is the start of the cc area of the
+ * array `c' belongs to, i.e. just past the line's real columns.
+ */
+#define CC_NEXT(cc, c) ((cc) + (c)->cc_next - 1)
+#define CC_AREA(line) ((line)->chars + (line)->cols)
+
 #ifdef TERM_CC_DIAGS
 /*
  * Diagnostic function: verify that a termline has a correct
@@ -155,6 +279,7 @@ static void cc_check(termline *line)
     int i, j;
 
     assert(line->size >= line->cols);
+    assert(line->size - line->cols <= TERMCHAR_CC_MAX);
 
     flags = snewn(line->size, unsigned char);
 
@@ -164,21 +289,21 @@ static void cc_check(termline *line)
     for (i = 0; i < line->cols; i++) {
 	j = i;
 	while (line->chars[j].cc_next) {
-	    j += line->chars[j].cc_next;
+	    j = line->cols + line->chars[j].cc_next - 1;
 	    assert(j >= line->cols && j < line->size);
 	    assert(!flags[j]);
 	    flags[j] = TRUE;
 	}
     }
 
-    j = line->cc_free;
-    if (j) {
+    if (line->cc_free) {
+	j = line->cols + line->cc_free - 1;
 	while (1) {
 	    assert(j >= line->cols && j < line->size);
 	    assert(!flags[j]);
 	    flags[j] = TRUE;
 	    if (line->chars[j].cc_next)
-		j += line->chars[j].cc_next;
+		j = line->cols + line->chars[j].cc_next - 1;
 	    else
 		break;
 	}
@@ -195,27 +320,35 @@ static void cc_check(termline *line)
 #endif
 
 /*
- * Add a combining character to a character cell.
+ * Add a combining character to a character cell. If the line
+ * already holds TERMCHAR_CC_MAX of them, it is dropped.
  */
 static void add_cc(termline *line, int col, unsigned long chr)
 {
-    int newcc;
+    termchar *c, *newcc;
 
     assert(col >= 0 && col < line->cols);
 
     /*
-     * Start by extending the cols array if the free list is empty.
+     * Start by extending the cc area if the free list is empty.
      */
     if (!line->cc_free) {
-	int n = line->size;
-	line->size += 16 + (line->size - line->cols) / 2;
-	line->chars = sresize(line->chars, line->size, termchar);
-	line->cc_free = n;
-	while (n < line->size) {
-	    if (n+1 < line->size)
-		line->chars[n].cc_next = 1;
+	int n = line->size - line->cols, newn;
+
+	if (n >= TERMCHAR_CC_MAX)
+	    return;
+	newn = n + 16 + n / 2;
+	if (newn > TERMCHAR_CC_MAX)
+	    newn = TERMCHAR_CC_MAX;
+	line->chars = sresize_pooled(line->chars, line->size,
+				     line->cols + newn, termchar);
+	line->size = line->cols + newn;
+	line->cc_free = n + 1;
+	while (n < newn) {
+	    if (n+1 < newn)
+		CC_AREA(line)[n].cc_next = n + 2;
 	    else
-		line->chars[n].cc_next = 0;
+		CC_AREA(line)[n].cc_next = 0;
 	    n++;
 	}
     }
@@ -223,21 +356,19 @@ static void add_cc(termline *line, int col, unsigned long chr)
     /*
      * Now walk the cc list of the cell in question.
      */
-    while (line->chars[col].cc_next)
-	col += line->chars[col].cc_next;
+    c = line->chars + col;
+    while (c->cc_next)
+	c = CC_NEXT(CC_AREA(line), c);
 
     /*
-     * `col' now points at the last cc currently in this cell; so
+     * `c' now points at the last cc currently in this cell; so
      * we simply add another one.
      */
-    newcc = line->cc_free;
-    if (line->chars[newcc].cc_next)
-	line->cc_free = newcc + line->chars[newcc].cc_next;
-    else
-	line->cc_free = 0;
-    line->chars[newcc].cc_next = 0;
-    line->chars[newcc].chr = chr;
-    line->chars[col].cc_next = newcc - col;
+    newcc = CC_AREA(line) + line->cc_free - 1;
+    c->cc_next = line->cc_free;
+    line->cc_free = newcc->cc_next;
+    newcc->cc_next = 0;
+    newcc->chr = chr;
 
 #ifdef TERM_CC_DIAGS
     cc_check(line);
@@ -249,23 +380,22 @@ static void add_cc(termline *line, int col, unsigned long chr)
  */
 static void clear_cc(termline *line, int col)
 {
-    int oldfree, origcol = col;
+    termchar *c;
+    int oldfree;
 
     assert(col >= 0 && col < line->cols);
 
-    if (!line->chars[col].cc_next)
+    c = line->chars + col;
+    if (!c->cc_next)
 	return;			       /* nothing needs doing */
 
     oldfree = line->cc_free;
-    line->cc_free = col + line->chars[col].cc_next;
-    while (line->chars[col].cc_next)
-	col += line->chars[col].cc_next;
-    if (oldfree)
-	line->chars[col].cc_next = oldfree - col;
-    else
-	line->chars[col].cc_next = 0;
-
-    line->chars[origcol].cc_next = 0;
+    line->cc_free = c->cc_next;
+    c->cc_next = 0;
+    c = CC_AREA(line) + line->cc_free - 1;
+    while (c->cc_next)
+	c = CC_NEXT(CC_AREA(line), c);
+    c->cc_next = oldfree;
 
 #ifdef TERM_CC_DIAGS
     cc_check(line);
@@ -273,11 +403,13 @@ static void clear_cc(termline *line, int col)
 }
 
 /*
- * Compare two character cells for equality. Special case required
- * in do_paint() where we override what we expect the chr and attr
- * fields to be.
+ * Compare two character cells for equality. `acc' and `bcc' are the
+ * cc areas of the arrays they come from, and may be NULL for a cell
+ * known to have no cc list. Special case required in do_paint()
+ * where we override what we expect the chr and attr fields to be.
  */
-static int termchars_equal_override(termchar *a, termchar *b,
+static int termchars_equal_override(termchar *a, termchar *acc,
+				    termchar *b, termchar *bcc,
 				    unsigned long bchr, unsigned long battr)
 {
     /* FULL-TERMCHAR */
@@ -288,24 +420,27 @@ static int termchars_equal_override(termchar *a, termchar *b,
     while (a->cc_next || b->cc_next) {
 	if (!a->cc_next || !b->cc_next)
 	    return FALSE;	       /* one cc-list ends, other does not */
-	a += a->cc_next;
-	b += b->cc_next;
+	a = CC_NEXT(acc, a);
+	b = CC_NEXT(bcc, b);
 	if (a->chr != b->chr)
 	    return FALSE;
     }
     return TRUE;
 }
 
-static int termchars_equal(termchar *a, termchar *b)
+static int termchars_equal(termchar *a, termchar *acc,
+			   termchar *b, termchar *bcc)
 {
-    return termchars_equal_override(a, b, b->chr, b->attr);
+    return termchars_equal_override(a, acc, b, bcc, b->chr, b->attr);
 }
 
 /*
  * Copy a character cell. (Requires a pointer to the destination
- * termline, so as to access its free list.)
+ * termline, so as to access its free list, and the cc area that
+ * src's cc list lives in, which may be NULL if it hasn't got one.)
  */
-static void copy_termchar(termline *destline, int x, termchar *src)
+static void copy_termchar(termline *destline, int x,
+			  termchar *src, termchar *srccc)
 {
     clear_cc(destline, x);
 
@@ -313,7 +448,7 @@ static void copy_termchar(termline *destline, int x, termchar *src)
     destline->chars[x].cc_next = 0;    /* and make sure this is zero */
 
     while (src->cc_next) {
-	src += src->cc_next;
+	src = CC_NEXT(srccc, src);
 	add_cc(destline, x, src->chr);
     }
 
@@ -330,10 +465,11 @@ static void move_termchar(termline *line, termchar *dest, termchar *src)
     /* First clear the cc list from the original char, just in case. */
     clear_cc(line, dest - line->chars);
 
-    /* Move the character cell and adjust its cc_next. */
-    *dest = *src;		       /* copy everything except cc-list */
-    if (src->cc_next)
-	dest->cc_next = src->cc_next - (dest-src);
+    /*
+     * Move the character cell. Its cc_next indexes the cc area, so
+     * the cc list comes with it unchanged.
+     */
+    *dest = *src;
 
     /* Ensure the original cell doesn't have a cc list. */
     src->cc_next = 0;
@@ -370,7 +506,7 @@ static int get(struct buf *b)
 }
 static void makerle(struct buf *b, termline *ldata,
 		    void (*makeliteral)(struct buf *b, termchar *c,
-					unsigned long *state))
+					termline *ldata, unsigned long *state))
 {
     int hdrpos, hdrsize, n, prevlen, prevpos, thislen, thispos, prev2;
     termchar *c = ldata->chars;
@@ -386,7 +522,7 @@ static void makerle(struct buf *b, termline *ldata,
 
     while (n-- > 0) {
 	thispos = b->len;
-	makeliteral(b, c++, &state);
+	makeliteral(b, c++, ldata, &state);
 	thislen = b->len - thispos;
 	if (thislen == prevlen &&
 	    !memcmp(b->data + prevpos, b->data + thispos, thislen)) {
@@ -439,7 +575,7 @@ static void makerle(struct buf *b, termline *ldata,
 		    int tmppos, tmplen;
 		    tmppos = b->len;
 		    oldstate = state;
-		    makeliteral(b, c, &state);
+		    makeliteral(b, c, ldata, &state);
 		    tmplen = b->len - tmppos;
 		    b->len = tmppos;
 		    if (tmplen != thislen ||
@@ -502,7 +638,8 @@ static void makerle(struct buf *b, termline *ldata,
 	b->len = hdrpos;
     }
 }
-static void makeliteral_chr(struct buf *b, termchar *c, unsigned long *state)
+static void makeliteral_chr(struct buf *b, termchar *c, termline *ldata,
+			    unsigned long *state)
 {
     /*
      * My encoding for characters is UTF-8-like, in that it stores
@@ -562,7 +699,8 @@ static void makeliteral_chr(struct buf *b, termchar *c, unsigned long *state)
     }
     *state = c->chr & ~0xFF;
 }
-static void makeliteral_attr(struct buf *b, termchar *c, unsigned long *state)
+static void makeliteral_attr(struct buf *b, termchar *c, termline *ldata,
+			     unsigned long *state)
 {
     /*
      * My encoding for attributes is 16-bit-granular and assumes
@@ -605,7 +743,8 @@ static void makeliteral_attr(struct buf *b, termchar *c, unsigned long *state)
 	add(b, (unsigned char)(attr & 0xFF));
     }
 }
-static void makeliteral_cc(struct buf *b, termchar *c, unsigned long *state)
+static void makeliteral_cc(struct buf *b, termchar *c, termline *ldata,
+			   unsigned long *state)
 {
     /*
      * For combining characters, I just encode a bunch of ordinary
@@ -619,1916 +758,4522 @@ static void makeliteral_cc(struct buf *b, termchar *c, unsigned long *state)
     termchar z;
 
     while (c->cc_next) {
-	c += c->cc_next;
+	c = CC_NEXT(CC_AREA(ldata), c);
 
 	assert(c->chr != 0);
 
 	zstate = 0;
-	makeliteral_chr(b, c, &zstate);
+	makeliteral_chr(b, c, ldata, &zstate);
     }
 
     z.chr = 0;
     zstate = 0;
-    makeliteral_chr(b, &z, &zstate);
+    makeliteral_chr(b, &z, ldata, &zstate);
 }
 
-static termline *decompressline(unsigned char *data, int *bytes_used);
+/*
+ * Compressed scrollback lines are not allocated individually.
+ * Instead they are packed end to end into large chunks, kept in a
+ * queue in the same order as the lines in term->scrollback.
+ *
+ * This works because lines only ever join the scrollback at the
+ * bottom, and only ever leave it at the top, when it is trimmed,
+ * or at the bottom again, when term_size() pulls lines back on to
+ * the screen. So the line being freed is always in the first or
+ * the last chunk, and a chunk can itself be freed as soon as the
+ * last line in it has gone.
+ */
+#define SB_CHUNK_SIZE 16384
 
-static unsigned char *compressline(termline *ldata)
-{
-    struct buf buffer = { NULL, 0, 0 }, *b = &buffer;
+struct sbchunk {
+    struct sbchunk *next, *prev;
+    unsigned char *data;
+    int size, used;		       /* bytes allocated, bytes handed out */
+    int nlines;			       /* lines still in use */
+};
 
-    /*
-     * First, store the column count, 7 bits at a time, least
-     * significant `digit' first, with the high bit set on all but
-     * the last.
-     */
-    {
-	int n = ldata->cols;
-	while (n >= 128) {
-	    add(b, (unsigned char)((n & 0x7F) | 0x80));
-	    n >>= 7;
-	}
-	add(b, (unsigned char)(n));
+static unsigned char *sb_alloc(Terminal *term, int len)
+{
+    struct sbchunk *ch = term->sbtail;
+    unsigned char *p;
+
+    if (!ch || ch->size - ch->used < len) {
+	ch = snew(struct sbchunk);
+	ch->size = (len > SB_CHUNK_SIZE ? len : SB_CHUNK_SIZE);
+	ch->data = snewn(ch->size, unsigned char);
+	ch->used = ch->nlines = 0;
+	ch->next = NULL;
+	ch->prev = term->sbtail;
+	if (term->sbtail)
+	    term->sbtail->next = ch;
+	else
+	    term->sbhead = ch;
+	term->sbtail = ch;
+	term->sbchunks++;
+	term->sbbytes += ch->size;
     }
 
-    /*
-     * Next store the lattrs; same principle.
-     */
-    {
-	int n = ldata->lattr;
-	while (n >= 128) {
-	    add(b, (unsigned char)((n & 0x7F) | 0x80));
-	    n >>= 7;
-	}
-	add(b, (unsigned char)(n));
-    }
+    p = ch->data + ch->used;
+    ch->used += len;
+    ch->nlines++;
+    return p;
+}
 
-    /*
-     * Now we store a sequence of separate run-length encoded
-     * fragments, each containing exactly as many symbols as there
-     * are columns in the ldata.
-     * 
-     * All of these have a common basic format:
-     * 
-     *  - a byte 00-7F indicates that X+1 literals follow it
-     * 	- a byte 80-FF indicates that a single literal follows it
-     * 	  and expects to be repeated (X-0x80)+2 times.
-     * 
-     * The format of the `literals' varies between the fragments.
-     */
-    makerle(b, ldata, makeliteral_chr);
-    makerle(b, ldata, makeliteral_attr);
-    makerle(b, ldata, makeliteral_cc);
+static void sb_free_chunk(Terminal *term, struct sbchunk *ch)
+{
+    if (ch->prev)
+	ch->prev->next = ch->next;
+    else
+	term->sbhead = ch->next;
+    if (ch->next)
+	ch->next->prev = ch->prev;
+    else
+	term->sbtail = ch->prev;
+    term->sbchunks--;
+    term->sbbytes -= ch->size;
+    sfree(ch->data);
+    sfree(ch);
+}
 
-    /*
-     * Diagnostics: ensure that the compressed data really does
-     * decompress to the right thing.
-     * 
-     * This is a bit performance-heavy for production code.
-     */
-#ifdef TERM_CC_DIAGS
-#ifndef CHECK_SB_COMPRESSION
-    {
-	int dused;
-	termline *dcl;
-	int i;
+/*
+ * Release the compressed line that has just been removed from the
+ * top of term->scrollback.
+ */
+static void sb_free_oldest(Terminal *term, unsigned char *line)
+{
+    struct sbchunk *ch = term->sbhead;
 
-#ifdef DIAGNOSTIC_SB_COMPRESSION
-	for (i = 0; i < b->len; i++) {
-	    printf(" %02x ", b->data[i]);
-	}
-	printf("\n");
-#endif
+    assert(ch && line >= ch->data && line < ch->data + ch->used);
+    if (--ch->nlines == 0)
+	sb_free_chunk(term, ch);
+}
 
-	dcl = decompressline(b->data, &dused);
-	assert(b->len == dused);
-	assert(ldata->cols == dcl->cols);
-	assert(ldata->lattr == dcl->lattr);
-	for (i = 0; i < ldata->cols; i++)
-	    assert(termchars_equal(&ldata->chars[i], &dcl->chars[i]));
+/*
+ * Release the compressed line that has just been removed from the
+ * bottom of term->scrollback. Its space can be reused straight
+ * away.
+ */
+static void sb_free_newest(Terminal *term, unsigned char *line)
+{
+    struct sbchunk *ch = term->sbtail;
 
-#ifdef DIAGNOSTIC_SB_COMPRESSION
-	printf("%d cols (%d bytes) -> %d bytes (factor of %g)\n",
-	       ldata->cols, 4 * ldata->cols, dused,
-	       (double)dused / (4 * ldata->cols));
-#endif
+    assert(ch && line >= ch->data && line < ch->data + ch->used);
+    ch->used = line - ch->data;
+    if (--ch->nlines == 0)
+	sb_free_chunk(term, ch);
+}
 
-	freeline(dcl);
-    }
-#endif
-#endif /* TERM_CC_DIAGS */
+static termline *decompressline(unsigned char *data, int *bytes_used);
 
-    /*
-     * Trim the allocated memory so we don't waste any, and return.
-     */
-    return sresize(b->data, b->len, unsigned char);
+/*
+ * Each compressed line in the chunks is preceded by its length, as
+ * a varint in the same format as the column count at the start of
+ * the line itself, so that the lines can be copied about without
+ * having to decode them. Given a pointer to one of these records,
+ * return a pointer to the line data and (optionally) its length.
+ */
+static unsigned char *sb_linedata(unsigned char *rec, int *len)
+{
+    int n = 0, shift = 0;
+
+    do {
+	n |= (*rec & 0x7F) << shift;
+	shift += 7;
+    } while (*rec++ & 0x80);
+    if (len)
+	*len = n;
+    return rec;
 }
 
-static void readrle(struct buf *b, termline *ldata,
-		    void (*readliteral)(struct buf *b, termchar *c,
-					termline *ldata, unsigned long *state))
+/*
+ * Copy a line of compressed data into the scrollback chunks as a
+ * new record.
+ */
+static unsigned char *sb_store(Terminal *term, unsigned char *data, int len)
 {
-    int n = 0;
-    unsigned long state = 0;
+    unsigned char *rec, *p;
+    int n, hdr = 1;
+
+    for (n = len; n >= 0x80; n >>= 7)
+	hdr++;
+    rec = p = sb_alloc(term, hdr + len);
+    for (n = len; n >= 0x80; n >>= 7)
+	*p++ = (n & 0x7F) | 0x80;
+    *p++ = n;
+    memcpy(p, data, len);
+    return rec;
+}
 
-    while (n < ldata->cols) {
-	int hdr = get(b);
+/*
+ * Old scrollback is compressed harder. Once more than
+ * cfg.sb_pack_age lines have accumulated in term->scrollback, the
+ * oldest SB_PAGE_LINES of them are taken out, their records joined
+ * together into a page, and the page compressed as one block with
+ * the LZ77 coder below. Runs of attributes and characters repeat
+ * far more between lines than within them, so this does a lot
+ * better than compressline() can on its own.
+ *
+ * The pages are kept in term->sbpages. Lines only ever leave the
+ * scrollback from the top or the bottom, so every page holds
+ * exactly SB_PAGE_LINES lines except that the first few lines of
+ * the first page may already have been discarded; there are
+ * term->sbpageskip of those. When lineptr() wants a line from a
+ * page, the whole page is decompressed into term->sbcache, where
+ * it stays until some other page is wanted.
+ */
+#define SB_PAGE_LINES 128
 
-	if (hdr >= 0x80) {
-	    /* A run. */
+struct sbpage {
+    unsigned char *data;	       /* NULL if the page is in term->sbfile */
+    long offset;		       /* and if so, where */
+    int len;			       /* compressed size */
+    int rawlen;			       /* uncompressed size */
+};
 
-	    int pos = b->len, count = hdr + 2 - 0x80;
-	    while (count--) {
-		assert(n < ldata->cols);
-		b->len = pos;
-		readliteral(b, ldata->chars + n, ldata, &state);
-		n++;
-	    }
-	} else {
-	    /* Just a sequence of consecutive literals. */
+/*
+ * The block coder is a simple LZ77 scheme in the style of LZ4,
+ * chosen for decompression speed over compression ratio. The
+ * output is a sequence of items, each consisting of
+ *
+ *  - a token byte, whose top four bits give the number of
+ *    literal bytes and whose bottom four give the length of the
+ *    match minus SBLZ_MINMATCH. 15 in either field means the
+ *    length continues in extra bytes: each 255 adds 255 and
+ *    stops at the first byte that isn't 255.
+ *  - any extra literal length bytes, then the literals.
+ *  - the distance back to the match, two bytes little-endian.
+ *  - any extra match length bytes.
+ *
+ * The last item in a block stops after its literals.
+ */
+#define SBLZ_MINMATCH 4
+#define SBLZ_HASHBITS 12
+#define SBLZ_MAXDIST 0xFFFF
+#define SBLZ_BOUND(len) ((len) + (len) / 255 + 16)
 
-	    int count = hdr + 1;
-	    while (count--) {
-		assert(n < ldata->cols);
-		readliteral(b, ldata->chars + n, ldata, &state);
-		n++;
-	    }
-	}
+static unsigned sblz_hash(const unsigned char *p)
+{
+    unsigned long v = p[0] | (p[1] << 8) | (p[2] << 16) |
+	((unsigned long)p[3] << 24);
+    return ((v * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - SBLZ_HASHBITS);
+}
+
+static unsigned char *sblz_putlen(unsigned char *op, int n)
+{
+    while (n >= 255) {
+	*op++ = 255;
+	n -= 255;
     }
+    *op++ = n;
+    return op;
+}
 
-    assert(n == ldata->cols);
+/*
+ * Emit one item. A negative dist means this is the last one and
+ * has no match.
+ */
+static unsigned char *sblz_item(unsigned char *op, const unsigned char *lit,
+				int nlit, int dist, int mlen)
+{
+    unsigned char *token = op++;
+
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+	op = sblz_putlen(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (dist >= 0) {
+	*op++ = dist & 0xFF;
+	*op++ = dist >> 8;
+	mlen -= SBLZ_MINMATCH;
+	*token |= (mlen < 15 ? mlen : 15);
+	if (mlen >= 15)
+	    op = sblz_putlen(op, mlen - 15);
+    }
+    return op;
 }
-static void readliteral_chr(struct buf *b, termchar *c, termline *ldata,
-			    unsigned long *state)
+
+/*
+ * Compress len bytes into out, which must have room for
+ * SBLZ_BOUND(len) bytes. Returns the compressed length.
+ */
+static int sblz_compress(const unsigned char *in, int len, unsigned char *out)
 {
-    int byte;
+    int table[1 << SBLZ_HASHBITS];
+    unsigned char *op = out;
+    int ip = 0, anchor = 0;
+    int i;
 
-    /*
-     * 00000000-0000007F: 0xxxxxxx
-     * 00000080-00003FFF: 10xxxxxx xxxxxxxx
-     * 00004000-001FFFFF: 110xxxxx xxxxxxxx xxxxxxxx
-     * 00200000-0FFFFFFF: 1110xxxx xxxxxxxx xxxxxxxx xxxxxxxx
-     * 10000000-FFFFFFFF: 11110ZZZ xxxxxxxx xxxxxxxx xxxxxxxx xxxxxxxx
-     */
+    for (i = 0; i < lenof(table); i++)
+	table[i] = -1;
+
+    while (ip + SBLZ_MINMATCH <= len) {
+	unsigned h = sblz_hash(in + ip);
+	int ref = table[h];
+	table[h] = ip;
+	if (ref >= 0 && ip - ref <= SBLZ_MAXDIST &&
+	    !memcmp(in + ref, in + ip, SBLZ_MINMATCH)) {
+	    int mlen = SBLZ_MINMATCH;
+	    while (ip + mlen < len && in[ref + mlen] == in[ip + mlen])
+		mlen++;
+	    op = sblz_item(op, in + anchor, ip - anchor, ip - ref, mlen);
+	    ip += mlen;
+	    anchor = ip;
+	} else
+	    ip++;
+    }
+    op = sblz_item(op, in + anchor, len - anchor, -1, 0);
 
-    byte = get(b);
-    if (byte < 0x80) {
-	c->chr = byte | *state;
-    } else if (byte < 0xC0) {
-	c->chr = (byte &~ 0xC0) << 8;
-	c->chr |= get(b);
-    } else if (byte < 0xE0) {
-	c->chr = (byte &~ 0xE0) << 16;
-	c->chr |= get(b) << 8;
-	c->chr |= get(b);
-    } else if (byte < 0xF0) {
-	c->chr = (byte &~ 0xF0) << 24;
-	c->chr |= get(b) << 16;
-	c->chr |= get(b) << 8;
-	c->chr |= get(b);
-    } else {
-	assert(byte == 0xF0);
-	c->chr = get(b) << 24;
-	c->chr |= get(b) << 16;
-	c->chr |= get(b) << 8;
-	c->chr |= get(b);
+    assert(op - out <= SBLZ_BOUND(len));
+    return op - out;
+}
+
+static int sblz_getlen(const unsigned char **ipp, int n)
+{
+    int byte;
+
+    if (n == 15) {
+	do {
+	    byte = *(*ipp)++;
+	    n += byte;
+	} while (byte == 255);
     }
-    *state = c->chr & ~0xFF;
+    return n;
 }
-static void readliteral_attr(struct buf *b, termchar *c, termline *ldata,
-			     unsigned long *state)
+
+/*
+ * Decompress a block which is known to expand to exactly outlen
+ * bytes.
+ */
+static void sblz_decompress(const unsigned char *in, int len,
+			    unsigned char *out, int outlen)
 {
-    unsigned val, attr, colourbits;
+    const unsigned char *ip = in, *end = in + len;
+    unsigned char *op = out, *oend = out + outlen;
 
-    val = get(b) << 8;
-    val |= get(b);
+    while (1) {
+	int token = *ip++;
+	int n = sblz_getlen(&ip, token >> 4);
+	int dist;
+	const unsigned char *ref;
+
+	assert(n <= end - ip && n <= oend - op);
+	memcpy(op, ip, n);
+	op += n;
+	ip += n;
+	if (ip == end)
+	    break;
 
-    if (val >= 0x8000) {
-	val &= ~0x8000;
-	val <<= 16;
-	val |= get(b) << 8;
-	val |= get(b);
+	dist = ip[0] | (ip[1] << 8);
+	ip += 2;
+	n = sblz_getlen(&ip, token & 15) + SBLZ_MINMATCH;
+	assert(dist > 0 && dist <= op - out && n <= oend - op);
+	/* the match may overlap the output, so copy a byte at a time */
+	for (ref = op - dist; n > 0; n--)
+	    *op++ = *ref++;
     }
+    assert(op == oend);
+}
 
-    colourbits = (val >> (32-9)) & 0xFF;
-    attr = (val & ((1<<(32-9))-1));
-
-    attr = (((attr >> (ATTR_FGSHIFT + 4)) << (ATTR_FGSHIFT + 8)) |
-	    (attr & ((1 << (ATTR_FGSHIFT + 4))-1)));
-    attr = (((attr >> (ATTR_BGSHIFT + 4)) << (ATTR_BGSHIFT + 8)) |
-	    (attr & ((1 << (ATTR_BGSHIFT + 4))-1)));
-
-    attr |= (colourbits >> 4) << (ATTR_BGSHIFT + 4);
-    attr |= (colourbits & 0xF) << (ATTR_FGSHIFT + 4);
+/*
+ * Get the number of lines of scrollback that have been compressed,
+ * packed or not.
+ */
+static int sb_stored(Terminal *term)
+{
+    return term->sbpacked + count234(term->scrollback);
+}
 
-    c->attr = attr;
+/*
+ * Get the total number of lines of scrollback, including those
+ * still waiting to be compressed.
+ */
+static int sb_count(Terminal *term)
+{
+    return sb_stored(term) + term->sbpendcount;
 }
-static void readliteral_cc(struct buf *b, termchar *c, termline *ldata,
-			   unsigned long *state)
+
+/*
+ * Lines that scroll() pushes into the scrollback aren't compressed
+ * straight away. They are queued in term->sbpend, below all the
+ * compressed lines, until term_out() has finished with its current
+ * batch of data; then sb_flush() compresses them all at once. If a
+ * burst of output pushes more than a scrollback's worth of lines,
+ * the surplus fall off the top while still pending and scroll()
+ * reuses them as blank lines, so they are never compressed at all.
+ */
+static termline *sb_pending(Terminal *term, int i)
 {
-    termchar n;
-    unsigned long zstate;
-    int x = c - ldata->chars;
+    i += term->sbpendstart;
+    if (i >= term->sbpendsize)
+	i -= term->sbpendsize;
+    return term->sbpend[i];
+}
 
-    c->cc_next = 0;
+static void sb_push(Terminal *term, termline *line)
+{
+    int i;
 
-    while (1) {
-	zstate = 0;
-	readliteral_chr(b, &n, ldata, &zstate);
-	if (!n.chr)
-	    break;
-	add_cc(ldata, x, n.chr);
+    if (term->sbpendcount == term->sbpendsize) {
+	termline **pend;
+	int newsize = term->sbpendsize * 3 / 2 + 64;
+
+	pend = snewn(newsize, termline *);
+	for (i = 0; i < term->sbpendcount; i++)
+	    pend[i] = sb_pending(term, i);
+	sfree(term->sbpend);
+	term->sbpend = pend;
+	term->sbpendsize = newsize;
+	term->sbpendstart = 0;
     }
+    i = term->sbpendstart + term->sbpendcount++;
+    if (i >= term->sbpendsize)
+	i -= term->sbpendsize;
+    term->sbpend[i] = line;
 }
 
-static termline *decompressline(unsigned char *data, int *bytes_used)
+/*
+ * Pages which have been spilled to disk are simply appended to
+ * term->sbfile. The space belonging to pages which have since been
+ * discarded is only reclaimed when most of the file is wasted, by
+ * copying the pages still in use into a fresh file.
+ */
+#define SB_FILE_SLACK 1048576
+
+static void sb_read_page(Terminal *term, struct sbpage *pg,
+			 unsigned char *buf)
 {
-    int ncols, byte, shift;
-    struct buf buffer, *b = &buffer;
-    termline *ldata;
+    if (fseek(term->sbfile, pg->offset, SEEK_SET) != 0 ||
+	fread(buf, 1, pg->len, term->sbfile) != (size_t)pg->len)
+	fatalbox("Unable to read scrollback from temporary file");
+}
 
-    b->data = data;
-    b->len = 0;
+static void sb_compact_file(Terminal *term)
+{
+    FILE *fp = open_temp_file();
+    unsigned char *buf;
+    long end = 0;
+    int i;
 
-    /*
-     * First read in the column count.
-     */
-    ncols = shift = 0;
-    do {
-	byte = get(b);
-	ncols |= (byte & 0x7F) << shift;
-	shift += 7;
-    } while (byte & 0x80);
+    if (!fp)
+	return;			       /* put up with the wasted space */
+
+    for (i = 0; i < term->sbspilled; i++) {
+	struct sbpage *pg = index234(term->sbpages, i);
+	assert(pg && !pg->data);
+	buf = snewn(pg->len, unsigned char);
+	sb_read_page(term, pg, buf);
+	if (fwrite(buf, 1, pg->len, fp) != (size_t)pg->len) {
+	    sfree(buf);
+	    fclose(fp);
+	    return;
+	}
+	sfree(buf);
+	pg->offset = end;
+	end += pg->len;
+    }
 
-    /*
-     * Now create the output termline.
-     */
-    ldata = snew(termline);
-    ldata->chars = snewn(ncols, termchar);
-    ldata->cols = ldata->size = ncols;
-    ldata->temporary = TRUE;
-    ldata->cc_free = 0;
+    fclose(term->sbfile);
+    term->sbfile = fp;
+    term->sbfileend = end;
+    assert(end == term->sbfilelive);
+}
 
-    /*
-     * We must set all the cc pointers in ldata->chars to 0 right
-     * now, so that cc diagnostics that verify the integrity of the
-     * whole line will make sense while we're in the middle of
-     * building it up.
-     */
-    {
-	int i;
-	for (i = 0; i < ldata->cols; i++)
-	    ldata->chars[i].cc_next = 0;
+static void sb_free_page(Terminal *term, struct sbpage *pg)
+{
+    if (term->sbcachepage == pg)
+	term->sbcachepage = NULL;
+    if (pg->data) {
+	term->sbpagebytes -= pg->len;
+	sfree(pg->data);
+    } else {
+	term->sbspilled--;
+	term->sbfilelive -= pg->len;
+	if (term->sbfilelive == 0)
+	    term->sbfileend = 0;
+	else if (term->sbfile &&
+		 term->sbfileend - term->sbfilelive > SB_FILE_SLACK &&
+		 term->sbfileend > 2 * term->sbfilelive)
+	    sb_compact_file(term);
     }
+    sfree(pg);
+}
 
-    /*
-     * Now read in the lattr.
-     */
-    ldata->lattr = shift = 0;
-    do {
-	byte = get(b);
-	ldata->lattr |= (byte & 0x7F) << shift;
-	shift += 7;
-    } while (byte & 0x80);
+/*
+ * Write out any pages that have become old enough to go to disk.
+ * If we can't, we say so and keep everything in memory from then on.
+ */
+static void sb_spill(Terminal *term)
+{
+    struct sbpage *pg;
+
+    while (term->cfg.sb_spill_age > 0 && !term->sbfilefailed &&
+	   term->sbspilled < count234(term->sbpages)) {
+	/* number of lines newer than the last one in the page */
+	int newer = sb_stored(term) -
+	    ((term->sbspilled + 1) * SB_PAGE_LINES - term->sbpageskip);
+	if (newer < term->cfg.sb_spill_age)
+	    break;
 
-    /*
-     * Now we read in each of the RLE streams in turn.
-     */
-    readrle(b, ldata, readliteral_chr);
-    readrle(b, ldata, readliteral_attr);
-    readrle(b, ldata, readliteral_cc);
+	pg = index234(term->sbpages, term->sbspilled);
+	if (!term->sbfile) {
+	    term->sbfile = open_temp_file();
+	    term->sbfileend = term->sbfilelive = 0;
+	}
+	if (!term->sbfile ||
+	    fseek(term->sbfile, term->sbfileend, SEEK_SET) != 0 ||
+	    fwrite(pg->data, 1, pg->len, term->sbfile) != (size_t)pg->len) {
+	    logevent(term->frontend, "Unable to write scrollback to a "
+		     "temporary file; keeping it all in memory");
+	    term->sbfilefailed = TRUE;
+	    break;
+	}
+	pg->offset = term->sbfileend;
+	term->sbfileend += pg->len;
+	term->sbfilelive += pg->len;
+	term->sbpagebytes -= pg->len;
+	sfree(pg->data);
+	pg->data = NULL;
+	term->sbspilled++;
+    }
+}
 
-    /* Return the number of bytes read, for diagnostic purposes. */
-    if (bytes_used)
-	*bytes_used = b->len;
+/*
+ * Make sure term->sbcache has room for a page's worth of records.
+ */
+static void sb_cache_reserve(Terminal *term, int rawlen)
+{
+    if (term->sbcachesize < rawlen) {
+	term->sbcachesize = rawlen;
+	term->sbcache = sresize(term->sbcache, rawlen, unsigned char);
+    }
+}
 
-    return ldata;
+/*
+ * Decompress a page into term->sbcache, if it isn't there already.
+ */
+static void sb_load_page(Terminal *term, struct sbpage *pg)
+{
+    if (term->sbcachepage == pg)
+	return;
+    sb_cache_reserve(term, pg->rawlen);
+    if (pg->data) {
+	sblz_decompress(pg->data, pg->len, term->sbcache, pg->rawlen);
+    } else {
+	unsigned char *buf = snewn(pg->len, unsigned char);
+	sb_read_page(term, pg, buf);
+	sblz_decompress(buf, pg->len, term->sbcache, pg->rawlen);
+	sfree(buf);
+    }
+    term->sbcachepage = pg;
 }
 
 /*
- * Resize a line to make it `cols' columns wide.
+ * Compress the oldest SB_PAGE_LINES lines of term->scrollback into
+ * a new page. The records are gathered in term->sbcache, since
+ * that's what the page would decompress to anyway.
  */
-static void resizeline(Terminal *term, termline *line, int cols)
+static void sb_pack(Terminal *term)
 {
-    int i, oldcols;
+    struct sbpage *pg;
+    void *recs[SB_PAGE_LINES];
+    unsigned char *rec, *data;
+    int i, len, rawlen;
+
+    i = delfirstn234(term->scrollback, recs, SB_PAGE_LINES);
+    assert(i == SB_PAGE_LINES);
+
+    rawlen = 0;
+    for (i = 0; i < SB_PAGE_LINES; i++) {
+	rec = recs[i];
+	data = sb_linedata(rec, &len);
+	rawlen += (data - rec) + len;
+    }
+    term->sbcachepage = NULL;
+    sb_cache_reserve(term, rawlen);
+
+    rawlen = 0;
+    for (i = 0; i < SB_PAGE_LINES; i++) {
+	rec = recs[i];
+	data = sb_linedata(rec, &len);
+	len += data - rec;
+	memcpy(term->sbcache + rawlen, rec, len);
+	rawlen += len;
+	sb_free_oldest(term, rec);
+    }
 
-    if (line->cols != cols) {
+    pg = snew(struct sbpage);
+    pg->rawlen = rawlen;
+    pg->data = snewn(SBLZ_BOUND(rawlen), unsigned char);
+    pg->len = sblz_compress(term->sbcache, rawlen, pg->data);
+    pg->data = sresize(pg->data, pg->len, unsigned char);
+    addpos234(term->sbpages, pg, count234(term->sbpages));
+    term->sbpacked += SB_PAGE_LINES;
+    term->sbpagebytes += pg->len;
+    term->sbcachepage = pg;
+
+    sb_spill(term);
+}
 
-	oldcols = line->cols;
+/*
+ * Unpack the newest page back into term->scrollback, which must be
+ * empty.
+ */
+static void sb_unpack(Terminal *term)
+{
+    struct sbpage *pg;
+    void *recs[SB_PAGE_LINES];
+    unsigned char *p;
+    int i, n, len, first;
+
+    assert(count234(term->scrollback) == 0);
+    pg = delpos234(term->sbpages, count234(term->sbpages) - 1);
+    assert(pg != NULL);
+    first = (count234(term->sbpages) == 0 ? term->sbpageskip : 0);
+
+    sb_load_page(term, pg);
+    p = term->sbcache;
+    n = 0;
+    for (i = 0; i < SB_PAGE_LINES; i++) {
+	unsigned char *data = sb_linedata(p, &len);
+	if (i >= first)
+	    recs[n++] = sb_store(term, data, len);
+	p = data + len;
+    }
+    appendn234(term->scrollback, recs, n);
 
-	/*
-	 * This line is the wrong length, which probably means it
-	 * hasn't been accessed since a resize. Resize it now.
-	 * 
-	 * First, go through all the characters that will be thrown
-	 * out in the resize (if we're shrinking the line) and
-	 * return their cc lists to the cc free list.
-	 */
-	for (i = cols; i < oldcols; i++)
-	    clear_cc(line, i);
+    term->sbpacked -= SB_PAGE_LINES - first;
+    if (first)
+	term->sbpageskip = 0;
+    sb_free_page(term, pg);
+}
 
-	/*
-	 * If we're shrinking the line, we now bodily move the
-	 * entire cc section from where it started to where it now
-	 * needs to be. (We have to do this before the resize, so
-	 * that the data we're copying is still there. However, if
-	 * we're expanding, we have to wait until _after_ the
-	 * resize so that the space we're copying into is there.)
-	 */
-	if (cols < oldcols)
-	    memmove(line->chars + cols, line->chars + oldcols,
-		    (line->size - line->cols) * TSIZE);
+/*
+ * Find the compressed data for a line of the scrollback, counting
+ * from 0 at the top. Returns NULL if it's out of range.
+ */
+static unsigned char *sb_line(Terminal *term, int index)
+{
+    unsigned char *rec;
 
-	/*
-	 * Now do the actual resize, leaving the _same_ amount of
-	 * cc space as there was to begin with.
-	 */
-	line->size += cols - oldcols;
-	line->chars = sresize(line->chars, line->size, TTYPE);
-	line->cols = cols;
+    if (index < 0)
+	return NULL;
+    if (index < term->sbpacked) {
+	int i;
+	index += term->sbpageskip;
+	sb_load_page(term, index234(term->sbpages, index / SB_PAGE_LINES));
+	rec = term->sbcache;
+	for (i = index % SB_PAGE_LINES; i > 0; i--) {
+	    int len;
+	    rec = sb_linedata(rec, &len) + len;
+	}
+    } else {
+	rec = index234(term->scrollback, index - term->sbpacked);
+	if (!rec)
+	    return NULL;
+    }
+    return sb_linedata(rec, NULL);
+}
 
-	/*
-	 * If we're expanding the line, _now_ we move the cc
-	 * section.
-	 */
-	if (cols > oldcols)
-	    memmove(line->chars + cols, line->chars + oldcols,
-		    (line->size - line->cols) * TSIZE);
+/*
+ * lineptr() is asked for the same few screenfuls of scrollback over
+ * and over again while the user is scrolled back (do_paint() looks
+ * at every line on each update) or is selecting text, so we keep a
+ * cache of decompressed lines. Lines are identified by a serial
+ * number counting from the first line ever added to the scrollback,
+ * so that adding or discarding lines doesn't disturb the others.
+ *
+ * The cache is direct-mapped on the serial number. Consecutive
+ * lines never collide, so any window of up to SB_LINECACHE lines
+ * stays resident, which is as much as an LRU would give us for the
+ * way lineptr() is used, and lookups cost nothing.
+ */
+#define SB_LINECACHE 256
 
-	/*
-	 * Go through what's left of the original line, and adjust
-	 * the first cc_next pointer in each list. (All the
-	 * subsequent ones are still valid because they are
-	 * relative offsets within the cc block.) Also do the same
-	 * to the head of the cc_free list.
-	 */
-	for (i = 0; i < oldcols && i < cols; i++)
-	    if (line->chars[i].cc_next)
-		line->chars[i].cc_next += cols - oldcols;
-	if (line->cc_free)
-	    line->cc_free += cols - oldcols;
+struct sblinecache {
+    unsigned long serial;
+    termline *line;		       /* NULL if this slot is empty */
+};
 
-	/*
-	 * And finally fill in the new space with erase chars. (We
-	 * don't have to worry about cc lists here, because we
-	 * _know_ the erase char doesn't have one.)
-	 */
-	for (i = oldcols; i < cols; i++)
-	    line->chars[i] = term->basic_erase_char;
+static void sb_uncache(Terminal *term, unsigned long serial)
+{
+    struct sblinecache *c;
 
-#ifdef TERM_CC_DIAGS
-	cc_check(line);
-#endif
+    if (!term->sblcache)
+	return;
+    c = &term->sblcache[serial % SB_LINECACHE];
+    if (c->line && c->serial == serial) {
+	freeline(c->line);
+	c->line = NULL;
     }
 }
 
-/*
- * Get the number of lines in the scrollback.
- */
-static int sblines(Terminal *term)
+static void sb_uncache_all(Terminal *term)
 {
-    int sblines = count234(term->scrollback);
-    if (term->cfg.erase_to_scrollback &&
-	term->alt_which && term->alt_screen) {
-	    sblines += term->alt_sblines;
+    int i;
+
+    if (!term->sblcache)
+	return;
+    for (i = 0; i < SB_LINECACHE; i++) {
+	freeline(term->sblcache[i].line);
+	term->sblcache[i].line = NULL;
     }
-    return sblines;
 }
 
 /*
- * Retrieve a line of the screen or of the scrollback, according to
- * whether the y coordinate is non-negative or negative
- * (respectively).
+ * Return a line of the scrollback, decompressed. The line belongs
+ * to the cache and stays valid until the scrollback next changes;
+ * it isn't marked as temporary, so unlineptr() leaves it alone.
  */
-static termline *lineptr(Terminal *term, int y, int lineno, int screen)
+static termline *sb_getline(Terminal *term, int index)
 {
-    termline *line;
-    tree234 *whichtree;
-    int treeindex;
-
-    if (y >= 0) {
-	whichtree = term->screen;
-	treeindex = y;
-    } else {
-	int altlines = 0;
+    unsigned long serial = term->sbfirst + index;
+    struct sblinecache *c;
+    unsigned char *cline;
+    int i;
 
-	assert(!screen);
+    if (index < 0 || index >= sb_count(term))
+	return NULL;
+    if (index >= sb_stored(term))
+	return sb_pending(term, index - sb_stored(term));
 
-	if (term->cfg.erase_to_scrollback &&
-	    term->alt_which && term->alt_screen) {
-	    altlines = term->alt_sblines;
-	}
-	if (y < -altlines) {
-	    whichtree = term->scrollback;
-	    treeindex = y + altlines + count234(term->scrollback);
-	} else {
-	    whichtree = term->alt_screen;
-	    treeindex = y + term->alt_sblines;
-	    /* treeindex = y + count234(term->alt_screen); */
-	}
-    }
-    if (whichtree == term->scrollback) {
-	unsigned char *cline = index234(whichtree, treeindex);
-	line = decompressline(cline, NULL);
-    } else {
-	line = index234(whichtree, treeindex);
+    if (!term->sblcache) {
+	term->sblcache = snewn(SB_LINECACHE, struct sblinecache);
+	for (i = 0; i < SB_LINECACHE; i++)
+	    term->sblcache[i].line = NULL;
     }
 
-    /* We assume that we don't screw up and retrieve something out of range. */
-    if (line == NULL) {
-	fatalbox("line==NULL in terminal.c\n"
-		 "lineno=%d y=%d w=%d h=%d\n"
-		 "count(scrollback=%p)=%d\n"
-		 "count(screen=%p)=%d\n"
-		 "count(alt=%p)=%d alt_sblines=%d\n"
-		 "whichtree=%p treeindex=%d\n\n"
-		 "Please contact <putty@projects.tartarus.org> "
-		 "and pass on the above information.",
-		 lineno, y, term->cols, term->rows,
-		 term->scrollback, count234(term->scrollback),
-		 term->screen, count234(term->screen),
-		 term->alt_screen, count234(term->alt_screen), term->alt_sblines,
-		 whichtree, treeindex);
+    c = &term->sblcache[serial % SB_LINECACHE];
+    if (c->line && c->serial == serial) {
+	term->sblcache_hits++;
+	return c->line;
     }
-    assert(line != NULL);
 
-    resizeline(term, line, term->cols);
-    /* FIXME: should we sort the compressed scrollback out here? */
+    term->sblcache_misses++;
+    cline = sb_line(term, index);
+    freeline(c->line);
+    c->line = decompressline(cline, NULL);
+    c->line->temporary = FALSE;
+    c->serial = serial;
+    return c->line;
+}
 
-    return line;
+/*
+ * Add n line records (from compressline()) to the bottom of the
+ * scrollback, packing old ones into pages as they pass the pack age.
+ */
+static void sb_append(Terminal *term, void **recs, int n)
+{
+    appendn234(term->scrollback, recs, n);
+    while (term->cfg.sb_pack_age > 0 &&
+	   count234(term->scrollback) >= term->cfg.sb_pack_age + SB_PAGE_LINES)
+	sb_pack(term);
 }
 
-#define lineptr(x) (lineptr)(term,x,__LINE__,FALSE)
-#define scrlineptr(x) (lineptr)(term,x,__LINE__,TRUE)
+/*
+ * Add a single line record. There must be no lines pending.
+ */
+static void sb_add(Terminal *term, unsigned char *rec)
+{
+    void *recs[1];
 
-static void term_schedule_tblink(Terminal *term);
-static void term_schedule_cblink(Terminal *term);
+    assert(term->sbpendcount == 0);
+    recs[0] = rec;
+    sb_append(term, recs, 1);
+}
 
-static void term_timer(void *ctx, long now)
+/*
+ * Discard the line at the top of the scrollback. If it hadn't been
+ * compressed yet, it is handed back for reuse rather than freed;
+ * otherwise this returns NULL.
+ */
+static termline *sb_drop_oldest(Terminal *term)
 {
-    Terminal *term = (Terminal *)ctx;
-    int update = FALSE;
-
-    if (term->tblink_pending && now - term->next_tblink >= 0) {
-	term->tblinker = !term->tblinker;
-	term->tblink_pending = FALSE;
-	term_schedule_tblink(term);
-	update = TRUE;
-    }
-
-    if (term->cblink_pending && now - term->next_cblink >= 0) {
-	term->cblinker = !term->cblinker;
-	term->cblink_pending = FALSE;
-	term_schedule_cblink(term);
-	update = TRUE;
-    }
-
-    if (term->in_vbell && now - term->vbell_end >= 0) {
-	term->in_vbell = FALSE;
-	update = TRUE;
-    }
-
-    if (update ||
-	(term->window_update_pending && now - term->next_update >= 0))
-	term_update(term);
-}
-
-static void term_schedule_update(Terminal *term)
-{
-    if (!term->window_update_pending) {
-	term->window_update_pending = TRUE;
-	term->next_update = schedule_timer(UPDATE_DELAY, term_timer, term);
+    sb_uncache(term, term->sbfirst++);
+    if (sb_stored(term) == 0) {
+	termline *line = sb_pending(term, 0);
+	if (++term->sbpendstart == term->sbpendsize)
+	    term->sbpendstart = 0;
+	term->sbpendcount--;
+	return line;
+    } else if (term->sbpacked > 0) {
+	term->sbpacked--;
+	if (++term->sbpageskip == SB_PAGE_LINES) {
+	    sb_free_page(term, delpos234(term->sbpages, 0));
+	    term->sbpageskip = 0;
+	}
+    } else {
+	sb_free_oldest(term, delpos234(term->scrollback, 0));
     }
+    return NULL;
 }
 
 /*
- * Call this whenever the terminal window state changes, to queue
- * an update.
- */
-static void seen_disp_event(Terminal *term)
-{
-    term->seen_disp_event = TRUE;      /* for scrollback-reset-on-activity */
-    term_schedule_update(term);
-}
-
-/*
- * Call when the terminal's blinking-text settings change, or when
- * a text blink has just occurred.
+ * Discard the n lines at the top of the scrollback: whole pages at
+ * a time, then the uncompressed records in bulk, then any pending
+ * lines.
  */
-static void term_schedule_tblink(Terminal *term)
+static void sb_trim(Terminal *term, int n)
 {
-    if (term->blink_is_real) {
-	if (!term->tblink_pending)
-	    term->next_tblink = schedule_timer(TBLINK_DELAY, term_timer, term);
-	term->tblink_pending = TRUE;
-    } else {
-	term->tblinker = 1;	       /* reset when not in use */
-	term->tblink_pending = FALSE;
+    void *recs[SB_PAGE_LINES];
+    int i, k;
+
+    sb_uncache_all(term);
+    term->sbfirst += n;
+    while (n > 0 && term->sbpacked > 0) {
+	k = SB_PAGE_LINES - term->sbpageskip;
+	if (k > n)
+	    k = n;
+	term->sbpacked -= k;
+	term->sbpageskip += k;
+	n -= k;
+	if (term->sbpageskip == SB_PAGE_LINES) {
+	    sb_free_page(term, delpos234(term->sbpages, 0));
+	    term->sbpageskip = 0;
+	}
+    }
+    while (n > 0 && count234(term->scrollback) > 0) {
+	k = delfirstn234(term->scrollback, recs,
+			 n < SB_PAGE_LINES ? n : SB_PAGE_LINES);
+	for (i = 0; i < k; i++)
+	    sb_free_oldest(term, recs[i]);
+	n -= k;
     }
+    while (n > 0 && term->sbpendcount > 0) {
+	freeline(sb_pending(term, 0));
+	if (++term->sbpendstart == term->sbpendsize)
+	    term->sbpendstart = 0;
+	term->sbpendcount--;
+	n--;
+    }
+    assert(n == 0);
 }
 
 /*
- * Likewise with cursor blinks.
+ * Remove the line at the bottom of the scrollback, and return it
+ * decompressed.
  */
-static void term_schedule_cblink(Terminal *term)
+static termline *sb_take_newest(Terminal *term)
 {
-    if (term->cfg.blink_cur && term->has_focus) {
-	if (!term->cblink_pending)
-	    term->next_cblink = schedule_timer(CBLINK_DELAY, term_timer, term);
-	term->cblink_pending = TRUE;
-    } else {
-	term->cblinker = 1;	       /* reset when not in use */
-	term->cblink_pending = FALSE;
+    unsigned char *rec;
+    termline *line;
+
+    sb_uncache(term, term->sbfirst + sb_count(term) - 1);
+    if (term->sbpendcount > 0) {
+	line = sb_pending(term, term->sbpendcount - 1);
+	term->sbpendcount--;
+	return line;
     }
+    if (count234(term->scrollback) == 0)
+	sb_unpack(term);
+    rec = delpos234(term->scrollback, count234(term->scrollback) - 1);
+    line = decompressline(sb_linedata(rec, NULL), NULL);
+    sb_free_newest(term, rec);
+    return line;
 }
 
 /*
- * Call to reset cursor blinking on new output.
+ * Throw away the entire contents of the scrollback.
  */
-static void term_reset_cblink(Terminal *term)
+static void sb_free_all(Terminal *term)
 {
-    seen_disp_event(term);
-    term->cblinker = 1;
-    term->cblink_pending = FALSE;
-    term_schedule_cblink(term);
+    struct sbpage *pg;
+
+    sb_uncache_all(term);
+    while (term->sbpendcount > 0)
+	freeline(sb_take_newest(term));
+    freetree234(term->scrollback);
+    term->scrollback = newtree234(NULL);
+    while (term->sbhead)
+	sb_free_chunk(term, term->sbhead);
+    if (term->sbfile) {
+	fclose(term->sbfile);
+	term->sbfile = NULL;
+    }
+    term->sbfilefailed = FALSE;
+    while ((pg = delpos234(term->sbpages, 0)) != NULL)
+	sb_free_page(term, pg);
+    term->sbpacked = term->sbpageskip = 0;
 }
 
 /*
- * Call to begin a visual bell.
+ * Compress a line and store the result in the scrollback chunks.
+ * The compressed data is built up in a scratch buffer kept in the
+ * Terminal, so that this does no allocation in the common case.
  */
-static void term_schedule_vbell(Terminal *term, int already_started,
-				long startpoint)
+static unsigned char *compressline(Terminal *term, termline *ldata)
 {
-    long ticks_already_gone;
+    struct buf buffer, *b = &buffer;
 
-    if (already_started)
-	ticks_already_gone = GETTICKCOUNT() - startpoint;
-    else
-	ticks_already_gone = 0;
+    b->data = term->sbbuf;
+    b->len = 0;
+    b->size = term->sbbufsize;
 
-    if (ticks_already_gone < VBELL_DELAY) {
-	term->in_vbell = TRUE;
-	term->vbell_end = schedule_timer(VBELL_DELAY - ticks_already_gone,
-					 term_timer, term);
-    } else {
-	term->in_vbell = FALSE;
+    /*
+     * First, store the column count, 7 bits at a time, least
+     * significant `digit' first, with the high bit set on all but
+     * the last.
+     */
+    {
+	int n = ldata->cols;
+	while (n >= 128) {
+	    add(b, (unsigned char)((n & 0x7F) | 0x80));
+	    n >>= 7;
+	}
+	add(b, (unsigned char)(n));
     }
-}
 
-/*
- * Set up power-on settings for the terminal.
- * If 'clear' is false, don't actually clear the primary screen, and
- * position the cursor below the last non-blank line (scrolling if
- * necessary).
- */
-static void power_on(Terminal *term, int clear)
-{
-    term->alt_x = term->alt_y = 0;
-    term->savecurs.x = term->savecurs.y = 0;
-    term->alt_savecurs.x = term->alt_savecurs.y = 0;
-    term->alt_t = term->marg_t = 0;
-    if (term->rows != -1)
-	term->alt_b = term->marg_b = term->rows - 1;
-    else
-	term->alt_b = term->marg_b = 0;
-    if (term->cols != -1) {
-	int i;
-	for (i = 0; i < term->cols; i++)
-	    term->tabs[i] = (i % 8 == 0 ? TRUE : FALSE);
+    /*
+     * Next store the lattrs; same principle.
+     */
+    {
+	int n = ldata->lattr;
+	while (n >= 128) {
+	    add(b, (unsigned char)((n & 0x7F) | 0x80));
+	    n >>= 7;
+	}
+	add(b, (unsigned char)(n));
     }
-    term->alt_om = term->dec_om = term->cfg.dec_om;
-    term->alt_ins = term->insert = FALSE;
-    term->alt_wnext = term->wrapnext =
-        term->save_wnext = term->alt_save_wnext = FALSE;
-    term->alt_wrap = term->wrap = term->cfg.wrap_mode;
-    term->alt_cset = term->cset = term->save_cset = term->alt_save_cset = 0;
-    term->alt_utf = term->utf = term->save_utf = term->alt_save_utf = 0;
-    term->utf_state = 0;
-    term->alt_sco_acs = term->sco_acs =
-        term->save_sco_acs = term->alt_save_sco_acs = 0;
-    term->cset_attr[0] = term->cset_attr[1] =
-        term->save_csattr = term->alt_save_csattr = CSET_ASCII;
-    term->rvideo = 0;
-    term->in_vbell = FALSE;
-    term->cursor_on = 1;
-    term->big_cursor = 0;
-    term->default_attr = term->save_attr =
-	term->alt_save_attr = term->curr_attr = ATTR_DEFAULT;
-    term->term_editing = term->term_echoing = FALSE;
-    term->app_cursor_keys = term->cfg.app_cursor;
-    term->app_keypad_keys = term->cfg.app_keypad;
-    term->use_bce = term->cfg.bce;
-    term->blink_is_real = term->cfg.blinktext;
-    term->erase_char = term->basic_erase_char;
-    term->alt_which = 0;
-    term_print_finish(term);
+
+    /*
+     * Now we store a sequence of separate run-length encoded
+     * fragments, each containing exactly as many symbols as there
+     * are columns in the ldata.
+     * 
+     * All of these have a common basic format:
+     * 
+     *  - a byte 00-7F indicates that X+1 literals follow it
+     * 	- a byte 80-FF indicates that a single literal follows it
+     * 	  and expects to be repeated (X-0x80)+2 times.
+     * 
+     * The format of the `literals' varies between the fragments.
+     */
+    makerle(b, ldata, makeliteral_chr);
+    makerle(b, ldata, makeliteral_attr);
+    makerle(b, ldata, makeliteral_cc);
+
+    /*
+     * Diagnostics: ensure that the compressed data really does
+     * decompress to the right thing.
+     * 
+     * This is a bit performance-heavy for production code.
+     */
+#ifdef TERM_CC_DIAGS
+#ifndef CHECK_SB_COMPRESSION
     {
+	int dused;
+	termline *dcl;
 	int i;
-	for (i = 0; i < 256; i++)
-	    term->wordness[i] = term->cfg.wordness[i];
-    }
-    if (term->screen) {
-	swap_screen(term, 1, FALSE, FALSE);
-	erase_lots(term, FALSE, TRUE, TRUE);
-	swap_screen(term, 0, FALSE, FALSE);
-	if (clear)
-	    erase_lots(term, FALSE, TRUE, TRUE);
-	term->curs.y = find_last_nonempty_line(term, term->screen) + 1;
-	if (term->curs.y == term->rows) {
-	    term->curs.y--;
-	    scroll(term, 0, term->rows - 1, 1, TRUE);
+
+#ifdef DIAGNOSTIC_SB_COMPRESSION
+	for (i = 0; i < b->len; i++) {
+	    printf(" %02x ", b->data[i]);
 	}
-    } else {
-	term->curs.y = 0;
+	printf("\n");
+#endif
+
+	dcl = decompressline(b->data, &dused);
+	assert(b->len == dused);
+	assert(ldata->cols == dcl->cols);
+	assert(ldata->lattr == dcl->lattr);
+	for (i = 0; i < ldata->cols; i++)
+	    assert(termchars_equal(&ldata->chars[i], CC_AREA(ldata),
+				   &dcl->chars[i], CC_AREA(dcl)));
+
+#ifdef DIAGNOSTIC_SB_COMPRESSION
+	printf("%d cols (%d bytes) -> %d bytes (factor of %g)\n",
+	       ldata->cols, 4 * ldata->cols, dused,
+	       (double)dused / (4 * ldata->cols));
+#endif
+
+	freeline(dcl);
     }
-    term->curs.x = 0;
-    term_schedule_tblink(term);
-    term_schedule_cblink(term);
+#endif
+#endif /* TERM_CC_DIAGS */
+
+    /*
+     * Keep the scratch buffer for next time, and copy the result
+     * into the scrollback.
+     */
+    term->sbbuf = b->data;
+    term->sbbufsize = b->size;
+    return sb_store(term, b->data, b->len);
 }
 
 /*
- * Force a screen update.
+ * Lines which sb_flush() has compressed are kept, up to a limit, for
+ * scroll() to use as blank lines.
  */
-void term_update(Terminal *term)
-{
-    Context ctx;
-
-    term->window_update_pending = FALSE;
-
-    ctx = get_ctx(term->frontend);
-    if (ctx) {
-	int need_sbar_update = term->seen_disp_event;
-	if (term->seen_disp_event && term->cfg.scroll_on_disp) {
-	    term->disptop = 0;	       /* return to main screen */
-	    term->seen_disp_event = 0;
-	    need_sbar_update = TRUE;
-	}
+#define SB_SPARE_LINES 256
 
-	if (need_sbar_update)
-	    update_sbar(term);
-	do_paint(term, ctx, TRUE);
-	sys_cursor(term->frontend, term->curs.x, term->curs.y - term->disptop);
-	free_ctx(ctx);
-    }
+static termline *sb_spare(Terminal *term)
+{
+    if (term->sbsparecount > 0)
+	return term->sbspare[--term->sbsparecount];
+    return newline(term, term->cols, FALSE);
 }
 
 /*
- * Called from front end when a keypress occurs, to trigger
- * anything magical that needs to happen in that situation.
+ * Compress all the pending lines into the scrollback.
  */
-void term_seen_key_event(Terminal *term)
+static void sb_flush(Terminal *term)
 {
-    /*
-     * On any keypress, clear the bell overload mechanism
-     * completely, on the grounds that large numbers of
-     * beeps coming from deliberate key action are likely
-     * to be intended (e.g. beeps from filename completion
-     * blocking repeatedly).
-     */
-    term->beep_overloaded = FALSE;
-    while (term->beephead) {
-	struct beeptime *tmp = term->beephead;
-	term->beephead = tmp->next;
-	sfree(tmp);
+    termline *line;
+    void *recs[SB_PAGE_LINES];
+    int i, n = term->sbpendcount;
+
+    term->sbpendcount = 0;
+    for (i = 0; i < n; i++) {
+	line = sb_pending(term, 0);
+	if (++term->sbpendstart == term->sbpendsize)
+	    term->sbpendstart = 0;
+	recs[i % SB_PAGE_LINES] = compressline(term, line);
+	if (i % SB_PAGE_LINES == SB_PAGE_LINES - 1 || i == n - 1)
+	    sb_append(term, recs, i % SB_PAGE_LINES + 1);
+	if (term->sbsparecount < SB_SPARE_LINES) {
+	    if (!term->sbspare)
+		term->sbspare = snewn(SB_SPARE_LINES, termline *);
+	    term->sbspare[term->sbsparecount++] = line;
+	} else {
+	    freeline(line);
+	}
+    }
+    term->sbpendstart = 0;
+}
+
+static void readrle(struct buf *b, termline *ldata,
+		    void (*readliteral)(struct buf *b, termchar *c,
+					termline *ldata, unsigned long *state))
+{
+    int n = 0;
+    unsigned long state = 0;
+
+    while (n < ldata->cols) {
+	int hdr = get(b);
+
+	if (hdr >= 0x80) {
+	    /* A run. */
+
+	    int pos = b->len, count = hdr + 2 - 0x80;
+	    while (count--) {
+		assert(n < ldata->cols);
+		b->len = pos;
+		readliteral(b, ldata->chars + n, ldata, &state);
+		n++;
+	    }
+	} else {
+	    /* Just a sequence of consecutive literals. */
+
+	    int count = hdr + 1;
+	    while (count--) {
+		assert(n < ldata->cols);
+		readliteral(b, ldata->chars + n, ldata, &state);
+		n++;
+	    }
+	}
     }
-    term->beeptail = NULL;
-    term->nbeeps = 0;
+
+    assert(n == ldata->cols);
+}
+static void readliteral_chr(struct buf *b, termchar *c, termline *ldata,
+			    unsigned long *state)
+{
+    unsigned long chr;
+    int byte;
 
     /*
-     * Reset the scrollback on keypress, if we're doing that.
+     * 00000000-0000007F: 0xxxxxxx
+     * 00000080-00003FFF: 10xxxxxx xxxxxxxx
+     * 00004000-001FFFFF: 110xxxxx xxxxxxxx xxxxxxxx
+     * 00200000-0FFFFFFF: 1110xxxx xxxxxxxx xxxxxxxx xxxxxxxx
+     * 10000000-FFFFFFFF: 11110ZZZ xxxxxxxx xxxxxxxx xxxxxxxx xxxxxxxx
      */
-    if (term->cfg.scroll_on_key) {
-	term->disptop = 0;	       /* return to main screen */
-	seen_disp_event(term);
+
+    byte = get(b);
+    if (byte < 0x80) {
+	chr = byte | *state;
+    } else if (byte < 0xC0) {
+	chr = (byte &~ 0xC0) << 8;
+	chr |= get(b);
+    } else if (byte < 0xE0) {
+	chr = (byte &~ 0xE0) << 16;
+	chr |= get(b) << 8;
+	chr |= get(b);
+    } else if (byte < 0xF0) {
+	chr = (byte &~ 0xF0) << 24;
+	chr |= get(b) << 16;
+	chr |= get(b) << 8;
+	chr |= get(b);
+    } else {
+	assert(byte == 0xF0);
+	chr = get(b) << 24;
+	chr |= get(b) << 16;
+	chr |= get(b) << 8;
+	chr |= get(b);
     }
+    c->chr = chr;
+    *state = chr & ~0xFF;
 }
-
-/*
- * Same as power_on(), but an external function.
- */
-void term_pwron(Terminal *term, int clear)
+static void readliteral_attr(struct buf *b, termchar *c, termline *ldata,
+			     unsigned long *state)
 {
-    power_on(term, clear);
-    if (term->ldisc)		       /* cause ldisc to notice changes */
-	ldisc_send(term->ldisc, NULL, 0, 0);
-    term->disptop = 0;
-    deselect(term);
-    term_update(term);
-}
+    unsigned val, attr, colourbits;
 
-static void set_erase_char(Terminal *term)
+    val = get(b) << 8;
+    val |= get(b);
+
+    if (val >= 0x8000) {
+	val &= ~0x8000;
+	val <<= 16;
+	val |= get(b) << 8;
+	val |= get(b);
+    }
+
+    colourbits = (val >> (32-9)) & 0xFF;
+    attr = (val & ((1<<(32-9))-1));
+
+    attr = (((attr >> (ATTR_FGSHIFT + 4)) << (ATTR_FGSHIFT + 8)) |
+	    (attr & ((1 << (ATTR_FGSHIFT + 4))-1)));
+    attr = (((attr >> (ATTR_BGSHIFT + 4)) << (ATTR_BGSHIFT + 8)) |
+	    (attr & ((1 << (ATTR_BGSHIFT + 4))-1)));
+
+    attr |= (colourbits >> 4) << (ATTR_BGSHIFT + 4);
+    attr |= (colourbits & 0xF) << (ATTR_FGSHIFT + 4);
+
+    c->attr = attr;
+}
+static void readliteral_cc(struct buf *b, termchar *c, termline *ldata,
+			   unsigned long *state)
 {
-    term->erase_char = term->basic_erase_char;
-    if (term->use_bce)
-	term->erase_char.attr = (term->curr_attr &
-				 (ATTR_FGMASK | ATTR_BGMASK));
+    termchar n;
+    unsigned long zstate;
+    int x = c - ldata->chars;
+
+    c->cc_next = 0;
+
+    while (1) {
+	zstate = 0;
+	readliteral_chr(b, &n, ldata, &zstate);
+	if (!n.chr)
+	    break;
+	add_cc(ldata, x, n.chr);
+    }
 }
 
-/*
- * When the user reconfigures us, we need to check the forbidden-
- * alternate-screen config option, disable raw mouse mode if the
- * user has disabled mouse reporting, and abandon a print job if
- * the user has disabled printing.
- */
-void term_reconfig(Terminal *term, Config *cfg)
+static termline *decompressline(unsigned char *data, int *bytes_used)
 {
+    int ncols, byte, shift;
+    struct buf buffer, *b = &buffer;
+    termline *ldata;
+
+    b->data = data;
+    b->len = 0;
+
     /*
-     * Before adopting the new config, check all those terminal
-     * settings which control power-on defaults; and if they've
-     * changed, we will modify the current state as well as the
-     * default one. The full list is: Auto wrap mode, DEC Origin
-     * Mode, BCE, blinking text, character classes.
+     * First read in the column count.
      */
-    int reset_wrap, reset_decom, reset_bce, reset_tblink, reset_charclass;
-    int i;
+    ncols = shift = 0;
+    do {
+	byte = get(b);
+	ncols |= (byte & 0x7F) << shift;
+	shift += 7;
+    } while (byte & 0x80);
 
-    reset_wrap = (term->cfg.wrap_mode != cfg->wrap_mode);
-    reset_decom = (term->cfg.dec_om != cfg->dec_om);
-    reset_bce = (term->cfg.bce != cfg->bce);
-    reset_tblink = (term->cfg.blinktext != cfg->blinktext);
-    reset_charclass = 0;
-    for (i = 0; i < lenof(term->cfg.wordness); i++)
-	if (term->cfg.wordness[i] != cfg->wordness[i])
-	    reset_charclass = 1;
+    /*
+     * Now create the output termline.
+     */
+    ldata = snew_pooled(termline);
+    ldata->chars = snewn_pooled(ncols, termchar);
+    ldata->cols = ldata->size = ncols;
+    ldata->temporary = TRUE;
+    ldata->cc_free = 0;
 
     /*
-     * If the bidi or shaping settings have changed, flush the bidi
-     * cache completely.
+     * We must set all the cc pointers in ldata->chars to 0 right
+     * now, so that cc diagnostics that verify the integrity of the
+     * whole line will make sense while we're in the middle of
+     * building it up.
      */
-    if (term->cfg.arabicshaping != cfg->arabicshaping ||
-	term->cfg.bidi != cfg->bidi) {
-	for (i = 0; i < term->bidi_cache_size; i++) {
-	    sfree(term->pre_bidi_cache[i].chars);
-	    sfree(term->post_bidi_cache[i].chars);
-	    term->pre_bidi_cache[i].width = -1;
-	    term->pre_bidi_cache[i].chars = NULL;
-	    term->post_bidi_cache[i].width = -1;
-	    term->post_bidi_cache[i].chars = NULL;
-	}
+    {
+	int i;
+	for (i = 0; i < ldata->cols; i++)
+	    ldata->chars[i].cc_next = 0;
     }
 
-    term->cfg = *cfg;		       /* STRUCTURE COPY */
+    /*
+     * Now read in the lattr.
+     */
+    ldata->lattr = shift = 0;
+    do {
+	byte = get(b);
+	ldata->lattr |= (byte & 0x7F) << shift;
+	shift += 7;
+    } while (byte & 0x80);
 
-    if (reset_wrap)
-	term->alt_wrap = term->wrap = term->cfg.wrap_mode;
-    if (reset_decom)
-	term->alt_om = term->dec_om = term->cfg.dec_om;
-    if (reset_bce) {
-	term->use_bce = term->cfg.bce;
-	set_erase_char(term);
-    }
-    if (reset_tblink) {
-	term->blink_is_real = term->cfg.blinktext;
-    }
-    if (reset_charclass)
-	for (i = 0; i < 256; i++)
-	    term->wordness[i] = term->cfg.wordness[i];
+    /*
+     * Now we read in each of the RLE streams in turn.
+     */
+    readrle(b, ldata, readliteral_chr);
+    readrle(b, ldata, readliteral_attr);
+    readrle(b, ldata, readliteral_cc);
 
-    if (term->cfg.no_alt_screen)
-	swap_screen(term, 0, FALSE, FALSE);
-    if (term->cfg.no_mouse_rep) {
-	term->xterm_mouse = 0;
-	set_raw_mouse_mode(term->frontend, 0);
-    }
-    if (term->cfg.no_remote_charset) {
-	term->cset_attr[0] = term->cset_attr[1] = CSET_ASCII;
-	term->sco_acs = term->alt_sco_acs = 0;
-	term->utf = 0;
-    }
-    if (!*term->cfg.printer) {
-	term_print_finish(term);
-    }
-    term_schedule_tblink(term);
-    term_schedule_cblink(term);
+    /* Return the number of bytes read, for diagnostic purposes. */
+    if (bytes_used)
+	*bytes_used = b->len;
+
+    return ldata;
 }
 
 /*
- * Clear the scrollback.
+ * Resize a line to make it `cols' columns wide.
  */
-void term_clrsb(Terminal *term)
+static void resizeline(Terminal *term, termline *line, int cols)
 {
-    unsigned char *line;
-    term->disptop = 0;
-    while ((line = delpos234(term->scrollback, 0)) != NULL) {
-	sfree(line);            /* this is compressed data, not a termline */
-    }
-    term->tempsblines = 0;
-    term->alt_sblines = 0;
-    update_sbar(term);
-}
+    int i, oldcols;
 
-/*
- * Initialise the terminal.
- */
-Terminal *term_init(Config *mycfg, struct unicode_data *ucsdata,
-		    void *frontend)
-{
-    Terminal *term;
+    if (line->cols != cols) {
 
-    /*
-     * Allocate a new Terminal structure and initialise the fields
-     * that need it.
-     */
-    term = snew(Terminal);
-    term->frontend = frontend;
-    term->ucsdata = ucsdata;
-    term->cfg = *mycfg;		       /* STRUCTURE COPY */
-    term->logctx = NULL;
-    term->compatibility_level = TM_PUTTY;
-    strcpy(term->id_string, "\033[?6c");
-    term->cblink_pending = term->tblink_pending = FALSE;
-    term->paste_buffer = NULL;
-    term->paste_len = 0;
-    term->last_paste = 0;
-    bufchain_init(&term->inbuf);
-    bufchain_init(&term->printer_buf);
-    term->printing = term->only_printing = FALSE;
-    term->print_job = NULL;
-    term->vt52_mode = FALSE;
-    term->cr_lf_return = FALSE;
-    term->seen_disp_event = FALSE;
-    term->xterm_mouse = term->mouse_is_down = FALSE;
-    term->reset_132 = FALSE;
-    term->cblinker = term->tblinker = 0;
-    term->has_focus = 1;
-    term->repeat_off = FALSE;
-    term->termstate = TOPLEVEL;
-    term->selstate = NO_SELECTION;
-    term->curstype = 0;
+	oldcols = line->cols;
 
-    term->screen = term->alt_screen = term->scrollback = NULL;
-    term->tempsblines = 0;
-    term->alt_sblines = 0;
-    term->disptop = 0;
-    term->disptext = NULL;
-    term->dispcursx = term->dispcursy = -1;
-    term->tabs = NULL;
-    deselect(term);
-    term->rows = term->cols = -1;
-    power_on(term, TRUE);
-    term->beephead = term->beeptail = NULL;
-#ifdef OPTIMISE_SCROLL
-    term->scrollhead = term->scrolltail = NULL;
-#endif /* OPTIMISE_SCROLL */
-    term->nbeeps = 0;
-    term->lastbeep = FALSE;
-    term->beep_overloaded = FALSE;
-    term->attr_mask = 0xffffffff;
-    term->resize_fn = NULL;
-    term->resize_ctx = NULL;
-    term->in_term_out = FALSE;
-    term->ltemp = NULL;
-    term->ltemp_size = 0;
-    term->wcFrom = NULL;
-    term->wcTo = NULL;
-    term->wcFromTo_size = 0;
+	/*
+	 * This line is the wrong length, which probably means it
+	 * hasn't been accessed since a resize. Resize it now.
+	 * 
+	 * First, go through all the characters that will be thrown
+	 * out in the resize (if we're shrinking the line) and
+	 * return their cc lists to the cc free list.
+	 */
+	for (i = cols; i < oldcols; i++)
+	    clear_cc(line, i);
 
-    term->window_update_pending = FALSE;
+	/*
+	 * If we're shrinking the line, we now bodily move the
+	 * entire cc section from where it started to where it now
+	 * needs to be. (We have to do this before the resize, so
+	 * that the data we're copying is still there. However, if
+	 * we're expanding, we have to wait until _after_ the
+	 * resize so that the space we're copying into is there.)
+	 */
+	if (cols < oldcols)
+	    memmove(line->chars + cols, line->chars + oldcols,
+		    (line->size - line->cols) * TSIZE);
 
-    term->bidi_cache_size = 0;
-    term->pre_bidi_cache = term->post_bidi_cache = NULL;
+	/*
+	 * Now do the actual resize, leaving the _same_ amount of
+	 * cc space as there was to begin with.
+	 */
+	line->chars = sresize_pooled(line->chars, line->size,
+				     line->size + cols - oldcols, TTYPE);
+	line->size += cols - oldcols;
+	line->cols = cols;
 
-    /* FULL-TERMCHAR */
-    term->basic_erase_char.chr = CSET_ASCII | ' ';
-    term->basic_erase_char.attr = ATTR_DEFAULT;
-    term->basic_erase_char.cc_next = 0;
-    term->erase_char = term->basic_erase_char;
+	/*
+	 * If we're expanding the line, _now_ we move the cc
+	 * section.
+	 */
+	if (cols > oldcols)
+	    memmove(line->chars + cols, line->chars + oldcols,
+		    (line->size - line->cols) * TSIZE);
 
-    return term;
-}
+	/*
+	 * The cc_next links in what's left of the original line
+	 * index the cc block rather than the line, so they are
+	 * still valid.
+	 */
 
-void term_free(Terminal *term)
-{
-    termline *line;
-    struct beeptime *beep;
-    int i;
+	/*
+	 * And finally fill in the new space with erase chars. (We
+	 * don't have to worry about cc lists here, because we
+	 * _know_ the erase char doesn't have one.)
+	 */
+	for (i = oldcols; i < cols; i++)
+	    line->chars[i] = term->basic_erase_char;
 
-    while ((line = delpos234(term->scrollback, 0)) != NULL)
-	sfree(line);		       /* compressed data, not a termline */
-    freetree234(term->scrollback);
-    while ((line = delpos234(term->screen, 0)) != NULL)
-	freeline(line);
-    freetree234(term->screen);
-    while ((line = delpos234(term->alt_screen, 0)) != NULL)
-	freeline(line);
-    freetree234(term->alt_screen);
-    if (term->disptext) {
-	for (i = 0; i < term->rows; i++)
-	    freeline(term->disptext[i]);
+#ifdef TERM_CC_DIAGS
+	cc_check(line);
+#endif
     }
-    sfree(term->disptext);
-    while (term->beephead) {
-	beep = term->beephead;
-	term->beephead = beep->next;
-	sfree(beep);
+}
+
+/*
+ * Get the number of lines in the scrollback.
+ */
+static int sblines(Terminal *term)
+{
+    int sblines = sb_count(term);
+    if (term->cfg.erase_to_scrollback &&
+	term->alt_which && term->alt_screen) {
+	    sblines += term->alt_sblines;
     }
-    bufchain_clear(&term->inbuf);
-    if(term->print_job)
-	printer_finish_job(term->print_job);
-    bufchain_clear(&term->printer_buf);
-    sfree(term->paste_buffer);
-    sfree(term->ltemp);
-    sfree(term->wcFrom);
-    sfree(term->wcTo);
+    return sblines;
+}
 
-    for (i = 0; i < term->bidi_cache_size; i++) {
-	sfree(term->pre_bidi_cache[i].chars);
-	sfree(term->post_bidi_cache[i].chars);
+/*
+ * Note that cells x0 to x1-1 of row i of the window may no longer
+ * match what disptext says is there, so the next do_paint() must
+ * look at them.
+ */
+static void disp_damage(Terminal *term, int i, int x0, int x1)
+{
+    struct termdamage *d;
+
+    if (!term->damage || i < 0 || i >= term->rows)
+	return;
+    if (x0 < 0)
+	x0 = 0;
+    if (x1 > term->cols)
+	x1 = term->cols;
+    if (x0 >= x1)
+	return;
+
+    d = &term->damage[i];
+    if (d->lo >= d->hi) {
+	d->lo = x0;
+	d->hi = x1;
+    } else {
+	if (d->lo > x0)
+	    d->lo = x0;
+	if (d->hi < x1)
+	    d->hi = x1;
     }
-    sfree(term->pre_bidi_cache);
-    sfree(term->post_bidi_cache);
+}
 
-    expire_timer_context(term);
+static void disp_damage_all(Terminal *term)
+{
+    int i;
 
-    sfree(term);
+    if (!term->damage)
+	return;
+    for (i = 0; i < term->rows; i++) {
+	term->damage[i].lo = 0;
+	term->damage[i].hi = term->cols;
+    }
 }
 
 /*
- * Set up the terminal for a given size.
+ * The same, in terms of a line of the screen or scrollback rather
+ * than a row of the window.
  */
-void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
+static void term_damage(Terminal *term, int y, int x0, int x1)
 {
-    tree234 *newalt;
-    termline **newdisp, *line;
-    int i, j, oldrows = term->rows;
-    int sblen;
-    int save_alt_which = term->alt_which;
-
-    if (newrows == term->rows && newcols == term->cols &&
-	newsavelines == term->savelines)
-	return;			       /* nothing to do */
+    disp_damage(term, y - term->disptop, x0, x1);
+}
 
-    /* Behave sensibly if we're given zero (or negative) rows/cols */
+/*
+ * Mark the whole of lines y0 to y1 inclusive, in either order.
+ */
+static void term_damage_lines(Terminal *term, int y0, int y1)
+{
+    int y;
 
-    if (newrows < 1) newrows = 1;
-    if (newcols < 1) newcols = 1;
+    if (y0 > y1) {
+	y = y0;
+	y0 = y1;
+	y1 = y;
+    }
+    if (y0 < term->disptop)
+	y0 = term->disptop;
+    if (y1 >= term->disptop + term->rows)
+	y1 = term->disptop + term->rows - 1;
+    for (y = y0; y <= y1; y++)
+	term_damage(term, y, 0, term->cols);
+}
 
-    deselect(term);
-    swap_screen(term, 0, FALSE, FALSE);
+/*
+ * Retrieve a line of the screen or of the scrollback, according to
+ * whether the y coordinate is non-negative or negative
+ * (respectively).
+ *
+ * scrlineptr() is for callers which may be about to modify the
+ * line, so it marks the whole of it as damaged. Anything which
+ * changes only a few cells can use lineptr() on the screen instead
+ * and call term_damage() itself.
+ */
+static termline *lineptr(Terminal *term, int y, int lineno, int screen)
+{
+    termline *line;
+    struct termscreen *whichscreen;
+    int index;
 
-    term->alt_t = term->marg_t = 0;
-    term->alt_b = term->marg_b = newrows - 1;
+    if (y >= 0) {
+	whichscreen = term->screen;
+	index = y;
+    } else {
+	int altlines = 0;
 
-    if (term->rows == -1) {
-	term->scrollback = newtree234(NULL);
-	term->screen = newtree234(NULL);
-	term->tempsblines = 0;
-	term->rows = 0;
-    }
+	assert(!screen);
 
-    /*
-     * Resize the screen and scrollback. We only need to shift
-     * lines around within our data structures, because lineptr()
-     * will take care of resizing each individual line if
-     * necessary. So:
-     * 
-     *  - If the new screen is longer, we shunt lines in from temporary
-     *    scrollback if possible, otherwise we add new blank lines at
-     *    the bottom.
-     *
-     *  - If the new screen is shorter, we remove any blank lines at
-     *    the bottom if possible, otherwise shunt lines above the cursor
-     *    to scrollback if possible, otherwise delete lines below the
-     *    cursor.
-     * 
-     *  - Then, if the new scrollback length is less than the
-     *    amount of scrollback we actually have, we must throw some
-     *    away.
-     */
-    sblen = count234(term->scrollback);
-    /* Do this loop to expand the screen if newrows > rows */
-    assert(term->rows == count234(term->screen));
-    while (term->rows < newrows) {
-	if (term->tempsblines > 0) {
-	    unsigned char *cline;
-	    /* Insert a line from the scrollback at the top of the screen. */
-	    assert(sblen >= term->tempsblines);
-	    cline = delpos234(term->scrollback, --sblen);
-	    line = decompressline(cline, NULL);
-	    sfree(cline);
-	    line->temporary = FALSE;   /* reconstituted line is now real */
-	    term->tempsblines -= 1;
-	    addpos234(term->screen, line, 0);
-	    term->curs.y += 1;
-	    term->savecurs.y += 1;
+	if (term->cfg.erase_to_scrollback &&
+	    term->alt_which && term->alt_screen) {
+	    altlines = term->alt_sblines;
+	}
+	if (y < -altlines) {
+	    whichscreen = NULL;
+	    index = y + altlines + sb_count(term);
 	} else {
-	    /* Add a new blank line at the bottom of the screen. */
-	    line = newline(term, newcols, FALSE);
-	    addpos234(term->screen, line, count234(term->screen));
+	    whichscreen = term->alt_screen;
+	    index = y + term->alt_sblines;
+	    /* index = y + term->alt_screen->rows; */
 	}
-	term->rows += 1;
     }
-    /* Do this loop to shrink the screen if newrows < rows */
-    while (term->rows > newrows) {
-	if (term->curs.y < term->rows - 1) {
+    if (!whichscreen) {
+	line = sb_getline(term, index);
+    } else if (index >= 0 && index < whichscreen->rows) {
+	line = screen_line(whichscreen, index);
+    } else {
+	line = NULL;
+    }
+
+    /* We assume that we don't screw up and retrieve something out of range. */
+    if (line == NULL) {
+	fatalbox("line==NULL in terminal.c\n"
+		 "lineno=%d y=%d w=%d h=%d\n"
+		 "count(scrollback=%p)=%d packed=%d\n"
+		 "count(screen=%p)=%d\n"
+		 "count(alt=%p)=%d alt_sblines=%d\n"
+		 "whichscreen=%p index=%d\n\n"
+		 "Please contact <putty@projects.tartarus.org> "
+		 "and pass on the above information.",
+		 lineno, y, term->cols, term->rows,
+		 term->scrollback, count234(term->scrollback), term->sbpacked,
+		 term->screen, term->screen->rows,
+		 term->alt_screen, term->alt_screen->rows, term->alt_sblines,
+		 whichscreen, index);
+    }
+    assert(line != NULL);
+
+    resizeline(term, line, term->cols);
+    /* FIXME: should we sort the compressed scrollback out here? */
+
+    if (screen)
+	term_damage(term, y, 0, term->cols);
+
+    return line;
+}
+
+#define lineptr(x) (lineptr)(term,x,__LINE__,FALSE)
+#define scrlineptr(x) (lineptr)(term,x,__LINE__,TRUE)
+
+static void term_schedule_tblink(Terminal *term);
+static void term_schedule_cblink(Terminal *term);
+
+static void term_timer(void *ctx, long now)
+{
+    Terminal *term = (Terminal *)ctx;
+    int update = FALSE;
+
+    if (term->tblink_pending && now - term->next_tblink >= 0) {
+	term->tblinker = !term->tblinker;
+	term->tblink_pending = FALSE;
+	term_schedule_tblink(term);
+	update = TRUE;
+    }
+
+    if (term->cblink_pending && now - term->next_cblink >= 0) {
+	term->cblinker = !term->cblinker;
+	term->cblink_pending = FALSE;
+	term_schedule_cblink(term);
+	update = TRUE;
+    }
+
+    if (term->in_vbell && now - term->vbell_end >= 0) {
+	term->in_vbell = FALSE;
+	update = TRUE;
+    }
+
+    if (update ||
+	(term->window_update_pending && now - term->next_update >= 0))
+	term_update(term);
+}
+
+static void term_schedule_update(Terminal *term)
+{
+    if (term->key_seen && GETTICKCOUNT() - term->key_time >= KEY_ECHO_WAIT)
+	term->key_seen = FALSE;	       /* no echo is coming */
+
+    if (!term->window_update_pending) {
+	int delay = (term->key_seen ? 0 : term->update_delay);
+
+	term->window_update_pending = TRUE;
+	term->next_update = schedule_timer(delay, term_timer, term);
+	if (delay > UPDATE_DELAY)
+	    term->frames_skipped += delay / UPDATE_DELAY - 1;
+    } else if (term->key_seen && term->next_update - GETTICKCOUNT() > 0) {
+	/*
+	 * An update is already on its way, but not soon enough for
+	 * the echo of a keypress. Bring it forward.
+	 */
+	term->next_update = schedule_timer(0, term_timer, term);
+    }
+}
+
+/*
+ * Call this whenever the terminal window state changes, to queue
+ * an update.
+ */
+static void seen_disp_event(Terminal *term)
+{
+    term->seen_disp_event = TRUE;      /* for scrollback-reset-on-activity */
+    term_schedule_update(term);
+}
+
+/*
+ * Call when the terminal's blinking-text settings change, or when
+ * a text blink has just occurred.
+ */
+static void term_schedule_tblink(Terminal *term)
+{
+    if (term->blink_is_real) {
+	if (!term->tblink_pending)
+	    term->next_tblink = schedule_timer(TBLINK_DELAY, term_timer, term);
+	term->tblink_pending = TRUE;
+    } else {
+	term->tblinker = 1;	       /* reset when not in use */
+	term->tblink_pending = FALSE;
+    }
+}
+
+/*
+ * Likewise with cursor blinks.
+ */
+static void term_schedule_cblink(Terminal *term)
+{
+    if (term->cfg.blink_cur && term->has_focus) {
+	if (!term->cblink_pending)
+	    term->next_cblink = schedule_timer(CBLINK_DELAY, term_timer, term);
+	term->cblink_pending = TRUE;
+    } else {
+	term->cblinker = 1;	       /* reset when not in use */
+	term->cblink_pending = FALSE;
+    }
+}
+
+/*
+ * Call to reset cursor blinking on new output.
+ */
+static void term_reset_cblink(Terminal *term)
+{
+    seen_disp_event(term);
+    term->cblinker = 1;
+    term->cblink_pending = FALSE;
+    term_schedule_cblink(term);
+}
+
+/*
+ * Call to begin a visual bell.
+ */
+static void term_schedule_vbell(Terminal *term, int already_started,
+				long startpoint)
+{
+    long ticks_already_gone;
+
+    if (already_started)
+	ticks_already_gone = GETTICKCOUNT() - startpoint;
+    else
+	ticks_already_gone = 0;
+
+    if (ticks_already_gone < VBELL_DELAY) {
+	term->in_vbell = TRUE;
+	term->vbell_end = schedule_timer(VBELL_DELAY - ticks_already_gone,
+					 term_timer, term);
+    } else {
+	term->in_vbell = FALSE;
+    }
+}
+
+/*
+ * Set up power-on settings for the terminal.
+ * If 'clear' is false, don't actually clear the primary screen, and
+ * position the cursor below the last non-blank line (scrolling if
+ * necessary).
+ */
+static void power_on(Terminal *term, int clear)
+{
+    term->alt_x = term->alt_y = 0;
+    term->savecurs.x = term->savecurs.y = 0;
+    term->alt_savecurs.x = term->alt_savecurs.y = 0;
+    term->alt_t = term->marg_t = 0;
+    if (term->rows != -1)
+	term->alt_b = term->marg_b = term->rows - 1;
+    else
+	term->alt_b = term->marg_b = 0;
+    if (term->cols != -1) {
+	int i;
+	for (i = 0; i < term->cols; i++)
+	    term->tabs[i] = (i % 8 == 0 ? TRUE : FALSE);
+    }
+    term->alt_om = term->dec_om = term->cfg.dec_om;
+    term->alt_ins = term->insert = FALSE;
+    term->alt_wnext = term->wrapnext =
+        term->save_wnext = term->alt_save_wnext = FALSE;
+    term->alt_wrap = term->wrap = term->cfg.wrap_mode;
+    term->alt_cset = term->cset = term->save_cset = term->alt_save_cset = 0;
+    term->alt_utf = term->utf = term->save_utf = term->alt_save_utf = 0;
+    term->utf_state = 0;
+    term->alt_sco_acs = term->sco_acs =
+        term->save_sco_acs = term->alt_save_sco_acs = 0;
+    term->cset_attr[0] = term->cset_attr[1] =
+        term->save_csattr = term->alt_save_csattr = CSET_ASCII;
+    term->rvideo = 0;
+    term->in_vbell = FALSE;
+    term->cursor_on = 1;
+    term->big_cursor = 0;
+    term->default_attr = term->save_attr =
+	term->alt_save_attr = term->curr_attr = ATTR_DEFAULT;
+    term->term_editing = term->term_echoing = FALSE;
+    term->app_cursor_keys = term->cfg.app_cursor;
+    term->app_keypad_keys = term->cfg.app_keypad;
+    term->use_bce = term->cfg.bce;
+    term->blink_is_real = term->cfg.blinktext;
+    term->erase_char = term->basic_erase_char;
+    term->alt_which = 0;
+    term_print_finish(term);
+    {
+	int i;
+	for (i = 0; i < 256; i++)
+	    term->wordness[i] = term->cfg.wordness[i];
+    }
+    if (term->screen) {
+	swap_screen(term, 1, FALSE, FALSE);
+	erase_lots(term, FALSE, TRUE, TRUE);
+	swap_screen(term, 0, FALSE, FALSE);
+	if (clear)
+	    erase_lots(term, FALSE, TRUE, TRUE);
+	term->curs.y = find_last_nonempty_line(term, term->screen) + 1;
+	if (term->curs.y == term->rows) {
+	    term->curs.y--;
+	    scroll(term, 0, term->rows - 1, 1, TRUE);
+	}
+    } else {
+	term->curs.y = 0;
+    }
+    term->curs.x = 0;
+    term_schedule_tblink(term);
+    term_schedule_cblink(term);
+}
+
+/*
+ * Force a screen update.
+ */
+void term_update(Terminal *term)
+{
+    Context ctx;
+    long ticks;
+
+    term->window_update_pending = FALSE;
+
+    ctx = get_ctx(term->frontend);
+    if (ctx) {
+	int need_sbar_update = term->seen_disp_event;
+	if (term->seen_disp_event && term->cfg.scroll_on_disp) {
+	    term->disptop = 0;	       /* return to main screen */
+	    term->seen_disp_event = 0;
+	    need_sbar_update = TRUE;
+	}
+
+	if (need_sbar_update)
+	    update_sbar(term);
+	ticks = GETTICKCOUNT();
+	do_paint(term, ctx, TRUE);
+	ticks = GETTICKCOUNT() - ticks;
+	sys_cursor(term->frontend, term->curs.x, term->curs.y - term->disptop);
+	free_ctx(ctx);
+
+	term->frames_painted++;
+	term->paint_ticks += ticks;
+
+	/*
+	 * GETTICKCOUNT() can be coarse (15-16ms on Windows), so a
+	 * single paint which happens to straddle a tick looks far
+	 * more expensive than it was. Judge the cost of painting by
+	 * a running average instead, which takes several expensive
+	 * paints in a row to push up. paint_cost is four times the
+	 * average, so that it doesn't lose too much to rounding.
+	 */
+	term->paint_cost += ticks - term->paint_cost / 4;
+
+	/*
+	 * If more than a screenful of output has gone by since the
+	 * last update, nobody could have read it all anyway; and if
+	 * painting is taking a good fraction of the time between
+	 * updates, it's slowing down term_out() for little gain. In
+	 * either case, update less often. Otherwise, work back
+	 * towards the normal rate.
+	 */
+	if (term->update_bytes >= (unsigned long)term->rows * term->cols ||
+	    term->paint_cost > term->update_delay) {
+	    term->update_delay *= 2;
+	    if (term->update_delay > MAX_UPDATE_DELAY)
+		term->update_delay = MAX_UPDATE_DELAY;
+	} else if (term->update_delay > UPDATE_DELAY) {
+	    term->update_delay /= 2;
+	    if (term->update_delay < UPDATE_DELAY)
+		term->update_delay = UPDATE_DELAY;
+	}
+	term->update_bytes = 0;
+    }
+}
+
+/*
+ * Called from front end when a keypress occurs, to trigger
+ * anything magical that needs to happen in that situation.
+ */
+void term_seen_key_event(Terminal *term)
+{
+    /*
+     * On any keypress, clear the bell overload mechanism
+     * completely, on the grounds that large numbers of
+     * beeps coming from deliberate key action are likely
+     * to be intended (e.g. beeps from filename completion
+     * blocking repeatedly).
+     */
+    term->beep_overloaded = FALSE;
+    while (term->beephead) {
+	struct beeptime *tmp = term->beephead;
+	term->beephead = tmp->next;
+	sfree(tmp);
+    }
+    term->beeptail = NULL;
+    term->nbeeps = 0;
+
+    /*
+     * Whatever the keypress makes happen on the screen, the user
+     * will want to see it as soon as possible.
+     */
+    term->key_seen = TRUE;
+    term->key_time = GETTICKCOUNT();
+
+    /*
+     * Reset the scrollback on keypress, if we're doing that.
+     */
+    if (term->cfg.scroll_on_key) {
+	term->disptop = 0;	       /* return to main screen */
+	seen_disp_event(term);
+    }
+}
+
+/*
+ * Same as power_on(), but an external function.
+ */
+void term_pwron(Terminal *term, int clear)
+{
+    power_on(term, clear);
+    if (term->ldisc)		       /* cause ldisc to notice changes */
+	ldisc_send(term->ldisc, NULL, 0, 0);
+    term->disptop = 0;
+    deselect(term);
+    term_update(term);
+}
+
+static void set_erase_char(Terminal *term)
+{
+    term->erase_char = term->basic_erase_char;
+    if (term->use_bce)
+	term->erase_char.attr = (term->curr_attr &
+				 (ATTR_FGMASK | ATTR_BGMASK));
+}
+
+/*
+ * When the user reconfigures us, we need to check the forbidden-
+ * alternate-screen config option, disable raw mouse mode if the
+ * user has disabled mouse reporting, and abandon a print job if
+ * the user has disabled printing.
+ */
+void term_reconfig(Terminal *term, Config *cfg)
+{
+    /*
+     * Before adopting the new config, check all those terminal
+     * settings which control power-on defaults; and if they've
+     * changed, we will modify the current state as well as the
+     * default one. The full list is: Auto wrap mode, DEC Origin
+     * Mode, BCE, blinking text, character classes.
+     */
+    int reset_wrap, reset_decom, reset_bce, reset_tblink, reset_charclass;
+    int i;
+
+    reset_wrap = (term->cfg.wrap_mode != cfg->wrap_mode);
+    reset_decom = (term->cfg.dec_om != cfg->dec_om);
+    reset_bce = (term->cfg.bce != cfg->bce);
+    reset_tblink = (term->cfg.blinktext != cfg->blinktext);
+    reset_charclass = 0;
+    for (i = 0; i < lenof(term->cfg.wordness); i++)
+	if (term->cfg.wordness[i] != cfg->wordness[i])
+	    reset_charclass = 1;
+
+    /*
+     * If the bidi or shaping settings have changed, flush the bidi
+     * cache completely.
+     */
+    if (term->cfg.arabicshaping != cfg->arabicshaping ||
+	term->cfg.bidi != cfg->bidi) {
+	for (i = 0; i < term->bidi_cache_size; i++) {
+	    sfree(term->pre_bidi_cache[i].chars);
+	    sfree(term->post_bidi_cache[i].chars);
+	    term->pre_bidi_cache[i].width = -1;
+	    term->pre_bidi_cache[i].chars = NULL;
+	    term->post_bidi_cache[i].width = -1;
+	    term->post_bidi_cache[i].chars = NULL;
+	}
+    }
+
+    term->cfg = *cfg;		       /* STRUCTURE COPY */
+    disp_damage_all(term);	       /* colour options may have changed */
+
+    if (reset_wrap)
+	term->alt_wrap = term->wrap = term->cfg.wrap_mode;
+    if (reset_decom)
+	term->alt_om = term->dec_om = term->cfg.dec_om;
+    if (reset_bce) {
+	term->use_bce = term->cfg.bce;
+	set_erase_char(term);
+    }
+    if (reset_tblink) {
+	term->blink_is_real = term->cfg.blinktext;
+    }
+    if (reset_charclass)
+	for (i = 0; i < 256; i++)
+	    term->wordness[i] = term->cfg.wordness[i];
+
+    if (term->cfg.no_alt_screen)
+	swap_screen(term, 0, FALSE, FALSE);
+    if (term->cfg.no_mouse_rep) {
+	term->xterm_mouse = 0;
+	set_raw_mouse_mode(term->frontend, 0);
+    }
+    if (term->cfg.no_remote_charset) {
+	term->cset_attr[0] = term->cset_attr[1] = CSET_ASCII;
+	term->sco_acs = term->alt_sco_acs = 0;
+	term->utf = 0;
+    }
+    if (!*term->cfg.printer) {
+	term_print_finish(term);
+    }
+    term_schedule_tblink(term);
+    term_schedule_cblink(term);
+}
+
+/*
+ * Clear the scrollback.
+ */
+void term_clrsb(Terminal *term)
+{
+    term->disptop = 0;
+    sb_free_all(term);
+    term->tempsblines = 0;
+    term->alt_sblines = 0;
+    update_sbar(term);
+}
+
+/*
+ * Initialise the terminal.
+ */
+Terminal *term_init(Config *mycfg, struct unicode_data *ucsdata,
+		    void *frontend)
+{
+    Terminal *term;
+
+    /*
+     * Allocate a new Terminal structure and initialise the fields
+     * that need it.
+     */
+    term = snew(Terminal);
+    term->frontend = frontend;
+    term->ucsdata = ucsdata;
+    term->cfg = *mycfg;		       /* STRUCTURE COPY */
+    term->logctx = NULL;
+    term->compatibility_level = TM_PUTTY;
+    strcpy(term->id_string, "\033[?6c");
+    term->cblink_pending = term->tblink_pending = FALSE;
+    term->paste_buffer = NULL;
+    term->paste_len = 0;
+    term->last_paste = 0;
+    bufchain_init(&term->inbuf);
+    bufchain_init(&term->printer_buf);
+    term->printing = term->only_printing = FALSE;
+    term->print_job = NULL;
+    term->vt52_mode = FALSE;
+    term->cr_lf_return = FALSE;
+    term->seen_disp_event = FALSE;
+    term->xterm_mouse = term->mouse_is_down = FALSE;
+    term->reset_132 = FALSE;
+    term->cblinker = term->tblinker = 0;
+    term->has_focus = 1;
+    term->repeat_off = FALSE;
+    term->termstate = TOPLEVEL;
+    term->selstate = NO_SELECTION;
+    term->curstype = 0;
+
+    term->screen = term->alt_screen = NULL;
+    term->scrollback = NULL;
+    term->tempsblines = 0;
+    term->sbhead = term->sbtail = NULL;
+    term->sbchunks = 0;
+    term->sbbytes = 0;
+    term->sbbuf = NULL;
+    term->sbbufsize = 0;
+    term->sbpages = newtree234(NULL);
+    term->sbpacked = term->sbpageskip = 0;
+    term->sbpagebytes = 0;
+    term->sbcachepage = NULL;
+    term->sbcache = NULL;
+    term->sbcachesize = 0;
+    term->sbfile = NULL;
+    term->sbspilled = 0;
+    term->sbfileend = term->sbfilelive = 0;
+    term->sbfilefailed = FALSE;
+    term->sbpend = term->sbspare = NULL;
+    term->sbpendsize = term->sbpendstart = term->sbpendcount = 0;
+    term->sbsparecount = 0;
+    term->sbfirst = 0;
+    term->sblcache = NULL;
+    term->sblcache_hits = term->sblcache_misses = 0;
+    term->alt_sblines = 0;
+    term->disptop = 0;
+    term->disptext = NULL;
+    term->dispcursx = term->dispcursy = -1;
+    term->damage = NULL;
+    term->disp_top = term->disp_rv = term->disp_blink = 0;
+    term->disp_sel = FALSE;
+    term->tabs = NULL;
+    deselect(term);
+    term->rows = term->cols = -1;
+    power_on(term, TRUE);
+    term->beephead = term->beeptail = NULL;
+#ifdef OPTIMISE_SCROLL
+    term->scrollhead = term->scrolltail = NULL;
+#endif /* OPTIMISE_SCROLL */
+    term->nbeeps = 0;
+    term->lastbeep = FALSE;
+    term->beep_overloaded = FALSE;
+    term->attr_mask = 0xffffffff;
+    term->resize_fn = NULL;
+    term->resize_ctx = NULL;
+    term->in_term_out = FALSE;
+    term->ltemp = NULL;
+    term->ltemp_size = 0;
+    term->wcFrom = NULL;
+    term->wcTo = NULL;
+    term->wcFromTo_size = 0;
+
+    term->window_update_pending = FALSE;
+    term->update_delay = UPDATE_DELAY;
+    term->paint_cost = 0;
+    term->update_bytes = 0;
+    term->key_seen = FALSE;
+    term->frames_painted = term->frames_skipped = 0;
+    term->paint_ticks = 0;
+
+    term->bidi_cache_size = 0;
+    term->pre_bidi_cache = term->post_bidi_cache = NULL;
+
+    /* FULL-TERMCHAR */
+    term->basic_erase_char.chr = CSET_ASCII | ' ';
+    term->basic_erase_char.attr = ATTR_DEFAULT;
+    term->basic_erase_char.cc_next = 0;
+    term->erase_char = term->basic_erase_char;
+
+    return term;
+}
+
+void term_free(Terminal *term)
+{
+    struct sbpage *pg;
+    struct beeptime *beep;
+    int i;
+
+    freetree234(term->scrollback);     /* lines are in the sbchunks */
+    while (term->sbhead)
+	sb_free_chunk(term, term->sbhead);
+    sfree(term->sbbuf);
+    sb_uncache_all(term);
+    sfree(term->sblcache);
+    for (i = 0; i < term->sbpendcount; i++)
+	freeline(sb_pending(term, i));
+    sfree(term->sbpend);
+    while (term->sbsparecount > 0)
+	freeline(term->sbspare[--term->sbsparecount]);
+    sfree(term->sbspare);
+    if (term->sbfile)
+	fclose(term->sbfile);
+    term->sbfile = NULL;
+    while ((pg = delpos234(term->sbpages, 0)) != NULL)
+	sb_free_page(term, pg);
+    freetree234(term->sbpages);
+    sfree(term->sbcache);
+    freescreen(term->screen);
+    freescreen(term->alt_screen);
+    if (term->disptext) {
+	for (i = 0; i < term->rows; i++)
+	    freeline(term->disptext[i]);
+    }
+    sfree(term->disptext);
+    sfree(term->damage);
+    while (term->beephead) {
+	beep = term->beephead;
+	term->beephead = beep->next;
+	sfree(beep);
+    }
+    bufchain_clear(&term->inbuf);
+    if(term->print_job)
+	printer_finish_job(term->print_job);
+    bufchain_clear(&term->printer_buf);
+    sfree(term->paste_buffer);
+    sfree(term->ltemp);
+    sfree(term->wcFrom);
+    sfree(term->wcTo);
+
+    for (i = 0; i < term->bidi_cache_size; i++) {
+	sfree(term->pre_bidi_cache[i].chars);
+	sfree(term->post_bidi_cache[i].chars);
+    }
+    sfree(term->pre_bidi_cache);
+    sfree(term->post_bidi_cache);
+
+    expire_timer_context(term);
+
+    sfree(term);
+}
+
+/*
+ * Set up the terminal for a given size.
+ */
+void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
+{
+    struct termscreen *newalt;
+    termline **newdisp, *line;
+    int i, j, oldrows = term->rows;
+    int sblen;
+    int save_alt_which = term->alt_which;
+
+    if (newrows == term->rows && newcols == term->cols &&
+	newsavelines == term->savelines)
+	return;			       /* nothing to do */
+
+    /* Behave sensibly if we're given zero (or negative) rows/cols */
+
+    if (newrows < 1) newrows = 1;
+    if (newcols < 1) newcols = 1;
+
+    deselect(term);
+    swap_screen(term, 0, FALSE, FALSE);
+
+    /* lines in the cache have been resized to the old width */
+    sb_uncache_all(term);
+    sb_flush(term);
+
+    term->alt_t = term->marg_t = 0;
+    term->alt_b = term->marg_b = newrows - 1;
+
+    if (term->rows == -1) {
+	term->scrollback = newtree234(NULL);
+	term->screen = newscreen();
+	term->tempsblines = 0;
+	term->rows = 0;
+    }
+
+    /*
+     * Resize the screen and scrollback. We only need to shift
+     * lines around within our data structures, because lineptr()
+     * will take care of resizing each individual line if
+     * necessary. So:
+     * 
+     *  - If the new screen is longer, we shunt lines in from temporary
+     *    scrollback if possible, otherwise we add new blank lines at
+     *    the bottom.
+     *
+     *  - If the new screen is shorter, we remove any blank lines at
+     *    the bottom if possible, otherwise shunt lines above the cursor
+     *    to scrollback if possible, otherwise delete lines below the
+     *    cursor.
+     * 
+     *  - Then, if the new scrollback length is less than the
+     *    amount of scrollback we actually have, we must throw some
+     *    away.
+     */
+    sblen = sb_count(term);
+    /* Do this loop to expand the screen if newrows > rows */
+    assert(term->rows == term->screen->rows);
+    while (term->rows < newrows) {
+	if (term->tempsblines > 0) {
+	    /* Insert a line from the scrollback at the top of the screen. */
+	    assert(sblen >= term->tempsblines);
+	    line = sb_take_newest(term);
+	    sblen--;
+	    line->temporary = FALSE;   /* reconstituted line is now real */
+	    term->tempsblines -= 1;
+	    screen_insert(term->screen, line, 0);
+	    term->curs.y += 1;
+	    term->savecurs.y += 1;
+	} else {
+	    /* Add a new blank line at the bottom of the screen. */
+	    line = newline(term, newcols, FALSE);
+	    screen_insert(term->screen, line, term->screen->rows);
+	}
+	term->rows += 1;
+    }
+    /* Do this loop to shrink the screen if newrows < rows */
+    while (term->rows > newrows) {
+	if (term->curs.y < term->rows - 1) {
 	    /* delete bottom row, unless it contains the cursor */
-	    sfree(delpos234(term->screen, term->rows - 1));
+	    freeline(screen_remove(term->screen, term->rows - 1));
 	} else {
 	    /* push top row to scrollback */
-	    line = delpos234(term->screen, 0);
-	    addpos234(term->scrollback, compressline(line), sblen++);
+	    line = screen_remove(term->screen, 0);
+	    sb_add(term, compressline(term, line));
+	    sblen++;
 	    freeline(line);
 	    term->tempsblines += 1;
 	    term->curs.y -= 1;
 	    term->savecurs.y -= 1;
 	}
-	term->rows -= 1;
+	term->rows -= 1;
+    }
+    assert(term->rows == newrows);
+    assert(term->screen->rows == newrows);
+
+    /* Delete any excess lines from the scrollback. */
+    if (sblen > newsavelines) {
+	sb_trim(term, sblen - newsavelines);
+	sblen = newsavelines;
+    }
+    if (sblen < term->tempsblines)
+	term->tempsblines = sblen;
+    assert(sb_count(term) <= newsavelines);
+    assert(sb_count(term) >= term->tempsblines);
+    term->disptop = 0;
+
+    /* Make a new displayed text buffer. */
+    newdisp = snewn(newrows, termline *);
+    for (i = 0; i < newrows; i++) {
+	newdisp[i] = newline(term, newcols, FALSE);
+	for (j = 0; j < newcols; j++)
+	    newdisp[i]->chars[j].attr = ATTR_INVALID;
+    }
+    if (term->disptext) {
+	for (i = 0; i < oldrows; i++)
+	    freeline(term->disptext[i]);
+    }
+    sfree(term->disptext);
+    term->disptext = newdisp;
+    term->dispcursx = term->dispcursy = -1;
+    term->damage = sresize(term->damage, newrows, struct termdamage);
+    for (i = 0; i < newrows; i++) {
+	term->damage[i].lo = 0;
+	term->damage[i].hi = newcols;
+	term->damage[i].blink = FALSE;
+    }
+
+    /* Make a new alternate screen. */
+    newalt = newscreen();
+    newalt->lines = snewn(newrows, termline *);
+    for (i = 0; i < newrows; i++)
+	newalt->lines[i] = newline(term, newcols, TRUE);
+    newalt->rows = newrows;
+    freescreen(term->alt_screen);
+    term->alt_screen = newalt;
+    term->alt_sblines = 0;
+
+    term->tabs = sresize(term->tabs, newcols, unsigned char);
+    {
+	int i;
+	for (i = (term->cols > 0 ? term->cols : 0); i < newcols; i++)
+	    term->tabs[i] = (i % 8 == 0 ? TRUE : FALSE);
+    }
+
+    /* Check that the cursor positions are still valid. */
+    if (term->savecurs.y < 0)
+	term->savecurs.y = 0;
+    if (term->savecurs.y >= newrows)
+	term->savecurs.y = newrows - 1;
+    if (term->curs.y < 0)
+	term->curs.y = 0;
+    if (term->curs.y >= newrows)
+	term->curs.y = newrows - 1;
+    if (term->curs.x >= newcols)
+	term->curs.x = newcols - 1;
+    term->alt_x = term->alt_y = 0;
+    term->wrapnext = term->alt_wnext = FALSE;
+
+    term->rows = newrows;
+    term->cols = newcols;
+    term->savelines = newsavelines;
+
+    swap_screen(term, save_alt_which, FALSE, FALSE);
+
+    update_sbar(term);
+    term_update(term);
+    if (term->resize_fn)
+	term->resize_fn(term->resize_ctx, term->cols, term->rows);
+}
+
+/*
+ * Hand a function and context pointer to the terminal which it can
+ * use to notify a back end of resizes.
+ */
+void term_provide_resize_fn(Terminal *term,
+			    void (*resize_fn)(void *, int, int),
+			    void *resize_ctx)
+{
+    term->resize_fn = resize_fn;
+    term->resize_ctx = resize_ctx;
+    if (resize_fn && term->cols > 0 && term->rows > 0)
+	resize_fn(resize_ctx, term->cols, term->rows);
+}
+
+/* Find the bottom line on the screen that has any content.
+ * If only the top line has content, returns 0.
+ * If no lines have content, return -1.
+ */ 
+static int find_last_nonempty_line(Terminal * term,
+				   struct termscreen * screen)
+{
+    int i;
+    for (i = screen->rows - 1; i >= 0; i--) {
+	termline *line = screen_line(screen, i);
+	int j;
+	for (j = 0; j < line->cols; j++)
+	    if (!termchars_equal(&line->chars[j], CC_AREA(line),
+				 &term->erase_char, NULL))
+		break;
+	if (j != line->cols) break;
+    }
+    return i;
+}
+
+/*
+ * Swap screens. If `reset' is TRUE and we have been asked to
+ * switch to the alternate screen, we must bring most of its
+ * configuration from the main screen and erase the contents of the
+ * alternate screen completely. (This is even true if we're already
+ * on it! Blame xterm.)
+ */
+static void swap_screen(Terminal *term, int which, int reset, int keep_cur_pos)
+{
+    int t;
+    pos tp;
+    struct termscreen *ttr;
+
+    if (!which)
+	reset = FALSE;		       /* do no weird resetting if which==0 */
+
+    if (which != term->alt_which) {
+	term->alt_which = which;
+	disp_damage_all(term);
+
+	ttr = term->alt_screen;
+	term->alt_screen = term->screen;
+	term->screen = ttr;
+	term->alt_sblines = find_last_nonempty_line(term, term->alt_screen) + 1;
+	t = term->curs.x;
+	if (!reset && !keep_cur_pos)
+	    term->curs.x = term->alt_x;
+	term->alt_x = t;
+	t = term->curs.y;
+	if (!reset && !keep_cur_pos)
+	    term->curs.y = term->alt_y;
+	term->alt_y = t;
+	t = term->marg_t;
+	if (!reset) term->marg_t = term->alt_t;
+	term->alt_t = t;
+	t = term->marg_b;
+	if (!reset) term->marg_b = term->alt_b;
+	term->alt_b = t;
+	t = term->dec_om;
+	if (!reset) term->dec_om = term->alt_om;
+	term->alt_om = t;
+	t = term->wrap;
+	if (!reset) term->wrap = term->alt_wrap;
+	term->alt_wrap = t;
+	t = term->wrapnext;
+	if (!reset) term->wrapnext = term->alt_wnext;
+	term->alt_wnext = t;
+	t = term->insert;
+	if (!reset) term->insert = term->alt_ins;
+	term->alt_ins = t;
+	t = term->cset;
+	if (!reset) term->cset = term->alt_cset;
+	term->alt_cset = t;
+	t = term->utf;
+	if (!reset) term->utf = term->alt_utf;
+	term->alt_utf = t;
+	t = term->sco_acs;
+	if (!reset) term->sco_acs = term->alt_sco_acs;
+	term->alt_sco_acs = t;
+
+	tp = term->savecurs;
+	if (!reset && !keep_cur_pos)
+	    term->savecurs = term->alt_savecurs;
+	term->alt_savecurs = tp;
+        t = term->save_cset;
+        if (!reset && !keep_cur_pos)
+            term->save_cset = term->alt_save_cset;
+        term->alt_save_cset = t;
+        t = term->save_csattr;
+        if (!reset && !keep_cur_pos)
+            term->save_csattr = term->alt_save_csattr;
+        term->alt_save_csattr = t;
+        t = term->save_attr;
+        if (!reset && !keep_cur_pos)
+            term->save_attr = term->alt_save_attr;
+        term->alt_save_attr = t;
+        t = term->save_utf;
+        if (!reset && !keep_cur_pos)
+            term->save_utf = term->alt_save_utf;
+        term->alt_save_utf = t;
+        t = term->save_wnext;
+        if (!reset && !keep_cur_pos)
+            term->save_wnext = term->alt_save_wnext;
+        term->alt_save_wnext = t;
+        t = term->save_sco_acs;
+        if (!reset && !keep_cur_pos)
+            term->save_sco_acs = term->alt_save_sco_acs;
+        term->alt_save_sco_acs = t;
+    }
+
+    if (reset && term->screen) {
+	/*
+	 * Yes, this _is_ supposed to honour background-colour-erase.
+	 */
+	erase_lots(term, FALSE, TRUE, TRUE);
+    }
+}
+
+/*
+ * Update the scroll bar.
+ */
+static void update_sbar(Terminal *term)
+{
+    int nscroll = sblines(term);
+    set_sbar(term->frontend, nscroll + term->rows,
+	     nscroll + term->disptop, term->rows);
+}
+
+/*
+ * Check whether the region bounded by the two pointers intersects
+ * the scroll region, and de-select the on-screen selection if so.
+ */
+static void check_selection(Terminal *term, pos from, pos to)
+{
+    if (poslt(from, term->selend) && poslt(term->selstart, to))
+	deselect(term);
+}
+
+/*
+ * Scroll the screen. (`lines' is +ve for scrolling forward, -ve
+ * for backward.) `sb' is TRUE if the scrolling is permitted to
+ * affect the scrollback buffer.
+ */
+static void scroll(Terminal *term, int topline, int botline, int lines, int sb)
+{
+    termline *line;
+    int i, k, n, seltop, olddisptop, shift;
+
+    if (topline != 0 || term->alt_which != 0)
+	sb = FALSE;
+
+    olddisptop = term->disptop;
+    shift = lines;
+    n = botline - topline + 1;
+
+    /*
+     * Each line that scrolls out of the region is blanked and reused
+     * for the line scrolling in at the other end. We do that to the
+     * lines where they stand and then rotate the region once. If we
+     * scroll by more than the region's height, the blanked lines go
+     * round again (and, if sb, into the scrollback, just as they
+     * would have if we had scrolled one line at a time).
+     */
+    if (lines < 0) {
+	for (k = 0; k < -lines && k < n; k++) {
+	    line = screen_line(term->screen, botline - k);
+            resizeline(term, line, term->cols);
+	    for (i = 0; i < term->cols; i++)
+		copy_termchar(line, i, &term->erase_char, NULL);
+	    line->lattr = LATTR_NORM;
+	}
+	screen_rotate(term->screen, topline, botline, n - (-lines % n));
+
+	if (term->selstart.y >= topline && term->selstart.y <= botline) {
+	    term->selstart.y -= lines;
+	    if (term->selstart.y > botline) {
+		term->selstart.y = botline + 1;
+		term->selstart.x = 0;
+	    }
+	}
+	if (term->selend.y >= topline && term->selend.y <= botline) {
+	    term->selend.y -= lines;
+	    if (term->selend.y > botline) {
+		term->selend.y = botline + 1;
+		term->selend.x = 0;
+	    }
+	}
+    } else if (lines > 0) {
+	for (k = 0; k < lines; k++) {
+	    line = screen_line(term->screen, topline + k % n);
+#ifdef TERM_CC_DIAGS
+	    cc_check(line);
+#endif
+	    if (sb && term->savelines > 0) {
+		termline *blank = NULL;
+		int sblen = sb_count(term);
+		/*
+		 * We must add this line to the scrollback. We'll
+		 * remove a line from the top of the scrollback if
+		 * the scrollback is full.
+		 */
+		if (sblen == term->savelines) {
+		    sblen--;
+		    blank = sb_drop_oldest(term);
+		} else
+		    term->tempsblines += 1;
+
+		sb_push(term, line);
+
+		/* a spare line takes its place, to become the bottom line */
+		line = blank ? blank : sb_spare(term);
+		screen_line(term->screen, topline + k % n) = line;
+	    } else if (k >= n) {
+		continue;	       /* already blank */
+	    }
+            resizeline(term, line, term->cols);
+	    for (i = 0; i < term->cols; i++)
+		copy_termchar(line, i, &term->erase_char, NULL);
+	    line->lattr = LATTR_NORM;
+	}
+	screen_rotate(term->screen, topline, botline, lines % n);
+
+	/*
+	 * If the user is currently looking at part of the
+	 * scrollback, and they haven't enabled any options that
+	 * are going to reset the scrollback as a result of this
+	 * movement, then the chances are they'd like to keep
+	 * looking at the same line. So we move their viewpoint at
+	 * the same rate as the scroll, at least until their
+	 * viewpoint hits the top end of the scrollback buffer, at
+	 * which point we don't have the choice any more.
+	 * 
+	 * Thanks to Jan Holmen Holsten for the idea and initial
+	 * implementation.
+	 */
+	if (sb && term->savelines > 0 &&
+	    term->disptop > -term->savelines && term->disptop < 0) {
+	    term->disptop -= lines;
+	    if (term->disptop < -term->savelines)
+		term->disptop = -term->savelines;
+	}
+
+	/*
+	 * If the selection endpoints move into the scrollback, we
+	 * keep them moving until they hit the top. However, of
+	 * course, if the line _hasn't_ moved into the scrollback
+	 * then we don't do this, and cut them off at the top of
+	 * the scroll region.
+	 * 
+	 * This applies to selstart and selend (for an existing
+	 * selection), and also selanchor (for one being selected
+	 * as we speak).
+	 */
+	seltop = sb ? -term->savelines : topline;
+
+	if (term->selstate != NO_SELECTION) {
+	    if (term->selstart.y >= seltop &&
+		term->selstart.y <= botline) {
+		term->selstart.y -= lines;
+		if (term->selstart.y < seltop) {
+		    term->selstart.y = seltop;
+		    term->selstart.x = 0;
+		}
+	    }
+	    if (term->selend.y >= seltop && term->selend.y <= botline) {
+		term->selend.y -= lines;
+		if (term->selend.y < seltop) {
+		    term->selend.y = seltop;
+		    term->selend.x = 0;
+		}
+	    }
+	    if (term->selanchor.y >= seltop &&
+		term->selanchor.y <= botline) {
+		term->selanchor.y -= lines;
+		if (term->selanchor.y < seltop) {
+		    term->selanchor.y = seltop;
+		    term->selanchor.x = 0;
+		}
+	    }
+	}
+    }
+
+    /*
+     * The whole region needs repainting; and if any scrollback is in
+     * view, what's visible of it may have moved as well.
+     */
+    if (sb && term->disptop < 0)
+	disp_damage_all(term);
+    else
+	for (i = topline; i <= botline; i++)
+	    term_damage(term, i, 0, term->cols);
+#ifdef OPTIMISE_SCROLL
+    shift += term->disptop - olddisptop;
+    if (shift < term->rows && shift > -term->rows && shift != 0)
+	scroll_display(term, topline, botline, shift);
+#endif /* OPTIMISE_SCROLL */
+}
+
+#ifdef OPTIMISE_SCROLL
+/*
+ * Add a scroll of a region on the screen into the pending scroll list.
+ * `lines' is +ve for scrolling forward, -ve for backward.
+ *
+ * If the scroll is on the same area as the last scroll in the list,
+ * merge them.
+ */
+static void save_scroll(Terminal *term, int topline, int botline, int lines)
+{
+    struct scrollregion *newscroll;
+    if (term->scrolltail &&
+	term->scrolltail->topline == topline && 
+	term->scrolltail->botline == botline) {
+	term->scrolltail->lines += lines;
+    } else {
+	newscroll = snew(struct scrollregion);
+	newscroll->topline = topline;
+	newscroll->botline = botline;
+	newscroll->lines = lines;
+	newscroll->next = NULL;
+
+	if (!term->scrollhead)
+	    term->scrollhead = newscroll;
+	else
+	    term->scrolltail->next = newscroll;
+	term->scrolltail = newscroll;
+    }
+}
+
+/*
+ * Scroll the physical display, and our conception of it in disptext.
+ */
+static void scroll_display(Terminal *term, int topline, int botline, int lines)
+{
+    int distance, nlines, i, j;
+
+    distance = lines > 0 ? lines : -lines;
+    nlines = botline - topline + 1 - distance;
+    if (lines > 0) {
+	for (i = 0; i < nlines; i++)
+	    for (j = 0; j < term->cols; j++)
+		copy_termchar(term->disptext[i], j,
+			      term->disptext[i+distance]->chars+j,
+			      CC_AREA(term->disptext[i+distance]));
+	if (term->dispcursy >= 0 &&
+	    term->dispcursy >= topline + distance &&
+	    term->dispcursy < topline + distance + nlines)
+	    term->dispcursy -= distance;
+	for (i = 0; i < distance; i++)
+	    for (j = 0; j < term->cols; j++)
+		term->disptext[nlines+i]->chars[j].attr |= ATTR_INVALID;
+    } else {
+	for (i = nlines; i-- ;)
+	    for (j = 0; j < term->cols; j++)
+		copy_termchar(term->disptext[i+distance], j,
+			      term->disptext[i]->chars+j,
+			      CC_AREA(term->disptext[i]));
+	if (term->dispcursy >= 0 &&
+	    term->dispcursy >= topline &&
+	    term->dispcursy < topline + nlines)
+	    term->dispcursy += distance;
+	for (i = 0; i < distance; i++)
+	    for (j = 0; j < term->cols; j++)
+		term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+    }
+    save_scroll(term, topline, botline, lines);
+}
+#endif /* OPTIMISE_SCROLL */
+
+/*
+ * Move the cursor to a given position, clipping at boundaries. We
+ * may or may not want to clip at the scroll margin: marg_clip is 0
+ * not to, 1 to disallow _passing_ the margins, and 2 to disallow
+ * even _being_ outside the margins.
+ */
+static void move(Terminal *term, int x, int y, int marg_clip)
+{
+    if (x < 0)
+	x = 0;
+    if (x >= term->cols)
+	x = term->cols - 1;
+    if (marg_clip) {
+	if ((term->curs.y >= term->marg_t || marg_clip == 2) &&
+	    y < term->marg_t)
+	    y = term->marg_t;
+	if ((term->curs.y <= term->marg_b || marg_clip == 2) &&
+	    y > term->marg_b)
+	    y = term->marg_b;
+    }
+    if (y < 0)
+	y = 0;
+    if (y >= term->rows)
+	y = term->rows - 1;
+    term->curs.x = x;
+    term->curs.y = y;
+    term->wrapnext = FALSE;
+}
+
+/*
+ * Save or restore the cursor and SGR mode.
+ */
+static void save_cursor(Terminal *term, int save)
+{
+    if (save) {
+	term->savecurs = term->curs;
+	term->save_attr = term->curr_attr;
+	term->save_cset = term->cset;
+	term->save_utf = term->utf;
+	term->save_wnext = term->wrapnext;
+	term->save_csattr = term->cset_attr[term->cset];
+	term->save_sco_acs = term->sco_acs;
+    } else {
+	term->curs = term->savecurs;
+	/* Make sure the window hasn't shrunk since the save */
+	if (term->curs.x >= term->cols)
+	    term->curs.x = term->cols - 1;
+	if (term->curs.y >= term->rows)
+	    term->curs.y = term->rows - 1;
+
+	term->curr_attr = term->save_attr;
+	term->cset = term->save_cset;
+	term->utf = term->save_utf;
+	term->wrapnext = term->save_wnext;
+	/*
+	 * wrapnext might reset to False if the x position is no
+	 * longer at the rightmost edge.
+	 */
+	if (term->wrapnext && term->curs.x < term->cols-1)
+	    term->wrapnext = FALSE;
+	term->cset_attr[term->cset] = term->save_csattr;
+	term->sco_acs = term->save_sco_acs;
+	set_erase_char(term);
+    }
+}
+
+/*
+ * This function is called before doing _anything_ which affects
+ * only part of a line of text. It is used to mark the boundary
+ * between two character positions, and it indicates that some sort
+ * of effect is going to happen on only one side of that boundary.
+ * 
+ * The effect of this function is to check whether a CJK
+ * double-width character is straddling the boundary, and to remove
+ * it and replace it with two spaces if so. (Of course, one or
+ * other of those spaces is then likely to be replaced with
+ * something else again, as a result of whatever happens next.)
+ * 
+ * Also, if the boundary is at the right-hand _edge_ of the screen,
+ * it implies something deliberate is being done to the rightmost
+ * column position; hence we must clear LATTR_WRAPPED2.
+ * 
+ * The input to the function is the coordinates of the _second_
+ * character of the pair.
+ */
+static void check_boundary(Terminal *term, int x, int y)
+{
+    termline *ldata;
+
+    /* Validate input coordinates, just in case. */
+    if (x == 0 || x > term->cols)
+	return;
+
+    ldata = lineptr(y);
+    if (x == term->cols) {
+	if (ldata->lattr & LATTR_WRAPPED2) {
+	    ldata->lattr &= ~LATTR_WRAPPED2;
+	    term_damage(term, y, 0, term->cols);
+	}
+    } else {
+	if (ldata->chars[x].chr == UCSWIDE) {
+	    clear_cc(ldata, x-1);
+	    clear_cc(ldata, x);
+	    ldata->chars[x-1].chr = ' ' | CSET_ASCII;
+	    ldata->chars[x] = ldata->chars[x-1];
+	    term_damage(term, y, x-1, x+1);
+	}
+    }
+}
+
+/*
+ * Erase a large portion of the screen: the whole screen, or the
+ * whole line, or parts thereof.
+ */
+static void erase_lots(Terminal *term,
+		       int line_only, int from_begin, int to_end)
+{
+    pos start, end;
+    int erase_lattr;
+    int erasing_lines_from_top = 0;
+
+    if (line_only) {
+	start.y = term->curs.y;
+	start.x = 0;
+	end.y = term->curs.y + 1;
+	end.x = 0;
+	erase_lattr = FALSE;
+    } else {
+	start.y = 0;
+	start.x = 0;
+	end.y = term->rows;
+	end.x = 0;
+	erase_lattr = TRUE;
+    }
+    if (!from_begin) {
+	start = term->curs;
+    }
+    if (!to_end) {
+	end = term->curs;
+	incpos(end);
+    }
+    if (!from_begin || !to_end)
+	check_boundary(term, term->curs.x, term->curs.y);
+    check_selection(term, start, end);
+
+    /* Clear screen also forces a full window redraw, just in case. */
+    if (start.y == 0 && start.x == 0 && end.y == term->rows)
+	term_invalidate(term);
+
+    /* Lines scrolled away shouldn't be brought back on if the terminal
+     * resizes. */
+    if (start.y == 0 && start.x == 0 && end.x == 0 && erase_lattr)
+	erasing_lines_from_top = 1;
+
+    if (term->cfg.erase_to_scrollback && erasing_lines_from_top) {
+	/* If it's a whole number of lines, starting at the top, and
+	 * we're fully erasing them, erase by scrolling and keep the
+	 * lines in the scrollback. */
+	int scrolllines = end.y;
+	if (end.y == term->rows) {
+	    /* Shrink until we find a non-empty row.*/
+	    scrolllines = find_last_nonempty_line(term, term->screen) + 1;
+	}
+	if (scrolllines > 0)
+	    scroll(term, 0, scrolllines - 1, scrolllines, TRUE);
+    } else {
+	termline *ldata = scrlineptr(start.y);
+	while (poslt(start, end)) {
+	    if (start.x == term->cols) {
+		if (!erase_lattr)
+		    ldata->lattr &= ~(LATTR_WRAPPED | LATTR_WRAPPED2);
+		else
+		    ldata->lattr = LATTR_NORM;
+	    } else {
+		copy_termchar(ldata, start.x, &term->erase_char, NULL);
+	    }
+	    if (incpos(start) && start.y < term->rows) {
+		ldata = scrlineptr(start.y);
+	    }
+	}
+    }
+
+    /* After an erase of lines from the top of the screen, we shouldn't
+     * bring the lines back again if the terminal enlarges (since the user or
+     * application has explictly thrown them away). */
+    if (erasing_lines_from_top && !(term->alt_which))
+	term->tempsblines = 0;
+}
+
+/*
+ * Insert or delete characters within the current line. n is +ve if
+ * insertion is desired, and -ve for deletion.
+ */
+static void insch(Terminal *term, int n)
+{
+    int dir = (n < 0 ? -1 : +1);
+    int m, j;
+    pos cursplus;
+    termline *ldata;
+
+    n = (n < 0 ? -n : n);
+    if (n > term->cols - term->curs.x)
+	n = term->cols - term->curs.x;
+    m = term->cols - term->curs.x - n;
+    cursplus.y = term->curs.y;
+    cursplus.x = term->curs.x + n;
+    check_selection(term, term->curs, cursplus);
+    check_boundary(term, term->curs.x, term->curs.y);
+    if (dir < 0)
+	check_boundary(term, term->curs.x + n, term->curs.y);
+    ldata = scrlineptr(term->curs.y);
+    if (dir < 0) {
+	for (j = 0; j < m; j++)
+	    move_termchar(ldata,
+			  ldata->chars + term->curs.x + j,
+			  ldata->chars + term->curs.x + j + n);
+	while (n--)
+	    copy_termchar(ldata, term->curs.x + m++, &term->erase_char, NULL);
+    } else {
+	for (j = m; j-- ;)
+	    move_termchar(ldata,
+			  ldata->chars + term->curs.x + j + n,
+			  ldata->chars + term->curs.x + j);
+	while (n--)
+	    copy_termchar(ldata, term->curs.x + n, &term->erase_char, NULL);
+    }
+}
+
+/*
+ * Toggle terminal mode `mode' to state `state'. (`query' indicates
+ * whether the mode is a DEC private one or a normal one.)
+ */
+static void toggle_mode(Terminal *term, int mode, int query, int state)
+{
+    if (query)
+	switch (mode) {
+	  case 1:		       /* DECCKM: application cursor keys */
+	    term->app_cursor_keys = state;
+	    break;
+	  case 2:		       /* DECANM: VT52 mode */
+	    term->vt52_mode = !state;
+	    if (term->vt52_mode) {
+		term->blink_is_real = FALSE;
+		term->vt52_bold = FALSE;
+	    } else {
+		term->blink_is_real = term->cfg.blinktext;
+	    }
+	    term_schedule_tblink(term);
+	    break;
+	  case 3:		       /* DECCOLM: 80/132 columns */
+	    deselect(term);
+	    if (!term->cfg.no_remote_resize)
+		request_resize(term->frontend, state ? 132 : 80, term->rows);
+	    term->reset_132 = state;
+	    term->alt_t = term->marg_t = 0;
+	    term->alt_b = term->marg_b = term->rows - 1;
+	    move(term, 0, 0, 0);
+	    erase_lots(term, FALSE, TRUE, TRUE);
+	    break;
+	  case 5:		       /* DECSCNM: reverse video */
+	    /*
+	     * Toggle reverse video. If we receive an OFF within the
+	     * visual bell timeout period after an ON, we trigger an
+	     * effective visual bell, so that ESC[?5hESC[?5l will
+	     * always be an actually _visible_ visual bell.
+	     */
+	    if (term->rvideo && !state) {
+		/* This is an OFF, so set up a vbell */
+		term_schedule_vbell(term, TRUE, term->rvbell_startpoint);
+	    } else if (!term->rvideo && state) {
+		/* This is an ON, so we notice the time and save it. */
+		term->rvbell_startpoint = GETTICKCOUNT();
+	    }
+	    term->rvideo = state;
+	    seen_disp_event(term);
+	    break;
+	  case 6:		       /* DECOM: DEC origin mode */
+	    term->dec_om = state;
+	    break;
+	  case 7:		       /* DECAWM: auto wrap */
+	    term->wrap = state;
+	    break;
+	  case 8:		       /* DECARM: auto key repeat */
+	    term->repeat_off = !state;
+	    break;
+	  case 10:		       /* DECEDM: set local edit mode */
+	    term->term_editing = state;
+	    if (term->ldisc)	       /* cause ldisc to notice changes */
+		ldisc_send(term->ldisc, NULL, 0, 0);
+	    break;
+	  case 25:		       /* DECTCEM: enable/disable cursor */
+	    compatibility2(OTHER, VT220);
+	    term->cursor_on = state;
+	    seen_disp_event(term);
+	    break;
+	  case 47:		       /* alternate screen */
+	    compatibility(OTHER);
+	    deselect(term);
+	    swap_screen(term, term->cfg.no_alt_screen ? 0 : state, FALSE, FALSE);
+	    term->disptop = 0;
+	    break;
+	  case 1000:		       /* xterm mouse 1 */
+	    term->xterm_mouse = state ? 1 : 0;
+	    set_raw_mouse_mode(term->frontend, state);
+	    break;
+	  case 1002:		       /* xterm mouse 2 */
+	    term->xterm_mouse = state ? 2 : 0;
+	    set_raw_mouse_mode(term->frontend, state);
+	    break;
+	  case 1047:                   /* alternate screen */
+	    compatibility(OTHER);
+	    deselect(term);
+	    swap_screen(term, term->cfg.no_alt_screen ? 0 : state, TRUE, TRUE);
+	    term->disptop = 0;
+	    break;
+	  case 1048:                   /* save/restore cursor */
+	    if (!term->cfg.no_alt_screen)
+                save_cursor(term, state);
+	    if (!state) seen_disp_event(term);
+	    break;
+	  case 1049:                   /* cursor & alternate screen */
+	    if (state && !term->cfg.no_alt_screen)
+		save_cursor(term, state);
+	    if (!state) seen_disp_event(term);
+	    compatibility(OTHER);
+	    deselect(term);
+	    swap_screen(term, term->cfg.no_alt_screen ? 0 : state, TRUE, FALSE);
+	    if (!state && !term->cfg.no_alt_screen)
+		save_cursor(term, state);
+	    term->disptop = 0;
+	    break;
+    } else
+	switch (mode) {
+	  case 4:		       /* IRM: set insert mode */
+	    compatibility(VT102);
+	    term->insert = state;
+	    break;
+	  case 12:		       /* SRM: set echo mode */
+	    term->term_echoing = !state;
+	    if (term->ldisc)	       /* cause ldisc to notice changes */
+		ldisc_send(term->ldisc, NULL, 0, 0);
+	    break;
+	  case 20:		       /* LNM: Return sends ... */
+	    term->cr_lf_return = state;
+	    break;
+	  case 34:		       /* WYULCURM: Make cursor BIG */
+	    compatibility2(OTHER, VT220);
+	    term->big_cursor = !state;
+	}
+}
+
+/*
+ * Process an OSC sequence: set window title or icon name.
+ */
+static void do_osc(Terminal *term)
+{
+    if (term->osc_w) {
+	while (term->osc_strlen--)
+	    term->wordness[(unsigned char)
+		term->osc_string[term->osc_strlen]] = term->esc_args[0];
+    } else {
+	term->osc_string[term->osc_strlen] = '\0';
+	switch (term->esc_args[0]) {
+	  case 0:
+	  case 1:
+	    if (!term->cfg.no_remote_wintitle)
+		set_icon(term->frontend, term->osc_string);
+	    if (term->esc_args[0] == 1)
+		break;
+	    /* fall through: parameter 0 means set both */
+	  case 2:
+	  case 21:
+	    if (!term->cfg.no_remote_wintitle)
+		set_title(term->frontend, term->osc_string);
+	    break;
+	}
+    }
+}
+
+/*
+ * ANSI printing routines.
+ */
+static void term_print_setup(Terminal *term)
+{
+    bufchain_clear(&term->printer_buf);
+    term->print_job = printer_start_job(term->cfg.printer);
+}
+static void term_print_flush(Terminal *term)
+{
+    void *data;
+    int len;
+    int size;
+    while ((size = bufchain_size(&term->printer_buf)) > 5) {
+	bufchain_prefix(&term->printer_buf, &data, &len);
+	if (len > size-5)
+	    len = size-5;
+	printer_job_data(term->print_job, data, len);
+	bufchain_consume(&term->printer_buf, len);
     }
-    assert(term->rows == newrows);
-    assert(count234(term->screen) == newrows);
+}
+static void term_print_finish(Terminal *term)
+{
+    void *data;
+    int len, size;
+    char c;
 
-    /* Delete any excess lines from the scrollback. */
-    while (sblen > newsavelines) {
-	line = delpos234(term->scrollback, 0);
-	sfree(line);
-	sblen--;
-    }
-    if (sblen < term->tempsblines)
-	term->tempsblines = sblen;
-    assert(count234(term->scrollback) <= newsavelines);
-    assert(count234(term->scrollback) >= term->tempsblines);
-    term->disptop = 0;
+    if (!term->printing && !term->only_printing)
+	return;			       /* we need do nothing */
 
-    /* Make a new displayed text buffer. */
-    newdisp = snewn(newrows, termline *);
-    for (i = 0; i < newrows; i++) {
-	newdisp[i] = newline(term, newcols, FALSE);
-	for (j = 0; j < newcols; j++)
-	    newdisp[i]->chars[j].attr = ATTR_INVALID;
-    }
-    if (term->disptext) {
-	for (i = 0; i < oldrows; i++)
-	    freeline(term->disptext[i]);
+    term_print_flush(term);
+    while ((size = bufchain_size(&term->printer_buf)) > 0) {
+	bufchain_prefix(&term->printer_buf, &data, &len);
+	c = *(char *)data;
+	if (c == '\033' || c == '\233') {
+	    bufchain_consume(&term->printer_buf, size);
+	    break;
+	} else {
+	    printer_job_data(term->print_job, &c, 1);
+	    bufchain_consume(&term->printer_buf, 1);
+	}
     }
-    sfree(term->disptext);
-    term->disptext = newdisp;
-    term->dispcursx = term->dispcursy = -1;
+    printer_finish_job(term->print_job);
+    term->print_job = NULL;
+    term->printing = term->only_printing = FALSE;
+}
 
-    /* Make a new alternate screen. */
-    newalt = newtree234(NULL);
-    for (i = 0; i < newrows; i++) {
-	line = newline(term, newcols, TRUE);
-	addpos234(newalt, line, i);
+/*
+ * Fast path for term_out(). Runs of printable ASCII in the normal
+ * character set make up the bulk of most terminal output, and for
+ * those the full state machine does nothing but copy each byte
+ * into the next cell along. So if the terminal is in a simple
+ * enough state, find the longest run of such bytes that fits on
+ * the current line and write it in one go, with a single boundary
+ * check at each end and a single selection check for the lot.
+ *
+ * Returns the number of bytes consumed; zero means the caller must
+ * process the next byte the slow way.
+ */
+static int term_out_ascii(Terminal *term, const unsigned char *chars,
+			  int nchars)
+{
+    termline *cline;
+    int x, n, i;
+
+    if (term->termstate != TOPLEVEL || term->printing ||
+	term->wrapnext || term->insert || term->vt52_mode)
+	return 0;
+    if (in_utf(term)) {
+	if (term->utf_state)
+	    return 0;
+    } else if (term->sco_acs || term->cset_attr[term->cset] != CSET_ASCII)
+	return 0;
+
+    x = term->curs.x;
+    n = term->cols - x;
+    if (n > nchars)
+	n = nchars;
+    for (i = 0; i < n; i++) {
+	unsigned char c = chars[i];
+	if (c < ' ' || c >= 0x7F || term->ucsdata->unitab_ctrl[c] != 0xFF)
+	    break;
     }
-    if (term->alt_screen) {
-	while (NULL != (line = delpos234(term->alt_screen, 0)))
-	    freeline(line);
-	freetree234(term->alt_screen);
+    n = i;
+    if (n <= 0)
+	return 0;
+
+    if (term->selstate != NO_SELECTION) {
+	pos from = term->curs, to = term->curs;
+	to.x = (x + n < term->cols ? x + n + 1 : term->cols);
+	check_selection(term, from, to);
     }
-    term->alt_screen = newalt;
-    term->alt_sblines = 0;
 
-    term->tabs = sresize(term->tabs, newcols, unsigned char);
-    {
-	int i;
-	for (i = (term->cols > 0 ? term->cols : 0); i < newcols; i++)
-	    term->tabs[i] = (i % 8 == 0 ? TRUE : FALSE);
+    check_boundary(term, x, term->curs.y);
+    check_boundary(term, x + n, term->curs.y);
+    cline = lineptr(term->curs.y);
+    for (i = 0; i < n; i++) {
+	/* FULL-TERMCHAR */
+	clear_cc(cline, x + i);
+	cline->chars[x + i].chr = chars[i] | CSET_ASCII;
+	cline->chars[x + i].attr = term->curr_attr;
     }
+    term_damage(term, term->curs.y, x, x + n);
 
-    /* Check that the cursor positions are still valid. */
-    if (term->savecurs.y < 0)
-	term->savecurs.y = 0;
-    if (term->savecurs.y >= newrows)
-	term->savecurs.y = newrows - 1;
-    if (term->curs.y < 0)
-	term->curs.y = 0;
-    if (term->curs.y >= newrows)
-	term->curs.y = newrows - 1;
-    if (term->curs.x >= newcols)
-	term->curs.x = newcols - 1;
-    term->alt_x = term->alt_y = 0;
-    term->wrapnext = term->alt_wnext = FALSE;
-
-    term->rows = newrows;
-    term->cols = newcols;
-    term->savelines = newsavelines;
-
-    swap_screen(term, save_alt_which, FALSE, FALSE);
+    if (term->logctx)
+	logtraffic_span(term->logctx, chars, n, LGTYP_ASCII);
 
-    update_sbar(term);
-    term_update(term);
-    if (term->resize_fn)
-	term->resize_fn(term->resize_ctx, term->cols, term->rows);
+    term->curs.x += n;
+    if (term->curs.x == term->cols) {
+	term->curs.x--;
+	term->wrapnext = TRUE;
+    }
+    seen_disp_event(term);
+    return n;
 }
 
 /*
- * Hand a function and context pointer to the terminal which it can
- * use to notify a back end of resizes.
+ * UTF-8 decoding stage for term_out(). Decode bytes from `chars'
+ * into code points in `out', which has room for *nout of them, and
+ * set *nout to the number actually produced. Partial sequences are
+ * carried between calls in term->utf_state, utf_char and utf_size.
+ * Returns the number of bytes consumed.
+ *
+ * Malformed input is replaced by UCSERR. A byte which interrupts a
+ * multibyte sequence produces UCSERR and is then decoded afresh, so
+ * if that happens when the output is already full, the byte is left
+ * unconsumed.
+ *
+ * In `batch' mode, decoding stops before an ESC, because whatever
+ * follows it belongs to the escape sequence parser and must not be
+ * translated; and it stops before any printable ASCII after the
+ * first character, so that term_out_ascii() gets a go at ASCII
+ * runs.
  */
-void term_provide_resize_fn(Terminal *term,
-			    void (*resize_fn)(void *, int, int),
-			    void *resize_ctx)
+static int term_utf8_decode(Terminal *term, const unsigned char *chars,
+			    int nchars, unsigned long *out, int *nout,
+			    int batch)
 {
-    term->resize_fn = resize_fn;
-    term->resize_ctx = resize_ctx;
-    if (resize_fn && term->cols > 0 && term->rows > 0)
-	resize_fn(resize_ctx, term->cols, term->rows);
-}
+    int i = 0, n = 0;
 
-/* Find the bottom line on the screen that has any content.
- * If only the top line has content, returns 0.
- * If no lines have content, return -1.
- */ 
-static int find_last_nonempty_line(Terminal * term, tree234 * screen)
-{
-    int i;
-    for (i = count234(screen) - 1; i >= 0; i--) {
-	termline *line = index234(screen, i);
-	int j;
-	for (j = 0; j < line->cols; j++)
-	    if (!termchars_equal(&line->chars[j], &term->erase_char))
+    while (i < nchars && n < *nout) {
+	unsigned long c = chars[i];
+
+	switch (term->utf_state) {
+	  case 0:
+	    if (c < 0x80) {
+		if (batch && (c == '\033' || (n > 0 && c >= ' ' && c < 0x7F)))
+		    goto done;
+		/* UTF-8 must be stateless so we ignore iso2022. */
+		if (term->ucsdata->unitab_ctrl[c] != 0xFF) 
+		     c = term->ucsdata->unitab_ctrl[c];
+		else c = ((unsigned char)c) | CSET_ASCII;
+		out[n++] = c;
+	    } else if ((c & 0xe0) == 0xc0) {
+		term->utf_size = term->utf_state = 1;
+		term->utf_char = (c & 0x1f);
+	    } else if ((c & 0xf0) == 0xe0) {
+		term->utf_size = term->utf_state = 2;
+		term->utf_char = (c & 0x0f);
+	    } else if ((c & 0xf8) == 0xf0) {
+		term->utf_size = term->utf_state = 3;
+		term->utf_char = (c & 0x07);
+	    } else if ((c & 0xfc) == 0xf8) {
+		term->utf_size = term->utf_state = 4;
+		term->utf_char = (c & 0x03);
+	    } else if ((c & 0xfe) == 0xfc) {
+		term->utf_size = term->utf_state = 5;
+		term->utf_char = (c & 0x01);
+	    } else {
+		out[n++] = UCSERR;
+	    }
+	    i++;
+	    break;
+	  case 1:
+	  case 2:
+	  case 3:
+	  case 4:
+	  case 5:
+	    if ((c & 0xC0) != 0x80) {
+		out[n++] = UCSERR;
+		term->utf_state = 0;
+		break;		       /* and reprocess this byte */
+	    }
+	    i++;
+	    term->utf_char = (term->utf_char << 6) | (c & 0x3f);
+	    if (--term->utf_state)
 		break;
-	if (j != line->cols) break;
+
+	    c = term->utf_char;
+
+	    /* Is somebody trying to be evil! */
+	    if (c < 0x80 ||
+		(c < 0x800 && term->utf_size >= 2) ||
+		(c < 0x10000 && term->utf_size >= 3) ||
+		(c < 0x200000 && term->utf_size >= 4) ||
+		(c < 0x4000000 && term->utf_size >= 5))
+		c = UCSERR;
+
+	    /* Unicode line separator and paragraph separator are CR-LF */
+	    if (c == 0x2028 || c == 0x2029)
+		c = 0x85;
+
+	    /* High controls are probably a Baaad idea too. */
+	    if (c < 0xA0)
+		c = 0xFFFD;
+
+	    /* The UTF-16 surrogates are not nice either. */
+	    /*       The standard give the option of decoding these: 
+	     *       I don't want to! */
+	    if (c >= 0xD800 && c < 0xE000)
+		c = UCSERR;
+
+	    /* ISO 10646 characters now limited to UTF-16 range. */
+	    if (c > 0x10FFFF)
+		c = UCSERR;
+
+	    /* This is currently a TagPhobic application.. */
+	    if (c >= 0xE0000 && c <= 0xE007F)
+		break;
+
+	    /* U+FEFF is best seen as a null. */
+	    if (c == 0xFEFF)
+		break;
+	    /* But U+FFFE is an error. */
+	    if (c == 0xFFFE || c == 0xFFFF)
+		c = UCSERR;
+
+	    out[n++] = c;
+	    break;
+	}
     }
+
+  done:
+    *nout = n;
     return i;
 }
 
 /*
- * Swap screens. If `reset' is TRUE and we have been asked to
- * switch to the alternate screen, we must bring most of its
- * configuration from the main screen and erase the contents of the
- * alternate screen completely. (This is even true if we're already
- * on it! Blame xterm.)
+ * Handlers for escape sequences, called from term_esc_char() once a
+ * complete sequence has been seen. The numeric arguments are in
+ * esc_args[] and esc_nargs, any intermediate or private marker is in
+ * esc_query, and `c' is the final byte.
  */
-static void swap_screen(Terminal *term, int which, int reset, int keep_cur_pos)
+
+/* CSI: enter CSI mode */
+static void esc_csi(Terminal *term, int c)
 {
-    int t;
-    pos tp;
-    tree234 *ttr;
+    term->termstate = SEEN_CSI;
+    term->esc_nargs = 1;
+    term->esc_args[0] = ARG_DEFAULT;
+    term->esc_query = FALSE;
+}
 
-    if (!which)
-	reset = FALSE;		       /* do no weird resetting if which==0 */
+/* OSC: xterm escape sequences */
+static void esc_osc(Terminal *term, int c)
+{
+    /* Compatibility is nasty here, xterm, linux, decterm yuk! */
+    term->termstate = SEEN_OSC;
+    term->esc_args[0] = 0;
+}
 
-    if (which != term->alt_which) {
-	term->alt_which = which;
+/* DECSC: save cursor */
+static void esc_decsc(Terminal *term, int c)
+{
+    save_cursor(term, TRUE);
+}
 
-	ttr = term->alt_screen;
-	term->alt_screen = term->screen;
-	term->screen = ttr;
-	term->alt_sblines = find_last_nonempty_line(term, term->alt_screen) + 1;
-	t = term->curs.x;
-	if (!reset && !keep_cur_pos)
-	    term->curs.x = term->alt_x;
-	term->alt_x = t;
-	t = term->curs.y;
-	if (!reset && !keep_cur_pos)
-	    term->curs.y = term->alt_y;
-	term->alt_y = t;
-	t = term->marg_t;
-	if (!reset) term->marg_t = term->alt_t;
-	term->alt_t = t;
-	t = term->marg_b;
-	if (!reset) term->marg_b = term->alt_b;
-	term->alt_b = t;
-	t = term->dec_om;
-	if (!reset) term->dec_om = term->alt_om;
-	term->alt_om = t;
-	t = term->wrap;
-	if (!reset) term->wrap = term->alt_wrap;
-	term->alt_wrap = t;
-	t = term->wrapnext;
-	if (!reset) term->wrapnext = term->alt_wnext;
-	term->alt_wnext = t;
-	t = term->insert;
-	if (!reset) term->insert = term->alt_ins;
-	term->alt_ins = t;
-	t = term->cset;
-	if (!reset) term->cset = term->alt_cset;
-	term->alt_cset = t;
-	t = term->utf;
-	if (!reset) term->utf = term->alt_utf;
-	term->alt_utf = t;
-	t = term->sco_acs;
-	if (!reset) term->sco_acs = term->alt_sco_acs;
-	term->alt_sco_acs = t;
+/* DECRC: restore cursor */
+static void esc_decrc(Terminal *term, int c)
+{
+    save_cursor(term, FALSE);
+    seen_disp_event(term);
+}
 
-	tp = term->savecurs;
-	if (!reset && !keep_cur_pos)
-	    term->savecurs = term->alt_savecurs;
-	term->alt_savecurs = tp;
-        t = term->save_cset;
-        if (!reset && !keep_cur_pos)
-            term->save_cset = term->alt_save_cset;
-        term->alt_save_cset = t;
-        t = term->save_csattr;
-        if (!reset && !keep_cur_pos)
-            term->save_csattr = term->alt_save_csattr;
-        term->alt_save_csattr = t;
-        t = term->save_attr;
-        if (!reset && !keep_cur_pos)
-            term->save_attr = term->alt_save_attr;
-        term->alt_save_attr = t;
-        t = term->save_utf;
-        if (!reset && !keep_cur_pos)
-            term->save_utf = term->alt_save_utf;
-        term->alt_save_utf = t;
-        t = term->save_wnext;
-        if (!reset && !keep_cur_pos)
-            term->save_wnext = term->alt_save_wnext;
-        term->alt_save_wnext = t;
-        t = term->save_sco_acs;
-        if (!reset && !keep_cur_pos)
-            term->save_sco_acs = term->alt_save_sco_acs;
-        term->alt_save_sco_acs = t;
-    }
+/* DECKPAM: keypad application mode */
+static void esc_deckpam(Terminal *term, int c)
+{
+    term->app_keypad_keys = TRUE;
+}
 
-    if (reset && term->screen) {
-	/*
-	 * Yes, this _is_ supposed to honour background-colour-erase.
-	 */
-	erase_lots(term, FALSE, TRUE, TRUE);
+/* DECKPNM: keypad numeric mode */
+static void esc_deckpnm(Terminal *term, int c)
+{
+    term->app_keypad_keys = FALSE;
+}
+
+/* IND: exactly equivalent to LF */
+static void esc_ind(Terminal *term, int c)
+{
+    if (term->curs.y == term->marg_b)
+	scroll(term, term->marg_t, term->marg_b, 1, TRUE);
+    else if (term->curs.y < term->rows - 1)
+	term->curs.y++;
+    term->wrapnext = FALSE;
+    seen_disp_event(term);
+}
+
+/* NEL: exactly equivalent to CR-LF */
+static void esc_nel(Terminal *term, int c)
+{
+    term->curs.x = 0;
+    if (term->curs.y == term->marg_b)
+	scroll(term, term->marg_t, term->marg_b, 1, TRUE);
+    else if (term->curs.y < term->rows - 1)
+	term->curs.y++;
+    term->wrapnext = FALSE;
+    seen_disp_event(term);
+}
+
+/* RI: reverse index - backwards LF */
+static void esc_ri(Terminal *term, int c)
+{
+    if (term->curs.y == term->marg_t)
+	scroll(term, term->marg_t, term->marg_b, -1, TRUE);
+    else if (term->curs.y > 0)
+	term->curs.y--;
+    term->wrapnext = FALSE;
+    seen_disp_event(term);
+}
+
+/* DECID: terminal type query */
+static void esc_decid(Terminal *term, int c)
+{
+    if (term->ldisc)
+	ldisc_send(term->ldisc, term->id_string,
+		   strlen(term->id_string), 0);
+}
+
+/* RIS: restore power-on settings */
+static void esc_ris(Terminal *term, int c)
+{
+    power_on(term, TRUE);
+    if (term->ldisc)   /* cause ldisc to notice changes */
+	ldisc_send(term->ldisc, NULL, 0, 0);
+    if (term->reset_132) {
+	if (!term->cfg.no_remote_resize)
+	    request_resize(term->frontend, 80, term->rows);
+	term->reset_132 = 0;
     }
+    term->disptop = 0;
+    seen_disp_event(term);
 }
 
-/*
- * Update the scroll bar.
- */
-static void update_sbar(Terminal *term)
+/* HTS: set a tab */
+static void esc_hts(Terminal *term, int c)
 {
-    int nscroll = sblines(term);
-    set_sbar(term->frontend, nscroll + term->rows,
-	     nscroll + term->disptop, term->rows);
+    term->tabs[term->curs.x] = TRUE;
 }
 
-/*
- * Check whether the region bounded by the two pointers intersects
- * the scroll region, and de-select the on-screen selection if so.
- */
-static void check_selection(Terminal *term, pos from, pos to)
+/* DECALN: fills screen with Es :-) */
+static void esc_decaln(Terminal *term, int c)
 {
-    if (poslt(from, term->selend) && poslt(term->selstart, to))
-	deselect(term);
+    termline *ldata;
+    int i, j;
+    pos scrtop, scrbot;
+
+    for (i = 0; i < term->rows; i++) {
+	ldata = scrlineptr(i);
+	for (j = 0; j < term->cols; j++) {
+	    copy_termchar(ldata, j,
+			  &term->basic_erase_char, NULL);
+	    ldata->chars[j].chr = 'E';
+	}
+	ldata->lattr = LATTR_NORM;
+    }
+    term->disptop = 0;
+    seen_disp_event(term);
+    scrtop.x = scrtop.y = 0;
+    scrbot.x = 0;
+    scrbot.y = term->rows;
+    check_selection(term, scrtop, scrbot);
 }
 
-/*
- * Scroll the screen. (`lines' is +ve for scrolling forward, -ve
- * for backward.) `sb' is TRUE if the scrolling is permitted to
- * affect the scrollback buffer.
- */
-static void scroll(Terminal *term, int topline, int botline, int lines, int sb)
+/* DECDHL, DECSWL, DECDWL: set line attributes */
+static void esc_declattr(Terminal *term, int c)
 {
-    termline *line;
-    int i, seltop, olddisptop, shift;
+    int nlattr;
 
-    if (topline != 0 || term->alt_which != 0)
-	sb = FALSE;
+    switch (c) {
+      case '3': /* DECDHL: 2*height, top */
+	nlattr = LATTR_TOP;
+	break;
+      case '4': /* DECDHL: 2*height, bottom */
+	nlattr = LATTR_BOT;
+	break;
+      case '5': /* DECSWL: normal */
+	nlattr = LATTR_NORM;
+	break;
+      default: /* case '6': DECDWL: 2*width */
+	nlattr = LATTR_WIDE;
+	break;
+    }
+    scrlineptr(term->curs.y)->lattr = nlattr;
+}
 
-    olddisptop = term->disptop;
-    shift = lines;
-    if (lines < 0) {
-	while (lines < 0) {
-	    line = delpos234(term->screen, botline);
-            resizeline(term, line, term->cols);
-	    for (i = 0; i < term->cols; i++)
-		copy_termchar(line, i, &term->erase_char);
-	    line->lattr = LATTR_NORM;
-	    addpos234(term->screen, line, topline);
+/* GZD4, G1D4: G0 or G1 designate 94-set */
+static void esc_scs(Terminal *term, int c)
+{
+    int which = (term->esc_query == ')');
 
-	    if (term->selstart.y >= topline && term->selstart.y <= botline) {
-		term->selstart.y++;
-		if (term->selstart.y > botline) {
-		    term->selstart.y = botline + 1;
-		    term->selstart.x = 0;
-		}
-	    }
-	    if (term->selend.y >= topline && term->selend.y <= botline) {
-		term->selend.y++;
-		if (term->selend.y > botline) {
-		    term->selend.y = botline + 1;
-		    term->selend.x = 0;
-		}
-	    }
+    if (term->cfg.no_remote_charset)
+	return;
+    switch (c) {
+      case 'A':
+	term->cset_attr[which] = CSET_GBCHR;
+	break;
+      case 'B':
+	term->cset_attr[which] = CSET_ASCII;
+	break;
+      case '0':
+	term->cset_attr[which] = CSET_LINEDRW;
+	break;
+      case 'U':
+	term->cset_attr[which] = CSET_SCOACS;
+	break;
+    }
+}
 
-	    lines++;
-	}
-    } else {
-	while (lines > 0) {
-	    line = delpos234(term->screen, topline);
-#ifdef TERM_CC_DIAGS
-	    cc_check(line);
-#endif
-	    if (sb && term->savelines > 0) {
-		int sblen = count234(term->scrollback);
-		/*
-		 * We must add this line to the scrollback. We'll
-		 * remove a line from the top of the scrollback if
-		 * the scrollback is full.
-		 */
-		if (sblen == term->savelines) {
-		    unsigned char *cline;
+/* DOCS: Designate other coding system */
+static void esc_docs(Terminal *term, int c)
+{
+    if (!term->cfg.no_remote_charset)
+	term->utf = (c != '@');
+}
 
-		    sblen--;
-		    cline = delpos234(term->scrollback, 0);
-		    sfree(cline);
-		} else
-		    term->tempsblines += 1;
 
-		addpos234(term->scrollback, compressline(line), sblen);
+/* CUU: move up N lines */
+static void csi_cuu(Terminal *term, int c)
+{
+    move(term, term->curs.x,
+	 term->curs.y - def(term->esc_args[0], 1), 1);
+    seen_disp_event(term);
+}
 
-		/* now `line' itself can be reused as the bottom line */
+/* CUD: move down N lines (also VPR) */
+static void csi_cud(Terminal *term, int c)
+{
+    move(term, term->curs.x,
+	 term->curs.y + def(term->esc_args[0], 1), 1);
+    seen_disp_event(term);
+}
 
-		/*
-		 * If the user is currently looking at part of the
-		 * scrollback, and they haven't enabled any options
-		 * that are going to reset the scrollback as a
-		 * result of this movement, then the chances are
-		 * they'd like to keep looking at the same line. So
-		 * we move their viewpoint at the same rate as the
-		 * scroll, at least until their viewpoint hits the
-		 * top end of the scrollback buffer, at which point
-		 * we don't have the choice any more.
-		 * 
-		 * Thanks to Jan Holmen Holsten for the idea and
-		 * initial implementation.
-		 */
-		if (term->disptop > -term->savelines && term->disptop < 0)
-		    term->disptop--;
-	    }
-            resizeline(term, line, term->cols);
-	    for (i = 0; i < term->cols; i++)
-		copy_termchar(line, i, &term->erase_char);
-	    line->lattr = LATTR_NORM;
-	    addpos234(term->screen, line, botline);
+/* Secondary DA: report xterm version */
+static void csi_da2(Terminal *term, int c)
+{
+    /* this reports xterm version 136 so that VIM can
+       use the drag messages from the mouse reporting */
+    if (term->ldisc)
+	ldisc_send(term->ldisc, "\033[>0;136;0c", 11, 0);
+}
 
-	    /*
-	     * If the selection endpoints move into the scrollback,
-	     * we keep them moving until they hit the top. However,
-	     * of course, if the line _hasn't_ moved into the
-	     * scrollback then we don't do this, and cut them off
-	     * at the top of the scroll region.
-	     * 
-	     * This applies to selstart and selend (for an existing
-	     * selection), and also selanchor (for one being
-	     * selected as we speak).
-	     */
-	    seltop = sb ? -term->savelines : topline;
-
-	    if (term->selstate != NO_SELECTION) {
-		if (term->selstart.y >= seltop &&
-		    term->selstart.y <= botline) {
-		    term->selstart.y--;
-		    if (term->selstart.y < seltop) {
-			term->selstart.y = seltop;
-			term->selstart.x = 0;
-		    }
-		}
-		if (term->selend.y >= seltop && term->selend.y <= botline) {
-		    term->selend.y--;
-		    if (term->selend.y < seltop) {
-			term->selend.y = seltop;
-			term->selend.x = 0;
-		    }
-		}
-		if (term->selanchor.y >= seltop &&
-		    term->selanchor.y <= botline) {
-		    term->selanchor.y--;
-		    if (term->selanchor.y < seltop) {
-			term->selanchor.y = seltop;
-			term->selanchor.x = 0;
-		    }
-		}
-	    }
+/* CUF: move right N cols (also HPR) */
+static void csi_cuf(Terminal *term, int c)
+{
+    move(term, term->curs.x + def(term->esc_args[0], 1),
+	 term->curs.y, 1);
+    seen_disp_event(term);
+}
 
-	    lines--;
-	}
-    }
-#ifdef OPTIMISE_SCROLL
-    shift += term->disptop - olddisptop;
-    if (shift < term->rows && shift > -term->rows && shift != 0)
-	scroll_display(term, topline, botline, shift);
-#endif /* OPTIMISE_SCROLL */
+/* CUB: move left N cols */
+static void csi_cub(Terminal *term, int c)
+{
+    move(term, term->curs.x - def(term->esc_args[0], 1),
+	 term->curs.y, 1);
+    seen_disp_event(term);
 }
 
-#ifdef OPTIMISE_SCROLL
-/*
- * Add a scroll of a region on the screen into the pending scroll list.
- * `lines' is +ve for scrolling forward, -ve for backward.
- *
- * If the scroll is on the same area as the last scroll in the list,
- * merge them.
- */
-static void save_scroll(Terminal *term, int topline, int botline, int lines)
+/* CNL: move down N lines and CR */
+static void csi_cnl(Terminal *term, int c)
 {
-    struct scrollregion *newscroll;
-    if (term->scrolltail &&
-	term->scrolltail->topline == topline && 
-	term->scrolltail->botline == botline) {
-	term->scrolltail->lines += lines;
-    } else {
-	newscroll = snew(struct scrollregion);
-	newscroll->topline = topline;
-	newscroll->botline = botline;
-	newscroll->lines = lines;
-	newscroll->next = NULL;
+    move(term, 0,
+	 term->curs.y + def(term->esc_args[0], 1), 1);
+    seen_disp_event(term);
+}
 
-	if (!term->scrollhead)
-	    term->scrollhead = newscroll;
-	else
-	    term->scrolltail->next = newscroll;
-	term->scrolltail = newscroll;
-    }
+/* CPL: move up N lines and CR */
+static void csi_cpl(Terminal *term, int c)
+{
+    move(term, 0,
+	 term->curs.y - def(term->esc_args[0], 1), 1);
+    seen_disp_event(term);
 }
 
-/*
- * Scroll the physical display, and our conception of it in disptext.
- */
-static void scroll_display(Terminal *term, int topline, int botline, int lines)
+/* CHA, HPA: set horizontal posn */
+static void csi_cha(Terminal *term, int c)
 {
-    int distance, nlines, i, j;
+    move(term, def(term->esc_args[0], 1) - 1,
+	 term->curs.y, 0);
+    seen_disp_event(term);
+}
 
-    distance = lines > 0 ? lines : -lines;
-    nlines = botline - topline + 1 - distance;
-    if (lines > 0) {
-	for (i = 0; i < nlines; i++)
-	    for (j = 0; j < term->cols; j++)
-		copy_termchar(term->disptext[i], j,
-			      term->disptext[i+distance]->chars+j);
-	if (term->dispcursy >= 0 &&
-	    term->dispcursy >= topline + distance &&
-	    term->dispcursy < topline + distance + nlines)
-	    term->dispcursy -= distance;
-	for (i = 0; i < distance; i++)
-	    for (j = 0; j < term->cols; j++)
-		term->disptext[nlines+i]->chars[j].attr |= ATTR_INVALID;
+/* VPA: set vertical posn */
+static void csi_vpa(Terminal *term, int c)
+{
+    move(term, term->curs.x,
+	 ((term->dec_om ? term->marg_t : 0) +
+	  def(term->esc_args[0], 1) - 1),
+	 (term->dec_om ? 2 : 0));
+    seen_disp_event(term);
+}
+
+/* CUP, HVP: set horz and vert posns at once */
+static void csi_cup(Terminal *term, int c)
+{
+    if (term->esc_nargs < 2)
+	term->esc_args[1] = ARG_DEFAULT;
+    move(term, def(term->esc_args[1], 1) - 1,
+	 ((term->dec_om ? term->marg_t : 0) +
+	  def(term->esc_args[0], 1) - 1),
+	 (term->dec_om ? 2 : 0));
+    seen_disp_event(term);
+}
+
+/* ED: erase screen or parts of it */
+static void csi_ed(Terminal *term, int c)
+{
+    unsigned int i = def(term->esc_args[0], 0);
+
+    if (i == 3) {
+	/* Erase Saved Lines (xterm)
+	 * This follows Thomas Dickey's xterm. */
+	term_clrsb(term);
     } else {
-	for (i = nlines; i-- ;)
-	    for (j = 0; j < term->cols; j++)
-		copy_termchar(term->disptext[i+distance], j,
-			      term->disptext[i]->chars+j);
-	if (term->dispcursy >= 0 &&
-	    term->dispcursy >= topline &&
-	    term->dispcursy < topline + nlines)
-	    term->dispcursy += distance;
-	for (i = 0; i < distance; i++)
-	    for (j = 0; j < term->cols; j++)
-		term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+	i++;
+	if (i > 3)
+	    i = 0;
+	erase_lots(term, FALSE, !!(i & 2), !!(i & 1));
     }
-    save_scroll(term, topline, botline, lines);
+    term->disptop = 0;
+    seen_disp_event(term);
 }
-#endif /* OPTIMISE_SCROLL */
 
-/*
- * Move the cursor to a given position, clipping at boundaries. We
- * may or may not want to clip at the scroll margin: marg_clip is 0
- * not to, 1 to disallow _passing_ the margins, and 2 to disallow
- * even _being_ outside the margins.
- */
-static void move(Terminal *term, int x, int y, int marg_clip)
+/* EL: erase line or parts of it */
+static void csi_el(Terminal *term, int c)
 {
-    if (x < 0)
-	x = 0;
-    if (x >= term->cols)
-	x = term->cols - 1;
-    if (marg_clip) {
-	if ((term->curs.y >= term->marg_t || marg_clip == 2) &&
-	    y < term->marg_t)
-	    y = term->marg_t;
-	if ((term->curs.y <= term->marg_b || marg_clip == 2) &&
-	    y > term->marg_b)
-	    y = term->marg_b;
-    }
-    if (y < 0)
-	y = 0;
-    if (y >= term->rows)
-	y = term->rows - 1;
-    term->curs.x = x;
-    term->curs.y = y;
-    term->wrapnext = FALSE;
+    unsigned int i = def(term->esc_args[0], 0) + 1;
+
+    if (i > 3)
+	i = 0;
+    erase_lots(term, TRUE, !!(i & 2), !!(i & 1));
+    seen_disp_event(term);
 }
 
-/*
- * Save or restore the cursor and SGR mode.
- */
-static void save_cursor(Terminal *term, int save)
+/* IL: insert lines */
+static void csi_il(Terminal *term, int c)
 {
-    if (save) {
-	term->savecurs = term->curs;
-	term->save_attr = term->curr_attr;
-	term->save_cset = term->cset;
-	term->save_utf = term->utf;
-	term->save_wnext = term->wrapnext;
-	term->save_csattr = term->cset_attr[term->cset];
-	term->save_sco_acs = term->sco_acs;
-    } else {
-	term->curs = term->savecurs;
-	/* Make sure the window hasn't shrunk since the save */
-	if (term->curs.x >= term->cols)
-	    term->curs.x = term->cols - 1;
-	if (term->curs.y >= term->rows)
-	    term->curs.y = term->rows - 1;
+    if (term->curs.y <= term->marg_b)
+	scroll(term, term->curs.y, term->marg_b,
+	       -def(term->esc_args[0], 1), FALSE);
+    seen_disp_event(term);
+}
 
-	term->curr_attr = term->save_attr;
-	term->cset = term->save_cset;
-	term->utf = term->save_utf;
-	term->wrapnext = term->save_wnext;
-	/*
-	 * wrapnext might reset to False if the x position is no
-	 * longer at the rightmost edge.
-	 */
-	if (term->wrapnext && term->curs.x < term->cols-1)
-	    term->wrapnext = FALSE;
-	term->cset_attr[term->cset] = term->save_csattr;
-	term->sco_acs = term->save_sco_acs;
-	set_erase_char(term);
-    }
+/* DL: delete lines */
+static void csi_dl(Terminal *term, int c)
+{
+    if (term->curs.y <= term->marg_b)
+	scroll(term, term->curs.y, term->marg_b,
+	       def(term->esc_args[0], 1),
+	       TRUE);
+    seen_disp_event(term);
+}
+
+/* ICH: insert chars */
+static void csi_ich(Terminal *term, int c)
+{
+    /* XXX VTTEST says this is vt220, vt510 manual says vt102 */
+    insch(term, def(term->esc_args[0], 1));
+    seen_disp_event(term);
 }
 
-/*
- * This function is called before doing _anything_ which affects
- * only part of a line of text. It is used to mark the boundary
- * between two character positions, and it indicates that some sort
- * of effect is going to happen on only one side of that boundary.
- * 
- * The effect of this function is to check whether a CJK
- * double-width character is straddling the boundary, and to remove
- * it and replace it with two spaces if so. (Of course, one or
- * other of those spaces is then likely to be replaced with
- * something else again, as a result of whatever happens next.)
- * 
- * Also, if the boundary is at the right-hand _edge_ of the screen,
- * it implies something deliberate is being done to the rightmost
- * column position; hence we must clear LATTR_WRAPPED2.
- * 
- * The input to the function is the coordinates of the _second_
- * character of the pair.
- */
-static void check_boundary(Terminal *term, int x, int y)
+/* DCH: delete chars */
+static void csi_dch(Terminal *term, int c)
 {
-    termline *ldata;
+    insch(term, -def(term->esc_args[0], 1));
+    seen_disp_event(term);
+}
 
-    /* Validate input coordinates, just in case. */
-    if (x == 0 || x > term->cols)
-	return;
+/* DA: terminal type query */
+static void csi_da(Terminal *term, int c)
+{
+    /* This is the response for a VT102 */
+    if (term->ldisc)
+	ldisc_send(term->ldisc, term->id_string,
+		   strlen(term->id_string), 0);
+}
 
-    ldata = scrlineptr(y);
-    if (x == term->cols) {
-	ldata->lattr &= ~LATTR_WRAPPED2;
-    } else {
-	if (ldata->chars[x].chr == UCSWIDE) {
-	    clear_cc(ldata, x-1);
-	    clear_cc(ldata, x);
-	    ldata->chars[x-1].chr = ' ' | CSET_ASCII;
-	    ldata->chars[x] = ldata->chars[x-1];
+/* DSR: cursor position query */
+static void csi_dsr(Terminal *term, int c)
+{
+    if (term->ldisc) {
+	if (term->esc_args[0] == 6) {
+	    char buf[32];
+	    sprintf(buf, "\033[%d;%dR", term->curs.y + 1,
+		    term->curs.x + 1);
+	    ldisc_send(term->ldisc, buf, strlen(buf), 0);
+	} else if (term->esc_args[0] == 5) {
+	    ldisc_send(term->ldisc, "\033[0n", 4, 0);
 	}
     }
 }
 
-/*
- * Erase a large portion of the screen: the whole screen, or the
- * whole line, or parts thereof.
- */
-static void erase_lots(Terminal *term,
-		       int line_only, int from_begin, int to_end)
+/* SM: toggle modes to high */
+static void csi_sm(Terminal *term, int c)
 {
-    pos start, end;
-    int erase_lattr;
-    int erasing_lines_from_top = 0;
+    int i;
+    for (i = 0; i < term->esc_nargs; i++)
+	toggle_mode(term, term->esc_args[i],
+		    term->esc_query, TRUE);
+}
 
-    if (line_only) {
-	start.y = term->curs.y;
-	start.x = 0;
-	end.y = term->curs.y + 1;
-	end.x = 0;
-	erase_lattr = FALSE;
-    } else {
-	start.y = 0;
-	start.x = 0;
-	end.y = term->rows;
-	end.x = 0;
-	erase_lattr = TRUE;
-    }
-    if (!from_begin) {
-	start = term->curs;
-    }
-    if (!to_end) {
-	end = term->curs;
-	incpos(end);
+/* MC: media copy */
+static void csi_mc(Terminal *term, int c)
+{
+    if (term->esc_nargs != 1) return;
+    if (term->esc_args[0] == 5 && *term->cfg.printer) {
+	term->printing = TRUE;
+	term->only_printing = !term->esc_query;
+	term->print_state = 0;
+	term_print_setup(term);
+    } else if (term->esc_args[0] == 4 &&
+	       term->printing) {
+	term_print_finish(term);
     }
-    if (!from_begin || !to_end)
-	check_boundary(term, term->curs.x, term->curs.y);
-    check_selection(term, start, end);
-
-    /* Clear screen also forces a full window redraw, just in case. */
-    if (start.y == 0 && start.x == 0 && end.y == term->rows)
-	term_invalidate(term);
+}
 
-    /* Lines scrolled away shouldn't be brought back on if the terminal
-     * resizes. */
-    if (start.y == 0 && start.x == 0 && end.x == 0 && erase_lattr)
-	erasing_lines_from_top = 1;
+/* RM: toggle modes to low */
+static void csi_rm(Terminal *term, int c)
+{
+    int i;
+    for (i = 0; i < term->esc_nargs; i++)
+	toggle_mode(term, term->esc_args[i],
+		    term->esc_query, FALSE);
+}
 
-    if (term->cfg.erase_to_scrollback && erasing_lines_from_top) {
-	/* If it's a whole number of lines, starting at the top, and
-	 * we're fully erasing them, erase by scrolling and keep the
-	 * lines in the scrollback. */
-	int scrolllines = end.y;
-	if (end.y == term->rows) {
-	    /* Shrink until we find a non-empty row.*/
-	    scrolllines = find_last_nonempty_line(term, term->screen) + 1;
-	}
-	if (scrolllines > 0)
-	    scroll(term, 0, scrolllines - 1, scrolllines, TRUE);
-    } else {
-	termline *ldata = scrlineptr(start.y);
-	while (poslt(start, end)) {
-	    if (start.x == term->cols) {
-		if (!erase_lattr)
-		    ldata->lattr &= ~(LATTR_WRAPPED | LATTR_WRAPPED2);
-		else
-		    ldata->lattr = LATTR_NORM;
-	    } else {
-		copy_termchar(ldata, start.x, &term->erase_char);
-	    }
-	    if (incpos(start) && start.y < term->rows) {
-		ldata = scrlineptr(start.y);
-	    }
+/* TBC: clear tabs */
+static void csi_tbc(Terminal *term, int c)
+{
+    if (term->esc_nargs == 1) {
+	if (term->esc_args[0] == 0) {
+	    term->tabs[term->curs.x] = FALSE;
+	} else if (term->esc_args[0] == 3) {
+	    int i;
+	    for (i = 0; i < term->cols; i++)
+		term->tabs[i] = FALSE;
 	}
     }
-
-    /* After an erase of lines from the top of the screen, we shouldn't
-     * bring the lines back again if the terminal enlarges (since the user or
-     * application has explictly thrown them away). */
-    if (erasing_lines_from_top && !(term->alt_which))
-	term->tempsblines = 0;
 }
 
-/*
- * Insert or delete characters within the current line. n is +ve if
- * insertion is desired, and -ve for deletion.
- */
-static void insch(Terminal *term, int n)
+/* DECSTBM: set scroll margins */
+static void csi_decstbm(Terminal *term, int c)
 {
-    int dir = (n < 0 ? -1 : +1);
-    int m, j;
-    pos cursplus;
-    termline *ldata;
-
-    n = (n < 0 ? -n : n);
-    if (n > term->cols - term->curs.x)
-	n = term->cols - term->curs.x;
-    m = term->cols - term->curs.x - n;
-    cursplus.y = term->curs.y;
-    cursplus.x = term->curs.x + n;
-    check_selection(term, term->curs, cursplus);
-    check_boundary(term, term->curs.x, term->curs.y);
-    if (dir < 0)
-	check_boundary(term, term->curs.x + n, term->curs.y);
-    ldata = scrlineptr(term->curs.y);
-    if (dir < 0) {
-	for (j = 0; j < m; j++)
-	    move_termchar(ldata,
-			  ldata->chars + term->curs.x + j,
-			  ldata->chars + term->curs.x + j + n);
-	while (n--)
-	    copy_termchar(ldata, term->curs.x + m++, &term->erase_char);
-    } else {
-	for (j = m; j-- ;)
-	    move_termchar(ldata,
-			  ldata->chars + term->curs.x + j + n,
-			  ldata->chars + term->curs.x + j);
-	while (n--)
-	    copy_termchar(ldata, term->curs.x + n, &term->erase_char);
+    if (term->esc_nargs <= 2) {
+	int top, bot;
+	top = def(term->esc_args[0], 1) - 1;
+	bot = (term->esc_nargs <= 1
+	       || term->esc_args[1] == 0 ?
+	       term->rows :
+	       def(term->esc_args[1], term->rows)) - 1;
+	if (bot >= term->rows)
+	    bot = term->rows - 1;
+	/* VTTEST Bug 9 - if region is less than 2 lines
+	 * don't change region.
+	 */
+	if (bot - top > 0) {
+	    term->marg_t = top;
+	    term->marg_b = bot;
+	    term->curs.x = 0;
+	    /*
+	     * I used to think the cursor should be
+	     * placed at the top of the newly marginned
+	     * area. Apparently not: VMS TPU falls over
+	     * if so.
+	     *
+	     * Well actually it should for
+	     * Origin mode - RDB
+	     */
+	    term->curs.y = (term->dec_om ?
+			    term->marg_t : 0);
+	    seen_disp_event(term);
+	}
     }
 }
 
-/*
- * Toggle terminal mode `mode' to state `state'. (`query' indicates
- * whether the mode is a DEC private one or a normal one.)
- */
-static void toggle_mode(Terminal *term, int mode, int query, int state)
+/* SGR: set graphics rendition */
+static void csi_sgr(Terminal *term, int c)
 {
-    if (query)
-	switch (mode) {
-	  case 1:		       /* DECCKM: application cursor keys */
-	    term->app_cursor_keys = state;
+    /* 
+     * A VT100 without the AVO only had one
+     * attribute, either underline or
+     * reverse video depending on the
+     * cursor type, this was selected by
+     * CSI 7m.
+     *
+     * case 2:
+     *  This is sometimes DIM, eg on the
+     *  GIGI and Linux
+     * case 8:
+     *  This is sometimes INVIS various ANSI.
+     * case 21:
+     *  This like 22 disables BOLD, DIM and INVIS
+     *
+     * The ANSI colours appear on any
+     * terminal that has colour (obviously)
+     * but the interaction between sgr0 and
+     * the colours varies but is usually
+     * related to the background colour
+     * erase item. The interaction between
+     * colour attributes and the mono ones
+     * is also very implementation
+     * dependent.
+     *
+     * The 39 and 49 attributes are likely
+     * to be unimplemented.
+     */
+    int i;
+    for (i = 0; i < term->esc_nargs; i++) {
+	switch (def(term->esc_args[i], 0)) {
+	  case 0:	/* restore defaults */
+	    term->curr_attr = term->default_attr;
 	    break;
-	  case 2:		       /* DECANM: VT52 mode */
-	    term->vt52_mode = !state;
-	    if (term->vt52_mode) {
-		term->blink_is_real = FALSE;
-		term->vt52_bold = FALSE;
-	    } else {
-		term->blink_is_real = term->cfg.blinktext;
-	    }
+	  case 1:	/* enable bold */
+	    compatibility(VT100AVO);
+	    term->curr_attr |= ATTR_BOLD;
+	    break;
+	  case 21:	/* (enable double underline) */
+	    compatibility(OTHER);
+	  case 4:	/* enable underline */
+	    compatibility(VT100AVO);
+	    term->curr_attr |= ATTR_UNDER;
+	    break;
+	  case 5:	/* enable blink */
+	    compatibility(VT100AVO);
+	    term->curr_attr |= ATTR_BLINK;
+	    break;
+	  case 6:	/* SCO light bkgrd */
+	    compatibility(SCOANSI);
+	    term->blink_is_real = FALSE;
+	    term->curr_attr |= ATTR_BLINK;
 	    term_schedule_tblink(term);
 	    break;
-	  case 3:		       /* DECCOLM: 80/132 columns */
-	    deselect(term);
-	    if (!term->cfg.no_remote_resize)
-		request_resize(term->frontend, state ? 132 : 80, term->rows);
-	    term->reset_132 = state;
-	    term->alt_t = term->marg_t = 0;
-	    term->alt_b = term->marg_b = term->rows - 1;
-	    move(term, 0, 0, 0);
-	    erase_lots(term, FALSE, TRUE, TRUE);
+	  case 7:	/* enable reverse video */
+	    term->curr_attr |= ATTR_REVERSE;
 	    break;
-	  case 5:		       /* DECSCNM: reverse video */
-	    /*
-	     * Toggle reverse video. If we receive an OFF within the
-	     * visual bell timeout period after an ON, we trigger an
-	     * effective visual bell, so that ESC[?5hESC[?5l will
-	     * always be an actually _visible_ visual bell.
-	     */
-	    if (term->rvideo && !state) {
-		/* This is an OFF, so set up a vbell */
-		term_schedule_vbell(term, TRUE, term->rvbell_startpoint);
-	    } else if (!term->rvideo && state) {
-		/* This is an ON, so we notice the time and save it. */
-		term->rvbell_startpoint = GETTICKCOUNT();
+	  case 10:      /* SCO acs off */
+	    compatibility(SCOANSI);
+	    if (term->cfg.no_remote_charset) break;
+	    term->sco_acs = 0; break;
+	  case 11:      /* SCO acs on */
+	    compatibility(SCOANSI);
+	    if (term->cfg.no_remote_charset) break;
+	    term->sco_acs = 1; break;
+	  case 12:      /* SCO acs on, |0x80 */
+	    compatibility(SCOANSI);
+	    if (term->cfg.no_remote_charset) break;
+	    term->sco_acs = 2; break;
+	  case 22:	/* disable bold */
+	    compatibility2(OTHER, VT220);
+	    term->curr_attr &= ~ATTR_BOLD;
+	    break;
+	  case 24:	/* disable underline */
+	    compatibility2(OTHER, VT220);
+	    term->curr_attr &= ~ATTR_UNDER;
+	    break;
+	  case 25:	/* disable blink */
+	    compatibility2(OTHER, VT220);
+	    term->curr_attr &= ~ATTR_BLINK;
+	    break;
+	  case 27:	/* disable reverse video */
+	    compatibility2(OTHER, VT220);
+	    term->curr_attr &= ~ATTR_REVERSE;
+	    break;
+	  case 30:
+	  case 31:
+	  case 32:
+	  case 33:
+	  case 34:
+	  case 35:
+	  case 36:
+	  case 37:
+	    /* foreground */
+	    term->curr_attr &= ~ATTR_FGMASK;
+	    term->curr_attr |=
+		(term->esc_args[i] - 30)<<ATTR_FGSHIFT;
+	    break;
+	  case 90:
+	  case 91:
+	  case 92:
+	  case 93:
+	  case 94:
+	  case 95:
+	  case 96:
+	  case 97:
+	    /* aixterm-style bright foreground */
+	    term->curr_attr &= ~ATTR_FGMASK;
+	    term->curr_attr |=
+		((term->esc_args[i] - 90 + 8)
+		 << ATTR_FGSHIFT);
+	    break;
+	  case 39:	/* default-foreground */
+	    term->curr_attr &= ~ATTR_FGMASK;
+	    term->curr_attr |= ATTR_DEFFG;
+	    break;
+	  case 40:
+	  case 41:
+	  case 42:
+	  case 43:
+	  case 44:
+	  case 45:
+	  case 46:
+	  case 47:
+	    /* background */
+	    term->curr_attr &= ~ATTR_BGMASK;
+	    term->curr_attr |=
+		(term->esc_args[i] - 40)<<ATTR_BGSHIFT;
+	    break;
+	  case 100:
+	  case 101:
+	  case 102:
+	  case 103:
+	  case 104:
+	  case 105:
+	  case 106:
+	  case 107:
+	    /* aixterm-style bright background */
+	    term->curr_attr &= ~ATTR_BGMASK;
+	    term->curr_attr |=
+		((term->esc_args[i] - 100 + 8)
+		 << ATTR_BGSHIFT);
+	    break;
+	  case 49:	/* default-background */
+	    term->curr_attr &= ~ATTR_BGMASK;
+	    term->curr_attr |= ATTR_DEFBG;
+	    break;
+	  case 38:   /* xterm 256-colour mode */
+	    if (i+2 < term->esc_nargs &&
+		term->esc_args[i+1] == 5) {
+		term->curr_attr &= ~ATTR_FGMASK;
+		term->curr_attr |=
+		    ((term->esc_args[i+2] & 0xFF)
+		     << ATTR_FGSHIFT);
+		i += 2;
 	    }
-	    term->rvideo = state;
-	    seen_disp_event(term);
 	    break;
-	  case 6:		       /* DECOM: DEC origin mode */
-	    term->dec_om = state;
+	  case 48:   /* xterm 256-colour mode */
+	    if (i+2 < term->esc_nargs &&
+		term->esc_args[i+1] == 5) {
+		term->curr_attr &= ~ATTR_BGMASK;
+		term->curr_attr |=
+		    ((term->esc_args[i+2] & 0xFF)
+		     << ATTR_BGSHIFT);
+		i += 2;
+	    }
 	    break;
-	  case 7:		       /* DECAWM: auto wrap */
-	    term->wrap = state;
+	}
+    }
+    set_erase_char(term);
+}
+
+/* SCOSC: save cursor */
+static void csi_scosc(Terminal *term, int c)
+{
+    save_cursor(term, TRUE);
+}
+
+/* SCORC: restore cursor */
+static void csi_scorc(Terminal *term, int c)
+{
+    save_cursor(term, FALSE);
+    seen_disp_event(term);
+}
+
+/* DECSLPP and dtterm window operations */
+static void csi_decslpp(Terminal *term, int c)
+{
+    /*
+     * VT340/VT420 sequence DECSLPP, DEC only allows values
+     *  24/25/36/48/72/144 other emulators (eg dtterm) use
+     * illegal values (eg first arg 1..9) for window changing 
+     * and reports.
+     */
+    if (term->esc_nargs <= 1
+	&& (term->esc_args[0] < 1 ||
+	    term->esc_args[0] >= 24)) {
+	if (!has_compat(VT340TEXT))
+	    return;
+	if (!term->cfg.no_remote_resize)
+	    request_resize(term->frontend, term->cols,
+			   def(term->esc_args[0], 24));
+	deselect(term);
+    } else if (term->esc_nargs >= 1 &&
+	       term->esc_args[0] >= 1 &&
+	       term->esc_args[0] < 24) {
+	if (!has_compat(OTHER))
+	    return;
+
+	switch (term->esc_args[0]) {
+	    int x, y, len;
+	    char buf[80], *p;
+	  case 1:
+	    set_iconic(term->frontend, FALSE);
 	    break;
-	  case 8:		       /* DECARM: auto key repeat */
-	    term->repeat_off = !state;
+	  case 2:
+	    set_iconic(term->frontend, TRUE);
 	    break;
-	  case 10:		       /* DECEDM: set local edit mode */
-	    term->term_editing = state;
-	    if (term->ldisc)	       /* cause ldisc to notice changes */
-		ldisc_send(term->ldisc, NULL, 0, 0);
+	  case 3:
+	    if (term->esc_nargs >= 3) {
+		if (!term->cfg.no_remote_resize)
+		    move_window(term->frontend,
+				def(term->esc_args[1], 0),
+				def(term->esc_args[2], 0));
+	    }
+	    break;
+	  case 4:
+	    /* We should resize the window to a given
+	     * size in pixels here, but currently our
+	     * resizing code isn't healthy enough to
+	     * manage it. */
+	    break;
+	  case 5:
+	    /* move to top */
+	    set_zorder(term->frontend, TRUE);
 	    break;
-	  case 25:		       /* DECTCEM: enable/disable cursor */
-	    compatibility2(OTHER, VT220);
-	    term->cursor_on = state;
-	    seen_disp_event(term);
+	  case 6:
+	    /* move to bottom */
+	    set_zorder(term->frontend, FALSE);
 	    break;
-	  case 47:		       /* alternate screen */
-	    compatibility(OTHER);
-	    deselect(term);
-	    swap_screen(term, term->cfg.no_alt_screen ? 0 : state, FALSE, FALSE);
-	    term->disptop = 0;
+	  case 7:
+	    refresh_window(term->frontend);
 	    break;
-	  case 1000:		       /* xterm mouse 1 */
-	    term->xterm_mouse = state ? 1 : 0;
-	    set_raw_mouse_mode(term->frontend, state);
+	  case 8:
+	    if (term->esc_nargs >= 3) {
+		if (!term->cfg.no_remote_resize)
+		    request_resize(term->frontend,
+				   def(term->esc_args[2], term->cfg.width),
+				   def(term->esc_args[1], term->cfg.height));
+	    }
 	    break;
-	  case 1002:		       /* xterm mouse 2 */
-	    term->xterm_mouse = state ? 2 : 0;
-	    set_raw_mouse_mode(term->frontend, state);
+	  case 9:
+	    if (term->esc_nargs >= 2)
+		set_zoomed(term->frontend,
+			   term->esc_args[1] ?
+			   TRUE : FALSE);
 	    break;
-	  case 1047:                   /* alternate screen */
-	    compatibility(OTHER);
-	    deselect(term);
-	    swap_screen(term, term->cfg.no_alt_screen ? 0 : state, TRUE, TRUE);
-	    term->disptop = 0;
+	  case 11:
+	    if (term->ldisc)
+		ldisc_send(term->ldisc,
+			   is_iconic(term->frontend) ?
+			   "\033[1t" : "\033[2t", 4, 0);
 	    break;
-	  case 1048:                   /* save/restore cursor */
-	    if (!term->cfg.no_alt_screen)
-                save_cursor(term, state);
-	    if (!state) seen_disp_event(term);
+	  case 13:
+	    if (term->ldisc) {
+		get_window_pos(term->frontend, &x, &y);
+		len = sprintf(buf, "\033[3;%d;%dt", x, y);
+		ldisc_send(term->ldisc, buf, len, 0);
+	    }
 	    break;
-	  case 1049:                   /* cursor & alternate screen */
-	    if (state && !term->cfg.no_alt_screen)
-		save_cursor(term, state);
-	    if (!state) seen_disp_event(term);
-	    compatibility(OTHER);
-	    deselect(term);
-	    swap_screen(term, term->cfg.no_alt_screen ? 0 : state, TRUE, FALSE);
-	    if (!state && !term->cfg.no_alt_screen)
-		save_cursor(term, state);
-	    term->disptop = 0;
+	  case 14:
+	    if (term->ldisc) {
+		get_window_pixels(term->frontend, &x, &y);
+		len = sprintf(buf, "\033[4;%d;%dt", x, y);
+		ldisc_send(term->ldisc, buf, len, 0);
+	    }
 	    break;
-    } else
-	switch (mode) {
-	  case 4:		       /* IRM: set insert mode */
-	    compatibility(VT102);
-	    term->insert = state;
+	  case 18:
+	    if (term->ldisc) {
+		len = sprintf(buf, "\033[8;%d;%dt",
+			      term->rows, term->cols);
+		ldisc_send(term->ldisc, buf, len, 0);
+	    }
 	    break;
-	  case 12:		       /* SRM: set echo mode */
-	    term->term_echoing = !state;
-	    if (term->ldisc)	       /* cause ldisc to notice changes */
-		ldisc_send(term->ldisc, NULL, 0, 0);
+	  case 19:
+	    /*
+	     * Hmmm. Strictly speaking we
+	     * should return `the size of the
+	     * screen in characters', but
+	     * that's not easy: (a) window
+	     * furniture being what it is it's
+	     * hard to compute, and (b) in
+	     * resize-font mode maximising the
+	     * window wouldn't change the
+	     * number of characters. *shrug*. I
+	     * think we'll ignore it for the
+	     * moment and see if anyone
+	     * complains, and then ask them
+	     * what they would like it to do.
+	     */
 	    break;
-	  case 20:		       /* LNM: Return sends ... */
-	    term->cr_lf_return = state;
+	  case 20:
+	    if (term->ldisc &&
+		term->cfg.remote_qtitle_action != TITLE_NONE) {
+		if(term->cfg.remote_qtitle_action == TITLE_REAL)
+		    p = get_window_title(term->frontend, TRUE);
+		else
+		    p = EMPTY_WINDOW_TITLE;
+		len = strlen(p);
+		ldisc_send(term->ldisc, "\033]L", 3, 0);
+		ldisc_send(term->ldisc, p, len, 0);
+		ldisc_send(term->ldisc, "\033\\", 2, 0);
+	    }
+	    break;
+	  case 21:
+	    if (term->ldisc &&
+		term->cfg.remote_qtitle_action != TITLE_NONE) {
+		if(term->cfg.remote_qtitle_action == TITLE_REAL)
+		    p = get_window_title(term->frontend, FALSE);
+		else
+		    p = EMPTY_WINDOW_TITLE;
+		len = strlen(p);
+		ldisc_send(term->ldisc, "\033]l", 3, 0);
+		ldisc_send(term->ldisc, p, len, 0);
+		ldisc_send(term->ldisc, "\033\\", 2, 0);
+	    }
 	    break;
-	  case 34:		       /* WYULCURM: Make cursor BIG */
-	    compatibility2(OTHER, VT220);
-	    term->big_cursor = !state;
 	}
+    }
 }
 
-/*
- * Process an OSC sequence: set window title or icon name.
- */
-static void do_osc(Terminal *term)
+/* SU: scroll up */
+static void csi_su(Terminal *term, int c)
 {
-    if (term->osc_w) {
-	while (term->osc_strlen--)
-	    term->wordness[(unsigned char)
-		term->osc_string[term->osc_strlen]] = term->esc_args[0];
-    } else {
-	term->osc_string[term->osc_strlen] = '\0';
-	switch (term->esc_args[0]) {
-	  case 0:
-	  case 1:
-	    if (!term->cfg.no_remote_wintitle)
-		set_icon(term->frontend, term->osc_string);
-	    if (term->esc_args[0] == 1)
-		break;
-	    /* fall through: parameter 0 means set both */
-	  case 2:
-	  case 21:
-	    if (!term->cfg.no_remote_wintitle)
-		set_title(term->frontend, term->osc_string);
-	    break;
+    scroll(term, term->marg_t, term->marg_b,
+	   def(term->esc_args[0], 1), TRUE);
+    term->wrapnext = FALSE;
+    seen_disp_event(term);
+}
+
+/* SD: scroll down */
+static void csi_sd(Terminal *term, int c)
+{
+    scroll(term, term->marg_t, term->marg_b,
+	   -def(term->esc_args[0], 1), TRUE);
+    term->wrapnext = FALSE;
+    seen_disp_event(term);
+}
+
+/* DECSNLS: set number of lines on screen */
+static void csi_decsnls(Terminal *term, int c)
+{
+    /* 
+     * Set number of lines on screen
+     * VT420 uses VGA like hardware and can
+     * support any size in reasonable range
+     * (24..49 AIUI) with no default specified.
+     */
+    if (term->esc_nargs == 1 && term->esc_args[0] > 0) {
+	if (!term->cfg.no_remote_resize)
+	    request_resize(term->frontend, term->cols,
+			   def(term->esc_args[0],
+			       term->cfg.height));
+	deselect(term);
+    }
+}
+
+/* DECSCPP: set number of columns per page */
+static void csi_decscpp(Terminal *term, int c)
+{
+    /*
+     * Set number of columns per page
+     * Docs imply range is only 80 or 132, but
+     * I'll allow any.
+     */
+    if (term->esc_nargs <= 1) {
+	if (!term->cfg.no_remote_resize)
+	    request_resize(term->frontend,
+			   def(term->esc_args[0],
+			       term->cfg.width), term->rows);
+	deselect(term);
+    }
+}
+
+/* ECH: write N spaces w/o moving cursor */
+static void csi_ech(Terminal *term, int c)
+{
+    /* XXX VTTEST says this is vt220, vt510 manual
+     * says vt100 */
+    int n = def(term->esc_args[0], 1);
+    pos cursplus;
+    int p = term->curs.x;
+    termline *cline = scrlineptr(term->curs.y);
+
+    if (n > term->cols - term->curs.x)
+	n = term->cols - term->curs.x;
+    cursplus = term->curs;
+    cursplus.x += n;
+    check_boundary(term, term->curs.x, term->curs.y);
+    check_boundary(term, term->curs.x+n, term->curs.y);
+    check_selection(term, term->curs, cursplus);
+    while (n--)
+	copy_termchar(cline, p++,
+		      &term->erase_char, NULL);
+    seen_disp_event(term);
+}
+
+/* DECREQTPARM: report terminal characteristics */
+static void csi_decreqtparm(Terminal *term, int c)
+{
+    if (term->ldisc) {
+	char buf[32];
+	int i = def(term->esc_args[0], 0);
+	if (i == 0 || i == 1) {
+	    strcpy(buf, "\033[2;1;1;112;112;1;0x");
+	    buf[2] += i;
+	    ldisc_send(term->ldisc, buf, 20, 0);
 	}
     }
 }
 
-/*
- * ANSI printing routines.
- */
-static void term_print_setup(Terminal *term)
+/* CBT: move back N tab stops */
+static void csi_cbt(Terminal *term, int c)
 {
-    bufchain_clear(&term->printer_buf);
-    term->print_job = printer_start_job(term->cfg.printer);
+    int i = def(term->esc_args[0], 1);
+    pos old_curs = term->curs;
+
+    for(;i>0 && term->curs.x>0; i--) {
+	do {
+	    term->curs.x--;
+	} while (term->curs.x >0 &&
+		 !term->tabs[term->curs.x]);
+    }
+    check_selection(term, old_curs, term->curs);
 }
-static void term_print_flush(Terminal *term)
+
+/* SCO: hide or show cursor */
+static void csi_scocursor(Terminal *term, int c)
 {
-    void *data;
-    int len;
-    int size;
-    while ((size = bufchain_size(&term->printer_buf)) > 5) {
-	bufchain_prefix(&term->printer_buf, &data, &len);
-	if (len > size-5)
-	    len = size-5;
-	printer_job_data(term->print_job, data, len);
-	bufchain_consume(&term->printer_buf, len);
+    switch(term->esc_args[0]) {
+      case 0:  /* hide cursor */
+	term->cursor_on = FALSE;
+	break;
+      case 1:  /* restore cursor */
+	term->big_cursor = FALSE;
+	term->cursor_on = TRUE;
+	break;
+      case 2:  /* block cursor */
+	term->big_cursor = TRUE;
+	term->cursor_on = TRUE;
+	break;
     }
 }
-static void term_print_finish(Terminal *term)
+
+/* SCO: set cursor start and end scanlines */
+static void csi_scocursorshape(Terminal *term, int c)
 {
-    void *data;
-    int len, size;
-    char c;
+    /*
+     * set cursor start on scanline esc_args[0] and
+     * end on scanline esc_args[1].If you set
+     * the bottom scan line to a value less than
+     * the top scan line, the cursor will disappear.
+     */
+    if (term->esc_nargs >= 2) {
+	if (term->esc_args[0] > term->esc_args[1])
+	    term->cursor_on = FALSE;
+	else
+	    term->cursor_on = TRUE;
+    }
+}
 
-    if (!term->printing && !term->only_printing)
-	return;			       /* we need do nothing */
+/* SCO: set blink attribute */
+static void csi_scoblink(Terminal *term, int c)
+{
+    term->blink_is_real = FALSE;
+    term_schedule_tblink(term);
+    if (term->esc_args[0]>=1)
+	term->curr_attr |= ATTR_BLINK;
+    else
+	term->curr_attr &= ~ATTR_BLINK;
+}
 
-    term_print_flush(term);
-    while ((size = bufchain_size(&term->printer_buf)) > 0) {
-	bufchain_prefix(&term->printer_buf, &data, &len);
-	c = *(char *)data;
-	if (c == '\033' || c == '\233') {
-	    bufchain_consume(&term->printer_buf, size);
-	    break;
+/* SCO: choose real blink or bright background */
+static void csi_scorealblink(Terminal *term, int c)
+{
+    term->blink_is_real = (term->esc_args[0] >= 1);
+    term_schedule_tblink(term);
+}
+
+/* SCO: set normal foreground */
+static void csi_scofg(Terminal *term, int c)
+{
+    if (term->esc_args[0] >= 0 && term->esc_args[0] < 16) {
+	long colour =
+	    (sco2ansicolour[term->esc_args[0] & 0x7] |
+	     (term->esc_args[0] & 0x8)) <<
+	    ATTR_FGSHIFT;
+	term->curr_attr &= ~ATTR_FGMASK;
+	term->curr_attr |= colour;
+	term->default_attr &= ~ATTR_FGMASK;
+	term->default_attr |= colour;
+	set_erase_char(term);
+    }
+}
+
+/* SCO: set normal background */
+static void csi_scobg(Terminal *term, int c)
+{
+    if (term->esc_args[0] >= 0 && term->esc_args[0] < 16) {
+	long colour =
+	    (sco2ansicolour[term->esc_args[0] & 0x7] |
+	     (term->esc_args[0] & 0x8)) <<
+	    ATTR_BGSHIFT;
+	term->curr_attr &= ~ATTR_BGMASK;
+	term->curr_attr |= colour;
+	term->default_attr &= ~ATTR_BGMASK;
+	term->default_attr |= colour;
+	set_erase_char(term);
+    }
+}
+
+/* SCO: set background colour erase */
+static void csi_scobce(Terminal *term, int c)
+{
+    term->use_bce = (term->esc_args[0] <= 0);
+    set_erase_char(term);
+}
+
+/* DECSCL: set compat level */
+static void csi_decscl(Terminal *term, int c)
+{
+    /*
+     * Allow the host to make this emulator a
+     * 'perfect' VT102. This first appeared in
+     * the VT220, but we do need to get back to
+     * PuTTY mode so I won't check it.
+     *
+     * The arg in 40..42,50 are a PuTTY extension.
+     * The 2nd arg, 8bit vs 7bit is not checked.
+     *
+     * Setting VT102 mode should also change
+     * the Fkeys to generate PF* codes as a
+     * real VT102 has no Fkeys. The VT220 does
+     * this, F11..F13 become ESC,BS,LF other
+     * Fkeys send nothing.
+     *
+     * Note ESC c will NOT change this!
+     */
+
+    switch (term->esc_args[0]) {
+      case 61:
+	term->compatibility_level &= ~TM_VTXXX;
+	term->compatibility_level |= TM_VT102;
+	break;
+      case 62:
+	term->compatibility_level &= ~TM_VTXXX;
+	term->compatibility_level |= TM_VT220;
+	break;
+
+      default:
+	if (term->esc_args[0] > 60 &&
+	    term->esc_args[0] < 70)
+	    term->compatibility_level |= TM_VTXXX;
+	break;
+
+      case 40:
+	term->compatibility_level &= TM_VTXXX;
+	break;
+      case 41:
+	term->compatibility_level = TM_PUTTY;
+	break;
+      case 42:
+	term->compatibility_level = TM_SCOANSI;
+	break;
+
+      case ARG_DEFAULT:
+	term->compatibility_level = TM_PUTTY;
+	break;
+      case 50:
+	break;
+    }
+
+    /* Change the response to CSI c */
+    if (term->esc_args[0] == 50) {
+	int i;
+	char lbuf[64];
+	strcpy(term->id_string, "\033[?");
+	for (i = 1; i < term->esc_nargs; i++) {
+	    if (i != 1)
+		strcat(term->id_string, ";");
+	    sprintf(lbuf, "%d", term->esc_args[i]);
+	    strcat(term->id_string, lbuf);
+	}
+	strcat(term->id_string, "c");
+    }
+#if 0
+    /* Is this a good idea ? 
+     * Well we should do a soft reset at this point ...
+     */
+    if (!has_compat(VT420) && has_compat(VT100)) {
+	if (!term->cfg.no_remote_resize) {
+	    if (term->reset_132)
+		request_resize(132, 24);
+	    else
+		request_resize(80, 24);
+	}
+    }
+#endif
+}
+
+/*
+ * Dispatch tables for escape sequences. Each entry names the
+ * sequence by ANSI(final, intermediate), the compatibility classes
+ * any one of which must be enabled for us to act on it (0 if it is
+ * always acted on), and the handler.
+ *
+ * CSI sequences with no intermediate or private marker are by far
+ * the most common, so they are looked up directly by final byte in
+ * csi_plain_actions[]; everything else is found by a linear search.
+ */
+struct esc_action {
+    int key;
+    int compat;
+    void (*handler)(Terminal *term, int c);
+};
+
+static const struct esc_action esc_actions[] = {
+    { '[', 0, esc_csi },	       /* by far the most common */
+    { ']', CL_OTHER, esc_osc },
+    { '7', CL_VT100, esc_decsc },
+    { '8', CL_VT100, esc_decrc },
+    { '=', CL_VT100, esc_deckpam },
+    { '>', CL_VT100, esc_deckpnm },
+    { 'D', CL_VT100, esc_ind },
+    { 'E', CL_VT100, esc_nel },
+    { 'M', CL_VT100, esc_ri },
+    { 'Z', CL_VT100, esc_decid },
+    { 'c', CL_VT100, esc_ris },
+    { 'H', CL_VT100, esc_hts },
+    { ANSI('8', '#'), CL_VT100, esc_decaln },
+    { ANSI('3', '#'), CL_VT100, esc_declattr },
+    { ANSI('4', '#'), CL_VT100, esc_declattr },
+    { ANSI('5', '#'), CL_VT100, esc_declattr },
+    { ANSI('6', '#'), CL_VT100, esc_declattr },
+    { ANSI('A', '('), CL_VT100, esc_scs },
+    { ANSI('B', '('), CL_VT100, esc_scs },
+    { ANSI('0', '('), CL_VT100, esc_scs },
+    { ANSI('U', '('), CL_OTHER, esc_scs },
+    { ANSI('A', ')'), CL_VT100, esc_scs },
+    { ANSI('B', ')'), CL_VT100, esc_scs },
+    { ANSI('0', ')'), CL_VT100, esc_scs },
+    { ANSI('U', ')'), CL_OTHER, esc_scs },
+    { ANSI('8', '%'), CL_OTHER, esc_docs },   /* Old Linux code */
+    { ANSI('G', '%'), CL_OTHER, esc_docs },
+    { ANSI('@', '%'), CL_OTHER, esc_docs },
+};
+
+static const struct esc_action csi_plain_actions[64] = {
+    { '@', CL_VT102, csi_ich },
+    { 'A', 0, csi_cuu },
+    { 'B', 0, csi_cud },
+    { 'C', 0, csi_cuf },
+    { 'D', 0, csi_cub },
+    { 'E', CL_ANSI, csi_cnl },
+    { 'F', CL_ANSI, csi_cpl },
+    { 'G', CL_ANSI, csi_cha },
+    { 'H', 0, csi_cup },
+    { 'I', 0, NULL },
+    { 'J', 0, csi_ed },
+    { 'K', 0, csi_el },
+    { 'L', CL_VT102, csi_il },
+    { 'M', CL_VT102, csi_dl },
+    { 'N', 0, NULL },
+    { 'O', 0, NULL },
+    { 'P', CL_VT102, csi_dch },
+    { 'Q', 0, NULL },
+    { 'R', 0, NULL },
+    { 'S', CL_SCOANSI, csi_su },
+    { 'T', CL_SCOANSI, csi_sd },
+    { 'U', 0, NULL },
+    { 'V', 0, NULL },
+    { 'W', 0, NULL },
+    { 'X', CL_ANSIMIN, csi_ech },
+    { 'Y', 0, NULL },
+    { 'Z', CL_OTHER, csi_cbt },
+    { '[', 0, NULL },
+    { '\\', 0, NULL },
+    { ']', 0, NULL },
+    { '^', 0, NULL },
+    { '_', 0, NULL },
+    { '`', CL_ANSI, csi_cha },	       /* HPA */
+    { 'a', CL_ANSI, csi_cuf },	       /* HPR */
+    { 'b', 0, NULL },
+    { 'c', CL_VT100, csi_da },
+    { 'd', CL_ANSI, csi_vpa },
+    { 'e', CL_ANSI, csi_cud },	       /* VPR */
+    { 'f', 0, csi_cup },	       /* HVP */
+    { 'g', CL_VT100, csi_tbc },
+    { 'h', CL_VT100, csi_sm },
+    { 'i', CL_VT100, csi_mc },
+    { 'j', 0, NULL },
+    { 'k', 0, NULL },
+    { 'l', CL_VT100, csi_rm },
+    { 'm', 0, csi_sgr },
+    { 'n', 0, csi_dsr },
+    { 'o', 0, NULL },
+    { 'p', 0, NULL },
+    { 'q', 0, NULL },
+    { 'r', CL_VT100, csi_decstbm },
+    { 's', 0, csi_scosc },
+    { 't', 0, csi_decslpp },	       /* checks compatibility itself */
+    { 'u', 0, csi_scorc },
+    { 'v', 0, NULL },
+    { 'w', 0, NULL },
+    { 'x', CL_VT100, csi_decreqtparm },
+    { 'y', 0, NULL },
+    { 'z', 0, NULL },
+    { '{', 0, NULL },
+    { '|', 0, NULL },
+    { '}', 0, NULL },
+    { '~', 0, NULL },
+    { '\177', 0, NULL },
+};
+
+static const struct esc_action csi_other_actions[] = {
+    { ANSI_QUE('h'), CL_VT100, csi_sm },
+    { ANSI_QUE('l'), CL_VT100, csi_rm },
+    { ANSI_QUE('i'), CL_VT100, csi_mc },
+    { ANSI('c', '>'), CL_OTHER, csi_da2 },
+    { ANSI('|', '*'), CL_VT420, csi_decsnls },
+    { ANSI('|', '$'), CL_VT340TEXT, csi_decscpp },
+    { ANSI('c', '='), CL_SCOANSI, csi_scocursor },
+    { ANSI('C', '='), CL_SCOANSI, csi_scocursorshape },
+    { ANSI('D', '='), CL_SCOANSI, csi_scoblink },
+    { ANSI('E', '='), CL_SCOANSI, csi_scorealblink },
+    { ANSI('F', '='), CL_SCOANSI, csi_scofg },
+    { ANSI('G', '='), CL_SCOANSI, csi_scobg },
+    { ANSI('L', '='), CL_SCOANSI, csi_scobce },
+    { ANSI('p', '"'), 0, csi_decscl },
+};
+
+/*
+ * Classes of byte seen by the escape sequence parser. Control
+ * characters are acted on by term_out_chars() before they get here
+ * (except in the OSC string states, which we don't handle), so
+ * EB_CTRL is only here for completeness.
+ */
+enum {
+    EB_CTRL,			       /* 00-1F */
+    EB_INTER,			       /* 20-2F: intermediate */
+    EB_DIGIT,			       /* 30-39: numeric argument */
+    EB_SEMI,			       /* 3B: argument separator */
+    EB_PRIVATE,			       /* 3A, 3C-3F: private marker */
+    EB_FINAL,			       /* 40-7E, and DEL and above */
+    EB_NCLASSES
+};
+
+static const unsigned char esc_byteclass[128] = {
+    EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL,
+    EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL,
+    EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL,
+    EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL, EB_CTRL,
+    EB_INTER, EB_INTER, EB_INTER, EB_INTER,
+    EB_INTER, EB_INTER, EB_INTER, EB_INTER,
+    EB_INTER, EB_INTER, EB_INTER, EB_INTER,
+    EB_INTER, EB_INTER, EB_INTER, EB_INTER,
+    EB_DIGIT, EB_DIGIT, EB_DIGIT, EB_DIGIT,
+    EB_DIGIT, EB_DIGIT, EB_DIGIT, EB_DIGIT,
+    EB_DIGIT, EB_DIGIT, EB_PRIVATE, EB_SEMI,
+    EB_PRIVATE, EB_PRIVATE, EB_PRIVATE, EB_PRIVATE,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+    EB_FINAL, EB_FINAL, EB_FINAL, EB_FINAL,
+};
+
+/*
+ * What to do with each class of byte in SEEN_ESC (row 0, also used
+ * for OSC_MAYBE_ST) and SEEN_CSI (row 1).
+ */
+enum { EA_DISPATCH, EA_COLLECT, EA_PARAM, EA_NEXTARG };
+
+static const unsigned char esc_transitions[2][EB_NCLASSES] = {
+    /* CTRL         INTER       DIGIT        SEMI         PRIVATE      FINAL */
+    { EA_DISPATCH, EA_COLLECT, EA_DISPATCH, EA_DISPATCH, EA_DISPATCH, EA_DISPATCH },
+    { EA_COLLECT,  EA_COLLECT, EA_PARAM,    EA_NEXTARG,  EA_COLLECT,  EA_DISPATCH },
+};
+
+/*
+ * Process one character of an escape sequence, in state SEEN_ESC,
+ * SEEN_CSI or OSC_MAYBE_ST.
+ */
+static void term_esc_char(Terminal *term, unsigned long c)
+{
+    const struct esc_action *act;
+    int csi = (term->termstate == SEEN_CSI);
+    int i, key;
+
+    switch (esc_transitions[csi][c < 0x80 ? esc_byteclass[c] : EB_FINAL]) {
+      case EA_COLLECT:
+	if (term->esc_query)
+	    term->esc_query = -1;
+	else if (c == '?')
+	    term->esc_query = TRUE;
+	else
+	    term->esc_query = c;
+	break;
+      case EA_PARAM:
+	if (term->esc_nargs <= ARGS_MAX) {
+	    if (term->esc_args[term->esc_nargs - 1] == ARG_DEFAULT)
+		term->esc_args[term->esc_nargs - 1] = 0;
+	    term->esc_args[term->esc_nargs - 1] =
+		10 * term->esc_args[term->esc_nargs - 1] + c - '0';
+	}
+	break;
+      case EA_NEXTARG:
+	if (++term->esc_nargs <= ARGS_MAX)
+	    term->esc_args[term->esc_nargs - 1] = ARG_DEFAULT;
+	break;
+      case EA_DISPATCH:
+	term->termstate = TOPLEVEL;
+	key = ANSI(c, term->esc_query);
+	act = NULL;
+	if (csi && !term->esc_query && c >= '@' && c < 0x80) {
+	    act = &csi_plain_actions[c - '@'];
+	} else if (csi) {
+	    for (i = 0; i < lenof(csi_other_actions); i++)
+		if (csi_other_actions[i].key == key) {
+		    act = &csi_other_actions[i];
+		    break;
+		}
 	} else {
-	    printer_job_data(term->print_job, &c, 1);
-	    bufchain_consume(&term->printer_buf, 1);
+	    for (i = 0; i < lenof(esc_actions); i++)
+		if (esc_actions[i].key == key) {
+		    act = &esc_actions[i];
+		    break;
+		}
 	}
+	if (act && act->handler &&
+	    (!act->compat || (act->compat & term->compatibility_level)))
+	    act->handler(term, c);
+	break;
     }
-    printer_finish_job(term->print_job);
-    term->print_job = NULL;
-    term->printing = term->only_printing = FALSE;
 }
 
 /*
- * Remove everything currently in `inbuf' and stick it up on the
- * in-memory display. There's a big state machine in here to
+ * Process a block of output from the backend and stick it up on
+ * the in-memory display. There's a big state machine in here to
  * process escape sequences...
  */
-static void term_out(Terminal *term)
+static void term_out_chars(Terminal *term, const unsigned char *chars,
+			   int nchars)
 {
     unsigned long c;
     int unget;
-    unsigned char localbuf[256], *chars;
-    int nchars = 0;
+    unsigned long ucsbuf[256];
+    int nrun, nucs = 0, ucspos = 0, decoded;
 
     unget = -1;
 
-    chars = NULL;		       /* placate compiler warnings */
-    while (nchars > 0 || unget != -1 || bufchain_size(&term->inbuf) > 0) {
-	if (unget == -1) {
-	    if (nchars == 0) {
-		void *ret;
-		bufchain_prefix(&term->inbuf, &ret, &nchars);
-		if (nchars > sizeof(localbuf))
-		    nchars = sizeof(localbuf);
-		memcpy(localbuf, ret, nchars);
-		bufchain_consume(&term->inbuf, nchars);
-		chars = localbuf;
-		assert(chars != NULL);
+    /*
+     * Optionally log the session traffic to a file. Useful for
+     * debugging and possibly also useful for actual logging. Every
+     * byte goes in the raw log exactly once, so do the lot now.
+     */
+    if (term->logctx)
+	logtraffic_span(term->logctx, chars, nchars, LGTYP_DEBUG);
+
+    while (nucs > 0 || nchars > 0 || unget != -1) {
+	if (nucs > 0) {
+	    /*
+	     * Take the next character from a batch that has already
+	     * been through the UTF-8 decoder.
+	     */
+	    c = ucsbuf[ucspos++];
+	    nucs--;
+	    decoded = TRUE;
+	} else if (unget == -1) {
+	    nrun = term_out_ascii(term, chars, nchars);
+	    if (nrun > 0) {
+		chars += nrun;
+		nchars -= nrun;
+		continue;
 	    }
-	    c = *chars++;
-	    nchars--;
 
 	    /*
-	     * Optionally log the session traffic to a file. Useful for
-	     * debugging and possibly also useful for actual logging.
+	     * In UTF-8 mode at top level, decode as much as we can in
+	     * one go. Nothing short of an escape sequence can change
+	     * the decoding state, and the decoder stops before ESC.
 	     */
-	    if (term->cfg.logtype == LGTYP_DEBUG && term->logctx)
-		logtraffic(term->logctx, (unsigned char) c, LGTYP_DEBUG);
+	    if (term->termstate == TOPLEVEL && in_utf(term) &&
+		!term->printing) {
+		nucs = lenof(ucsbuf);
+		nrun = term_utf8_decode(term, chars, nchars,
+					ucsbuf, &nucs, TRUE);
+		chars += nrun;
+		nchars -= nrun;
+		ucspos = 0;
+		if (nrun > 0 || nucs > 0)
+		    continue;
+	    }
+
+	    c = *chars++;
+	    nchars--;
+	    decoded = FALSE;
 	} else {
 	    c = unget;
 	    unget = -1;
+	    decoded = FALSE;
 	}
 
 	/* Note only VT220+ are 8-bit VT102 is seven bit, it shouldn't even
@@ -2569,91 +5314,17 @@ static void term_out(Terminal *term)
 	}
 
 	/* First see about all those translations. */
-	if (term->termstate == TOPLEVEL) {
-	    if (in_utf(term))
-		switch (term->utf_state) {
-		  case 0:
-		    if (c < 0x80) {
-			/* UTF-8 must be stateless so we ignore iso2022. */
-			if (term->ucsdata->unitab_ctrl[c] != 0xFF) 
-			     c = term->ucsdata->unitab_ctrl[c];
-			else c = ((unsigned char)c) | CSET_ASCII;
-			break;
-		    } else if ((c & 0xe0) == 0xc0) {
-			term->utf_size = term->utf_state = 1;
-			term->utf_char = (c & 0x1f);
-		    } else if ((c & 0xf0) == 0xe0) {
-			term->utf_size = term->utf_state = 2;
-			term->utf_char = (c & 0x0f);
-		    } else if ((c & 0xf8) == 0xf0) {
-			term->utf_size = term->utf_state = 3;
-			term->utf_char = (c & 0x07);
-		    } else if ((c & 0xfc) == 0xf8) {
-			term->utf_size = term->utf_state = 4;
-			term->utf_char = (c & 0x03);
-		    } else if ((c & 0xfe) == 0xfc) {
-			term->utf_size = term->utf_state = 5;
-			term->utf_char = (c & 0x01);
-		    } else {
-			c = UCSERR;
-			break;
-		    }
+	if (term->termstate == TOPLEVEL && !decoded) {
+	    if (in_utf(term)) {
+		unsigned char byte = (unsigned char) c;
+		unsigned long uc;
+		int nuc = 1;
+
+		if (!term_utf8_decode(term, &byte, 1, &uc, &nuc, FALSE))
+		    unget = byte;      /* reprocess after the error */
+		if (!nuc)
 		    continue;
-		  case 1:
-		  case 2:
-		  case 3:
-		  case 4:
-		  case 5:
-		    if ((c & 0xC0) != 0x80) {
-			unget = c;
-			c = UCSERR;
-			term->utf_state = 0;
-			break;
-		    }
-		    term->utf_char = (term->utf_char << 6) | (c & 0x3f);
-		    if (--term->utf_state)
-			continue;
-
-		    c = term->utf_char;
-
-		    /* Is somebody trying to be evil! */
-		    if (c < 0x80 ||
-			(c < 0x800 && term->utf_size >= 2) ||
-			(c < 0x10000 && term->utf_size >= 3) ||
-			(c < 0x200000 && term->utf_size >= 4) ||
-			(c < 0x4000000 && term->utf_size >= 5))
-			c = UCSERR;
-
-		    /* Unicode line separator and paragraph separator are CR-LF */
-		    if (c == 0x2028 || c == 0x2029)
-			c = 0x85;
-
-		    /* High controls are probably a Baaad idea too. */
-		    if (c < 0xA0)
-			c = 0xFFFD;
-
-		    /* The UTF-16 surrogates are not nice either. */
-		    /*       The standard give the option of decoding these: 
-		     *       I don't want to! */
-		    if (c >= 0xD800 && c < 0xE000)
-			c = UCSERR;
-
-		    /* ISO 10646 characters now limited to UTF-16 range. */
-		    if (c > 0x10FFFF)
-			c = UCSERR;
-
-		    /* This is currently a TagPhobic application.. */
-		    if (c >= 0xE0000 && c <= 0xE007F)
-			continue;
-
-		    /* U+FEFF is best seen as a null. */
-		    if (c == 0xFEFF)
-			continue;
-		    /* But U+FFFE is an error. */
-		    if (c == 0xFFFE || c == 0xFFFF)
-			c = UCSERR;
-
-		    break;
+		c = uc;
 	    }
 	    /* Are we in the nasty ACS mode? Note: no sco in utf mode. */
 	    else if(term->sco_acs && 
@@ -2720,7 +5391,7 @@ static void term_out(Terminal *term)
 		check_boundary(term, term->curs.x, term->curs.y);
 		check_boundary(term, term->curs.x+1, term->curs.y);
 		copy_termchar(scrlineptr(term->curs.y),
-			      term->curs.x, &term->erase_char);
+			      term->curs.x, &term->erase_char, NULL);
 	    }
 	} else
 	    /* Or normal C0 controls. */
@@ -2880,7 +5551,7 @@ static void term_out(Terminal *term)
 	      case '\t':	      /* HT: Character tabulation */
 		{
 		    pos old_curs = term->curs;
-		    termline *ldata = scrlineptr(term->curs.y);
+		    termline *ldata = lineptr(term->curs.y);
 
 		    do {
 			term->curs.x++;
@@ -2906,7 +5577,12 @@ static void term_out(Terminal *term)
 		/* Only graphic characters get this far;
 		 * ctrls are stripped above */
 		{
-		    termline *cline = scrlineptr(term->curs.y);
+		    /*
+		     * This is the commonest way for the screen to
+		     * change, so rather than use scrlineptr() we mark
+		     * as damaged only the cells we actually write.
+		     */
+		    termline *cline = lineptr(term->curs.y);
 		    int width = 0;
 		    if (DIRECT_CHAR(c))
 			width = 1;
@@ -2917,13 +5593,14 @@ static void term_out(Terminal *term)
 
 		    if (term->wrapnext && term->wrap && width > 0) {
 			cline->lattr |= LATTR_WRAPPED;
+			term_damage(term, term->curs.y, 0, term->cols);
 			if (term->curs.y == term->marg_b)
 			    scroll(term, term->marg_t, term->marg_b, 1, TRUE);
 			else if (term->curs.y < term->rows - 1)
 			    term->curs.y++;
 			term->curs.x = 0;
 			term->wrapnext = FALSE;
-			cline = scrlineptr(term->curs.y);
+			cline = lineptr(term->curs.y);
 		    }
 		    if (term->insert && width > 0)
 			insch(term, width);
@@ -2963,15 +5640,16 @@ static void term_out(Terminal *term)
 			check_boundary(term, term->curs.x+2, term->curs.y);
 			if (term->curs.x == term->cols-1) {
 			    copy_termchar(cline, term->curs.x,
-					  &term->erase_char);
+					  &term->erase_char, NULL);
 			    cline->lattr |= LATTR_WRAPPED | LATTR_WRAPPED2;
+			    term_damage(term, term->curs.y, 0, term->cols);
 			    if (term->curs.y == term->marg_b)
 				scroll(term, term->marg_t, term->marg_b,
 				       1, TRUE);
 			    else if (term->curs.y < term->rows - 1)
 				term->curs.y++;
 			    term->curs.x = 0;
-			    cline = scrlineptr(term->curs.y);
+			    cline = lineptr(term->curs.y);
 			    /* Now we must check_boundary again, of course. */
 			    check_boundary(term, term->curs.x, term->curs.y);
 			    check_boundary(term, term->curs.x+2, term->curs.y);
@@ -2981,6 +5659,8 @@ static void term_out(Terminal *term)
 			clear_cc(cline, term->curs.x);
 			cline->chars[term->curs.x].chr = c;
 			cline->chars[term->curs.x].attr = term->curr_attr;
+			term_damage(term, term->curs.y,
+				    term->curs.x, term->curs.x + 2);
 
 			term->curs.x++;
 
@@ -2998,6 +5678,8 @@ static void term_out(Terminal *term)
 			clear_cc(cline, term->curs.x);
 			cline->chars[term->curs.x].chr = c;
 			cline->chars[term->curs.x].attr = term->curr_attr;
+			term_damage(term, term->curs.y,
+				    term->curs.x, term->curs.x + 1);
 
 			break;
 		      case 0:
@@ -3019,6 +5701,7 @@ static void term_out(Terminal *term)
 			    }
 
 			    add_cc(cline, x, c);
+			    term_damage(term, term->curs.y, x, x + 1);
 			    seen_disp_event(term);
 			}
 			continue;
@@ -3031,6 +5714,7 @@ static void term_out(Terminal *term)
 			term->wrapnext = TRUE;
 			if (term->wrap && term->vt52_mode) {
 			    cline->lattr |= LATTR_WRAPPED;
+			    term_damage(term, term->curs.y, 0, term->cols);
 			    if (term->curs.y == term->marg_b)
 				scroll(term, term->marg_t, term->marg_b, 1, TRUE);
 			    else if (term->curs.y < term->rows - 1)
@@ -3056,1023 +5740,8 @@ static void term_out(Terminal *term)
 		}
 		/* else fall through */
 	      case SEEN_ESC:
-		if (c >= ' ' && c <= '/') {
-		    if (term->esc_query)
-			term->esc_query = -1;
-		    else
-			term->esc_query = c;
-		    break;
-		}
-		term->termstate = TOPLEVEL;
-		switch (ANSI(c, term->esc_query)) {
-		  case '[':		/* enter CSI mode */
-		    term->termstate = SEEN_CSI;
-		    term->esc_nargs = 1;
-		    term->esc_args[0] = ARG_DEFAULT;
-		    term->esc_query = FALSE;
-		    break;
-		  case ']':		/* OSC: xterm escape sequences */
-		    /* Compatibility is nasty here, xterm, linux, decterm yuk! */
-		    compatibility(OTHER);
-		    term->termstate = SEEN_OSC;
-		    term->esc_args[0] = 0;
-		    break;
-		  case '7':		/* DECSC: save cursor */
-		    compatibility(VT100);
-		    save_cursor(term, TRUE);
-		    break;
-		  case '8':	 	/* DECRC: restore cursor */
-		    compatibility(VT100);
-		    save_cursor(term, FALSE);
-		    seen_disp_event(term);
-		    break;
-		  case '=':		/* DECKPAM: Keypad application mode */
-		    compatibility(VT100);
-		    term->app_keypad_keys = TRUE;
-		    break;
-		  case '>':		/* DECKPNM: Keypad numeric mode */
-		    compatibility(VT100);
-		    term->app_keypad_keys = FALSE;
-		    break;
-		  case 'D':	       /* IND: exactly equivalent to LF */
-		    compatibility(VT100);
-		    if (term->curs.y == term->marg_b)
-			scroll(term, term->marg_t, term->marg_b, 1, TRUE);
-		    else if (term->curs.y < term->rows - 1)
-			term->curs.y++;
-		    term->wrapnext = FALSE;
-		    seen_disp_event(term);
-		    break;
-		  case 'E':	       /* NEL: exactly equivalent to CR-LF */
-		    compatibility(VT100);
-		    term->curs.x = 0;
-		    if (term->curs.y == term->marg_b)
-			scroll(term, term->marg_t, term->marg_b, 1, TRUE);
-		    else if (term->curs.y < term->rows - 1)
-			term->curs.y++;
-		    term->wrapnext = FALSE;
-		    seen_disp_event(term);
-		    break;
-		  case 'M':	       /* RI: reverse index - backwards LF */
-		    compatibility(VT100);
-		    if (term->curs.y == term->marg_t)
-			scroll(term, term->marg_t, term->marg_b, -1, TRUE);
-		    else if (term->curs.y > 0)
-			term->curs.y--;
-		    term->wrapnext = FALSE;
-		    seen_disp_event(term);
-		    break;
-		  case 'Z':	       /* DECID: terminal type query */
-		    compatibility(VT100);
-		    if (term->ldisc)
-			ldisc_send(term->ldisc, term->id_string,
-				   strlen(term->id_string), 0);
-		    break;
-		  case 'c':	       /* RIS: restore power-on settings */
-		    compatibility(VT100);
-		    power_on(term, TRUE);
-		    if (term->ldisc)   /* cause ldisc to notice changes */
-			ldisc_send(term->ldisc, NULL, 0, 0);
-		    if (term->reset_132) {
-			if (!term->cfg.no_remote_resize)
-			    request_resize(term->frontend, 80, term->rows);
-			term->reset_132 = 0;
-		    }
-		    term->disptop = 0;
-		    seen_disp_event(term);
-		    break;
-		  case 'H':	       /* HTS: set a tab */
-		    compatibility(VT100);
-		    term->tabs[term->curs.x] = TRUE;
-		    break;
-
-		  case ANSI('8', '#'):	/* DECALN: fills screen with Es :-) */
-		    compatibility(VT100);
-		    {
-			termline *ldata;
-			int i, j;
-			pos scrtop, scrbot;
-
-			for (i = 0; i < term->rows; i++) {
-			    ldata = scrlineptr(i);
-			    for (j = 0; j < term->cols; j++) {
-				copy_termchar(ldata, j,
-					      &term->basic_erase_char);
-				ldata->chars[j].chr = 'E';
-			    }
-			    ldata->lattr = LATTR_NORM;
-			}
-			term->disptop = 0;
-			seen_disp_event(term);
-			scrtop.x = scrtop.y = 0;
-			scrbot.x = 0;
-			scrbot.y = term->rows;
-			check_selection(term, scrtop, scrbot);
-		    }
-		    break;
-
-		  case ANSI('3', '#'):
-		  case ANSI('4', '#'):
-		  case ANSI('5', '#'):
-		  case ANSI('6', '#'):
-		    compatibility(VT100);
-		    {
-			int nlattr;
-
-			switch (ANSI(c, term->esc_query)) {
-			  case ANSI('3', '#'): /* DECDHL: 2*height, top */
-			    nlattr = LATTR_TOP;
-			    break;
-			  case ANSI('4', '#'): /* DECDHL: 2*height, bottom */
-			    nlattr = LATTR_BOT;
-			    break;
-			  case ANSI('5', '#'): /* DECSWL: normal */
-			    nlattr = LATTR_NORM;
-			    break;
-			  default: /* case ANSI('6', '#'): DECDWL: 2*width */
-			    nlattr = LATTR_WIDE;
-			    break;
-			}
-			scrlineptr(term->curs.y)->lattr = nlattr;
-		    }
-		    break;
-		  /* GZD4: G0 designate 94-set */
-		  case ANSI('A', '('):
-		    compatibility(VT100);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[0] = CSET_GBCHR;
-		    break;
-		  case ANSI('B', '('):
-		    compatibility(VT100);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[0] = CSET_ASCII;
-		    break;
-		  case ANSI('0', '('):
-		    compatibility(VT100);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[0] = CSET_LINEDRW;
-		    break;
-		  case ANSI('U', '('): 
-		    compatibility(OTHER);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[0] = CSET_SCOACS; 
-		    break;
-		  /* G1D4: G1-designate 94-set */
-		  case ANSI('A', ')'):
-		    compatibility(VT100);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[1] = CSET_GBCHR;
-		    break;
-		  case ANSI('B', ')'):
-		    compatibility(VT100);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[1] = CSET_ASCII;
-		    break;
-		  case ANSI('0', ')'):
-		    compatibility(VT100);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[1] = CSET_LINEDRW;
-		    break;
-		  case ANSI('U', ')'): 
-		    compatibility(OTHER);
-		    if (!term->cfg.no_remote_charset)
-			term->cset_attr[1] = CSET_SCOACS; 
-		    break;
-		  /* DOCS: Designate other coding system */
-		  case ANSI('8', '%'):	/* Old Linux code */
-		  case ANSI('G', '%'):
-		    compatibility(OTHER);
-		    if (!term->cfg.no_remote_charset)
-			term->utf = 1;
-		    break;
-		  case ANSI('@', '%'):
-		    compatibility(OTHER);
-		    if (!term->cfg.no_remote_charset)
-			term->utf = 0;
-		    break;
-		}
-		break;
 	      case SEEN_CSI:
-		term->termstate = TOPLEVEL;  /* default */
-		if (isdigit(c)) {
-		    if (term->esc_nargs <= ARGS_MAX) {
-			if (term->esc_args[term->esc_nargs - 1] == ARG_DEFAULT)
-			    term->esc_args[term->esc_nargs - 1] = 0;
-			term->esc_args[term->esc_nargs - 1] =
-			    10 * term->esc_args[term->esc_nargs - 1] + c - '0';
-		    }
-		    term->termstate = SEEN_CSI;
-		} else if (c == ';') {
-		    if (++term->esc_nargs <= ARGS_MAX)
-			term->esc_args[term->esc_nargs - 1] = ARG_DEFAULT;
-		    term->termstate = SEEN_CSI;
-		} else if (c < '@') {
-		    if (term->esc_query)
-			term->esc_query = -1;
-		    else if (c == '?')
-			term->esc_query = TRUE;
-		    else
-			term->esc_query = c;
-		    term->termstate = SEEN_CSI;
-		} else
-		    switch (ANSI(c, term->esc_query)) {
-		      case 'A':       /* CUU: move up N lines */
-			move(term, term->curs.x,
-			     term->curs.y - def(term->esc_args[0], 1), 1);
-			seen_disp_event(term);
-			break;
-		      case 'e':		/* VPR: move down N lines */
-			compatibility(ANSI);
-			/* FALLTHROUGH */
-		      case 'B':		/* CUD: Cursor down */
-			move(term, term->curs.x,
-			     term->curs.y + def(term->esc_args[0], 1), 1);
-			seen_disp_event(term);
-			break;
-		      case ANSI('c', '>'):	/* DA: report xterm version */
-			compatibility(OTHER);
-			/* this reports xterm version 136 so that VIM can
-			   use the drag messages from the mouse reporting */
-			if (term->ldisc)
-			    ldisc_send(term->ldisc, "\033[>0;136;0c", 11, 0);
-			break;
-		      case 'a':		/* HPR: move right N cols */
-			compatibility(ANSI);
-			/* FALLTHROUGH */
-		      case 'C':		/* CUF: Cursor right */ 
-			move(term, term->curs.x + def(term->esc_args[0], 1),
-			     term->curs.y, 1);
-			seen_disp_event(term);
-			break;
-		      case 'D':       /* CUB: move left N cols */
-			move(term, term->curs.x - def(term->esc_args[0], 1),
-			     term->curs.y, 1);
-			seen_disp_event(term);
-			break;
-		      case 'E':       /* CNL: move down N lines and CR */
-			compatibility(ANSI);
-			move(term, 0,
-			     term->curs.y + def(term->esc_args[0], 1), 1);
-			seen_disp_event(term);
-			break;
-		      case 'F':       /* CPL: move up N lines and CR */
-			compatibility(ANSI);
-			move(term, 0,
-			     term->curs.y - def(term->esc_args[0], 1), 1);
-			seen_disp_event(term);
-			break;
-		      case 'G':	      /* CHA */
-		      case '`':       /* HPA: set horizontal posn */
-			compatibility(ANSI);
-			move(term, def(term->esc_args[0], 1) - 1,
-			     term->curs.y, 0);
-			seen_disp_event(term);
-			break;
-		      case 'd':       /* VPA: set vertical posn */
-			compatibility(ANSI);
-			move(term, term->curs.x,
-			     ((term->dec_om ? term->marg_t : 0) +
-			      def(term->esc_args[0], 1) - 1),
-			     (term->dec_om ? 2 : 0));
-			seen_disp_event(term);
-			break;
-		      case 'H':	     /* CUP */
-		      case 'f':      /* HVP: set horz and vert posns at once */
-			if (term->esc_nargs < 2)
-			    term->esc_args[1] = ARG_DEFAULT;
-			move(term, def(term->esc_args[1], 1) - 1,
-			     ((term->dec_om ? term->marg_t : 0) +
-			      def(term->esc_args[0], 1) - 1),
-			     (term->dec_om ? 2 : 0));
-			seen_disp_event(term);
-			break;
-		      case 'J':       /* ED: erase screen or parts of it */
-			{
-			    unsigned int i = def(term->esc_args[0], 0);
-			    if (i == 3) {
-				/* Erase Saved Lines (xterm)
-				 * This follows Thomas Dickey's xterm. */
-				term_clrsb(term);
-			    } else {
-				i++;
-				if (i > 3)
-				    i = 0;
-				erase_lots(term, FALSE, !!(i & 2), !!(i & 1));
-			    }
-			}
-			term->disptop = 0;
-			seen_disp_event(term);
-			break;
-		      case 'K':       /* EL: erase line or parts of it */
-			{
-			    unsigned int i = def(term->esc_args[0], 0) + 1;
-			    if (i > 3)
-				i = 0;
-			    erase_lots(term, TRUE, !!(i & 2), !!(i & 1));
-			}
-			seen_disp_event(term);
-			break;
-		      case 'L':       /* IL: insert lines */
-			compatibility(VT102);
-			if (term->curs.y <= term->marg_b)
-			    scroll(term, term->curs.y, term->marg_b,
-				   -def(term->esc_args[0], 1), FALSE);
-			seen_disp_event(term);
-			break;
-		      case 'M':       /* DL: delete lines */
-			compatibility(VT102);
-			if (term->curs.y <= term->marg_b)
-			    scroll(term, term->curs.y, term->marg_b,
-				   def(term->esc_args[0], 1),
-				   TRUE);
-			seen_disp_event(term);
-			break;
-		      case '@':       /* ICH: insert chars */
-			/* XXX VTTEST says this is vt220, vt510 manual says vt102 */
-			compatibility(VT102);
-			insch(term, def(term->esc_args[0], 1));
-			seen_disp_event(term);
-			break;
-		      case 'P':       /* DCH: delete chars */
-			compatibility(VT102);
-			insch(term, -def(term->esc_args[0], 1));
-			seen_disp_event(term);
-			break;
-		      case 'c':       /* DA: terminal type query */
-			compatibility(VT100);
-			/* This is the response for a VT102 */
-			if (term->ldisc)
-			    ldisc_send(term->ldisc, term->id_string,
- 				       strlen(term->id_string), 0);
-			break;
-		      case 'n':       /* DSR: cursor position query */
-			if (term->ldisc) {
-			    if (term->esc_args[0] == 6) {
-				char buf[32];
-				sprintf(buf, "\033[%d;%dR", term->curs.y + 1,
-					term->curs.x + 1);
-				ldisc_send(term->ldisc, buf, strlen(buf), 0);
-			    } else if (term->esc_args[0] == 5) {
-				ldisc_send(term->ldisc, "\033[0n", 4, 0);
-			    }
-			}
-			break;
-		      case 'h':       /* SM: toggle modes to high */
-		      case ANSI_QUE('h'):
-			compatibility(VT100);
-			{
-			    int i;
-			    for (i = 0; i < term->esc_nargs; i++)
-				toggle_mode(term, term->esc_args[i],
-					    term->esc_query, TRUE);
-			}
-			break;
-		      case 'i':		/* MC: Media copy */
-		      case ANSI_QUE('i'):
-			compatibility(VT100);
-			{
-			    if (term->esc_nargs != 1) break;
-			    if (term->esc_args[0] == 5 && *term->cfg.printer) {
-				term->printing = TRUE;
-				term->only_printing = !term->esc_query;
-				term->print_state = 0;
-				term_print_setup(term);
-			    } else if (term->esc_args[0] == 4 &&
-				       term->printing) {
-				term_print_finish(term);
-			    }
-			}
-			break;			
-		      case 'l':       /* RM: toggle modes to low */
-		      case ANSI_QUE('l'):
-			compatibility(VT100);
-			{
-			    int i;
-			    for (i = 0; i < term->esc_nargs; i++)
-				toggle_mode(term, term->esc_args[i],
-					    term->esc_query, FALSE);
-			}
-			break;
-		      case 'g':       /* TBC: clear tabs */
-			compatibility(VT100);
-			if (term->esc_nargs == 1) {
-			    if (term->esc_args[0] == 0) {
-				term->tabs[term->curs.x] = FALSE;
-			    } else if (term->esc_args[0] == 3) {
-				int i;
-				for (i = 0; i < term->cols; i++)
-				    term->tabs[i] = FALSE;
-			    }
-			}
-			break;
-		      case 'r':       /* DECSTBM: set scroll margins */
-			compatibility(VT100);
-			if (term->esc_nargs <= 2) {
-			    int top, bot;
-			    top = def(term->esc_args[0], 1) - 1;
-			    bot = (term->esc_nargs <= 1
-				   || term->esc_args[1] == 0 ?
-				   term->rows :
-				   def(term->esc_args[1], term->rows)) - 1;
-			    if (bot >= term->rows)
-				bot = term->rows - 1;
-			    /* VTTEST Bug 9 - if region is less than 2 lines
-			     * don't change region.
-			     */
-			    if (bot - top > 0) {
-				term->marg_t = top;
-				term->marg_b = bot;
-				term->curs.x = 0;
-				/*
-				 * I used to think the cursor should be
-				 * placed at the top of the newly marginned
-				 * area. Apparently not: VMS TPU falls over
-				 * if so.
-				 *
-				 * Well actually it should for
-				 * Origin mode - RDB
-				 */
-				term->curs.y = (term->dec_om ?
-						term->marg_t : 0);
-				seen_disp_event(term);
-			    }
-			}
-			break;
-		      case 'm':       /* SGR: set graphics rendition */
-			{
-			    /* 
-			     * A VT100 without the AVO only had one
-			     * attribute, either underline or
-			     * reverse video depending on the
-			     * cursor type, this was selected by
-			     * CSI 7m.
-			     *
-			     * case 2:
-			     *  This is sometimes DIM, eg on the
-			     *  GIGI and Linux
-			     * case 8:
-			     *  This is sometimes INVIS various ANSI.
-			     * case 21:
-			     *  This like 22 disables BOLD, DIM and INVIS
-			     *
-			     * The ANSI colours appear on any
-			     * terminal that has colour (obviously)
-			     * but the interaction between sgr0 and
-			     * the colours varies but is usually
-			     * related to the background colour
-			     * erase item. The interaction between
-			     * colour attributes and the mono ones
-			     * is also very implementation
-			     * dependent.
-			     *
-			     * The 39 and 49 attributes are likely
-			     * to be unimplemented.
-			     */
-			    int i;
-			    for (i = 0; i < term->esc_nargs; i++) {
-				switch (def(term->esc_args[i], 0)) {
-				  case 0:	/* restore defaults */
-				    term->curr_attr = term->default_attr;
-				    break;
-				  case 1:	/* enable bold */
-				    compatibility(VT100AVO);
-				    term->curr_attr |= ATTR_BOLD;
-				    break;
-				  case 21:	/* (enable double underline) */
-				    compatibility(OTHER);
-				  case 4:	/* enable underline */
-				    compatibility(VT100AVO);
-				    term->curr_attr |= ATTR_UNDER;
-				    break;
-				  case 5:	/* enable blink */
-				    compatibility(VT100AVO);
-				    term->curr_attr |= ATTR_BLINK;
-				    break;
-				  case 6:	/* SCO light bkgrd */
-				    compatibility(SCOANSI);
-				    term->blink_is_real = FALSE;
-				    term->curr_attr |= ATTR_BLINK;
-				    term_schedule_tblink(term);
-				    break;
-				  case 7:	/* enable reverse video */
-				    term->curr_attr |= ATTR_REVERSE;
-				    break;
-				  case 10:      /* SCO acs off */
-				    compatibility(SCOANSI);
-				    if (term->cfg.no_remote_charset) break;
-				    term->sco_acs = 0; break;
-				  case 11:      /* SCO acs on */
-				    compatibility(SCOANSI);
-				    if (term->cfg.no_remote_charset) break;
-				    term->sco_acs = 1; break;
-				  case 12:      /* SCO acs on, |0x80 */
-				    compatibility(SCOANSI);
-				    if (term->cfg.no_remote_charset) break;
-				    term->sco_acs = 2; break;
-				  case 22:	/* disable bold */
-				    compatibility2(OTHER, VT220);
-				    term->curr_attr &= ~ATTR_BOLD;
-				    break;
-				  case 24:	/* disable underline */
-				    compatibility2(OTHER, VT220);
-				    term->curr_attr &= ~ATTR_UNDER;
-				    break;
-				  case 25:	/* disable blink */
-				    compatibility2(OTHER, VT220);
-				    term->curr_attr &= ~ATTR_BLINK;
-				    break;
-				  case 27:	/* disable reverse video */
-				    compatibility2(OTHER, VT220);
-				    term->curr_attr &= ~ATTR_REVERSE;
-				    break;
-				  case 30:
-				  case 31:
-				  case 32:
-				  case 33:
-				  case 34:
-				  case 35:
-				  case 36:
-				  case 37:
-				    /* foreground */
-				    term->curr_attr &= ~ATTR_FGMASK;
-				    term->curr_attr |=
-					(term->esc_args[i] - 30)<<ATTR_FGSHIFT;
-				    break;
-				  case 90:
-				  case 91:
-				  case 92:
-				  case 93:
-				  case 94:
-				  case 95:
-				  case 96:
-				  case 97:
-				    /* aixterm-style bright foreground */
-				    term->curr_attr &= ~ATTR_FGMASK;
-				    term->curr_attr |=
-					((term->esc_args[i] - 90 + 8)
-                                         << ATTR_FGSHIFT);
-				    break;
-				  case 39:	/* default-foreground */
-				    term->curr_attr &= ~ATTR_FGMASK;
-				    term->curr_attr |= ATTR_DEFFG;
-				    break;
-				  case 40:
-				  case 41:
-				  case 42:
-				  case 43:
-				  case 44:
-				  case 45:
-				  case 46:
-				  case 47:
-				    /* background */
-				    term->curr_attr &= ~ATTR_BGMASK;
-				    term->curr_attr |=
-					(term->esc_args[i] - 40)<<ATTR_BGSHIFT;
-				    break;
-				  case 100:
-				  case 101:
-				  case 102:
-				  case 103:
-				  case 104:
-				  case 105:
-				  case 106:
-				  case 107:
-				    /* aixterm-style bright background */
-				    term->curr_attr &= ~ATTR_BGMASK;
-				    term->curr_attr |=
-					((term->esc_args[i] - 100 + 8)
-                                         << ATTR_BGSHIFT);
-				    break;
-				  case 49:	/* default-background */
-				    term->curr_attr &= ~ATTR_BGMASK;
-				    term->curr_attr |= ATTR_DEFBG;
-				    break;
-				  case 38:   /* xterm 256-colour mode */
-				    if (i+2 < term->esc_nargs &&
-					term->esc_args[i+1] == 5) {
-					term->curr_attr &= ~ATTR_FGMASK;
-					term->curr_attr |=
-					    ((term->esc_args[i+2] & 0xFF)
-					     << ATTR_FGSHIFT);
-					i += 2;
-				    }
-				    break;
-				  case 48:   /* xterm 256-colour mode */
-				    if (i+2 < term->esc_nargs &&
-					term->esc_args[i+1] == 5) {
-					term->curr_attr &= ~ATTR_BGMASK;
-					term->curr_attr |=
-					    ((term->esc_args[i+2] & 0xFF)
-					     << ATTR_BGSHIFT);
-					i += 2;
-				    }
-				    break;
-				}
-			    }
-			    set_erase_char(term);
-			}
-			break;
-		      case 's':       /* save cursor */
-			save_cursor(term, TRUE);
-			break;
-		      case 'u':       /* restore cursor */
-			save_cursor(term, FALSE);
-			seen_disp_event(term);
-			break;
-		      case 't': /* DECSLPP: set page size - ie window height */
-			/*
-			 * VT340/VT420 sequence DECSLPP, DEC only allows values
-			 *  24/25/36/48/72/144 other emulators (eg dtterm) use
-			 * illegal values (eg first arg 1..9) for window changing 
-			 * and reports.
-			 */
-			if (term->esc_nargs <= 1
-			    && (term->esc_args[0] < 1 ||
-				term->esc_args[0] >= 24)) {
-			    compatibility(VT340TEXT);
-			    if (!term->cfg.no_remote_resize)
-				request_resize(term->frontend, term->cols,
-					       def(term->esc_args[0], 24));
-			    deselect(term);
-			} else if (term->esc_nargs >= 1 &&
-				   term->esc_args[0] >= 1 &&
-				   term->esc_args[0] < 24) {
-			    compatibility(OTHER);
-
-			    switch (term->esc_args[0]) {
-				int x, y, len;
-				char buf[80], *p;
-			      case 1:
-				set_iconic(term->frontend, FALSE);
-				break;
-			      case 2:
-				set_iconic(term->frontend, TRUE);
-				break;
-			      case 3:
-				if (term->esc_nargs >= 3) {
-				    if (!term->cfg.no_remote_resize)
-					move_window(term->frontend,
-						    def(term->esc_args[1], 0),
-						    def(term->esc_args[2], 0));
-				}
-				break;
-			      case 4:
-				/* We should resize the window to a given
-				 * size in pixels here, but currently our
-				 * resizing code isn't healthy enough to
-				 * manage it. */
-				break;
-			      case 5:
-				/* move to top */
-				set_zorder(term->frontend, TRUE);
-				break;
-			      case 6:
-				/* move to bottom */
-				set_zorder(term->frontend, FALSE);
-				break;
-			      case 7:
-				refresh_window(term->frontend);
-				break;
-			      case 8:
-				if (term->esc_nargs >= 3) {
-				    if (!term->cfg.no_remote_resize)
-					request_resize(term->frontend,
-						       def(term->esc_args[2], term->cfg.width),
-						       def(term->esc_args[1], term->cfg.height));
-				}
-				break;
-			      case 9:
-				if (term->esc_nargs >= 2)
-				    set_zoomed(term->frontend,
-					       term->esc_args[1] ?
-					       TRUE : FALSE);
-				break;
-			      case 11:
-				if (term->ldisc)
-				    ldisc_send(term->ldisc,
-					       is_iconic(term->frontend) ?
-					       "\033[1t" : "\033[2t", 4, 0);
-				break;
-			      case 13:
-				if (term->ldisc) {
-				    get_window_pos(term->frontend, &x, &y);
-				    len = sprintf(buf, "\033[3;%d;%dt", x, y);
-				    ldisc_send(term->ldisc, buf, len, 0);
-				}
-				break;
-			      case 14:
-				if (term->ldisc) {
-				    get_window_pixels(term->frontend, &x, &y);
-				    len = sprintf(buf, "\033[4;%d;%dt", x, y);
-				    ldisc_send(term->ldisc, buf, len, 0);
-				}
-				break;
-			      case 18:
-				if (term->ldisc) {
-				    len = sprintf(buf, "\033[8;%d;%dt",
-						  term->rows, term->cols);
-				    ldisc_send(term->ldisc, buf, len, 0);
-				}
-				break;
-			      case 19:
-				/*
-				 * Hmmm. Strictly speaking we
-				 * should return `the size of the
-				 * screen in characters', but
-				 * that's not easy: (a) window
-				 * furniture being what it is it's
-				 * hard to compute, and (b) in
-				 * resize-font mode maximising the
-				 * window wouldn't change the
-				 * number of characters. *shrug*. I
-				 * think we'll ignore it for the
-				 * moment and see if anyone
-				 * complains, and then ask them
-				 * what they would like it to do.
-				 */
-				break;
-			      case 20:
-				if (term->ldisc &&
-				    term->cfg.remote_qtitle_action != TITLE_NONE) {
-				    if(term->cfg.remote_qtitle_action == TITLE_REAL)
-					p = get_window_title(term->frontend, TRUE);
-				    else
-					p = EMPTY_WINDOW_TITLE;
-				    len = strlen(p);
-				    ldisc_send(term->ldisc, "\033]L", 3, 0);
-				    ldisc_send(term->ldisc, p, len, 0);
-				    ldisc_send(term->ldisc, "\033\\", 2, 0);
-				}
-				break;
-			      case 21:
-				if (term->ldisc &&
-				    term->cfg.remote_qtitle_action != TITLE_NONE) {
-				    if(term->cfg.remote_qtitle_action == TITLE_REAL)
-					p = get_window_title(term->frontend, FALSE);
-				    else
-					p = EMPTY_WINDOW_TITLE;
-				    len = strlen(p);
-				    ldisc_send(term->ldisc, "\033]l", 3, 0);
-				    ldisc_send(term->ldisc, p, len, 0);
-				    ldisc_send(term->ldisc, "\033\\", 2, 0);
-				}
-				break;
-			    }
-			}
-			break;
-		      case 'S':		/* SU: Scroll up */
-			compatibility(SCOANSI);
-			scroll(term, term->marg_t, term->marg_b,
-			       def(term->esc_args[0], 1), TRUE);
-			term->wrapnext = FALSE;
-			seen_disp_event(term);
-			break;
-		      case 'T':		/* SD: Scroll down */
-			compatibility(SCOANSI);
-			scroll(term, term->marg_t, term->marg_b,
-			       -def(term->esc_args[0], 1), TRUE);
-			term->wrapnext = FALSE;
-			seen_disp_event(term);
-			break;
-		      case ANSI('|', '*'): /* DECSNLS */
-			/* 
-			 * Set number of lines on screen
-			 * VT420 uses VGA like hardware and can
-			 * support any size in reasonable range
-			 * (24..49 AIUI) with no default specified.
-			 */
-			compatibility(VT420);
-			if (term->esc_nargs == 1 && term->esc_args[0] > 0) {
-			    if (!term->cfg.no_remote_resize)
-				request_resize(term->frontend, term->cols,
-					       def(term->esc_args[0],
-						   term->cfg.height));
-			    deselect(term);
-			}
-			break;
-		      case ANSI('|', '$'): /* DECSCPP */
-			/*
-			 * Set number of columns per page
-			 * Docs imply range is only 80 or 132, but
-			 * I'll allow any.
-			 */
-			compatibility(VT340TEXT);
-			if (term->esc_nargs <= 1) {
-			    if (!term->cfg.no_remote_resize)
-				request_resize(term->frontend,
-					       def(term->esc_args[0],
-						   term->cfg.width), term->rows);
-			    deselect(term);
-			}
-			break;
-		      case 'X':     /* ECH: write N spaces w/o moving cursor */
-			/* XXX VTTEST says this is vt220, vt510 manual
-			 * says vt100 */
-			compatibility(ANSIMIN);
-			{
-			    int n = def(term->esc_args[0], 1);
-			    pos cursplus;
-			    int p = term->curs.x;
-			    termline *cline = scrlineptr(term->curs.y);
-
-			    if (n > term->cols - term->curs.x)
-				n = term->cols - term->curs.x;
-			    cursplus = term->curs;
-			    cursplus.x += n;
-			    check_boundary(term, term->curs.x, term->curs.y);
-			    check_boundary(term, term->curs.x+n, term->curs.y);
-			    check_selection(term, term->curs, cursplus);
-			    while (n--)
-				copy_termchar(cline, p++,
-					      &term->erase_char);
-			    seen_disp_event(term);
-			}
-			break;
-		      case 'x':       /* DECREQTPARM: report terminal characteristics */
-			compatibility(VT100);
-			if (term->ldisc) {
-			    char buf[32];
-			    int i = def(term->esc_args[0], 0);
-			    if (i == 0 || i == 1) {
-				strcpy(buf, "\033[2;1;1;112;112;1;0x");
-				buf[2] += i;
-				ldisc_send(term->ldisc, buf, 20, 0);
-			    }
-			}
-			break;
-		      case 'Z':		/* CBT */
-			compatibility(OTHER);
-			{
-			    int i = def(term->esc_args[0], 1);
-			    pos old_curs = term->curs;
-
-			    for(;i>0 && term->curs.x>0; i--) {
-				do {
-				    term->curs.x--;
-				} while (term->curs.x >0 &&
-					 !term->tabs[term->curs.x]);
-			    }
-			    check_selection(term, old_curs, term->curs);
-			}
-			break;
-		      case ANSI('c', '='):      /* Hide or Show Cursor */
-			compatibility(SCOANSI);
-			switch(term->esc_args[0]) {
-			  case 0:  /* hide cursor */
-			    term->cursor_on = FALSE;
-			    break;
-			  case 1:  /* restore cursor */
-			    term->big_cursor = FALSE;
-			    term->cursor_on = TRUE;
-			    break;
-			  case 2:  /* block cursor */
-			    term->big_cursor = TRUE;
-			    term->cursor_on = TRUE;
-			    break;
-			}
-			break;
-		      case ANSI('C', '='):
-			/*
-			 * set cursor start on scanline esc_args[0] and
-			 * end on scanline esc_args[1].If you set
-			 * the bottom scan line to a value less than
-			 * the top scan line, the cursor will disappear.
-			 */
-			compatibility(SCOANSI);
-			if (term->esc_nargs >= 2) {
-			    if (term->esc_args[0] > term->esc_args[1])
-				term->cursor_on = FALSE;
-			    else
-				term->cursor_on = TRUE;
-			}
-			break;
-		      case ANSI('D', '='):
-			compatibility(SCOANSI);
-			term->blink_is_real = FALSE;
-			term_schedule_tblink(term);
-			if (term->esc_args[0]>=1)
-			    term->curr_attr |= ATTR_BLINK;
-			else
-			    term->curr_attr &= ~ATTR_BLINK;
-			break;
-		      case ANSI('E', '='):
-			compatibility(SCOANSI);
-			term->blink_is_real = (term->esc_args[0] >= 1);
-			term_schedule_tblink(term);
-			break;
-		      case ANSI('F', '='):      /* set normal foreground */
-			compatibility(SCOANSI);
-			if (term->esc_args[0] >= 0 && term->esc_args[0] < 16) {
-			    long colour =
- 				(sco2ansicolour[term->esc_args[0] & 0x7] |
-				 (term->esc_args[0] & 0x8)) <<
-				ATTR_FGSHIFT;
-			    term->curr_attr &= ~ATTR_FGMASK;
-			    term->curr_attr |= colour;
-			    term->default_attr &= ~ATTR_FGMASK;
-			    term->default_attr |= colour;
-			    set_erase_char(term);
-			}
-			break;
-		      case ANSI('G', '='):      /* set normal background */
-			compatibility(SCOANSI);
-			if (term->esc_args[0] >= 0 && term->esc_args[0] < 16) {
-			    long colour =
- 				(sco2ansicolour[term->esc_args[0] & 0x7] |
-				 (term->esc_args[0] & 0x8)) <<
-				ATTR_BGSHIFT;
-			    term->curr_attr &= ~ATTR_BGMASK;
-			    term->curr_attr |= colour;
-			    term->default_attr &= ~ATTR_BGMASK;
-			    term->default_attr |= colour;
-			    set_erase_char(term);
-			}
-			break;
-		      case ANSI('L', '='):
-			compatibility(SCOANSI);
-			term->use_bce = (term->esc_args[0] <= 0);
-			set_erase_char(term);
-			break;
-		      case ANSI('p', '"'): /* DECSCL: set compat level */
-			/*
-			 * Allow the host to make this emulator a
-			 * 'perfect' VT102. This first appeared in
-			 * the VT220, but we do need to get back to
-			 * PuTTY mode so I won't check it.
-			 *
-			 * The arg in 40..42,50 are a PuTTY extension.
-			 * The 2nd arg, 8bit vs 7bit is not checked.
-			 *
-			 * Setting VT102 mode should also change
-			 * the Fkeys to generate PF* codes as a
-			 * real VT102 has no Fkeys. The VT220 does
-			 * this, F11..F13 become ESC,BS,LF other
-			 * Fkeys send nothing.
-			 *
-			 * Note ESC c will NOT change this!
-			 */
-
-			switch (term->esc_args[0]) {
-			  case 61:
-			    term->compatibility_level &= ~TM_VTXXX;
-			    term->compatibility_level |= TM_VT102;
-			    break;
-			  case 62:
-			    term->compatibility_level &= ~TM_VTXXX;
-			    term->compatibility_level |= TM_VT220;
-			    break;
-
-			  default:
-			    if (term->esc_args[0] > 60 &&
-				term->esc_args[0] < 70)
-				term->compatibility_level |= TM_VTXXX;
-			    break;
-
-			  case 40:
-			    term->compatibility_level &= TM_VTXXX;
-			    break;
-			  case 41:
-			    term->compatibility_level = TM_PUTTY;
-			    break;
-			  case 42:
-			    term->compatibility_level = TM_SCOANSI;
-			    break;
-
-			  case ARG_DEFAULT:
-			    term->compatibility_level = TM_PUTTY;
-			    break;
-			  case 50:
-			    break;
-			}
-
-			/* Change the response to CSI c */
-			if (term->esc_args[0] == 50) {
-			    int i;
-			    char lbuf[64];
-			    strcpy(term->id_string, "\033[?");
-			    for (i = 1; i < term->esc_nargs; i++) {
-				if (i != 1)
-				    strcat(term->id_string, ";");
-				sprintf(lbuf, "%d", term->esc_args[i]);
-				strcat(term->id_string, lbuf);
-			    }
-			    strcat(term->id_string, "c");
-			}
-#if 0
-			/* Is this a good idea ? 
-			 * Well we should do a soft reset at this point ...
-			 */
-			if (!has_compat(VT420) && has_compat(VT100)) {
-			    if (!term->cfg.no_remote_resize) {
-				if (term->reset_132)
-				    request_resize(132, 24);
-				else
-				    request_resize(80, 24);
-			    }
-			}
-#endif
-			break;
-		    }
+		term_esc_char(term, c);
 		break;
 	      case SEEN_OSC:
 		term->osc_w = FALSE;
@@ -4440,7 +6109,36 @@ static void term_out(Terminal *term)
 	    check_selection(term, term->curs, cursplus);
 	}
     }
+}
+
+/*
+ * Remove everything currently in `inbuf' and stick it up on the
+ * in-memory display. If `data' is non-NULL it is processed first,
+ * straight out of the caller's buffer; the caller must only pass
+ * it if inbuf is empty, or output would be reordered.
+ *
+ * Data in inbuf is likewise parsed in place, several granules at
+ * a time. Anything added to inbuf while we're at it (by a reentrant
+ * term_data() call) goes on the end and is dealt with in turn.
+ */
+static void term_out(Terminal *term, const char *data, int len)
+{
+    if (data)
+	term_out_chars(term, (const unsigned char *)data, len);
+
+    while (bufchain_size(&term->inbuf) > 0) {
+	void *segs[16];
+	int lens[16], nsegs, i;
+
+	nsegs = bufchain_prefixv(&term->inbuf, segs, lens, lenof(segs));
+	for (len = i = 0; i < nsegs; i++) {
+	    term_out_chars(term, (const unsigned char *)segs[i], lens[i]);
+	    len += lens[i];
+	}
+	bufchain_consume(&term->inbuf, len);
+    }
 
+    sb_flush(term);
     term_print_flush(term);
     if (term->cfg.logflush)
 	logflush(term->logctx);
@@ -4469,7 +6167,9 @@ static int term_bidi_cache_hit(Terminal *term, int line,
 	return FALSE;		       /* line is wrong width */
 
     for (i = 0; i < width; i++)
-	if (!termchars_equal(term->pre_bidi_cache[line].chars+i, lbefore+i))
+	if (!termchars_equal(term->pre_bidi_cache[line].chars+i,
+			     term->pre_bidi_cache[line].chars+width,
+			     lbefore+i, lbefore+width))
 	    return FALSE;	       /* line doesn't match cache */
 
     return TRUE;		       /* it didn't match. */
@@ -4610,9 +6310,6 @@ static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
 	    for(it=0; it<term->cols ; it++)
 	    {
 		term->ltemp[it] = ldata->chars[term->wcTo[it].index];
-		if (term->ltemp[it].cc_next)
-		    term->ltemp[it].cc_next -=
-		    it - term->wcTo[it].index;
 
 		if (term->wcTo[it].origwc != term->wcTo[it].wc)
 		    term->ltemp[it].chr = term->wcTo[it].wc;
@@ -4639,7 +6336,7 @@ static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
 static void do_paint(Terminal *term, Context ctx, int may_optimise)
 {
     int i, j, our_curs_y, our_curs_x;
-    int rv, cursor;
+    int rv, cursor, blink, sel;
     pos scrpos;
     wchar_t *ch;
     int chlen;
@@ -4660,7 +6357,60 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
      * selection, rv, 
      * cfg.blinkpc, blink_is_real, tblinker, 
      * curs.y, curs.x, cblinker, cfg.blink_cur, cursor_on, has_focus, wrapnext
+     *
+     * Changes to the screen array are recorded as they happen in
+     * term->damage. For everything else, we compare with what we
+     * painted last time and add to the damage here.
+     */
+    if (term->disptop != term->disp_top || rv != term->disp_rv) {
+	disp_damage_all(term);
+	term->disp_top = term->disptop;
+	term->disp_rv = rv;
+    }
+
+    /*
+     * When blinking text changes phase, only the rows which had some
+     * last time need repainting.
+     */
+    blink = (!term->blink_is_real ? 0 :
+	     term->has_focus && term->tblinker ? 2 : 1);
+    if (blink != term->disp_blink) {
+	for (i = 0; i < term->rows; i++)
+	    if (term->damage[i].blink)
+		disp_damage(term, i, 0, term->cols);
+	term->disp_blink = blink;
+    }
+
+    /*
+     * If the selection has changed, repaint the lines it used to
+     * cover and the lines it covers now. When one end of a
+     * lexicographic selection is being dragged, that reduces to just
+     * the lines between the old and new positions of that end.
      */
+    sel = (term->selstate == DRAGGING || term->selstate == SELECTED);
+    if (sel != term->disp_sel ||
+	(sel && (term->seltype != term->disp_seltype ||
+		 !poseq(term->selstart, term->disp_selstart) ||
+		 !poseq(term->selend, term->disp_selend)))) {
+	if (sel && term->disp_sel && term->seltype == LEXICOGRAPHIC &&
+	    term->disp_seltype == LEXICOGRAPHIC) {
+	    if (!poseq(term->selstart, term->disp_selstart))
+		term_damage_lines(term, term->selstart.y,
+				  term->disp_selstart.y);
+	    if (!poseq(term->selend, term->disp_selend))
+		term_damage_lines(term, term->selend.y, term->disp_selend.y);
+	} else {
+	    if (term->disp_sel)
+		term_damage_lines(term, term->disp_selstart.y,
+				  term->disp_selend.y);
+	    if (sel)
+		term_damage_lines(term, term->selstart.y, term->selend.y);
+	}
+	term->disp_sel = sel;
+	term->disp_seltype = term->seltype;
+	term->disp_selstart = term->selstart;
+	term->disp_selend = term->selend;
+    }
 
     /* Has the cursor position or type changed ? */
     if (term->cursor_on) {
@@ -4720,11 +6470,20 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 	if (term->dispcursx < term->cols-1 && dispcurs[1].chr == UCSWIDE)
 	    dispcurs[1].attr |= ATTR_INVALID;
 	dispcurs->attr |= ATTR_INVALID;
+	disp_damage(term, term->dispcursy,
+		    term->dispcursx - 1, term->dispcursx + 2);
 
 	term->curstype = 0;
     }
     term->dispcursx = term->dispcursy = -1;
 
+    /*
+     * The loop below finds the cursor again only if it looks at the
+     * cursor's cell, so it must always do so. (This is all a cursor
+     * blink costs us, if nothing else has changed.)
+     */
+    disp_damage(term, our_curs_y, our_curs_x, our_curs_x + 1);
+
 #ifdef OPTIMISE_SCROLL
     /* Do scrolls */
     sr = term->scrollhead;
@@ -4740,15 +6499,22 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
     /* The normal screen data */
     for (i = 0; i < term->rows; i++) {
 	termline *ldata;
-	termchar *lchars;
+	termchar *lchars, *lcc;
 	int dirty_line, dirty_run, selected;
 	unsigned long attr = 0, cset = 0;
 	int updated_line = 0;
-	int start = 0;
+	int start;
 	int ccount = 0;
 	int last_run_dirty = 0;
 	int laststart, dirtyrect;
 	int *backward;
+	int lo, hi, rowblink = FALSE;
+
+	lo = term->damage[i].lo;
+	hi = term->damage[i].hi;
+	if (lo >= hi)
+	    continue;		       /* nothing here can have changed */
+	term->damage[i].lo = term->damage[i].hi = 0;
 
 	scrpos.y = i + term->disptop;
 	ldata = lineptr(scrpos.y);
@@ -4761,18 +6527,44 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 	    lchars = ldata->chars;
 	    backward = NULL;
 	}
+	lcc = lchars + term->cols;     /* ldata->cols, after lineptr() */
+
+	/*
+	 * Widen the damaged range to take in the whole of any run
+	 * that we drew in one go last time, so that the loops below
+	 * do exactly what they would have done had they started at
+	 * the left edge and carried on to the right edge. We can't
+	 * do that if bidi may have moved things about, or if the line
+	 * attributes have changed, or if the font wants every run
+	 * redrawn anyway.
+	 */
+	if (lchars != ldata->chars || term->ucsdata->dbcs_screenfont ||
+	    ldata->lattr != term->disptext[i]->lattr) {
+	    lo = 0;
+	    hi = term->cols;
+	} else {
+	    while (lo > 0 &&
+		   (!(term->disptext[i]->chars[lo].attr & DATTR_STARTRUN) ||
+		    lchars[lo].chr == UCSWIDE))
+		lo--;
+	    while (hi < term->cols &&
+		   !(term->disptext[i]->chars[hi].attr & DATTR_STARTRUN))
+		hi++;
+	}
 
 	/*
 	 * First loop: work along the line deciding what we want
 	 * each character cell to look like.
 	 */
-	for (j = 0; j < term->cols; j++) {
+	for (j = lo; j < hi; j++) {
 	    unsigned long tattr, tchar;
 	    termchar *d = lchars + j;
 	    scrpos.x = backward ? backward[j] : j;
 
 	    tchar = d->chr;
 	    tattr = d->attr;
+	    if (tattr & ATTR_BLINK)
+		rowblink = TRUE;
 
             if (!term->cfg.ansi_colour)
                 tattr = (tattr & ~(ATTR_FGMASK | ATTR_BGMASK)) | 
@@ -4842,6 +6634,13 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 		term->dispcursy = i;
 	    }
 
+	    /*
+	     * A change of width forces a redraw of the rest of the
+	     * line in the final loop, so all of it must be looked at.
+	     */
+	    if ((term->disptext[i]->chars[j].attr ^ tattr) & ATTR_WIDE)
+		hi = term->cols;
+
 	    /* FULL-TERMCHAR */
 	    newline[j].attr = tattr;
 	    newline[j].chr = tchar;
@@ -4863,9 +6662,9 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 	 * bounding rectangle, should solve any possible problems
 	 * with fonts that overflow their character cells.
 	 */
-	laststart = 0;
+	laststart = lo;
 	dirtyrect = FALSE;
-	for (j = 0; j < term->cols; j++) {
+	for (j = lo; j < hi; j++) {
 	    if (term->disptext[i]->chars[j].attr & DATTR_STARTRUN) {
 		laststart = j;
 		dirtyrect = FALSE;
@@ -4895,7 +6694,8 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 				  term->disptext[i]->lattr);
 	term->disptext[i]->lattr = ldata->lattr;
 
-	for (j = 0; j < term->cols; j++) {
+	start = lo;
+	for (j = lo; j < hi; j++) {
 	    unsigned long tattr, tchar;
 	    int break_run, do_copy;
 	    termchar *d = lchars + j;
@@ -4955,7 +6755,8 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 
 	    do_copy = FALSE;
 	    if (!termchars_equal_override(&term->disptext[i]->chars[j],
-					  d, tchar, tattr)) {
+					  CC_AREA(term->disptext[i]),
+					  d, lcc, tchar, tattr)) {
 		do_copy = TRUE;
 		dirty_run = TRUE;
 	    }
@@ -4972,7 +6773,7 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 		while (dd->cc_next) {
 		    unsigned long schar;
 
-		    dd += dd->cc_next;
+		    dd = CC_NEXT(lcc, dd);
 
 		    schar = dd->chr;
 		    switch (schar & CSET_MASK) {
@@ -4998,7 +6799,7 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 	    }
 
 	    if (do_copy) {
-		copy_termchar(term->disptext[i], j, d);
+		copy_termchar(term->disptext[i], j, d, lcc);
 		term->disptext[i]->chars[j].chr = tchar;
 		term->disptext[i]->chars[j].attr = tattr;
 		if (start == j)
@@ -5015,9 +6816,10 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 		     * Ever.
 		     */
 		    assert(!(i == our_curs_y && j == our_curs_x));
-		    if (!termchars_equal(&term->disptext[i]->chars[j], d))
+		    if (!termchars_equal(&term->disptext[i]->chars[j],
+					 CC_AREA(term->disptext[i]), d, lcc))
 			dirty_run = TRUE;
-		    copy_termchar(term->disptext[i], j, d);
+		    copy_termchar(term->disptext[i], j, d, lcc);
 		}
 	    }
 	}
@@ -5031,6 +6833,11 @@ static void do_paint(Terminal *term, Context ctx, int may_optimise)
 	    updated_line = 1;
 	}
 
+	if (lo == 0 && hi == term->cols)
+	    term->damage[i].blink = rowblink;
+	else if (rowblink)
+	    term->damage[i].blink = TRUE;
+
 	unlineptr(ldata);
     }
 
@@ -5048,6 +6855,7 @@ void term_invalidate(Terminal *term)
     for (i = 0; i < term->rows; i++)
 	for (j = 0; j < term->cols; j++)
 	    term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+    disp_damage_all(term);
 
     term_schedule_update(term);
 }
@@ -5065,12 +6873,15 @@ void term_paint(Terminal *term, Context ctx,
     if (bottom >= term->rows) bottom = term->rows-1;
 
     for (i = top; i <= bottom && i < term->rows; i++) {
-	if ((term->disptext[i]->lattr & LATTR_MODE) == LATTR_NORM)
+	if ((term->disptext[i]->lattr & LATTR_MODE) == LATTR_NORM) {
 	    for (j = left; j <= right && j < term->cols; j++)
 		term->disptext[i]->chars[j].attr |= ATTR_INVALID;
-	else
+	    disp_damage(term, i, left, right + 1);
+	} else {
 	    for (j = left / 2; j <= right / 2 + 1 && j < term->cols; j++)
 		term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+	    disp_damage(term, i, left / 2, right / 2 + 2);
+	}
     }
 
     if (immediately) {
@@ -5265,7 +7076,7 @@ static void clipme(Terminal *term, pos top, pos bottom, int rect, int desel)
 		    clip_addchar(&buf, *p, attr);
 
 		if (ldata->chars[x].cc_next)
-		    x += ldata->chars[x].cc_next;
+		    x = ldata->cols + ldata->chars[x].cc_next - 1;
 		else
 		    break;
 	    }
@@ -5294,7 +7105,7 @@ void term_copyall(Terminal *term)
 {
     pos top;
     pos bottom;
-    tree234 *screen = term->screen;
+    struct termscreen *screen = term->screen;
     top.y = -sblines(term);
     top.x = 0;
     bottom.y = find_last_nonempty_line(term, screen);
@@ -6321,7 +8132,19 @@ int term_ldisc(Terminal *term, int option)
 
 int term_data(Terminal *term, int is_stderr, const char *data, int len)
 {
-    bufchain_add(&term->inbuf, data, len);
+    term->update_bytes += len;
+
+    /*
+     * If we can process this data straight away and there's
+     * nothing queued ahead of it, term_out() can parse it where it
+     * is rather than having it copied into inbuf first. Otherwise
+     * it has to wait its turn in inbuf.
+     */
+    if (term->in_term_out || term->selstate == DRAGGING ||
+	bufchain_size(&term->inbuf) > 0) {
+	bufchain_add(&term->inbuf, data, len);
+	data = NULL;
+    }
 
     if (!term->in_term_out) {
 	term->in_term_out = TRUE;
@@ -6331,8 +8154,14 @@ int term_data(Terminal *term, int is_stderr, const char *data, int len)
 	 * because the user will want the screen to hold still to
 	 * be selected.
 	 */
-	if (term->selstate != DRAGGING)
-	    term_out(term);
+	if (term->selstate != DRAGGING) {
+	    term_out(term, data, len);
+	    /*
+	     * That was the response to the last keypress, and its
+	     * update is now scheduled. Anything after it can wait.
+	     */
+	    term->key_seen = FALSE;
+	}
 	term->in_term_out = FALSE;
     }
 
@@ -6387,6 +8216,19 @@ void term_set_focus(Terminal *term, int has_focus)
     term_schedule_cblink(term);
 }
 
+/*
+ * Report how window updates have gone: how many were painted, how
+ * many were skipped because updates had been slowed down, and the
+ * total time spent painting, in ticks.
+ */
+void term_get_update_stats(Terminal *term, unsigned long *painted,
+			   unsigned long *skipped, unsigned long *ticks)
+{
+    *painted = term->frames_painted;
+    *skipped = term->frames_skipped;
+    *ticks = term->paint_ticks;
+}
+
 /*
  * Provide "auto" settings for remote tty modes, suitable for an
  * application with a terminal window.
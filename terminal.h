@@ -32,27 +32,39 @@ struct scrollregion {
 typedef struct termchar termchar;
 typedef struct termline termline;
 
+#define TERMCHAR_CHR_BITS 21
+#define TERMCHAR_CC_BITS 11
+#define TERMCHAR_CC_MAX ((1 << TERMCHAR_CC_BITS) - 1) /* ccs in one line */
+
 struct termchar {
     /*
      * Any code in terminal.c which definitely needs to be changed
      * when extra fields are added here is labelled with a comment
      * saying FULL-TERMCHAR.
+     *
+     * There is one of these for every character cell on the screen,
+     * in disptext and in the bidi caches, so it is kept to eight
+     * bytes. Every character we store (Unicode, or one of the CSET_*
+     * pages) fits in 21 bits.
      */
-    unsigned long chr;
-    unsigned long attr;
+    unsigned int chr : TERMCHAR_CHR_BITS;
 
     /*
      * The cc_next field is used to link multiple termchars
      * together into a list, so as to fit more than one character
      * into a character cell (Unicode combining characters).
      * 
-     * cc_next is a relative offset into the current array of
-     * termchars. I.e. to advance to the next character in a list,
-     * one does `tc += tc->next'.
+     * The extra characters live in the cc area of the array, after
+     * the line's real columns. cc_next is one more than the index
+     * within that area of the next character in the list, so that
+     * it doesn't change when the line is resized or permuted. Use
+     * CC_NEXT() in terminal.c to follow it.
      * 
      * Zero means end of list.
      */
-    int cc_next;
+    unsigned int cc_next : TERMCHAR_CC_BITS;
+
+    unsigned int attr;
 };
 
 struct termline {
@@ -61,10 +73,30 @@ struct termline {
     int size;			       /* number of allocated termchars
 					* (cc-lists may make this > cols) */
     int temporary;		       /* TRUE if decompressed from scrollback */
-    int cc_free;		       /* offset to first cc in free list */
+    int cc_free;		       /* first cc in free list, as cc_next */
     struct termchar *chars;
 };
 
+/*
+ * The lines of a screen, kept as a circular array so that scrolling
+ * the whole screen is just a change of `top'.
+ */
+struct termscreen {
+    termline **lines;		       /* `rows' slots, in ring order */
+    int rows;
+    int top;			       /* slot holding line 0 */
+};
+
+/*
+ * The columns of one display row which may have changed since
+ * do_paint() last looked at it, as the half-open range [lo,hi). An
+ * empty range means the row can be skipped altogether.
+ */
+struct termdamage {
+    int lo, hi;
+    int blink;			       /* row had blinking text last time */
+};
+
 struct bidi_cache_entry {
     int width;
     struct termchar *chars;
@@ -76,17 +108,74 @@ struct terminal_tag {
     int compatibility_level;
 
     tree234 *scrollback;	       /* lines scrolled off top of screen */
-    tree234 *screen;		       /* lines on primary screen */
-    tree234 *alt_screen;	       /* lines on alternate screen */
+    struct termscreen *screen;	       /* lines on primary screen */
+    struct termscreen *alt_screen;     /* lines on alternate screen */
     int disptop;		       /* distance scrolled back (0 or -ve) */
     int tempsblines;		       /* number of lines of .scrollback that
 					  can be retrieved onto the terminal
 					  ("temporary scrollback") */
 
+    /*
+     * The compressed lines in .scrollback are stored in a queue of
+     * large chunks, oldest first (see sb_alloc() in terminal.c).
+     */
+    struct sbchunk *sbhead, *sbtail;
+    int sbchunks;		       /* number of chunks in the queue */
+    unsigned long sbbytes;	       /* total size of those chunks */
+    unsigned char *sbbuf;	       /* scratch space for compressline() */
+    int sbbufsize;
+
+    /*
+     * Scrollback more than cfg.sb_pack_age lines old is moved out of
+     * .scrollback into pages of SB_PAGE_LINES lines, each of which is
+     * compressed as a single block (see sb_pack() in terminal.c).
+     * These are the oldest lines of all, so the scrollback as a whole
+     * is the first sbpacked lines from .sbpages followed by
+     * everything in .scrollback.
+     */
+    tree234 *sbpages;		       /* struct sbpage, oldest first */
+    int sbpacked;		       /* number of lines in .sbpages */
+    int sbpageskip;		       /* lines dropped from the first page */
+    unsigned long sbpagebytes;	       /* total compressed size of pages */
+    struct sbpage *sbcachepage;	       /* page whose contents are in: */
+    unsigned char *sbcache;
+    int sbcachesize;
+
+    /*
+     * Pages more than cfg.sb_spill_age lines old are written out to
+     * a temporary file (see sb_spill() in terminal.c). As with
+     * packing, it's always the oldest pages that are spilled.
+     */
+    FILE *sbfile;
+    int sbspilled;		       /* number of pages in .sbfile */
+    long sbfileend;		       /* where the next page will go */
+    long sbfilelive;		       /* bytes of the file still in use */
+    int sbfilefailed;		       /* don't try to spill any more */
+
+    termline **sbpend;		       /* lines not yet compressed, as a ring */
+    int sbpendsize, sbpendstart, sbpendcount;
+    termline **sbspare;		       /* blank lines for scroll() to reuse */
+    int sbsparecount;
+
+    unsigned long sbfirst;	       /* serial number of the top line */
+    struct sblinecache *sblcache;      /* see sb_getline() in terminal.c */
+    unsigned long sblcache_hits, sblcache_misses;
+
     termline **disptext;	       /* buffer of text on real screen */
     int dispcursx, dispcursy;	       /* location of cursor on real screen */
     int curstype;		       /* type of cursor on real screen */
 
+    /*
+     * do_paint() only examines the damaged parts of each row (see
+     * term_damage() in terminal.c), and whatever else has to be
+     * redrawn because the state below differs from what it was the
+     * last time it painted.
+     */
+    struct termdamage *damage;	       /* one per row of disptext */
+    int disp_top, disp_rv, disp_blink;
+    int disp_sel, disp_seltype;
+    pos disp_selstart, disp_selend;
+
 #define VBELL_TIMEOUT (TICKSPERSEC/10) /* visual bell lasts 1/10 sec */
 
     struct beeptime *beephead, *beeptail;
@@ -254,9 +343,31 @@ struct terminal_tag {
     /*
      * We schedule a window update shortly after receiving terminal
      * data. This tracks whether one is currently pending.
+     *
+     * How shortly depends on update_delay, which term_update()
+     * lengthens when output is arriving faster than it can usefully
+     * be shown or painting is expensive, and shortens again when
+     * things quieten down. After a keypress, the update showing the
+     * next output to arrive happens straight away, so that echoed
+     * characters appear promptly. (Not just the next update, which
+     * may only be for the keypress resetting the scrollback.)
      */
     int window_update_pending;
     long next_update;
+    int update_delay;
+    long paint_cost;		       /* 4 * recent average ticks/paint */
+    unsigned long update_bytes;	       /* data received since last update */
+    int key_seen;		       /* keypress with no output since */
+    long key_time;		       /* when it was */
+
+    /*
+     * Statistics on window updates, for anyone who's interested
+     * (see term_get_update_stats()). frames_skipped counts the
+     * updates we would have done at the full rate but didn't
+     * because update_delay was longer.
+     */
+    unsigned long frames_painted, frames_skipped;
+    unsigned long paint_ticks;	       /* total time spent painting */
 
     /*
      * Track pending blinks and tblinks.
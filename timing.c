@@ -2,97 +2,251 @@
  * timing.c
  * 
  * This module tracks any timers set up by schedule_timer(). It
- * keeps all the currently active timers in a list; it informs the
- * front end of when the next timer is due to go off if that
- * changes; and, very importantly, it tracks the context pointers
- * passed to schedule_timer(), so that if a context is freed all
- * the timers associated with it can be immediately annulled.
+ * keeps all the currently active timers in a timer wheel; it
+ * informs the front end of when the next timer is due to go off if
+ * that changes; and, very importantly, it tracks the context
+ * pointers passed to schedule_timer(), so that if a context is
+ * freed all the timers associated with it can be immediately
+ * annulled.
  */
 
 #include <assert.h>
 #include <stdio.h>
 
 #include "putty.h"
-#include "tree234.h"
+
+/*
+ * The wheel is hierarchical. Level 0 has a slot for each of the
+ * next WHEEL_SLOTS ticks; each slot of level 1 covers WHEEL_SLOTS
+ * ticks, each slot of level 2 covers WHEEL_SLOTS^2, and so on. A
+ * timer goes in the lowest level whose span reaches its due time,
+ * and is moved down (`cascaded') when the wheel reaches the start
+ * of its slot, until it ends up in level 0 and runs. So adding or
+ * removing a timer costs O(1), and no timer is moved more than
+ * WHEEL_LEVELS-1 times.
+ *
+ * Timers due further ahead than the whole wheel spans (about twelve
+ * days, with millisecond ticks) are parked as far ahead as it goes,
+ * and put back in the right place when they cascade.
+ */
+#define WHEEL_BITS 5
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 6
+#define WHEEL_SPAN (1L << (WHEEL_BITS * WHEEL_LEVELS))
 
 struct timer {
     timer_fn_t fn;
     void *ctx;
     long now;
+    int level, slot;		       /* where it is in the wheel */
+    struct timer *next, **prevp;       /* list of timers in that slot */
+    struct timer *cnext, **cprevp;     /* list of timers for its ctx */
+};
+
+/*
+ * Every context we've been given, with a list of its timers, in a
+ * hash table keyed on the context pointer. The table doubles in
+ * size whenever it gets fuller than one context per bucket.
+ */
+struct timer_context {
+    void *ctx;
+    struct timer *timers;
+    struct timer_context *next;	       /* in its hash chain */
 };
 
-static tree234 *timers = NULL;
-static tree234 *timer_contexts = NULL;
+static struct timer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static unsigned long wheel_mask[WHEEL_LEVELS]; /* slots in use */
+static long wheel_time;		       /* everything due by then has run */
+static int ntimers = 0;
+static long first_when;		       /* no timer is due before this */
+
+static struct timer_context **contexts = NULL;
+static int ncontexts = 0, contexts_size = 0;
+
+static int initialised = FALSE;
 static long now = 0L;
 
-static int compare_timers(void *av, void *bv)
+static void init_timers(void)
 {
-    struct timer *a = (struct timer *)av;
-    struct timer *b = (struct timer *)bv;
-    long at = a->now - now;
-    long bt = b->now - now;
+    if (!initialised) {
+	initialised = TRUE;
+	now = wheel_time = GETTICKCOUNT();
+    }
+}
 
-    if (at < bt)
-	return -1;
-    else if (at > bt)
-	return +1;
+static unsigned ctx_hash(void *ctx, int size)
+{
+    unsigned char *p = (unsigned char *)&ctx;
+    unsigned h = 0;
+    int i;
 
-    /*
-     * Failing that, compare on the other two fields, just so that
-     * we don't get unwanted equality.
-     */
-#ifdef __LCC__
-    /* lcc won't let us compare function pointers. Legal, but annoying. */
-    {
-	int c = memcmp(&a->fn, &b->fn, sizeof(a->fn));
-	if (c < 0)
-	    return -1;
-	else if (c > 0)
-	    return +1;
+    for (i = 0; i < sizeof(ctx); i++)
+	h = h * 31 + p[i];
+    return h % size;
+}
+
+static void grow_contexts(void)
+{
+    struct timer_context **old = contexts, *c;
+    int oldsize = contexts_size, i;
+    unsigned h;
+
+    contexts_size = oldsize ? oldsize * 2 : 64;
+    contexts = snewn(contexts_size, struct timer_context *);
+    for (i = 0; i < contexts_size; i++)
+	contexts[i] = NULL;
+    for (i = 0; i < oldsize; i++) {
+	while ((c = old[i]) != NULL) {
+	    old[i] = c->next;
+	    h = ctx_hash(c->ctx, contexts_size);
+	    c->next = contexts[h];
+	    contexts[h] = c;
+	}
     }
-#else    
-    if (a->fn < b->fn)
-	return -1;
-    else if (a->fn > b->fn)
-	return +1;
-#endif
+    sfree(old);
+}
 
-    if (a->ctx < b->ctx)
-	return -1;
-    else if (a->ctx > b->ctx)
-	return +1;
+/*
+ * Put a timer in the right place in the wheel, relative to the
+ * current wheel_time.
+ */
+static void wheel_add(struct timer *t)
+{
+    unsigned long key = t->now;
+    long delta = t->now - wheel_time;
+    int level;
 
-    /*
-     * Failing _that_, the two entries genuinely are equal, and we
-     * never have a need to store them separately in the tree.
-     */
-    return 0;
+    if (delta < 0) {
+	/* Only if the clock is misbehaving. Run it as soon as we can. */
+	delta = 1;
+	key = wheel_time + 1;
+    } else if (delta >= WHEEL_SPAN) {
+	delta = WHEEL_SPAN - 1;
+	key = wheel_time + delta;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+	if (delta < (1L << (WHEEL_BITS * (level + 1))))
+	    break;
+
+    t->level = level;
+    t->slot = (key >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    t->next = wheel[level][t->slot];
+    if (t->next)
+	t->next->prevp = &t->next;
+    t->prevp = &wheel[level][t->slot];
+    wheel[level][t->slot] = t;
+    wheel_mask[level] |= 1UL << t->slot;
 }
 
-static int compare_timer_contexts(void *av, void *bv)
+static void wheel_remove(struct timer *t)
 {
-    char *a = (char *)av;
-    char *b = (char *)bv;
-    if (a < b)
-	return -1;
-    else if (a > b)
-	return +1;
-    return 0;
+    *t->prevp = t->next;
+    if (t->next)
+	t->next->prevp = t->prevp;
+    if (!wheel[t->level][t->slot])
+	wheel_mask[t->level] &= ~(1UL << t->slot);
 }
 
-static void init_timers(void)
+/*
+ * Empty a slot of the wheel, returning what was in it as a list
+ * whose head the caller must supply.
+ */
+static void wheel_take(int level, int slot, struct timer **head)
+{
+    *head = wheel[level][slot];
+    if (*head)
+	(*head)->prevp = head;
+    wheel[level][slot] = NULL;
+    wheel_mask[level] &= ~(1UL << slot);
+}
+
+/*
+ * How many slots on from `slot' is the next one in use, going round
+ * the wheel? (A result of WHEEL_SLOTS means `slot' itself.) `mask'
+ * must be non-zero.
+ */
+static int next_slot(unsigned long mask, int slot)
+{
+    int d;
+
+    for (d = 1; d < WHEEL_SLOTS; d++)
+	if (mask & (1UL << ((slot + d) & (WHEEL_SLOTS - 1))))
+	    break;
+    return d;
+}
+
+/*
+ * Work out when the wheel next needs attention: when the next
+ * timer in level 0 is due, or when the next occupied slot of a
+ * higher level must be cascaded, whichever is sooner; or `limit',
+ * if that's sooner still. Any slots passed over on the way there
+ * are empty, so we can skip straight to it.
+ */
+static long wheel_next_event(long limit)
 {
-    if (!timers) {
-	timers = newtree234(compare_timers);
-	timer_contexts = newtree234(compare_timer_contexts);
-	now = GETTICKCOUNT();
+    unsigned long best = limit - wheel_time;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+	if (wheel_mask[level]) {
+	    int shift = WHEEL_BITS * level;
+	    unsigned long pos = (unsigned long)wheel_time >> shift;
+	    int d = next_slot(wheel_mask[level], pos & (WHEEL_SLOTS - 1));
+	    unsigned long dist = ((pos + d) << shift) - wheel_time;
+
+	    if (dist < best)
+		best = dist;
+	}
     }
+    return wheel_time + best;
+}
+
+/*
+ * Find out exactly when the first timer is due. There must be at
+ * least one.
+ */
+static long wheel_first(void)
+{
+    struct timer *t, *best = NULL;
+    int level, slot;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+	if (!wheel_mask[level])
+	    continue;
+	if (level < WHEEL_LEVELS - 1) {
+	    /*
+	     * The first slot in use on this level holds its earliest
+	     * timers.
+	     */
+	    slot = ((unsigned long)wheel_time >> (WHEEL_BITS * level)) &
+		(WHEEL_SLOTS - 1);
+	    slot = (slot + next_slot(wheel_mask[level], slot)) &
+		(WHEEL_SLOTS - 1);
+	    for (t = wheel[level][slot]; t; t = t->next)
+		if (!best || t->now - best->now < 0)
+		    best = t;
+	} else {
+	    /*
+	     * But the top level may have far-future timers parked
+	     * anywhere, so search the lot.
+	     */
+	    for (slot = 0; slot < WHEEL_SLOTS; slot++)
+		for (t = wheel[level][slot]; t; t = t->next)
+		    if (!best || t->now - best->now < 0)
+			best = t;
+	}
+    }
+    assert(best);
+    return best->now;
 }
 
 long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
 {
     long when;
-    struct timer *t, *first;
+    struct timer_context *c;
+    struct timer *t;
+    unsigned h;
 
     init_timers();
 
@@ -106,24 +260,47 @@ long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
     if (when - now <= 0)
 	when = now + 1;
 
-    t = snew(struct timer);
+    if (!contexts)
+	grow_contexts();
+    h = ctx_hash(ctx, contexts_size);
+    for (c = contexts[h]; c; c = c->next)
+	if (c->ctx == ctx)
+	    break;
+    if (!c) {
+	if (ncontexts >= contexts_size) {
+	    grow_contexts();
+	    h = ctx_hash(ctx, contexts_size);
+	}
+	ncontexts++;
+	c = snew(struct timer_context);
+	c->ctx = ctx;
+	c->timers = NULL;
+	c->next = contexts[h];
+	contexts[h] = c;
+    }
+
+    for (t = c->timers; t; t = t->cnext)
+	if (t->now == when && t->fn == fn)
+	    return when;	       /* identical timer already exists */
+
+    t = snew_pooled(struct timer);
     t->fn = fn;
     t->ctx = ctx;
     t->now = when;
+    t->cnext = c->timers;
+    if (t->cnext)
+	t->cnext->cprevp = &t->cnext;
+    t->cprevp = &c->timers;
+    c->timers = t;
+    wheel_add(t);
 
-    if (t != add234(timers, t)) {
-	sfree(t);		       /* identical timer already exists */
-    } else {
-	add234(timer_contexts, t->ctx);/* don't care if this fails */
-    }
-
-    first = (struct timer *)index234(timers, 0);
-    if (first == t) {
+    if (ntimers++ == 0 || when - first_when < 0) {
 	/*
 	 * This timer is the very first on the list, so we must
 	 * notify the front end.
 	 */
-	timer_change_notify(first->now);
+	first_when = when;
+	timer_change_notify(when);
     }
 
     return when;
@@ -136,8 +313,6 @@ long schedule_timer(int ticks, timer_fn_t fn, void *ctx)
  */
 int run_timers(long anow, long *next)
 {
-    struct timer *first;
-
     init_timers();
 
 #ifdef TIMING_SYNC
@@ -194,36 +369,51 @@ int run_timers(long anow, long *next)
 
     now = anow;
 
-    while (1) {
-	first = (struct timer *)index234(timers, 0);
+    while (now - wheel_time > 0) {
+	struct timer *t, *due;
+	int level;
 
-	if (!first)
-	    return FALSE;	       /* no timers remaining */
+	wheel_time = wheel_next_event(now);
 
-	if (find234(timer_contexts, first->ctx, NULL) == NULL) {
-	    /*
-	     * This timer belongs to a context that has been
-	     * expired. Delete it without running.
-	     */
-	    delpos234(timers, 0);
-	    sfree(first);
-	} else if (first->now - now <= 0) {
-	    /*
-	     * This timer is active and has reached its running
-	     * time. Run it.
-	     */
-	    delpos234(timers, 0);
-	    first->fn(first->ctx, first->now);
-	    sfree(first);
-	} else {
-	    /*
-	     * This is the first still-active timer that is in the
-	     * future. Return how long it has yet to go.
-	     */
-	    *next = first->now;
-	    return TRUE;
+	/*
+	 * Cascade any slots whose time has come, so that the timers
+	 * in them move down the wheel towards level 0.
+	 */
+	for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+	    int shift = WHEEL_BITS * level;
+
+	    if (((unsigned long)wheel_time & ((1UL << shift) - 1)) == 0) {
+		wheel_take(level, ((unsigned long)wheel_time >> shift) &
+			   (WHEEL_SLOTS - 1), &due);
+		while ((t = due) != NULL) {
+		    due = t->next;
+		    wheel_add(t);
+		}
+	    }
+	}
+
+	/*
+	 * Everything in this tick's slot of level 0 is now due. A
+	 * timer function may expire the context of one of the
+	 * others, which will then vanish from the list as we go.
+	 */
+	wheel_take(0, wheel_time & (WHEEL_SLOTS - 1), &due);
+	while ((t = due) != NULL) {
+	    wheel_remove(t);
+	    *t->cprevp = t->cnext;
+	    if (t->cnext)
+		t->cnext->cprevp = t->cprevp;
+	    ntimers--;
+	    t->fn(t->ctx, t->now);
+	    sfree_pooled(t, struct timer);
 	}
     }
+
+    if (!ntimers)
+	return FALSE;		       /* no timers remaining */
+
+    *next = first_when = wheel_first();
+    return TRUE;
 }
 
 /*
@@ -231,13 +421,43 @@ int run_timers(long anow, long *next)
  */
 void expire_timer_context(void *ctx)
 {
+    struct timer_context **cp, *c;
+    struct timer *t;
+    int refind = FALSE;
+
     init_timers();
 
+    if (!contexts)
+	return;
+    for (cp = &contexts[ctx_hash(ctx, contexts_size)]; (c = *cp) != NULL;
+	 cp = &c->next)
+	if (c->ctx == ctx)
+	    break;
+
     /*
-     * We don't bother to check the return value; if the context
-     * already wasn't in the tree (presumably because no timers
+     * If the context isn't there (presumably because no timers
      * ever actually got scheduled for it) then that's fine and we
      * simply don't need to do anything.
      */
-    del234(timer_contexts, ctx);
+    if (!c)
+	return;
+
+    *cp = c->next;
+    ncontexts--;
+    while ((t = c->timers) != NULL) {
+	c->timers = t->cnext;
+	if (t->now == first_when)
+	    refind = TRUE;
+	wheel_remove(t);
+	ntimers--;
+	sfree_pooled(t, struct timer);
+    }
+    sfree(c);
+
+    /*
+     * If that got rid of the first timer, find the new one, so that
+     * schedule_timer() can still tell when to notify the front end.
+     */
+    if (refind && ntimers)
+	first_when = wheel_first();
 }
@@ -27,39 +27,77 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
 
 #include "puttymem.h"
 #include "tree234.h"
 
+/*
+ * Despite the name, this is now a counted B+tree rather than a
+ * 2-3-4 tree. All the elements live in the leaves; an internal node
+ * holds up to NODE234_MAX kids, with the element count of each
+ * kid's subtree, and a copy of the first element of each subtree so
+ * that sorted lookups can choose a kid without looking inside it.
+ * Every node except the root holds at least NODE234_MIN entries.
+ *
+ * With nodes this wide, looking up an index in a tree of half a
+ * million elements visits four or five nodes, scanning a couple of
+ * cache lines of counts in each, instead of chasing a pointer for
+ * every two or three elements.
+ */
+#ifndef NODE234_MAX
 #ifdef TEST
-#define LOG(x) (printf x)
+#define NODE234_MAX 4		       /* small nodes exercise rebalancing */
 #else
-#define LOG(x)
+#define NODE234_MAX 32
+#endif
+#endif
+#define NODE234_MIN (NODE234_MAX / 2)
+
+#if NODE234_MAX < 4 || NODE234_MAX % 2 != 0
+#error NODE234_MAX must be even and at least 4
 #endif
 
 typedef struct node234_Tag node234;
 
 struct tree234_Tag {
     node234 *root;
+    int height;			       /* 0 if empty, 1 if root is a leaf */
+    int count;
     cmpfn234 cmp;
 };
 
+/*
+ * In a leaf, elems[] holds the elements themselves, and the fields
+ * after it are not allocated at all.
+ */
 struct node234_Tag {
-    node234 *parent;
-    node234 *kids[4];
-    int counts[4];
-    void *elems[3];
+    int n;			       /* number of elements or kids */
+    void *elems[NODE234_MAX];
+    int counts[NODE234_MAX];
+    node234 *kids[NODE234_MAX];
 };
 
+#define LEAF234_SIZE (offsetof(node234, counts))
+
+static node234 *newnode234(int leaf)
+{
+    node234 *n = (node234 *) smalloc(leaf ? LEAF234_SIZE : sizeof(node234));
+    n->n = 0;
+    return n;
+}
+
 /*
  * Create a 2-3-4 tree.
  */
 tree234 *newtree234(cmpfn234 cmp)
 {
     tree234 *ret = snew(tree234);
-    LOG(("created tree %p\n", ret));
     ret->root = NULL;
+    ret->height = 0;
+    ret->count = 0;
     ret->cmp = cmp;
     return ret;
 }
@@ -67,37 +105,37 @@ tree234 *newtree234(cmpfn234 cmp)
 /*
  * Free a 2-3-4 tree (not including freeing the elements).
  */
-static void freenode234(node234 * n)
+static void freenode234(node234 * n, int height)
 {
+    int i;
+
     if (!n)
 	return;
-    freenode234(n->kids[0]);
-    freenode234(n->kids[1]);
-    freenode234(n->kids[2]);
-    freenode234(n->kids[3]);
+    if (height > 1)
+	for (i = 0; i < n->n; i++)
+	    freenode234(n->kids[i], height - 1);
     sfree(n);
 }
 
 void freetree234(tree234 * t)
 {
-    freenode234(t->root);
+    freenode234(t->root, t->height);
     sfree(t);
 }
 
 /*
  * Internal function to count a node.
  */
-static int countnode234(node234 * n)
+static int countnode234(node234 * n, int height)
 {
     int count = 0;
     int i;
     if (!n)
 	return 0;
-    for (i = 0; i < 4; i++)
+    if (height == 1)
+	return n->n;
+    for (i = 0; i < n->n; i++)
 	count += n->counts[i];
-    for (i = 0; i < 3; i++)
-	if (n->elems[i])
-	    count++;
     return count;
 }
 
@@ -106,343 +144,196 @@ static int countnode234(node234 * n)
  */
 int count234(tree234 * t)
 {
-    if (t->root)
-	return countnode234(t->root);
-    else
-	return 0;
+    return t->count;
 }
 
 /*
- * Add an element e to a 2-3-4 tree t. Returns e on success, or if
- * an existing element compares equal, returns that.
+ * Internal function to copy len entries (elements, or kids with
+ * their counts and first elements) from position from in src to
+ * position to in dst. The two ranges may overlap.
  */
-static void *add234_internal(tree234 * t, void *e, int index)
+static void move234(node234 * dst, int to, node234 * src, int from,
+		    int len, int leaf)
 {
-    node234 *n, **np, *left, *right;
-    void *orig_e = e;
-    int c, lcount, rcount;
+    memmove(dst->elems + to, src->elems + from, len * sizeof(void *));
+    if (!leaf) {
+	memmove(dst->counts + to, src->counts + from, len * sizeof(int));
+	memmove(dst->kids + to, src->kids + from, len * sizeof(node234 *));
+    }
+}
 
-    LOG(("adding node %p to tree %p\n", e, t));
-    if (t->root == NULL) {
-	t->root = snew(node234);
-	t->root->elems[1] = t->root->elems[2] = NULL;
-	t->root->kids[0] = t->root->kids[1] = NULL;
-	t->root->kids[2] = t->root->kids[3] = NULL;
-	t->root->counts[0] = t->root->counts[1] = 0;
-	t->root->counts[2] = t->root->counts[3] = 0;
-	t->root->parent = NULL;
-	t->root->elems[0] = e;
-	LOG(("  created root %p\n", t->root));
-	return orig_e;
+/*
+ * Internal function to insert an entry at position pos in node n:
+ * an element e if n is a leaf, or otherwise a kid with its count
+ * and first element e. If n was full, it is split in half first,
+ * and the new right half is returned for the caller to insert in
+ * the parent; otherwise this returns NULL.
+ */
+static node234 *insert234(node234 * n, int leaf, int pos, void *e,
+			  node234 * kid, int count)
+{
+    node234 *m = NULL;
+
+    if (n->n == NODE234_MAX) {
+	m = newnode234(leaf);
+	move234(m, 0, n, NODE234_MIN, NODE234_MAX - NODE234_MIN, leaf);
+	m->n = NODE234_MAX - NODE234_MIN;
+	n->n = NODE234_MIN;
+	if (pos > NODE234_MIN) {
+	    pos -= NODE234_MIN;
+	    n = m;
+	}
+    }
+    move234(n, pos + 1, n, pos, n->n - pos, leaf);
+    n->elems[pos] = e;
+    if (!leaf) {
+	n->counts[pos] = count;
+	n->kids[pos] = kid;
     }
+    n->n++;
+    return m;
+}
 
-    n = NULL; /* placate gcc; will always be set below since t->root != NULL */
-    np = &t->root;
-    while (*np) {
-	int childnum;
-	n = *np;
-	LOG(("  node %p: %p/%d [%p] %p/%d [%p] %p/%d [%p] %p/%d\n",
-	     n,
-	     n->kids[0], n->counts[0], n->elems[0],
-	     n->kids[1], n->counts[1], n->elems[1],
-	     n->kids[2], n->counts[2], n->elems[2],
-	     n->kids[3], n->counts[3]));
-	if (index >= 0) {
-	    if (!n->kids[0]) {
-		/*
-		 * Leaf node. We want to insert at kid position
-		 * equal to the index:
-		 * 
-		 *   0 A 1 B 2 C 3
-		 */
-		childnum = index;
-	    } else {
-		/*
-		 * Internal node. We always descend through it (add
-		 * always starts at the bottom, never in the
-		 * middle).
-		 */
-		do {		       /* this is a do ... while (0) to allow `break' */
-		    if (index <= n->counts[0]) {
-			childnum = 0;
-			break;
-		    }
-		    index -= n->counts[0] + 1;
-		    if (index <= n->counts[1]) {
-			childnum = 1;
-			break;
-		    }
-		    index -= n->counts[1] + 1;
-		    if (index <= n->counts[2]) {
-			childnum = 2;
-			break;
-		    }
-		    index -= n->counts[2] + 1;
-		    if (index <= n->counts[3]) {
-			childnum = 3;
-			break;
-		    }
-		    return NULL;       /* error: index out of range */
-		} while (0);
-	    }
-	} else {
-	    if ((c = t->cmp(e, n->elems[0])) < 0)
-		childnum = 0;
-	    else if (c == 0)
-		return n->elems[0];    /* already exists */
-	    else if (n->elems[1] == NULL
-		     || (c = t->cmp(e, n->elems[1])) < 0) childnum = 1;
-	    else if (c == 0)
-		return n->elems[1];    /* already exists */
-	    else if (n->elems[2] == NULL
-		     || (c = t->cmp(e, n->elems[2])) < 0) childnum = 2;
-	    else if (c == 0)
-		return n->elems[2];    /* already exists */
+/*
+ * Internal function to make a new root above two subtrees of the
+ * given height.
+ */
+static node234 *newroot234(node234 * a, node234 * b, int height)
+{
+    node234 *n = newnode234(0);
+    n->n = 2;
+    n->elems[0] = a->elems[0];
+    n->counts[0] = countnode234(a, height);
+    n->kids[0] = a;
+    n->elems[1] = b->elems[0];
+    n->counts[1] = countnode234(b, height);
+    n->kids[1] = b;
+    return n;
+}
+
+/*
+ * Internal function to share the entries of two adjacent nodes at
+ * the same level evenly between them.
+ */
+static void share234(node234 * a, node234 * b, int leaf)
+{
+    int want = (a->n + b->n) / 2, k;
+
+    if (a->n > want) {
+	k = a->n - want;
+	move234(b, k, b, 0, b->n, leaf);
+	move234(b, 0, a, want, k, leaf);
+	b->n += k;
+    } else if (a->n < want) {
+	k = want - a->n;
+	move234(a, a->n, b, 0, k, leaf);
+	move234(b, 0, b, k, b->n - k, leaf);
+	b->n -= k;
+    }
+    a->n = want;
+}
+
+/*
+ * Internal function to find the place for an element e in a sorted
+ * tree: sets *pos to the number of elements comparing less than it,
+ * and returns an element comparing equal to it if there is one.
+ */
+static void *search234(tree234 * t, void *e, cmpfn234 cmp, int *pos)
+{
+    node234 *n = t->root;
+    int h, i, lo, hi, mid, idx = 0;
+
+    for (h = t->height; h > 1; h--) {
+	/* Find the last kid whose first element is <= e. */
+	lo = 1;
+	hi = n->n;
+	while (lo < hi) {
+	    mid = (lo + hi) / 2;
+	    if (cmp(e, n->elems[mid]) < 0)
+		hi = mid;
 	    else
-		childnum = 3;
+		lo = mid + 1;
 	}
-	np = &n->kids[childnum];
-	LOG(("  moving to child %d (%p)\n", childnum, *np));
+	for (i = 0; i < lo - 1; i++)
+	    idx += n->counts[i];
+	n = n->kids[lo - 1];
     }
 
-    /*
-     * We need to insert the new element in n at position np.
-     */
-    left = NULL;
-    lcount = 0;
-    right = NULL;
-    rcount = 0;
-    while (n) {
-	LOG(("  at %p: %p/%d [%p] %p/%d [%p] %p/%d [%p] %p/%d\n",
-	     n,
-	     n->kids[0], n->counts[0], n->elems[0],
-	     n->kids[1], n->counts[1], n->elems[1],
-	     n->kids[2], n->counts[2], n->elems[2],
-	     n->kids[3], n->counts[3]));
-	LOG(("  need to insert %p/%d [%p] %p/%d at position %d\n",
-	     left, lcount, e, right, rcount, np - n->kids));
-	if (n->elems[1] == NULL) {
-	    /*
-	     * Insert in a 2-node; simple.
-	     */
-	    if (np == &n->kids[0]) {
-		LOG(("  inserting on left of 2-node\n"));
-		n->kids[2] = n->kids[1];
-		n->counts[2] = n->counts[1];
-		n->elems[1] = n->elems[0];
-		n->kids[1] = right;
-		n->counts[1] = rcount;
-		n->elems[0] = e;
-		n->kids[0] = left;
-		n->counts[0] = lcount;
-	    } else {		       /* np == &n->kids[1] */
-		LOG(("  inserting on right of 2-node\n"));
-		n->kids[2] = right;
-		n->counts[2] = rcount;
-		n->elems[1] = e;
-		n->kids[1] = left;
-		n->counts[1] = lcount;
-	    }
-	    if (n->kids[0])
-		n->kids[0]->parent = n;
-	    if (n->kids[1])
-		n->kids[1]->parent = n;
-	    if (n->kids[2])
-		n->kids[2]->parent = n;
-	    LOG(("  done\n"));
-	    break;
-	} else if (n->elems[2] == NULL) {
-	    /*
-	     * Insert in a 3-node; simple.
-	     */
-	    if (np == &n->kids[0]) {
-		LOG(("  inserting on left of 3-node\n"));
-		n->kids[3] = n->kids[2];
-		n->counts[3] = n->counts[2];
-		n->elems[2] = n->elems[1];
-		n->kids[2] = n->kids[1];
-		n->counts[2] = n->counts[1];
-		n->elems[1] = n->elems[0];
-		n->kids[1] = right;
-		n->counts[1] = rcount;
-		n->elems[0] = e;
-		n->kids[0] = left;
-		n->counts[0] = lcount;
-	    } else if (np == &n->kids[1]) {
-		LOG(("  inserting in middle of 3-node\n"));
-		n->kids[3] = n->kids[2];
-		n->counts[3] = n->counts[2];
-		n->elems[2] = n->elems[1];
-		n->kids[2] = right;
-		n->counts[2] = rcount;
-		n->elems[1] = e;
-		n->kids[1] = left;
-		n->counts[1] = lcount;
-	    } else {		       /* np == &n->kids[2] */
-		LOG(("  inserting on right of 3-node\n"));
-		n->kids[3] = right;
-		n->counts[3] = rcount;
-		n->elems[2] = e;
-		n->kids[2] = left;
-		n->counts[2] = lcount;
-	    }
-	    if (n->kids[0])
-		n->kids[0]->parent = n;
-	    if (n->kids[1])
-		n->kids[1]->parent = n;
-	    if (n->kids[2])
-		n->kids[2]->parent = n;
-	    if (n->kids[3])
-		n->kids[3]->parent = n;
-	    LOG(("  done\n"));
-	    break;
-	} else {
-	    node234 *m = snew(node234);
-	    m->parent = n->parent;
-	    LOG(("  splitting a 4-node; created new node %p\n", m));
-	    /*
-	     * Insert in a 4-node; split into a 2-node and a
-	     * 3-node, and move focus up a level.
-	     * 
-	     * I don't think it matters which way round we put the
-	     * 2 and the 3. For simplicity, we'll put the 3 first
-	     * always.
-	     */
-	    if (np == &n->kids[0]) {
-		m->kids[0] = left;
-		m->counts[0] = lcount;
-		m->elems[0] = e;
-		m->kids[1] = right;
-		m->counts[1] = rcount;
-		m->elems[1] = n->elems[0];
-		m->kids[2] = n->kids[1];
-		m->counts[2] = n->counts[1];
-		e = n->elems[1];
-		n->kids[0] = n->kids[2];
-		n->counts[0] = n->counts[2];
-		n->elems[0] = n->elems[2];
-		n->kids[1] = n->kids[3];
-		n->counts[1] = n->counts[3];
-	    } else if (np == &n->kids[1]) {
-		m->kids[0] = n->kids[0];
-		m->counts[0] = n->counts[0];
-		m->elems[0] = n->elems[0];
-		m->kids[1] = left;
-		m->counts[1] = lcount;
-		m->elems[1] = e;
-		m->kids[2] = right;
-		m->counts[2] = rcount;
-		e = n->elems[1];
-		n->kids[0] = n->kids[2];
-		n->counts[0] = n->counts[2];
-		n->elems[0] = n->elems[2];
-		n->kids[1] = n->kids[3];
-		n->counts[1] = n->counts[3];
-	    } else if (np == &n->kids[2]) {
-		m->kids[0] = n->kids[0];
-		m->counts[0] = n->counts[0];
-		m->elems[0] = n->elems[0];
-		m->kids[1] = n->kids[1];
-		m->counts[1] = n->counts[1];
-		m->elems[1] = n->elems[1];
-		m->kids[2] = left;
-		m->counts[2] = lcount;
-		/* e = e; */
-		n->kids[0] = right;
-		n->counts[0] = rcount;
-		n->elems[0] = n->elems[2];
-		n->kids[1] = n->kids[3];
-		n->counts[1] = n->counts[3];
-	    } else {		       /* np == &n->kids[3] */
-		m->kids[0] = n->kids[0];
-		m->counts[0] = n->counts[0];
-		m->elems[0] = n->elems[0];
-		m->kids[1] = n->kids[1];
-		m->counts[1] = n->counts[1];
-		m->elems[1] = n->elems[1];
-		m->kids[2] = n->kids[2];
-		m->counts[2] = n->counts[2];
-		n->kids[0] = left;
-		n->counts[0] = lcount;
-		n->elems[0] = e;
-		n->kids[1] = right;
-		n->counts[1] = rcount;
-		e = n->elems[2];
-	    }
-	    m->kids[3] = n->kids[3] = n->kids[2] = NULL;
-	    m->counts[3] = n->counts[3] = n->counts[2] = 0;
-	    m->elems[2] = n->elems[2] = n->elems[1] = NULL;
-	    if (m->kids[0])
-		m->kids[0]->parent = m;
-	    if (m->kids[1])
-		m->kids[1]->parent = m;
-	    if (m->kids[2])
-		m->kids[2]->parent = m;
-	    if (n->kids[0])
-		n->kids[0]->parent = n;
-	    if (n->kids[1])
-		n->kids[1]->parent = n;
-	    LOG(("  left (%p): %p/%d [%p] %p/%d [%p] %p/%d\n", m,
-		 m->kids[0], m->counts[0], m->elems[0],
-		 m->kids[1], m->counts[1], m->elems[1],
-		 m->kids[2], m->counts[2]));
-	    LOG(("  right (%p): %p/%d [%p] %p/%d\n", n,
-		 n->kids[0], n->counts[0], n->elems[0],
-		 n->kids[1], n->counts[1]));
-	    left = m;
-	    lcount = countnode234(left);
-	    right = n;
-	    rcount = countnode234(right);
-	}
-	if (n->parent)
-	    np = (n->parent->kids[0] == n ? &n->parent->kids[0] :
-		  n->parent->kids[1] == n ? &n->parent->kids[1] :
-		  n->parent->kids[2] == n ? &n->parent->kids[2] :
-		  &n->parent->kids[3]);
-	n = n->parent;
+    /* Find the first element in the leaf which is >= e. */
+    lo = 0;
+    hi = n ? n->n : 0;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (cmp(e, n->elems[mid]) <= 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
     }
+    *pos = idx + lo;
+    if (n && lo < n->n && cmp(e, n->elems[lo]) == 0)
+	return n->elems[lo];
+    return NULL;
+}
 
-    /*
-     * If we've come out of here by `break', n will still be
-     * non-NULL and all we need to do is go back up the tree
-     * updating counts. If we've come here because n is NULL, we
-     * need to create a new root for the tree because the old one
-     * has just split into two. */
-    if (n) {
-	while (n->parent) {
-	    int count = countnode234(n);
-	    int childnum;
-	    childnum = (n->parent->kids[0] == n ? 0 :
-			n->parent->kids[1] == n ? 1 :
-			n->parent->kids[2] == n ? 2 : 3);
-	    n->parent->counts[childnum] = count;
-	    n = n->parent;
-	}
-    } else {
-	LOG(("  root is overloaded, split into two\n"));
-	t->root = snew(node234);
-	t->root->kids[0] = left;
-	t->root->counts[0] = lcount;
+/*
+ * Internal function to add an element e at position index in the
+ * subtree n. Returns the new right half if n had to be split.
+ */
+static node234 *add234_node(node234 * n, int height, int index, void *e)
+{
+    node234 *kid, *sib;
+    int i, count;
+
+    if (height == 1)
+	return insert234(n, 1, index, e, NULL, 0);
+
+    for (i = 0; i < n->n - 1 && index > n->counts[i]; i++)
+	index -= n->counts[i];
+    kid = n->kids[i];
+    sib = add234_node(kid, height - 1, index, e);
+    n->elems[i] = kid->elems[0];
+    if (!sib) {
+	n->counts[i]++;
+	return NULL;
+    }
+    count = n->counts[i] + 1;
+    n->counts[i] = countnode234(kid, height - 1);
+    return insert234(n, 0, i + 1, sib->elems[0], sib,
+		     count - n->counts[i]);
+}
+
+/*
+ * Add an element e to a 2-3-4 tree t. Returns e on success, or if
+ * an existing element compares equal, returns that.
+ */
+static void *add234_internal(tree234 * t, void *e, int index)
+{
+    node234 *sib;
+    void *ret;
+
+    if (index < 0) {
+	ret = search234(t, e, t->cmp, &index);
+	if (ret)
+	    return ret;		       /* already exists */
+    } else if (index > t->count) {
+	return NULL;		       /* error: index out of range */
+    }
+
+    t->count++;
+    if (t->root == NULL) {
+	t->root = newnode234(1);
+	t->root->n = 1;
 	t->root->elems[0] = e;
-	t->root->kids[1] = right;
-	t->root->counts[1] = rcount;
-	t->root->elems[1] = NULL;
-	t->root->kids[2] = NULL;
-	t->root->counts[2] = 0;
-	t->root->elems[2] = NULL;
-	t->root->kids[3] = NULL;
-	t->root->counts[3] = 0;
-	t->root->parent = NULL;
-	if (t->root->kids[0])
-	    t->root->kids[0]->parent = t->root;
-	if (t->root->kids[1])
-	    t->root->kids[1]->parent = t->root;
-	LOG(("  new root is %p/%d [%p] %p/%d\n",
-	     t->root->kids[0], t->root->counts[0],
-	     t->root->elems[0], t->root->kids[1], t->root->counts[1]));
+	t->height = 1;
+	return e;
     }
 
-    return orig_e;
+    sib = add234_node(t->root, t->height, index, e);
+    if (sib) {
+	t->root = newroot234(t->root, sib, t->height);
+	t->height++;
+    }
+    return e;
 }
 
 void *add234(tree234 * t, void *e)
@@ -468,34 +359,32 @@ void *addpos234(tree234 * t, void *e, int index)
 void *index234(tree234 * t, int index)
 {
     node234 *n;
+    int h, i, count;
 
-    if (!t->root)
-	return NULL;		       /* tree is empty */
-
-    if (index < 0 || index >= countnode234(t->root))
-	return NULL;		       /* out of range */
+    if (index < 0 || index >= t->count)
+	return NULL;		       /* out of range, or tree empty */
 
     n = t->root;
-
-    while (n) {
-	if (index < n->counts[0])
-	    n = n->kids[0];
-	else if (index -= n->counts[0] + 1, index < 0)
-	    return n->elems[0];
-	else if (index < n->counts[1])
-	    n = n->kids[1];
-	else if (index -= n->counts[1] + 1, index < 0)
-	    return n->elems[1];
-	else if (index < n->counts[2])
-	    n = n->kids[2];
-	else if (index -= n->counts[2] + 1, index < 0)
-	    return n->elems[2];
-	else
-	    n = n->kids[3];
+    count = t->count;
+    for (h = t->height; h > 1; h--) {
+	/*
+	 * Scan the counts from whichever end is nearer. Lookups
+	 * near the end of a tree are common (the bottom of the
+	 * scrollback, for instance), so this matters.
+	 */
+	if (index < count / 2) {
+	    for (i = 0; index >= n->counts[i]; i++)
+		index -= n->counts[i];
+	} else {
+	    index = count - index;     /* elements from index to the end */
+	    for (i = n->n - 1; index > n->counts[i]; i--)
+		index -= n->counts[i];
+	    index = n->counts[i] - index;
+	}
+	count = n->counts[i];
+	n = n->kids[i];
     }
-
-    /* We shouldn't ever get here. I wonder how we did. */
-    return NULL;
+    return n->elems[index];
 }
 
 /*
@@ -508,10 +397,8 @@ void *index234(tree234 * t, int index)
 void *findrelpos234(tree234 * t, void *e, cmpfn234 cmp,
 		    int relation, int *index)
 {
-    node234 *n;
     void *ret;
-    int c;
-    int idx, ecount, kcount, cmpret;
+    int idx;
 
     if (t->root == NULL)
 	return NULL;
@@ -519,88 +406,40 @@ void *findrelpos234(tree234 * t, void *e, cmpfn234 cmp,
     if (cmp == NULL)
 	cmp = t->cmp;
 
-    n = t->root;
-    /*
-     * Attempt to find the element itself.
-     */
-    idx = 0;
-    ecount = -1;
-    /*
-     * Prepare a fake `cmp' result if e is NULL.
-     */
-    cmpret = 0;
     if (e == NULL) {
+	/*
+	 * NULL stands for a value beyond the end of the tree in
+	 * whichever direction we're searching.
+	 */
 	assert(relation == REL234_LT || relation == REL234_GT);
-	if (relation == REL234_LT)
-	    cmpret = +1;	       /* e is a max: always greater */
-	else if (relation == REL234_GT)
-	    cmpret = -1;	       /* e is a min: always smaller */
-    }
-    while (1) {
-	for (kcount = 0; kcount < 4; kcount++) {
-	    if (kcount >= 3 || n->elems[kcount] == NULL ||
-		(c = cmpret ? cmpret : cmp(e, n->elems[kcount])) < 0) {
-		break;
-	    }
-	    if (n->kids[kcount])
-		idx += n->counts[kcount];
-	    if (c == 0) {
-		ecount = kcount;
-		break;
-	    }
-	    idx++;
-	}
-	if (ecount >= 0)
-	    break;
-	if (n->kids[kcount])
-	    n = n->kids[kcount];
-	else
-	    break;
-    }
-
-    if (ecount >= 0) {
+	idx = (relation == REL234_LT ? t->count - 1 : 0);
+    } else if ((ret = search234(t, e, cmp, &idx)) != NULL) {
 	/*
-	 * We have found the element we're looking for. It's
-	 * n->elems[ecount], at tree index idx. If our search
-	 * relation is EQ, LE or GE we can now go home.
+	 * We have found the element we're looking for, at tree
+	 * index idx. If our search relation is EQ, LE or GE we can
+	 * now go home; otherwise we want its neighbour.
 	 */
 	if (relation != REL234_LT && relation != REL234_GT) {
 	    if (index)
 		*index = idx;
-	    return n->elems[ecount];
+	    return ret;
 	}
-
-	/*
-	 * Otherwise, we'll do an indexed lookup for the previous
-	 * or next element. (It would be perfectly possible to
-	 * implement these search types in a non-counted tree by
-	 * going back up from where we are, but far more fiddly.)
-	 */
 	if (relation == REL234_LT)
 	    idx--;
 	else
 	    idx++;
     } else {
 	/*
-	 * We've found our way to the bottom of the tree and we
-	 * know where we would insert this node if we wanted to:
-	 * we'd put it in in place of the (empty) subtree
-	 * n->kids[kcount], and it would have index idx
-	 * 
-	 * But the actual element isn't there. So if our search
-	 * relation is EQ, we're doomed.
+	 * The element isn't there, but idx is where it would be
+	 * inserted. So if our search relation is EQ, we're doomed;
+	 * otherwise we want the element at idx-1 (if we're going
+	 * left - LE or LT) or idx (if we're going right - GE or
+	 * GT).
 	 */
 	if (relation == REL234_EQ)
 	    return NULL;
-
-	/*
-	 * Otherwise, we must do an index lookup for index idx-1
-	 * (if we're going left - LE or LT) or index idx (if we're
-	 * going right - GE or GT).
-	 */
-	if (relation == REL234_LT || relation == REL234_LE) {
+	if (relation == REL234_LT || relation == REL234_LE)
 	    idx--;
-	}
     }
 
     /*
@@ -627,359 +466,382 @@ void *findpos234(tree234 * t, void *e, cmpfn234 cmp, int *index)
 }
 
 /*
- * Delete an element e in a 2-3-4 tree. Does not free the element,
- * merely removes all links to it from the tree nodes.
+ * Internal function to bring kid i of internal node n back up to
+ * the minimum size, by merging it with a neighbour if they fit in
+ * one node, or by sharing the neighbour's entries if not.
  */
+static void rebalance234(node234 * n, int i, int kidheight)
+{
+    node234 *a, *b;
+    int leaf = (kidheight == 1);
+
+    if (i == n->n - 1)
+	i--;			       /* use the left neighbour instead */
+    a = n->kids[i];
+    b = n->kids[i + 1];
+    if (a->n + b->n <= NODE234_MAX) {
+	move234(a, a->n, b, 0, b->n, leaf);
+	a->n += b->n;
+	n->counts[i] += n->counts[i + 1];
+	sfree(b);
+	move234(n, i + 1, n, i + 2, n->n - i - 2, 0);
+	n->n--;
+    } else {
+	share234(a, b, leaf);
+	n->counts[i] = countnode234(a, kidheight);
+	n->counts[i + 1] = countnode234(b, kidheight);
+	n->elems[i + 1] = b->elems[0];
+    }
+}
+
+/*
+ * Internal function to delete the element at position index in the
+ * subtree n. This may leave n below the minimum size, for the
+ * caller to deal with.
+ */
+static void *delpos234_node(node234 * n, int height, int index)
+{
+    void *e;
+    int i;
+
+    if (height == 1) {
+	e = n->elems[index];
+	move234(n, index, n, index + 1, n->n - index - 1, 1);
+	n->n--;
+	return e;
+    }
+
+    for (i = 0; index >= n->counts[i]; i++)
+	index -= n->counts[i];
+    e = delpos234_node(n->kids[i], height - 1, index);
+    n->counts[i]--;
+    n->elems[i] = n->kids[i]->elems[0];
+    if (n->kids[i]->n < NODE234_MIN)
+	rebalance234(n, i, height - 1);
+    return e;
+}
+
 static void *delpos234_internal(tree234 * t, int index)
 {
-    node234 *n;
-    void *retval;
-    int ei = -1;
+    node234 *n = t->root;
+    void *e;
+
+    e = delpos234_node(n, t->height, index);
+    t->count--;
+    if (t->height > 1 && n->n == 1) {
+	t->root = n->kids[0];
+	t->height--;
+	sfree(n);
+    } else if (t->height == 1 && n->n == 0) {
+	t->root = NULL;
+	t->height = 0;
+	sfree(n);
+    }
+    return e;
+}
+void *delpos234(tree234 * t, int index)
+{
+    if (index < 0 || index >= t->count)
+	return NULL;
+    return delpos234_internal(t, index);
+}
+void *del234(tree234 * t, void *e)
+{
+    int index;
+    if (!findrelpos234(t, e, NULL, REL234_EQ, &index))
+	return NULL;		       /* it wasn't in there anyway */
+    return delpos234_internal(t, index);	/* it's there; delete it. */
+}
 
-    retval = 0;
+/*
+ * Internal functions supporting the bulk operations. These work on
+ * bare subtrees rather than whole tree234s, so they pass the height
+ * of each subtree around explicitly. The root of a subtree may be
+ * smaller than NODE234_MIN, as long as it's not empty and (if it's
+ * an internal node) it has at least two kids.
+ */
 
-    n = t->root;
-    LOG(("deleting item %d from tree %p\n", index, t));
-    while (1) {
-	while (n) {
-	    int ki;
-	    node234 *sub;
-
-	    LOG(
-		("  node %p: %p/%d [%p] %p/%d [%p] %p/%d [%p] %p/%d index=%d\n",
-		 n, n->kids[0], n->counts[0], n->elems[0], n->kids[1],
-		 n->counts[1], n->elems[1], n->kids[2], n->counts[2],
-		 n->elems[2], n->kids[3], n->counts[3], index));
-	    if (index < n->counts[0]) {
-		ki = 0;
-	    } else if (index -= n->counts[0] + 1, index < 0) {
-		ei = 0;
-		break;
-	    } else if (index < n->counts[1]) {
-		ki = 1;
-	    } else if (index -= n->counts[1] + 1, index < 0) {
-		ei = 1;
-		break;
-	    } else if (index < n->counts[2]) {
-		ki = 2;
-	    } else if (index -= n->counts[2] + 1, index < 0) {
-		ei = 2;
-		break;
-	    } else {
-		ki = 3;
-	    }
-	    /*
-	     * Recurse down to subtree ki. If it has only one element,
-	     * we have to do some transformation to start with.
-	     */
-	    LOG(("  moving to subtree %d\n", ki));
-	    sub = n->kids[ki];
-	    if (!sub->elems[1]) {
-		LOG(("  subtree has only one element!\n", ki));
-		if (ki > 0 && n->kids[ki - 1]->elems[1]) {
-		    /*
-		     * Case 3a, left-handed variant. Child ki has
-		     * only one element, but child ki-1 has two or
-		     * more. So we need to move a subtree from ki-1
-		     * to ki.
-		     * 
-		     *                . C .                     . B .
-		     *               /     \     ->            /     \
-		     * [more] a A b B c   d D e      [more] a A b   c C d D e
-		     */
-		    node234 *sib = n->kids[ki - 1];
-		    int lastelem = (sib->elems[2] ? 2 :
-				    sib->elems[1] ? 1 : 0);
-		    sub->kids[2] = sub->kids[1];
-		    sub->counts[2] = sub->counts[1];
-		    sub->elems[1] = sub->elems[0];
-		    sub->kids[1] = sub->kids[0];
-		    sub->counts[1] = sub->counts[0];
-		    sub->elems[0] = n->elems[ki - 1];
-		    sub->kids[0] = sib->kids[lastelem + 1];
-		    sub->counts[0] = sib->counts[lastelem + 1];
-		    if (sub->kids[0])
-			sub->kids[0]->parent = sub;
-		    n->elems[ki - 1] = sib->elems[lastelem];
-		    sib->kids[lastelem + 1] = NULL;
-		    sib->counts[lastelem + 1] = 0;
-		    sib->elems[lastelem] = NULL;
-		    n->counts[ki] = countnode234(sub);
-		    LOG(("  case 3a left\n"));
-		    LOG(
-			("  index and left subtree count before adjustment: %d, %d\n",
-			 index, n->counts[ki - 1]));
-		    index += n->counts[ki - 1];
-		    n->counts[ki - 1] = countnode234(sib);
-		    index -= n->counts[ki - 1];
-		    LOG(
-			("  index and left subtree count after adjustment: %d, %d\n",
-			 index, n->counts[ki - 1]));
-		} else if (ki < 3 && n->kids[ki + 1]
-			   && n->kids[ki + 1]->elems[1]) {
-		    /*
-		     * Case 3a, right-handed variant. ki has only
-		     * one element but ki+1 has two or more. Move a
-		     * subtree from ki+1 to ki.
-		     * 
-		     *      . B .                             . C .
-		     *     /     \                ->         /     \
-		     *  a A b   c C d D e [more]      a A b B c   d D e [more]
-		     */
-		    node234 *sib = n->kids[ki + 1];
-		    int j;
-		    sub->elems[1] = n->elems[ki];
-		    sub->kids[2] = sib->kids[0];
-		    sub->counts[2] = sib->counts[0];
-		    if (sub->kids[2])
-			sub->kids[2]->parent = sub;
-		    n->elems[ki] = sib->elems[0];
-		    sib->kids[0] = sib->kids[1];
-		    sib->counts[0] = sib->counts[1];
-		    for (j = 0; j < 2 && sib->elems[j + 1]; j++) {
-			sib->kids[j + 1] = sib->kids[j + 2];
-			sib->counts[j + 1] = sib->counts[j + 2];
-			sib->elems[j] = sib->elems[j + 1];
-		    }
-		    sib->kids[j + 1] = NULL;
-		    sib->counts[j + 1] = 0;
-		    sib->elems[j] = NULL;
-		    n->counts[ki] = countnode234(sub);
-		    n->counts[ki + 1] = countnode234(sib);
-		    LOG(("  case 3a right\n"));
-		} else {
-		    /*
-		     * Case 3b. ki has only one element, and has no
-		     * neighbour with more than one. So pick a
-		     * neighbour and merge it with ki, taking an
-		     * element down from n to go in the middle.
-		     *
-		     *      . B .                .
-		     *     /     \     ->        |
-		     *  a A b   c C d      a A b B c C d
-		     * 
-		     * (Since at all points we have avoided
-		     * descending to a node with only one element,
-		     * we can be sure that n is not reduced to
-		     * nothingness by this move, _unless_ it was
-		     * the very first node, ie the root of the
-		     * tree. In that case we remove the now-empty
-		     * root and replace it with its single large
-		     * child as shown.)
-		     */
-		    node234 *sib;
-		    int j;
-
-		    if (ki > 0) {
-			ki--;
-			index += n->counts[ki] + 1;
-		    }
-		    sib = n->kids[ki];
-		    sub = n->kids[ki + 1];
-
-		    sub->kids[3] = sub->kids[1];
-		    sub->counts[3] = sub->counts[1];
-		    sub->elems[2] = sub->elems[0];
-		    sub->kids[2] = sub->kids[0];
-		    sub->counts[2] = sub->counts[0];
-		    sub->elems[1] = n->elems[ki];
-		    sub->kids[1] = sib->kids[1];
-		    sub->counts[1] = sib->counts[1];
-		    if (sub->kids[1])
-			sub->kids[1]->parent = sub;
-		    sub->elems[0] = sib->elems[0];
-		    sub->kids[0] = sib->kids[0];
-		    sub->counts[0] = sib->counts[0];
-		    if (sub->kids[0])
-			sub->kids[0]->parent = sub;
-
-		    n->counts[ki + 1] = countnode234(sub);
-
-		    sfree(sib);
-
-		    /*
-		     * That's built the big node in sub. Now we
-		     * need to remove the reference to sib in n.
-		     */
-		    for (j = ki; j < 3 && n->kids[j + 1]; j++) {
-			n->kids[j] = n->kids[j + 1];
-			n->counts[j] = n->counts[j + 1];
-			n->elems[j] = j < 2 ? n->elems[j + 1] : NULL;
-		    }
-		    n->kids[j] = NULL;
-		    n->counts[j] = 0;
-		    if (j < 3)
-			n->elems[j] = NULL;
-		    LOG(("  case 3b ki=%d\n", ki));
-
-		    if (!n->elems[0]) {
-			/*
-			 * The root is empty and needs to be
-			 * removed.
-			 */
-			LOG(("  shifting root!\n"));
-			t->root = sub;
-			sub->parent = NULL;
-			sfree(n);
-		    }
-		}
+/*
+ * Build a subtree from n elements, in order, filling the nodes at
+ * each level as evenly as possible. Returns it and its height.
+ */
+static node234 *build234(void **elems, int n, int *height)
+{
+    node234 **level, *node;
+    int *counts;
+    int nnodes, nparents, per, extra, pos, count, i, j, h;
+
+    if (n <= 0) {
+	*height = 0;
+	return NULL;
+    }
+
+    nnodes = (n + NODE234_MAX - 1) / NODE234_MAX;
+    level = snewn(nnodes, node234 *);
+    counts = snewn(nnodes, int);
+    per = n / nnodes;
+    extra = n % nnodes;
+    for (i = 0; i < nnodes; i++) {
+	node = newnode234(1);
+	node->n = per + (i < extra ? 1 : 0);
+	memcpy(node->elems, elems, node->n * sizeof(void *));
+	elems += node->n;
+	level[i] = node;
+	counts[i] = node->n;
+    }
+
+    for (h = 1; nnodes > 1; h++) {
+	nparents = (nnodes + NODE234_MAX - 1) / NODE234_MAX;
+	per = nnodes / nparents;
+	extra = nnodes % nparents;
+	for (i = pos = 0; i < nparents; i++) {
+	    node = newnode234(0);
+	    node->n = per + (i < extra ? 1 : 0);
+	    count = 0;
+	    for (j = 0; j < node->n; j++, pos++) {
+		node->elems[j] = level[pos]->elems[0];
+		node->counts[j] = counts[pos];
+		node->kids[j] = level[pos];
+		count += counts[pos];
 	    }
-	    n = sub;
+	    /* pos > i by now, so this can't overwrite anything unread */
+	    level[i] = node;
+	    counts[i] = count;
 	}
-	if (!retval)
-	    retval = n->elems[ei];
+	nnodes = nparents;
+    }
 
-	if (ei == -1)
-	    return NULL;	       /* although this shouldn't happen */
+    node = level[0];
+    sfree(level);
+    sfree(counts);
+    *height = h;
+    return node;
+}
 
-	/*
-	 * Treat special case: this is the one remaining item in
-	 * the tree. n is the tree root (no parent), has one
-	 * element (no elems[1]), and has no kids (no kids[0]).
-	 */
-	if (!n->parent && !n->elems[1] && !n->kids[0]) {
-	    LOG(("  removed last element in tree\n"));
-	    sfree(n);
-	    t->root = NULL;
-	    return retval;
+/*
+ * Join the subtree r on to the right of the subtree n, which is
+ * taller. We walk down n's right-hand edge to the level above r,
+ * and then either merge r into the rightmost node there or (if
+ * they won't fit in one node) even them up and add r as a new kid.
+ * Returns a new right half of n if n had to be split.
+ */
+static node234 *joinright234(node234 * n, int height, node234 * r,
+			     int rheight)
+{
+    int last = n->n - 1;
+    node234 *kid = n->kids[last], *sib;
+
+    if (height - 1 == rheight) {
+	if (kid->n + r->n <= NODE234_MAX) {
+	    move234(kid, kid->n, r, 0, r->n, rheight == 1);
+	    kid->n += r->n;
+	    sfree(r);
+	    sib = NULL;
+	} else {
+	    share234(kid, r, rheight == 1);
+	    sib = r;
 	}
+    } else {
+	sib = joinright234(kid, height - 1, r, rheight);
+    }
+    n->counts[last] = countnode234(kid, height - 1);
+    if (!sib)
+	return NULL;
+    return insert234(n, 0, last + 1, sib->elems[0], sib,
+		     countnode234(sib, height - 1));
+}
 
-	/*
-	 * Now we have the element we want, as n->elems[ei], and we
-	 * have also arranged for that element not to be the only
-	 * one in its node. So...
-	 */
-
-	if (!n->kids[0] && n->elems[1]) {
-	    /*
-	     * Case 1. n is a leaf node with more than one element,
-	     * so it's _really easy_. Just delete the thing and
-	     * we're done.
-	     */
-	    int i;
-	    LOG(("  case 1\n"));
-	    for (i = ei; i < 2 && n->elems[i + 1]; i++)
-		n->elems[i] = n->elems[i + 1];
-	    n->elems[i] = NULL;
-	    /*
-	     * Having done that to the leaf node, we now go back up
-	     * the tree fixing the counts.
-	     */
-	    while (n->parent) {
-		int childnum;
-		childnum = (n->parent->kids[0] == n ? 0 :
-			    n->parent->kids[1] == n ? 1 :
-			    n->parent->kids[2] == n ? 2 : 3);
-		n->parent->counts[childnum]--;
-		n = n->parent;
-	    }
-	    return retval;	       /* finished! */
-	} else if (n->kids[ei]->elems[1]) {
-	    /*
-	     * Case 2a. n is an internal node, and the root of the
-	     * subtree to the left of e has more than one element.
-	     * So find the predecessor p to e (ie the largest node
-	     * in that subtree), place it where e currently is, and
-	     * then start the deletion process over again on the
-	     * subtree with p as target.
-	     */
-	    node234 *m = n->kids[ei];
-	    void *target;
-	    LOG(("  case 2a\n"));
-	    while (m->kids[0]) {
-		m = (m->kids[3] ? m->kids[3] :
-		     m->kids[2] ? m->kids[2] :
-		     m->kids[1] ? m->kids[1] : m->kids[0]);
-	    }
-	    target = (m->elems[2] ? m->elems[2] :
-		      m->elems[1] ? m->elems[1] : m->elems[0]);
-	    n->elems[ei] = target;
-	    index = n->counts[ei] - 1;
-	    n = n->kids[ei];
-	} else if (n->kids[ei + 1]->elems[1]) {
-	    /*
-	     * Case 2b, symmetric to 2a but s/left/right/ and
-	     * s/predecessor/successor/. (And s/largest/smallest/).
-	     */
-	    node234 *m = n->kids[ei + 1];
-	    void *target;
-	    LOG(("  case 2b\n"));
-	    while (m->kids[0]) {
-		m = m->kids[0];
-	    }
-	    target = m->elems[0];
-	    n->elems[ei] = target;
-	    n = n->kids[ei + 1];
-	    index = 0;
+/*
+ * The mirror image: join the subtree l on to the left of the
+ * taller subtree n.
+ */
+static node234 *joinleft234(node234 * n, int height, node234 * l,
+			    int lheight)
+{
+    node234 *kid = n->kids[0], *sib;
+
+    if (height - 1 == lheight) {
+	if (kid->n + l->n <= NODE234_MAX) {
+	    move234(kid, l->n, kid, 0, kid->n, lheight == 1);
+	    move234(kid, 0, l, 0, l->n, lheight == 1);
+	    kid->n += l->n;
+	    sfree(l);
+	    sib = NULL;
 	} else {
-	    /*
-	     * Case 2c. n is an internal node, and the subtrees to
-	     * the left and right of e both have only one element.
-	     * So combine the two subnodes into a single big node
-	     * with their own elements on the left and right and e
-	     * in the middle, then restart the deletion process on
-	     * that subtree, with e still as target.
-	     */
-	    node234 *a = n->kids[ei], *b = n->kids[ei + 1];
-	    int j;
-
-	    LOG(("  case 2c\n"));
-	    a->elems[1] = n->elems[ei];
-	    a->kids[2] = b->kids[0];
-	    a->counts[2] = b->counts[0];
-	    if (a->kids[2])
-		a->kids[2]->parent = a;
-	    a->elems[2] = b->elems[0];
-	    a->kids[3] = b->kids[1];
-	    a->counts[3] = b->counts[1];
-	    if (a->kids[3])
-		a->kids[3]->parent = a;
+	    share234(l, kid, lheight == 1);
+	    sib = l;
+	}
+    } else {
+	sib = joinleft234(kid, height - 1, l, lheight);
+    }
+    n->counts[0] = countnode234(kid, height - 1);
+    n->elems[0] = kid->elems[0];
+    if (!sib)
+	return NULL;
+    if (height - 1 == lheight)	       /* l itself goes on the left */
+	return insert234(n, 0, 0, sib->elems[0], sib,
+			 countnode234(sib, lheight));
+    return insert234(n, 0, 1, sib->elems[0], sib,
+		     countnode234(sib, height - 1));
+}
+
+/*
+ * Join two subtrees, of arbitrary heights, into one. The cost is
+ * proportional to the difference in their heights.
+ */
+static node234 *join234(node234 * a, int aheight, node234 * b,
+			int bheight, int *height)
+{
+    node234 *sib;
+
+    if (!a) {
+	*height = bheight;
+	return b;
+    }
+    if (!b) {
+	*height = aheight;
+	return a;
+    }
+
+    if (aheight == bheight) {
+	if (a->n + b->n <= NODE234_MAX) {
+	    move234(a, a->n, b, 0, b->n, aheight == 1);
+	    a->n += b->n;
 	    sfree(b);
-	    n->counts[ei] = countnode234(a);
-	    /*
-	     * That's built the big node in a, and destroyed b. Now
-	     * remove the reference to b (and e) in n.
-	     */
-	    for (j = ei; j < 2 && n->elems[j + 1]; j++) {
-		n->elems[j] = n->elems[j + 1];
-		n->kids[j + 1] = n->kids[j + 2];
-		n->counts[j + 1] = n->counts[j + 2];
-	    }
-	    n->elems[j] = NULL;
-	    n->kids[j + 1] = NULL;
-	    n->counts[j + 1] = 0;
-	    /*
-	     * It's possible, in this case, that we've just removed
-	     * the only element in the root of the tree. If so,
-	     * shift the root.
-	     */
-	    if (n->elems[0] == NULL) {
-		LOG(("  shifting root!\n"));
-		t->root = a;
-		a->parent = NULL;
-		sfree(n);
-	    }
-	    /*
-	     * Now go round the deletion process again, with n
-	     * pointing at the new big node and e still the same.
-	     */
-	    n = a;
-	    index = a->counts[0] + a->counts[1] + 1;
+	    *height = aheight;
+	    return a;
 	}
+	share234(a, b, aheight == 1);
+	*height = aheight + 1;
+	return newroot234(a, b, aheight);
+    } else if (aheight > bheight) {
+	sib = joinright234(a, aheight, b, bheight);
+	*height = aheight + (sib ? 1 : 0);
+	return sib ? newroot234(a, sib, aheight) : a;
+    } else {
+	sib = joinleft234(b, bheight, a, aheight);
+	*height = bheight + (sib ? 1 : 0);
+	return sib ? newroot234(b, sib, bheight) : b;
     }
 }
-void *delpos234(tree234 * t, int index)
+
+/*
+ * Copy the elements of a subtree out in order, freeing its nodes.
+ */
+static void drain234(node234 * n, int height, void **elems, int *pos)
 {
-    if (index < 0 || index >= countnode234(t->root))
+    int i;
+
+    if (height == 1) {
+	if (elems)
+	    memcpy(elems + *pos, n->elems, n->n * sizeof(void *));
+	*pos += n->n;
+    } else {
+	for (i = 0; i < n->n; i++)
+	    drain234(n->kids[i], height - 1, elems, pos);
+    }
+    sfree(n);
+}
+
+/*
+ * Remove the first index elements of a subtree, copying them out as
+ * drain234 does, and return what's left. At each level, the kids
+ * wholly before the split point are drained, the kid containing it
+ * is split recursively, and what's left of that is joined on to the
+ * remaining kids. The joins telescope, so the whole thing costs
+ * O(index + height).
+ */
+static node234 *splitright234(node234 * n, int height, int index,
+			      void **elems, int *pos, int *rheight)
+{
+    node234 *r, *rest;
+    int i, rh, resth, nrest;
+
+    if (height == 1) {
+	if (elems)
+	    memcpy(elems + *pos, n->elems, index * sizeof(void *));
+	*pos += index;
+	move234(n, 0, n, index, n->n - index, 1);
+	n->n -= index;
+	if (n->n == 0) {
+	    sfree(n);
+	    *rheight = 0;
+	    return NULL;
+	}
+	*rheight = 1;
+	return n;
+    }
+
+    for (i = 0; i < n->n && index >= n->counts[i]; i++) {
+	index -= n->counts[i];
+	drain234(n->kids[i], height - 1, elems, pos);
+    }
+    if (i == n->n) {
+	sfree(n);
+	*rheight = 0;
 	return NULL;
-    return delpos234_internal(t, index);
+    }
+
+    r = splitright234(n->kids[i], height - 1, index, elems, pos, &rh);
+
+    nrest = n->n - i - 1;
+    if (nrest >= 2) {
+	move234(n, 0, n, i + 1, nrest, 0);
+	n->n = nrest;
+	rest = n;
+	resth = height;
+    } else {
+	rest = (nrest == 1 ? n->kids[i + 1] : NULL);
+	resth = (nrest == 1 ? height - 1 : 0);
+	sfree(n);
+    }
+    return join234(r, rh, rest, resth, rheight);
 }
-void *del234(tree234 * t, void *e)
+
+/*
+ * Create a 2-3-4 tree from an array of n elements, in O(n).
+ */
+tree234 *newtree234_array(cmpfn234 cmp, void **elems, int n)
 {
-    int index;
-    if (!findrelpos234(t, e, NULL, REL234_EQ, &index))
-	return NULL;		       /* it wasn't in there anyway */
-    return delpos234_internal(t, index);	/* it's there; delete it. */
+    tree234 *t = newtree234(cmp);
+    t->root = build234(elems, n, &t->height);
+    t->count = (n > 0 ? n : 0);
+    return t;
+}
+
+/*
+ * Append n elements to the end of a 2-3-4 tree, by building them
+ * into a subtree of their own and joining that on.
+ */
+void appendn234(tree234 * t, void **elems, int n)
+{
+    node234 *b;
+    int bheight;
+
+    if (n <= 0)
+	return;
+    b = build234(elems, n, &bheight);
+    t->root = join234(t->root, t->height, b, bheight, &t->height);
+    t->count += n;
+}
+
+/*
+ * Delete the first n elements of a 2-3-4 tree.
+ */
+int delfirstn234(tree234 * t, void **elems, int n)
+{
+    int pos;
+
+    if (n > t->count)
+	n = t->count;
+    if (n <= 0)
+	return 0;
+    pos = 0;
+    t->root = splitright234(t->root, t->height, n, elems, &pos,
+			    &t->height);
+    assert(pos == n);
+    t->count -= n;
+    return n;
 }
 
 #ifdef TEST
@@ -990,21 +852,24 @@ void *del234(tree234 * t, void *e)
  * obvious and slow insert and delete functions). After each tree
  * operation, the verify() function is called, which ensures all
  * the tree properties are preserved:
- *  - node->child->parent always equals node
- *  - tree->root->parent always equals NULL
- *  - number of kids == 0 or number of elements + 1;
- *  - tree has the same depth everywhere
- *  - every node has at least one element
+ *  - tree->height is 0 exactly when the tree is empty
+ *  - every leaf is at the same depth, tree->height - 1
+ *  - every node holds between NODE234_MIN and NODE234_MAX entries,
+ *    except the root, which needs only one element if it's a leaf
+ *    or two kids if not
  *  - subtree element counts are accurate
- *  - any NULL kid pointer is accompanied by a zero count
- *  - in a sorted tree: ordering property between elements of a
- *    node and elements of its children is preserved
+ *  - each internal node's copy of the first element of a kid's
+ *    subtree is accurate
+ *  - in a sorted tree: the elements are in strictly increasing
+ *    order
  * and also ensures the list represented by the tree is the same
  * list it should be. (This last check also doubly verifies the
  * ordering properties, because the `same list it should be' is by
- * definition correctly ordered. It also ensures all nodes are
- * distinct, because the enum functions would get caught in a loop
- * if not.)
+ * definition correctly ordered.)
+ *
+ * By default the test build uses tiny nodes, so that splitting,
+ * merging and sharing all get exercised by small data sets. Build
+ * with -DNODE234_MAX=32 to test the real node size.
  */
 
 #include <stdarg.h>
@@ -1031,117 +896,56 @@ cmpfn234 cmp;
 tree234 *tree;
 
 typedef struct {
-    int treedepth;
-    int elemcount;
+    void *last;			       /* last element seen, in a sorted tree */
 } chkctx;
 
-int chknode(chkctx * ctx, int level, node234 * node,
-	    void *lowbound, void *highbound)
+int chknode(chkctx * ctx, int level, node234 * node)
 {
-    int nkids, nelems;
-    int i;
-    int count;
-
-    /* Count the non-NULL kids. */
-    for (nkids = 0; nkids < 4 && node->kids[nkids]; nkids++);
-    /* Ensure no kids beyond the first NULL are non-NULL. */
-    for (i = nkids; i < 4; i++)
-	if (node->kids[i]) {
-	    error("node %p: nkids=%d but kids[%d] non-NULL",
-		  node, nkids, i);
-	} else if (node->counts[i]) {
-	    error("node %p: kids[%d] NULL but count[%d]=%d nonzero",
-		  node, i, i, node->counts[i]);
-	}
-
-    /* Count the non-NULL elements. */
-    for (nelems = 0; nelems < 3 && node->elems[nelems]; nelems++);
-    /* Ensure no elements beyond the first NULL are non-NULL. */
-    for (i = nelems; i < 3; i++)
-	if (node->elems[i]) {
-	    error("node %p: nelems=%d but elems[%d] non-NULL",
-		  node, nelems, i);
-	}
-
-    if (nkids == 0) {
-	/*
-	 * If nkids==0, this is a leaf node; verify that the tree
-	 * depth is the same everywhere.
-	 */
-	if (ctx->treedepth < 0)
-	    ctx->treedepth = level;    /* we didn't know the depth yet */
-	else if (ctx->treedepth != level)
-	    error("node %p: leaf at depth %d, previously seen depth %d",
-		  node, level, ctx->treedepth);
-    } else {
-	/*
-	 * If nkids != 0, then it should be nelems+1, unless nelems
-	 * is 0 in which case nkids should also be 0 (and so we
-	 * shouldn't be in this condition at all).
-	 */
-	int shouldkids = (nelems ? nelems + 1 : 0);
-	if (nkids != shouldkids) {
-	    error("node %p: %d elems should mean %d kids but has %d",
-		  node, nelems, shouldkids, nkids);
-	}
-    }
+    int leaf = (level == tree->height - 1);
+    int min, i, count, subcount;
 
     /*
-     * nelems should be at least 1.
+     * Check the node's size.
      */
-    if (nelems == 0) {
-	error("node %p: no elems", node, nkids);
+    if (level > 0)
+	min = NODE234_MIN;
+    else
+	min = (leaf ? 1 : 2);
+    if (node->n < min || node->n > NODE234_MAX) {
+	error("node %p at depth %d: %d entries, should be %d to %d",
+	      node, level, node->n, min, NODE234_MAX);
     }
 
-    /*
-     * Add nelems to the running element count of the whole tree.
-     */
-    ctx->elemcount += nelems;
-
-    /*
-     * Check ordering property: all elements should be strictly >
-     * lowbound, strictly < highbound, and strictly < each other in
-     * sequence. (lowbound and highbound are NULL at edges of tree
-     * - both NULL at root node - and NULL is considered to be <
-     * everything and > everything. IYSWIM.)
-     */
-    if (cmp) {
-	for (i = -1; i < nelems; i++) {
-	    void *lower = (i == -1 ? lowbound : node->elems[i]);
-	    void *higher =
-		(i + 1 == nelems ? highbound : node->elems[i + 1]);
-	    if (lower && higher && cmp(lower, higher) >= 0) {
-		error("node %p: kid comparison [%d=%s,%d=%s] failed",
-		      node, i, lower, i + 1, higher);
+    if (leaf) {
+	/*
+	 * Check ordering property: each element should be
+	 * strictly greater than the one before it.
+	 */
+	for (i = 0; i < node->n; i++) {
+	    if (cmp && ctx->last && cmp(ctx->last, node->elems[i]) >= 0) {
+		error("node %p: element %d=%s not greater than %s",
+		      node, i, node->elems[i], ctx->last);
 	    }
+	    ctx->last = node->elems[i];
 	}
+	return node->n;
     }
 
     /*
-     * Check parent pointers: all non-NULL kids should have a
-     * parent pointer coming back to this node.
-     */
-    for (i = 0; i < nkids; i++)
-	if (node->kids[i]->parent != node) {
-	    error("node %p kid %d: parent ptr is %p not %p",
-		  node, i, node->kids[i]->parent, node);
-	}
-
-
-    /*
-     * Now (finally!) recurse into subtrees.
+     * Recurse into subtrees, and check their counts and first
+     * elements.
      */
-    count = nelems;
-
-    for (i = 0; i < nkids; i++) {
-	void *lower = (i == 0 ? lowbound : node->elems[i - 1]);
-	void *higher = (i >= nelems ? highbound : node->elems[i]);
-	int subcount =
-	    chknode(ctx, level + 1, node->kids[i], lower, higher);
+    count = 0;
+    for (i = 0; i < node->n; i++) {
+	subcount = chknode(ctx, level + 1, node->kids[i]);
 	if (node->counts[i] != subcount) {
 	    error("node %p kid %d: count says %d, subtree really has %d",
 		  node, i, node->counts[i], subcount);
 	}
+	if (node->elems[i] != node->kids[i]->elems[0]) {
+	    error("node %p kid %d: first element says %s, really %s",
+		  node, i, node->elems[i], node->kids[i]->elems[0]);
+	}
 	count += subcount;
     }
 
@@ -1151,20 +955,19 @@ int chknode(chkctx * ctx, int level, node234 * node,
 void verify(void)
 {
     chkctx ctx;
-    int i;
+    int i, elemcount;
     void *p;
 
-    ctx.treedepth = -1;		       /* depth unknown yet */
-    ctx.elemcount = 0;		       /* no elements seen yet */
+    ctx.last = NULL;
+    elemcount = 0;
     /*
      * Verify validity of tree properties.
      */
-    if (tree->root) {
-	if (tree->root->parent != NULL)
-	    error("root->parent is %p should be null", tree->root->parent);
-	chknode(&ctx, 0, tree->root, NULL, NULL);
-    }
-    printf("tree depth: %d\n", ctx.treedepth);
+    if ((tree->root == NULL) != (tree->height == 0))
+	error("root is %p but height is %d", tree->root, tree->height);
+    if (tree->root)
+	elemcount = chknode(&ctx, 0, tree->root);
+    printf("tree depth: %d\n", tree->height - 1);
     /*
      * Enumerate the tree and ensure it matches up to the array.
      */
@@ -1175,17 +978,17 @@ void verify(void)
 	    error("enum at position %d: array says %s, tree says %s",
 		  i, array[i], p);
     }
-    if (ctx.elemcount != i) {
+    if (elemcount != i) {
 	error("tree really contains %d elements, enum gave %d",
-	      ctx.elemcount, i);
+	      elemcount, i);
     }
     if (i < arraylen) {
 	error("enum gave only %d elements, array has %d", i, arraylen);
     }
     i = count234(tree);
-    if (ctx.elemcount != i) {
+    if (elemcount != i) {
 	error("tree really contains %d elements, count234 gave %d",
-	      ctx.elemcount, i);
+	      elemcount, i);
     }
 }
 
@@ -1278,6 +1081,62 @@ void deltest(void *elem)
     delpostest(i);
 }
 
+void arraytest(cmpfn234 cmpfn, void **elems, int n)
+{
+    int i;
+
+    if (arraysize < n) {
+	arraysize = n + 256;
+	array = sresize(array, arraysize, void *);
+    }
+    for (i = 0; i < n; i++)
+	array[i] = elems[i];
+    arraylen = n;
+
+    tree = newtree234_array(cmpfn, elems, n);
+
+    verify();
+}
+
+void appendtest(void **elems, int n)
+{
+    int i;
+
+    if (arraysize < arraylen + n) {
+	arraysize = arraylen + n + 256;
+	array = sresize(array, arraysize, void *);
+    }
+    for (i = 0; i < n; i++)
+	array[arraylen++] = elems[i];
+
+    appendn234(tree, elems, n);
+
+    verify();
+}
+
+void delfirsttest(int n)
+{
+    void **ret = snewn(n + 1, void *);
+    int i, expected, realret;
+
+    expected = (n < arraylen ? n : arraylen);
+    realret = delfirstn234(tree, ret, n);
+    if (realret != expected) {
+	error("delfirst(%d) returned %d, expected %d", n, realret, expected);
+    } else {
+	for (i = 0; i < expected; i++)
+	    if (ret[i] != array[i])
+		error("delfirst element %d: got %s, expected %s",
+		      i, ret[i], array[i]);
+    }
+    for (i = expected; i < arraylen; i++)
+	array[i - expected] = array[i];
+    arraylen -= expected;
+    sfree(ret);
+
+    verify();
+}
+
 /* A sample data set and test utility. Designed for pseudo-randomness,
  * and yet repeatability. */
 
@@ -1472,6 +1331,68 @@ int main(void)
 	printf("deleting string %s from index %d\n", array[j], j);
 	delpostest(j);
     }
+    freetree234(tree);
+
+    /*
+     * Now the bulk operations. Build trees of every size up to a
+     * few hundred straight from an array, and then grow and shrink
+     * one by random amounts at each end.
+     */
+    {
+	void *bulk[1000];
+
+	for (i = 0; i < lenof(bulk); i++)
+	    bulk[i] = strings[randomnumber(&seed) % NSTR];
+
+	for (i = 0; i < 300; i++) {
+	    printf("building unsorted tree of size %d\n", i);
+	    arraytest(NULL, bulk, i);
+	    freetree234(tree);
+	}
+
+	arraytest(NULL, bulk, 0);
+	for (i = 0; i < 1000; i++) {
+	    printf("trial: %d\n", i);
+	    j = randomnumber(&seed) % (i < 500 ? 200 : 50);
+	    k = randomnumber(&seed) % 150;
+	    printf("appending %d elements, then deleting %d\n", j, k);
+	    appendtest(bulk + randomnumber(&seed) % (lenof(bulk) - j), j);
+	    delfirsttest(k);
+	}
+	while (arraylen > 0) {
+	    printf("cleanup: tree size %d\n", arraylen);
+	    delfirsttest(randomnumber(&seed) % 50);
+	}
+	freetree234(tree);
+    }
+
+    /*
+     * And a sorted tree built from a sorted array, which we then
+     * check with findtest and extend with add234 as normal.
+     */
+    {
+	void *sorted[NSTR];
+	int n = 0;
+
+	for (i = 0; i < NSTR; i++) {
+	    for (j = n; j > 0 && mycmp(strings[i], sorted[j - 1]) < 0; j--)
+		sorted[j] = sorted[j - 1];
+	    sorted[j] = strings[i];
+	    n++;
+	}
+
+	cmp = mycmp;
+	arraytest(mycmp, sorted, n / 2);
+	findtest();
+	appendtest(sorted + n / 2, n - n / 2);
+	findtest();
+	for (i = 0; i < n; i += 2)
+	    deltest(sorted[i]);
+	findtest();
+	delfirsttest(n / 4);
+	findtest();
+	freetree234(tree);
+    }
 
     return 0;
 }
@@ -157,4 +157,26 @@ void *delpos234(tree234 * t, int index);
  */
 int count234(tree234 * t);
 
+/*
+ * Bulk operations. These cost O(n + log size) rather than n
+ * separate insertions or deletions.
+ *
+ * newtree234_array creates a tree holding the n elements of an
+ * array, in that order. For a sorted tree, the array must already
+ * be sorted and contain no duplicates; this is not checked.
+ *
+ * appendn234 adds n elements from an array to the end of a tree. It
+ * works on unsorted trees, and on sorted trees provided the array
+ * is sorted and every element in it compares greater than anything
+ * already in the tree (again, this is not checked).
+ *
+ * delfirstn234 deletes the first n elements of a tree, sorted or
+ * unsorted, and returns how many it deleted (fewer than n if the
+ * tree was smaller). If `elems' is non-NULL, the deleted elements
+ * are written to it in order, for the user to free or whatever.
+ */
+tree234 *newtree234_array(cmpfn234 cmp, void **elems, int n);
+void appendn234(tree234 * t, void **elems, int n);
+int delfirstn234(tree234 * t, void **elems, int n);
+
 #endif				/* TREE234_H */
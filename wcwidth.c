@@ -60,6 +60,7 @@
  */
 
 #include <wchar.h>
+#include <string.h>
 
 #include "putty.h" /* for prototypes */
 
@@ -119,9 +120,13 @@ static int bisearch(wchar_t ucs, const struct interval *table, int max) {
  *
  * This implementation assumes that wchar_t characters are encoded
  * in ISO 10646.
+ *
+ * calc_wcwidth() and calc_wcwidth_cjk() work the width out from the
+ * interval tables; mk_wcwidth() and mk_wcwidth_cjk(), further down,
+ * look it up in tables built from them.
  */
 
-int mk_wcwidth(wchar_t ucs)
+static int calc_wcwidth(wchar_t ucs)
 {
   /* sorted list of non-overlapping intervals of non-spacing characters */
   /* generated by "uniset +cat=Me +cat=Mn +cat=Cf -00AD +1160-11FF +200B c" */
@@ -198,20 +203,6 @@ int mk_wcwidth(wchar_t ucs)
 }
 
 
-int mk_wcswidth(const wchar_t *pwcs, size_t n)
-{
-  int w, width = 0;
-
-  for (;*pwcs && n-- > 0; pwcs++)
-    if ((w = mk_wcwidth(*pwcs)) < 0)
-      return -1;
-    else
-      width += w;
-
-  return width;
-}
-
-
 /*
  * The following functions are the same as mk_wcwidth() and
  * mk_wcwidth_cjk(), except that spacing characters in the East Asian
@@ -221,7 +212,7 @@ int mk_wcswidth(const wchar_t *pwcs, size_t n)
  * the traditional terminal character-width behaviour. It is not
  * otherwise recommended for general use.
  */
-int mk_wcwidth_cjk(wchar_t ucs)
+static int calc_wcwidth_cjk(wchar_t ucs)
 {
   /* sorted list of non-overlapping intervals of East Asian Ambiguous
    * characters, generated by "uniset +WIDTH-A -cat=Me -cat=Mn -cat=Cf c" */
@@ -285,7 +276,92 @@ int mk_wcwidth_cjk(wchar_t ucs)
 	       sizeof(ambiguous) / sizeof(struct interval) - 1))
     return 2;
 
-  return mk_wcwidth(ucs);
+  return calc_wcwidth(ucs);
+}
+
+
+/*
+ * Lookup tables for the above. Each 256-character page of Unicode
+ * maps to a "leaf" holding the widths of its characters, so a
+ * lookup is two loads. Most pages are all one width, so there are
+ * only a few dozen distinct leaves between the two variants, and
+ * pages with the same widths share one.
+ *
+ * The tables are filled in a page at a time, the first time a
+ * character in that page is looked up: in practice a session only
+ * ever sees a handful of pages, and this way nobody pays to fill in
+ * the rest. It also means the interval tables above remain the only
+ * thing to update for a new version of Unicode, with no generated
+ * table to keep in step with them. A page index of 0 means the page
+ * isn't done yet.
+ */
+#define WCW_NPAGES (0x110000 >> 8)
+#define WCW_MAXLEAVES 128
+
+static signed char wcw_leaves[WCW_MAXLEAVES][256];
+static int wcw_nleaves = 0;
+static unsigned char wcw_page[2][WCW_NPAGES];
+
+/*
+ * Fill in the table entry for a page, returning its index (plus
+ * one) or 0 if we've run out of leaves.
+ */
+static int wcw_fill(unsigned long page, int cjk)
+{
+  signed char leaf[256];
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    wchar_t ucs = (wchar_t)((page << 8) | i);
+    leaf[i] = (cjk ? calc_wcwidth_cjk(ucs) : calc_wcwidth(ucs));
+  }
+  for (i = 0; i < wcw_nleaves; i++)
+    if (!memcmp(wcw_leaves[i], leaf, 256))
+      break;
+  if (i == wcw_nleaves) {
+    if (wcw_nleaves == WCW_MAXLEAVES)
+      return 0;
+    memcpy(wcw_leaves[wcw_nleaves++], leaf, 256);
+  }
+  return wcw_page[cjk][page] = i + 1;
+}
+
+static int wcw_lookup(wchar_t ucs, int cjk)
+{
+  unsigned long c = (unsigned long)ucs;
+  int leaf;
+
+  if (c >= 0x110000)
+    return (cjk ? calc_wcwidth_cjk(ucs) : calc_wcwidth(ucs));
+  leaf = wcw_page[cjk][c >> 8];
+  if (!leaf && !(leaf = wcw_fill(c >> 8, cjk)))
+    return (cjk ? calc_wcwidth_cjk(ucs) : calc_wcwidth(ucs));
+  return wcw_leaves[leaf - 1][c & 0xFF];
+}
+
+int mk_wcwidth(wchar_t ucs)
+{
+  return wcw_lookup(ucs, 0);
+}
+
+
+int mk_wcswidth(const wchar_t *pwcs, size_t n)
+{
+  int w, width = 0;
+
+  for (;*pwcs && n-- > 0; pwcs++)
+    if ((w = mk_wcwidth(*pwcs)) < 0)
+      return -1;
+    else
+      width += w;
+
+  return width;
+}
+
+
+int mk_wcwidth_cjk(wchar_t ucs)
+{
+  return wcw_lookup(ucs, 1);
 }
 
 
@@ -301,3 +377,59 @@ int mk_wcswidth_cjk(const wchar_t *pwcs, size_t n)
 
   return width;
 }
+
+#ifdef TEST
+
+/*
+ * Test code: check mk_wcwidth() and mk_wcwidth_cjk() against the
+ * calc_ functions for every character in Unicode, then time both on
+ * a mixture of characters like a CJK terminal would see. Build it
+ * from the bench directory with
+ *
+ *   gcc -DTEST -O2 -I. -I.. ../wcwidth.c -o wcwidthtest
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+int main(void)
+{
+  static const unsigned long mix[] = {
+    0xE9, 0x3B1, 0x416, 0x2500, 0x2588, 0x300, 0x3042, 0x30AB,
+    0x4E00, 0x6F22, 0x8A9E, 0xAC00, 0xD55C, 0xFF21, 0x1F600, 0x20000,
+  };
+  unsigned long c;
+  int i, cjk, errs = 0;
+  long n, total;
+  clock_t t;
+
+  for (cjk = 0; cjk < 2; cjk++)
+    for (c = 0; c < 0x110000 + 256; c++) {
+      wchar_t ucs = (wchar_t)c;
+      int want = (cjk ? calc_wcwidth_cjk(ucs) : calc_wcwidth(ucs));
+      int got = (cjk ? mk_wcwidth_cjk(ucs) : mk_wcwidth(ucs));
+      if (want != got) {
+        if (errs++ < 20)
+          printf("U+%04lX%s: expected %d, got %d\n",
+                 c, cjk ? " (cjk)" : "", want, got);
+      }
+    }
+  printf("%d errors, %d leaves\n", errs, wcw_nleaves);
+
+  for (i = 0; i < 4; i++) {
+    int (*fn)(wchar_t) = (i == 0 ? calc_wcwidth : i == 1 ? mk_wcwidth :
+                          i == 2 ? calc_wcwidth_cjk : mk_wcwidth_cjk);
+    total = 0;
+    t = clock();
+    for (n = 0; n < 50000000; n++)
+      total += fn((wchar_t)(mix[n & 15] + (n >> 4 & 63)));
+    printf("%-16s %6.2f ns/char (%ld)\n",
+           i == 0 ? "calc_wcwidth" : i == 1 ? "mk_wcwidth" :
+           i == 2 ? "calc_wcwidth_cjk" : "mk_wcwidth_cjk",
+           (double)(clock() - t) / CLOCKS_PER_SEC * 1e9 / n, total);
+  }
+
+  return errs != 0;
+}
+
+#endif
@@ -288,6 +288,10 @@ static void close_session(void)
 
     session_closed = TRUE;
     sprintf(morestuff, "%.70s (inactive)", appname);
+
+    /* The window may stay open a while; make sure the log is complete. */
+    if (logctx)
+	log_sync(logctx);
     set_icon(NULL, morestuff);
     set_title(NULL, morestuff);
 
@@ -831,6 +835,14 @@ void cleanup_exit(int code)
 	DeleteObject(pal);
     sk_cleanup();
 
+    /* Write out (and, if compressed, finish) the session log. */
+    if (logctx) {
+	if (term)
+	    term_provide_logctx(term, NULL);
+	log_free(logctx);
+	logctx = NULL;
+    }
+
     shutdown_help();
 
     exit(code);
@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <io.h>
+#include <fcntl.h>
 #include "putty.h"
 
 OSVERSIONINFO osVersion;
@@ -72,6 +74,105 @@ BOOL init_winver(void)
     return GetVersionEx ( (OSVERSIONINFO *) &osVersion);
 }
 
+/*
+ * Threads and events, for logging.c.
+ */
+struct thread {
+    HANDLE h;
+    void (*fn)(void *ctx);
+    void *ctx;
+};
+
+static DWORD WINAPI thread_main(void *param)
+{
+    struct thread *t = (struct thread *)param;
+    t->fn(t->ctx);
+    return 0;
+}
+
+void *thread_start(void (*fn)(void *ctx), void *ctx)
+{
+    struct thread *t = snew(struct thread);
+    DWORD id;
+
+    t->fn = fn;
+    t->ctx = ctx;
+    t->h = CreateThread(NULL, 0, thread_main, t, 0, &id);
+    if (!t->h) {
+	sfree(t);
+	return NULL;
+    }
+    return t;
+}
+
+void thread_join(void *thread)
+{
+    struct thread *t = (struct thread *)thread;
+    WaitForSingleObject(t->h, INFINITE);
+    CloseHandle(t->h);
+    sfree(t);
+}
+
+void *event_new(void)
+{
+    return CreateEvent(NULL, FALSE, FALSE, NULL);   /* auto-reset */
+}
+
+void event_set(void *event)
+{
+    SetEvent((HANDLE)event);
+}
+
+void event_wait(void *event)
+{
+    WaitForSingleObject((HANDLE)event, INFINITE);
+}
+
+void event_free(void *event)
+{
+    CloseHandle((HANDLE)event);
+}
+
+void memory_barrier(void)
+{
+    LONG dummy = 0;
+    InterlockedExchange(&dummy, 1);    /* a full barrier */
+}
+
+/*
+ * tmpfile() in the Microsoft C library makes its file in the root
+ * of the current drive, which ordinary users often can't write to.
+ * Use the proper temporary directory instead.
+ */
+FILE *open_temp_file(void)
+{
+    char dir[MAX_PATH], path[MAX_PATH];
+    HANDLE h;
+    FILE *fp;
+    int fd;
+
+    if (!GetTempPath(sizeof(dir), dir) ||
+	!GetTempFileName(dir, "pty", 0, path))
+	return NULL;
+    h = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		   CREATE_ALWAYS,
+		   FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+		   NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+	DeleteFile(path);
+	return NULL;
+    }
+    fd = _open_osfhandle((intptr_t)h, _O_RDWR | _O_BINARY);
+    if (fd < 0) {
+	CloseHandle(h);
+	return NULL;
+    }
+    fp = _fdopen(fd, "w+b");
+    if (!fp)
+	_close(fd);
+    return fp;
+}
+
 #ifdef DEBUG
 static FILE *debug_fp = NULL;
 static HANDLE debug_hdl = INVALID_HANDLE_VALUE;
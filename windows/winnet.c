@@ -148,6 +148,9 @@ DECL_WINSOCK_FUNCTION(static, int, setsockopt,
 DECL_WINSOCK_FUNCTION(static, SOCKET, socket, (int, int, int));
 DECL_WINSOCK_FUNCTION(static, int, listen, (SOCKET, int));
 DECL_WINSOCK_FUNCTION(static, int, send, (SOCKET, const char FAR *, int, int));
+DECL_WINSOCK_FUNCTION(static, int, WSASend,
+		      (SOCKET, LPWSABUF, DWORD, LPDWORD, DWORD,
+		       LPWSAOVERLAPPED, LPWSAOVERLAPPED_COMPLETION_ROUTINE));
 DECL_WINSOCK_FUNCTION(static, int, ioctlsocket,
 		      (SOCKET, long, u_long FAR *));
 DECL_WINSOCK_FUNCTION(static, SOCKET, accept,
@@ -273,6 +276,7 @@ void sk_init(void)
     GET_WINSOCK_FUNCTION(winsock_module, socket);
     GET_WINSOCK_FUNCTION(winsock_module, listen);
     GET_WINSOCK_FUNCTION(winsock_module, send);
+    GET_WINSOCK_FUNCTION(winsock_module, WSASend);
     GET_WINSOCK_FUNCTION(winsock_module, ioctlsocket);
     GET_WINSOCK_FUNCTION(winsock_module, accept);
     GET_WINSOCK_FUNCTION(winsock_module, recv);
@@ -1235,11 +1239,32 @@ void try_send(Actual_Socket s)
 	    urgentflag = MSG_OOB;
 	    len = s->sending_oob;
 	    data = &s->oobdata;
+	    nsent = p_send(s->s, data, len, urgentflag);
+	} else if (p_WSASend) {
+	    /*
+	     * With WinSock 2, hand over as much of the buffer chain
+	     * as we can in one go.
+	     */
+	    void *segs[16];
+	    int lens[16], nsegs, i;
+	    WSABUF wbufs[16];
+	    DWORD sent;
+
+	    nsegs = bufchain_prefixv(&s->output_data, segs, lens,
+				     lenof(segs));
+	    for (i = 0; i < nsegs; i++) {
+		wbufs[i].buf = segs[i];
+		wbufs[i].len = lens[i];
+	    }
+	    if (p_WSASend(s->s, wbufs, nsegs, &sent, 0, NULL, NULL) == 0)
+		nsent = sent;
+	    else
+		nsent = -1;
 	} else {
 	    urgentflag = 0;
 	    bufchain_prefix(&s->output_data, &data, &len);
+	    nsent = p_send(s->s, data, len, urgentflag);
 	}
-	nsent = p_send(s->s, data, len, urgentflag);
 	if (nsent <= 0) {
 	    err = (nsent < 0 ? p_WSAGetLastError() : 0);
 	    if ((err < WSABASEERR && nsent < 0) || err == WSAEWOULDBLOCK) {